@@ -34,11 +34,13 @@ sed '
   /^crypt bctx$/d
   /^crypt crypto_initialized$/d
   /^crypt crypto_errs_initialized$/d
+  /^crypt crypto_locks$/d
   /^main allow_kq$/d
   /^main daemon_mode$/d
   /^main handle_signal_cb(int, short, void\*)::got_sigint$/d
   /^main pidfile_name$/d
   /^main registration_helper$/d
+  /^main n_workers$/d
   /^main the_event_base$/d
   /^network listeners$/d
   /^rng rng$/d
@@ -48,6 +50,9 @@ sed '
   /^util log_timestamps$/d
   /^util log_ts_base$/d
   /^util-net the_evdns_base$/d
+  /^workers workers$/d
+  /^workers this_worker$/d
+  /^transparent_proxy TransparentProxy::worker_transparentized_connections$/d
   /^apache_payload_server std::__ioinit$/d
 ')
 
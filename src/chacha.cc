@@ -0,0 +1,295 @@
+/* See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "chacha.h"
+
+#include <algorithm>
+
+/* Portable implementations of ChaCha20 and Poly1305, after RFC 7539
+   and the public-domain poly1305-donna; for the AEAD that CPUs
+   without AES instructions can run faster than AES-GCM, whatever
+   OpenSSL there is.  */
+
+static inline uint32_t
+load_le32(const uint8_t *p)
+{
+  return uint32_t(p[0]) | (uint32_t(p[1]) << 8) |
+    (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static inline void
+store_le32(uint8_t *p, uint32_t v)
+{
+  p[0] = uint8_t(v);
+  p[1] = uint8_t(v >> 8);
+  p[2] = uint8_t(v >> 16);
+  p[3] = uint8_t(v >> 24);
+}
+
+static inline uint32_t
+rotl32(uint32_t x, unsigned int n)
+{
+  return (x << n) | (x >> (32 - n));
+}
+
+#define QUARTERROUND(a, b, c, d)                  \
+  a += b; d ^= a; d = rotl32(d, 16);              \
+  c += d; b ^= c; b = rotl32(b, 12);              \
+  a += b; d ^= a; d = rotl32(d, 8);               \
+  c += d; b ^= c; b = rotl32(b, 7)
+
+void
+chacha20_block(uint8_t out[CHACHA20_BLOCK_LEN],
+               const uint8_t key[CHACHA20_KEY_LEN],
+               uint32_t counter,
+               const uint8_t nonce[CHACHA20_NONCE_LEN])
+{
+  uint32_t in[16], x[16];
+
+  in[0] = 0x61707865;
+  in[1] = 0x3320646e;
+  in[2] = 0x79622d32;
+  in[3] = 0x6b206574;
+  for (unsigned int i = 0; i < 8; i++)
+    in[4 + i] = load_le32(key + 4*i);
+  in[12] = counter;
+  for (unsigned int i = 0; i < 3; i++)
+    in[13 + i] = load_le32(nonce + 4*i);
+
+  memcpy(x, in, sizeof x);
+  for (unsigned int i = 0; i < 10; i++) {
+    QUARTERROUND(x[0], x[4], x[8],  x[12]);
+    QUARTERROUND(x[1], x[5], x[9],  x[13]);
+    QUARTERROUND(x[2], x[6], x[10], x[14]);
+    QUARTERROUND(x[3], x[7], x[11], x[15]);
+    QUARTERROUND(x[0], x[5], x[10], x[15]);
+    QUARTERROUND(x[1], x[6], x[11], x[12]);
+    QUARTERROUND(x[2], x[7], x[8],  x[13]);
+    QUARTERROUND(x[3], x[4], x[9],  x[14]);
+  }
+  for (unsigned int i = 0; i < 16; i++)
+    store_le32(out + 4*i, x[i] + in[i]);
+}
+
+#undef QUARTERROUND
+
+chacha20_stream::chacha20_stream(const uint8_t k[CHACHA20_KEY_LEN],
+                                 const uint8_t n[CHACHA20_NONCE_LEN],
+                                 uint32_t first_block)
+  : counter(first_block), used(CHACHA20_BLOCK_LEN)
+{
+  memcpy(key, k, sizeof key);
+  memcpy(nonce, n, sizeof nonce);
+}
+
+chacha20_stream::~chacha20_stream()
+{
+  memset(key, 0, sizeof key);
+  memset(ks, 0, sizeof ks);
+}
+
+void
+chacha20_stream::apply(uint8_t *out, const uint8_t *in, size_t len)
+{
+  while (len > 0) {
+    if (used == CHACHA20_BLOCK_LEN) {
+      chacha20_block(ks, key, counter++, nonce);
+      used = 0;
+    }
+    size_t n = std::min(len, CHACHA20_BLOCK_LEN - used);
+    if (in) {
+      for (size_t i = 0; i < n; i++)
+        out[i] = in[i] ^ ks[used + i];
+      in += n;
+    } else {
+      memcpy(out, ks + used, n);
+    }
+    used += n;
+    out += n;
+    len -= n;
+  }
+}
+
+void
+chacha20_stream::skip(size_t len)
+{
+  size_t left = CHACHA20_BLOCK_LEN - used;
+  if (len <= left) {
+    used += len;
+    return;
+  }
+  len -= left;
+  counter += len / CHACHA20_BLOCK_LEN;
+  used = CHACHA20_BLOCK_LEN;
+  if (len % CHACHA20_BLOCK_LEN) {
+    chacha20_block(ks, key, counter++, nonce);
+    used = len % CHACHA20_BLOCK_LEN;
+  }
+}
+
+/* Poly1305 in radix 2^26, so that the products fit in 64 bits. */
+
+poly1305::poly1305(const uint8_t key[POLY1305_KEY_LEN])
+  : leftover(0)
+{
+  // r is clamped as the specification requires.
+  r[0] = (load_le32(key +  0)     ) & 0x3ffffff;
+  r[1] = (load_le32(key +  3) >> 2) & 0x3ffff03;
+  r[2] = (load_le32(key +  6) >> 4) & 0x3ffc0ff;
+  r[3] = (load_le32(key +  9) >> 6) & 0x3f03fff;
+  r[4] = (load_le32(key + 12) >> 8) & 0x00fffff;
+
+  memset(h, 0, sizeof h);
+  for (unsigned int i = 0; i < 4; i++)
+    pad[i] = load_le32(key + 16 + 4*i);
+}
+
+poly1305::~poly1305()
+{
+  memset(r, 0, sizeof r);
+  memset(h, 0, sizeof h);
+  memset(pad, 0, sizeof pad);
+}
+
+void
+poly1305::blocks(const uint8_t *m, size_t len, uint32_t hibit)
+{
+  const uint32_t r0 = r[0], r1 = r[1], r2 = r[2], r3 = r[3], r4 = r[4];
+  const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+  uint32_t h0 = h[0], h1 = h[1], h2 = h[2], h3 = h[3], h4 = h[4];
+
+  while (len >= 16) {
+    h0 += (load_le32(m +  0)     ) & 0x3ffffff;
+    h1 += (load_le32(m +  3) >> 2) & 0x3ffffff;
+    h2 += (load_le32(m +  6) >> 4) & 0x3ffffff;
+    h3 += (load_le32(m +  9) >> 6) & 0x3ffffff;
+    h4 += (load_le32(m + 12) >> 8) | hibit;
+
+    uint64_t d0 = uint64_t(h0) * r0 + uint64_t(h1) * s4 +
+      uint64_t(h2) * s3 + uint64_t(h3) * s2 + uint64_t(h4) * s1;
+    uint64_t d1 = uint64_t(h0) * r1 + uint64_t(h1) * r0 +
+      uint64_t(h2) * s4 + uint64_t(h3) * s3 + uint64_t(h4) * s2;
+    uint64_t d2 = uint64_t(h0) * r2 + uint64_t(h1) * r1 +
+      uint64_t(h2) * r0 + uint64_t(h3) * s4 + uint64_t(h4) * s3;
+    uint64_t d3 = uint64_t(h0) * r3 + uint64_t(h1) * r2 +
+      uint64_t(h2) * r1 + uint64_t(h3) * r0 + uint64_t(h4) * s4;
+    uint64_t d4 = uint64_t(h0) * r4 + uint64_t(h1) * r3 +
+      uint64_t(h2) * r2 + uint64_t(h3) * r1 + uint64_t(h4) * r0;
+
+    uint32_t c;
+    c = uint32_t(d0 >> 26); h0 = uint32_t(d0) & 0x3ffffff;
+    d1 += c; c = uint32_t(d1 >> 26); h1 = uint32_t(d1) & 0x3ffffff;
+    d2 += c; c = uint32_t(d2 >> 26); h2 = uint32_t(d2) & 0x3ffffff;
+    d3 += c; c = uint32_t(d3 >> 26); h3 = uint32_t(d3) & 0x3ffffff;
+    d4 += c; c = uint32_t(d4 >> 26); h4 = uint32_t(d4) & 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    m += 16;
+    len -= 16;
+  }
+
+  h[0] = h0; h[1] = h1; h[2] = h2; h[3] = h3; h[4] = h4;
+}
+
+void
+poly1305::update(const uint8_t *m, size_t len)
+{
+  if (leftover) {
+    size_t n = std::min(len, 16 - leftover);
+    memcpy(buf + leftover, m, n);
+    leftover += n;
+    m += n;
+    len -= n;
+    if (leftover < 16)
+      return;
+    blocks(buf, 16, 1 << 24);
+    leftover = 0;
+  }
+
+  size_t whole = len & ~size_t(15);
+  if (whole) {
+    blocks(m, whole, 1 << 24);
+    m += whole;
+    len -= whole;
+  }
+
+  if (len) {
+    memcpy(buf, m, len);
+    leftover = len;
+  }
+}
+
+void
+poly1305::pad16()
+{
+  if (leftover) {
+    memset(buf + leftover, 0, 16 - leftover);
+    blocks(buf, 16, 1 << 24);
+    leftover = 0;
+  }
+}
+
+void
+poly1305::finish(uint8_t tag[POLY1305_TAG_LEN])
+{
+  if (leftover) {
+    buf[leftover] = 1;
+    memset(buf + leftover + 1, 0, 16 - leftover - 1);
+    blocks(buf, 16, 0);
+    leftover = 0;
+  }
+
+  uint32_t h0 = h[0], h1 = h[1], h2 = h[2], h3 = h[3], h4 = h[4];
+  uint32_t c;
+
+  // Carry all the way through.
+  c = h1 >> 26; h1 &= 0x3ffffff;
+  h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+  h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+  h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+  h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+  h1 += c;
+
+  // Compute h - p = h + 5 - 2^130, and take it if it is not negative;
+  // in constant time.
+  uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+  uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+  uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+  uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+  uint32_t g4 = h4 + c - (1 << 26);
+
+  uint32_t mask = (g4 >> 31) - 1;
+  g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+  mask = ~mask;
+  h0 = (h0 & mask) | g0;
+  h1 = (h1 & mask) | g1;
+  h2 = (h2 & mask) | g2;
+  h3 = (h3 & mask) | g3;
+  h4 = (h4 & mask) | g4;
+
+  // h mod 2^128, plus the pad.
+  h0 = (h0      ) | (h1 << 26);
+  h1 = (h1 >>  6) | (h2 << 20);
+  h2 = (h2 >> 12) | (h3 << 14);
+  h3 = (h3 >> 18) | (h4 <<  8);
+
+  uint64_t f;
+  f = uint64_t(h0) + pad[0];             h0 = uint32_t(f);
+  f = uint64_t(h1) + pad[1] + (f >> 32); h1 = uint32_t(f);
+  f = uint64_t(h2) + pad[2] + (f >> 32); h2 = uint32_t(f);
+  f = uint64_t(h3) + pad[3] + (f >> 32); h3 = uint32_t(f);
+
+  store_le32(tag +  0, h0);
+  store_le32(tag +  4, h1);
+  store_le32(tag +  8, h2);
+  store_le32(tag + 12, h3);
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// c-file-style: "gnu"
+// c-file-offsets: ((innamespace . 0) (brace-list-open . 0))
+// End:
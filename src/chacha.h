@@ -0,0 +1,86 @@
+/* See LICENSE for other credits and copying information
+ */
+
+#ifndef CHACHA_H
+#define CHACHA_H
+
+/* NOTE: The APIs defined in this header should not be used directly
+   for encryption.  Use the crypt.h 'gcm_encryptor' and
+   'gcm_decryptor' objects created with create_chacha20_poly1305()
+   instead.  The random number generator uses the block function. */
+
+const size_t CHACHA20_KEY_LEN   = 32;
+const size_t CHACHA20_NONCE_LEN = 12;
+const size_t CHACHA20_BLOCK_LEN = 64;
+const size_t POLY1305_KEY_LEN   = 32;
+const size_t POLY1305_TAG_LEN   = 16;
+
+/** The ChaCha20 block function of RFC 7539: write to 'out' the 64
+    bytes of keystream for block 'counter' under 'key' and 'nonce'. */
+void chacha20_block(uint8_t out[CHACHA20_BLOCK_LEN],
+                    const uint8_t key[CHACHA20_KEY_LEN],
+                    uint32_t counter,
+                    const uint8_t nonce[CHACHA20_NONCE_LEN]);
+
+/** The ChaCha20 keystream for one key and nonce, from a given block
+    on, to be applied a piece at a time. */
+class chacha20_stream
+{
+  uint8_t key[CHACHA20_KEY_LEN];
+  uint8_t nonce[CHACHA20_NONCE_LEN];
+  uint32_t counter;                  // of the next block to generate
+  uint8_t ks[CHACHA20_BLOCK_LEN];
+  size_t used;                       // bytes of 'ks' already applied
+
+  chacha20_stream(const chacha20_stream&) DELETE_METHOD;
+  chacha20_stream& operator=(const chacha20_stream&) DELETE_METHOD;
+
+public:
+  chacha20_stream(const uint8_t k[CHACHA20_KEY_LEN],
+                  const uint8_t n[CHACHA20_NONCE_LEN],
+                  uint32_t first_block);
+  ~chacha20_stream();
+
+  /** XOR the next 'len' bytes of keystream with 'in' into 'out',
+      which may be the same buffer.  A null 'in' stands for zeroes. */
+  void apply(uint8_t *out, const uint8_t *in, size_t len);
+
+  /** Skip 'len' bytes of keystream. */
+  void skip(size_t len);
+};
+
+/** The Poly1305 one-time authenticator of RFC 7539. */
+class poly1305
+{
+  uint32_t r[5];
+  uint32_t h[5];
+  uint32_t pad[4];
+  uint8_t buf[16];
+  size_t leftover;
+
+  poly1305(const poly1305&) DELETE_METHOD;
+  poly1305& operator=(const poly1305&) DELETE_METHOD;
+
+  void blocks(const uint8_t *m, size_t len, uint32_t hibit);
+
+public:
+  poly1305(const uint8_t key[POLY1305_KEY_LEN]);
+  ~poly1305();
+
+  void update(const uint8_t *m, size_t len);
+
+  /** Bring the input so far up to a multiple of 16 bytes with
+      zeroes, as the AEAD construction does between its parts. */
+  void pad16();
+
+  void finish(uint8_t tag[POLY1305_TAG_LEN]);
+};
+
+#endif
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// c-file-style: "gnu"
+// c-file-offsets: ((innamespace . 0) (brace-list-open . 0))
+// End:
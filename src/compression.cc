@@ -6,6 +6,7 @@
 
 #include <zlib.h>
 #include <limits>
+#include <event2/buffer.h>
 
 // zlib doesn't believe in size_t. When size_t is bigger than uInt, we
 // theoretically could break operations up into uInt-sized chunks to
@@ -19,88 +20,340 @@ const size_t ZLIB_UINT_MAX = std::numeric_limits<uInt>::max();
 const size_t ZLIB_CEILING = (SIZE_T_CEILING > ZLIB_UINT_MAX
                              ? ZLIB_UINT_MAX : SIZE_T_CEILING);
 
-ssize_t
-compress(const uint8_t *source, size_t slen,
-         uint8_t *dest, size_t dlen,
-         compression_format fmt)
+// Output goes to an evbuffer this much at a time.
+const size_t ZLIB_EVBUFFER_CHUNK = 4096;
+
+deflater::deflater(compression_format fmt)
+  : strm(new z_stream), gzh(0)
 {
   log_assert(fmt == c_format_zlib || fmt == c_format_gzip);
-
-  if (slen > ZLIB_CEILING || dlen > ZLIB_CEILING)
-    return -1;
-
-  z_stream strm;
-  memset(&strm, 0, sizeof strm);
+  memset(strm, 0, sizeof *strm);
 
   int wbits = MAX_WBITS;
   if (fmt == c_format_gzip)
     wbits |= 16; // magic number 16 = compress as gzip
 
-  int ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+  int ret = deflateInit2(strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
                          wbits, 8, Z_DEFAULT_STRATEGY);
   if (ret != Z_OK) {
-    log_warn("compression failure (initialization): %s", strm.msg);
-    return -1;
+    log_warn("compression failure (initialization): %s", strm->msg);
+    delete strm;
+    strm = 0;
+    return;
   }
 
   if (fmt == c_format_gzip) {
-    gz_header gzh;
-    memset(&gzh, 0, sizeof gzh);
-    gzh.os = 0xFF; // "unknown"
-    ret = deflateSetHeader(&strm, &gzh);
+    gzh = new gz_header;
+    memset(gzh, 0, sizeof *gzh);
+    gzh->os = 0xFF; // "unknown"
+    ret = deflateSetHeader(strm, gzh);
     if (ret != Z_OK) {
-      log_warn("compression failure (initialization): %s", strm.msg);
+      log_warn("compression failure (initialization): %s", strm->msg);
+      deflateEnd(strm);
+      delete strm;
+      strm = 0;
+    }
+  }
+}
+
+deflater::~deflater()
+{
+  if (strm) {
+    deflateEnd(strm);
+    delete strm;
+  }
+  delete gzh;
+}
+
+void
+deflater::set_output(uint8_t *dest, size_t len)
+{
+  strm->next_out = dest;
+  strm->avail_out = std::min(len, ZLIB_CEILING);
+}
+
+size_t
+deflater::output_left() const
+{
+  return strm->avail_out;
+}
+
+size_t
+deflater::total_out() const
+{
+  return strm->total_out;
+}
+
+int
+deflater::run(int flush)
+{
+  for (;;) {
+    int ret = deflate(strm, flush);
+    if (ret == Z_STREAM_END)
+      return 0;
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      log_warn("compression failure: %s", strm->msg);
       return -1;
     }
+    if (flush == Z_NO_FLUSH && strm->avail_in == 0)
+      return 0;
+    if (strm->avail_out == 0)
+      return -2;
   }
+}
 
-  strm.next_in = const_cast<Bytef*>(source);
-  strm.avail_in = slen;
-  strm.next_out = dest;
-  strm.avail_out = dlen;
+int
+deflater::run(int flush, struct evbuffer *dest)
+{
+  for (;;) {
+    struct evbuffer_iovec v;
+    if (evbuffer_reserve_space(dest, ZLIB_EVBUFFER_CHUNK, &v, 1) != 1) {
+      log_warn("compression failure: memory allocation failure");
+      return -1;
+    }
+    set_output((uint8_t *)v.iov_base, v.iov_len);
+    int ret = run(flush);
+    v.iov_len -= strm->avail_out;
+    strm->next_out = 0;
+    strm->avail_out = 0;
+    if (evbuffer_commit_space(dest, &v, 1)) {
+      log_warn("compression failure: memory allocation failure");
+      return -1;
+    }
+    if (ret != -2)
+      return ret;
+  }
+}
 
-  ret = deflate(&strm, Z_FINISH);
-  if (ret != Z_STREAM_END) {
-    log_warn("compression failure: %s", strm.msg);
-    deflateEnd(&strm);
-    return -1;
+int
+deflater::write(const uint8_t *src, size_t len)
+{
+  if (src) {
+    if (len > ZLIB_CEILING)
+      return -1;
+    strm->next_in = const_cast<Bytef*>(src);
+    strm->avail_in = len;
+  }
+  return run(Z_NO_FLUSH);
+}
+
+int
+deflater::write(const uint8_t *src, size_t len, struct evbuffer *dest)
+{
+  if (src) {
+    if (len > ZLIB_CEILING)
+      return -1;
+    strm->next_in = const_cast<Bytef*>(src);
+    strm->avail_in = len;
+  }
+  return run(Z_NO_FLUSH, dest);
+}
+
+int
+deflater::finish()
+{
+  return run(Z_FINISH);
+}
+
+int
+deflater::finish(struct evbuffer *dest)
+{
+  return run(Z_FINISH, dest);
+}
+
+inflater::inflater()
+  : strm(new z_stream)
+{
+  memset(strm, 0, sizeof *strm);
+  int ret = inflateInit2(strm, MAX_WBITS|32); /* autodetect gzip/zlib */
+  if (ret != Z_OK) {
+    log_warn("decompression failure (initialization): %s", strm->msg);
+    delete strm;
+    strm = 0;
+  }
+}
+
+inflater::~inflater()
+{
+  if (strm) {
+    inflateEnd(strm);
+    delete strm;
   }
+}
+
+void
+inflater::set_output(uint8_t *dest, size_t len)
+{
+  strm->next_out = dest;
+  strm->avail_out = std::min(len, ZLIB_CEILING);
+}
+
+size_t
+inflater::output_left() const
+{
+  return strm->avail_out;
+}
+
+size_t
+inflater::total_out() const
+{
+  return strm->total_out;
+}
+
+int
+inflater::write(const uint8_t *src, size_t len)
+{
+  if (src) {
+    if (len > ZLIB_CEILING)
+      return -1;
+    strm->next_in = const_cast<Bytef*>(src);
+    strm->avail_in = len;
+  }
+
+  for (;;) {
+    int ret = inflate(strm, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END)
+      return 1;
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      log_warn("decompression failure: %s", strm->msg);
+      return -1;
+    }
+    if (strm->avail_out == 0)
+      return -2;
+    if (strm->avail_in == 0)
+      return 0;
+  }
+}
 
-  deflateEnd(&strm);
-  return strm.total_out;
+int
+inflater::write(const uint8_t *src, size_t len,
+                struct evbuffer *dest, size_t limit)
+{
+  for (;;) {
+    size_t room = limit > strm->total_out ? limit - strm->total_out : 0;
+    if (room == 0) {
+      // At the limit, still let the end of the stream be read, into a
+      // byte of scratch space zlib needs to make progress; any output
+      // landing there is over the limit.
+      uint8_t scratch;
+      set_output(&scratch, 1);
+      int ret = write(src, len);
+      bool over = strm->avail_out == 0;
+      strm->next_out = 0;
+      strm->avail_out = 0;
+      return over ? -2 : ret;
+    }
+
+    struct evbuffer_iovec v;
+    if (evbuffer_reserve_space(dest, std::min(room, ZLIB_EVBUFFER_CHUNK),
+                               &v, 1) != 1) {
+      log_warn("decompression failure: memory allocation failure");
+      return -1;
+    }
+    if (v.iov_len > room)
+      v.iov_len = room;
+
+    set_output((uint8_t *)v.iov_base, v.iov_len);
+    int ret = write(src, len);
+    src = 0;
+    v.iov_len -= strm->avail_out;
+    strm->next_out = 0;
+    strm->avail_out = 0;
+    if (evbuffer_commit_space(dest, &v, 1)) {
+      log_warn("decompression failure: memory allocation failure");
+      return -1;
+    }
+    if (ret != -2)
+      return ret;
+  }
 }
 
 ssize_t
-decompress(const uint8_t *source, size_t slen, uint8_t *dest, size_t dlen)
+compress(const uint8_t *source, size_t slen,
+         uint8_t *dest, size_t dlen,
+         compression_format fmt)
 {
   if (slen > ZLIB_CEILING || dlen > ZLIB_CEILING)
     return -1;
 
-  /* allocate inflate state */
-  z_stream strm;
-  memset(&strm, 0, sizeof strm);
-  int ret = inflateInit2(&strm, MAX_WBITS|32); /* autodetect gzip/zlib */
-  if (ret != Z_OK) {
-    log_warn("decompression failure (initialization): %s", strm.msg);
+  deflater z(fmt);
+  if (!z.ok())
     return -1;
-  }
 
-  strm.next_in = const_cast<Bytef*>(source);
-  strm.avail_in = slen;
-  strm.next_out = dest;
-  strm.avail_out = dlen;
+  z.set_output(dest, dlen);
+  int ret = z.write(source, slen);
+  if (ret == 0)
+    ret = z.finish();
+  if (ret == -2)
+    log_debug("compression failure: output does not fit in %lu bytes",
+              (unsigned long)dlen);
+  if (ret)
+    return -1;
+
+  return z.total_out();
+}
+
+ssize_t
+decompress(const uint8_t *source, size_t slen, uint8_t *dest, size_t dlen)
+{
+  if (slen > ZLIB_CEILING || dlen > ZLIB_CEILING)
+    return -1;
+
+  inflater z;
+  if (!z.ok())
+    return -1;
 
-  ret = inflate(&strm, Z_FINISH);
-  if (ret == Z_BUF_ERROR) {
-    inflateEnd(&strm);
+  z.set_output(dest, dlen);
+  int ret = z.write(source, slen);
+  if (ret == -2)
     return -2; // need more space
+  if (ret == 0)
+    log_warn("decompression failure: stream truncated");
+  if (ret != 1)
+    return -1;
+
+  return z.total_out();
+}
+
+ssize_t
+decompress_skip(const uint8_t *source, size_t slen, size_t skip,
+                uint8_t *dest, size_t dlen)
+{
+  if (slen > ZLIB_CEILING || dlen > ZLIB_CEILING)
+    return -1;
+
+  inflater z;
+  if (!z.ok())
+    return -1;
+
+  // Inflate the part to be skipped a piece at a time into scratch
+  // space, then the rest straight into DEST.
+  uint8_t scratch[1024];
+  const uint8_t *src = source;
+  int ret = -2;
+  while (skip > 0 && ret == -2) {
+    size_t n = std::min(skip, sizeof scratch);
+    z.set_output(scratch, n);
+    ret = z.write(src, slen);
+    src = 0;
+    skip -= n - z.output_left();
   }
-  if (ret != Z_STREAM_END) {
-    log_warn("decompression failure: %s", strm.msg);
-    inflateEnd(&strm);
+  if (skip > 0) {
+    if (ret >= 0)
+      log_warn("decompression failure: stream too short");
     return -1;
   }
+  if (ret == 1)
+    return 0;
+
+  z.set_output(dest, dlen);
+  ret = z.write(src, slen);
+  if (ret == -2)
+    return -2; // need more space
+  if (ret == 0)
+    log_warn("decompression failure: stream truncated");
+  if (ret != 1)
+    return -1;
 
-  inflateEnd(&strm);
-  return strm.total_out;
+  return dlen - z.output_left();
 }
@@ -27,9 +27,107 @@ ssize_t compress(const uint8_t *source, size_t slen,
  * buffer at DEST.  There are DLEN bytes of available space at the
  * destination.  Automatically detects the compression format in use.
  *
- * Returns the amount of data actually written to DEST, or -1 on error.
+ * Returns the amount of data actually written to DEST, -2 if it did
+ * not all fit in DLEN bytes, or -1 on error.
  */
 ssize_t decompress(const uint8_t *source, size_t slen,
                    uint8_t *dest, size_t dlen);
 
+/**
+ * As decompress(), but the first SKIP bytes of the decompressed data
+ * are thrown away and only the rest is written to DEST, so that a
+ * section in the middle of a large stream can be recovered without
+ * room for all of it.  Beyond DEST, only a small fixed-size scratch
+ * buffer is used.
+ *
+ * Returns the amount of data written to DEST, -2 if it did not all fit
+ * in DLEN bytes, or -1 on error (including a stream that decompresses
+ * to fewer than SKIP bytes).
+ */
+ssize_t decompress_skip(const uint8_t *source, size_t slen, size_t skip,
+                        uint8_t *dest, size_t dlen);
+
+struct evbuffer;
+struct gz_header_s;
+struct z_stream_s;
+
+/**
+ * Incremental compression.  Input is passed to write() in as many
+ * pieces as is convenient, and the compressed stream goes either to
+ * space the caller provides with set_output(), or is appended to an
+ * evbuffer; finish() ends the stream.
+ *
+ * write() and finish() return 0 on success, -1 on error, or -2 if the
+ * space from set_output() has been used up, whether or not there is
+ * more output to come.  In the last case the input not yet consumed
+ * is remembered (so it must stay valid): call set_output() again and
+ * then write(0, 0) or finish() to carry on.
+ */
+class deflater
+{
+  struct z_stream_s *strm;
+  struct gz_header_s *gzh;      // zlib refers to it until the end
+
+  deflater(const deflater&) DELETE_METHOD;
+  deflater& operator=(const deflater&) DELETE_METHOD;
+
+  int run(int flush);
+  int run(int flush, struct evbuffer *dest);
+
+public:
+  deflater(compression_format fmt);
+  ~deflater();
+
+  /** False if the stream could not be set up, in which case nothing
+      else may be called. */
+  bool ok() const { return strm != 0; }
+
+  /** Write further output to the LEN bytes at DEST. */
+  void set_output(uint8_t *dest, size_t len);
+
+  /** Bytes of the space from the last set_output() not yet used. */
+  size_t output_left() const;
+
+  /** Total bytes of output so far. */
+  size_t total_out() const;
+
+  int write(const uint8_t *src, size_t len);
+  int write(const uint8_t *src, size_t len, struct evbuffer *dest);
+
+  int finish();
+  int finish(struct evbuffer *dest);
+};
+
+/**
+ * Incremental decompression of a zlib or gzip stream (the format is
+ * detected, as by decompress()); the counterpart of 'deflater'.
+ *
+ * write() returns 1 once the end of the stream has been reached, 0 if
+ * more input is needed, -1 if the data are corrupt, or -2 if the
+ * output space ran out, which is resumed as for a deflater.  The
+ * evbuffer form refuses (with -2) to make the total output more than
+ * LIMIT bytes.
+ */
+class inflater
+{
+  struct z_stream_s *strm;
+
+  inflater(const inflater&) DELETE_METHOD;
+  inflater& operator=(const inflater&) DELETE_METHOD;
+
+public:
+  inflater();
+  ~inflater();
+
+  bool ok() const { return strm != 0; }
+
+  void set_output(uint8_t *dest, size_t len);
+  size_t output_left() const;
+  size_t total_out() const;
+
+  int write(const uint8_t *src, size_t len);
+  int write(const uint8_t *src, size_t len,
+            struct evbuffer *dest, size_t limit);
+};
+
 #endif
@@ -34,7 +34,7 @@ struct conn_global_state
       event loop. */
   unordered_set<circuit_t *> closed_circuits;
 
-  /** The one and only event base used by this program.
+  /** The event base used by this worker.
       Not owned by this object. */
   struct event_base *the_event_base;
 
@@ -119,7 +119,8 @@ close_cleanup_cb(evutil_socket_t, short, void *arg)
   cgs = 0;
 }
 
-static conn_global_state *cgs = NULL;
+/* Each worker thread (see workers.h) has its own connection state. */
+static __thread conn_global_state *cgs = NULL;
 
 void
 conn_global_init(struct event_base *evbase)
@@ -250,7 +251,7 @@ conn_send_eof(conn_t *dest)
    that can only send data in small chunks. */
 
 static void
-flush_timer_cb(evutil_socket_t, short, void *arg)
+flush_timer_cb(void *arg)
 {
   circuit_t *ckt = (circuit_t *)arg;
   log_debug(ckt, "flush timer expired, %lu bytes available",
@@ -264,7 +265,7 @@ flush_timer_cb(evutil_socket_t, short, void *arg)
    connections. */
 
 static void
-axe_timer_cb(evutil_socket_t, short, void *arg)
+axe_timer_cb(void *arg)
 {
   circuit_t *ckt = (circuit_t *)arg;
   log_warn(ckt, "timeout waiting for new connections");
@@ -281,6 +282,8 @@ circuit_create(config_t *cfg, size_t index)
 
   ckt = cfg->circuit_create(index);
   ckt->serial = ++cgs->last_ckt_serial;
+  ckt->flush_timer.set_callback(flush_timer_cb, ckt);
+  ckt->axe_timer.set_callback(axe_timer_cb, ckt);
 
   if (cfg->mode == LSN_SOCKS_CLIENT)
     ckt->socks_state = socks_state_new();
@@ -298,10 +301,6 @@ circuit_t::~circuit_t()
     free((void *)this->up_peer);
   if (this->socks_state)
     socks_state_free(this->socks_state);
-  if (this->flush_timer)
-    event_free(this->flush_timer);
-  if (this->axe_timer)
-    event_free(this->axe_timer);
 }
 
 void
@@ -312,10 +311,8 @@ circuit_t::close()
 
   if (this->up_buffer)
     bufferevent_disable(this->up_buffer, EV_READ|EV_WRITE);
-  if (this->flush_timer)
-    event_del(this->flush_timer);
-  if (this->axe_timer)
-    event_del(this->axe_timer);
+  this->flush_timer.disarm();
+  this->axe_timer.disarm();
 
   bool need_event =
     cgs->closed_connections.empty() && cgs->closed_circuits.empty();
@@ -404,42 +401,24 @@ void
 circuit_arm_flush_timer(circuit_t *ckt, unsigned int milliseconds)
 {
   log_debug(ckt, "flush within %u milliseconds", milliseconds);
-
-  struct timeval tv;
-  tv.tv_sec = milliseconds / 1000;
-  tv.tv_usec = (milliseconds % 1000) * 1000;
-
-  if (!ckt->flush_timer)
-    ckt->flush_timer = evtimer_new(ckt->cfg()->base, flush_timer_cb, ckt);
-
-  evtimer_add(ckt->flush_timer, &tv);
+  ckt->cfg()->timers()->arm(&ckt->flush_timer, milliseconds);
 }
 
 void
 circuit_disarm_flush_timer(circuit_t *ckt)
 {
-  if (ckt->flush_timer)
-    evtimer_del(ckt->flush_timer);
+  ckt->flush_timer.disarm();
 }
 
 void
 circuit_arm_axe_timer(circuit_t *ckt, unsigned int milliseconds)
 {
   log_debug(ckt, "axe after %u milliseconds", milliseconds);
-
-  struct timeval tv;
-  tv.tv_sec = milliseconds / 1000;
-  tv.tv_usec = (milliseconds % 1000) * 1000;
-
-  if (!ckt->axe_timer)
-    ckt->axe_timer = evtimer_new(ckt->cfg()->base, axe_timer_cb, ckt);
-
-  evtimer_add(ckt->axe_timer, &tv);
+  ckt->cfg()->timers()->arm(&ckt->axe_timer, milliseconds);
 }
 
 void
 circuit_disarm_axe_timer(circuit_t *ckt)
 {
-  if (ckt->axe_timer)
-    evtimer_del(ckt->axe_timer);
+  ckt->axe_timer.disarm();
 }
@@ -8,6 +8,8 @@
 
 #include <event2/bufferevent.h>
 
+#include "timer_wheel.h"
+
 #include <time.h> //Keeping track of life length of a connection for debug reason
 
 #define MAX_GLOBAL_CONN_COUNT 256 //To prevent the total number of connections
@@ -153,8 +155,8 @@ void conn_do_flush(conn_t *conn);
  */
 
 struct circuit_t {
-  struct event       *flush_timer;
-  struct event       *axe_timer;
+  wheel_timer         flush_timer;
+  wheel_timer         axe_timer;
   struct bufferevent *up_buffer;
   const char         *up_peer;
   socks_state_t      *socks_state;
@@ -167,8 +169,8 @@ struct circuit_t {
   bool                pending_write_eof : 1;
 
   circuit_t()
-    : flush_timer(0)
-    , axe_timer(0)
+    : flush_timer()
+    , axe_timer()
     , up_buffer(0)
     , up_peer(0)
     , socks_state(0)
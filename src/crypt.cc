@@ -5,6 +5,7 @@
 
 #include "util.h"
 #include "crypt.h"
+#include "chacha.h"
 
 #include <openssl/engine.h>
 #include <openssl/err.h>
@@ -13,10 +14,42 @@
 #include <openssl/hmac.h>
 #include <openssl/objects.h>
 
+#include <algorithm>
+
+#include <pthread.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
 static bool crypto_initialized = false;
 static bool crypto_errs_initialized = false;
 static BN_CTX *bctx = 0;
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/* Older OpenSSL is only safe to call from several worker threads at
+   once if we supply it with locks. */
+static pthread_mutex_t *crypto_locks = 0;
+
+static void
+crypto_locking_cb(int mode, int n, const char *, int)
+{
+  if (mode & CRYPTO_LOCK)
+    pthread_mutex_lock(&crypto_locks[n]);
+  else
+    pthread_mutex_unlock(&crypto_locks[n]);
+}
+
+static unsigned long
+crypto_thread_id_cb()
+{
+  return (unsigned long)pthread_self();
+}
+#endif
+
 #define REQUIRE_INIT_CRYPTO() \
   log_assert(crypto_initialized)
 
@@ -33,8 +66,20 @@ init_crypto()
   if (!bctx)
     log_crypto_abort("initialization");
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  crypto_locks = (pthread_mutex_t *)
+    xmalloc(CRYPTO_num_locks() * sizeof(pthread_mutex_t));
+  for (int i = 0; i < CRYPTO_num_locks(); i++)
+    pthread_mutex_init(&crypto_locks[i], NULL);
+  CRYPTO_set_id_callback(crypto_thread_id_cb);
+  CRYPTO_set_locking_callback(crypto_locking_cb);
+#endif
+
   // We don't need to call OpenSSL_add_all_algorithms, since we never
   // look up ciphers by textual name.
+
+  log_info("crypto: %s, AES: %s", SSLeay_version(SSLEAY_VERSION),
+           crypto_aes_backend());
 }
 
 void
@@ -45,6 +90,14 @@ free_crypto()
     // OpenSSL_add_all_algorithms.
     BN_CTX_free(bctx);
     ENGINE_cleanup();
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    CRYPTO_set_locking_callback(NULL);
+    CRYPTO_set_id_callback(NULL);
+    for (int i = 0; i < CRYPTO_num_locks(); i++)
+      pthread_mutex_destroy(&crypto_locks[i]);
+    free(crypto_locks);
+    crypto_locks = 0;
+#endif
   }
   if (crypto_errs_initialized)
     ERR_free_strings();
@@ -81,6 +134,32 @@ log_crypto_warn(const char *msg)
   return -1;
 }
 
+const char *
+crypto_aes_backend()
+{
+#if defined(__i386__) || defined(__x86_64__)
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_AES))
+    return "generic";
+  if (__get_cpuid_max(0, 0) >= 7) {
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    if (ecx & (1 << 9))  // VAES
+      return "AES-NI+VAES";
+  }
+  return "AES-NI";
+#elif defined(__aarch64__) && defined(__linux__)
+  return (getauxval(AT_HWCAP) & HWCAP_AES) ? "ARMv8 AES" : "generic";
+#else
+  return "generic";
+#endif
+}
+
+bool
+crypto_aes_accelerated()
+{
+  return strcmp(crypto_aes_backend(), "generic") != 0;
+}
+
 static const EVP_CIPHER *
 aes_ecb_by_size(size_t keylen)
 {
@@ -154,6 +233,8 @@ namespace {
     ecb_encryptor_impl() { EVP_CIPHER_CTX_init(&ctx); }
     virtual ~ecb_encryptor_impl();
     virtual void encrypt(uint8_t *out, const uint8_t *in);
+    virtual void encrypt_blocks(uint8_t *out, const uint8_t *in,
+                                size_t nblocks);
   };
 
   struct ecb_encryptor_noop_impl : ecb_encryptor
@@ -161,6 +242,8 @@ namespace {
     ecb_encryptor_noop_impl() {}
     virtual ~ecb_encryptor_noop_impl();
     virtual void encrypt(uint8_t *out, const uint8_t *in);
+    virtual void encrypt_blocks(uint8_t *out, const uint8_t *in,
+                                size_t nblocks);
   };
 
   struct ecb_decryptor_impl : ecb_decryptor
@@ -276,12 +359,31 @@ ecb_encryptor_impl::encrypt(uint8_t *out, const uint8_t *in)
     log_crypto_abort("ecb_encryptor::encrypt");
 }
 
+void
+ecb_encryptor_impl::encrypt_blocks(uint8_t *out, const uint8_t *in,
+                                   size_t nblocks)
+{
+  log_assert(nblocks <= size_t(INT_MAX) / AES_BLOCK_LEN);
+
+  int olen;
+  if (!EVP_EncryptUpdate(&ctx, out, &olen, in, nblocks * AES_BLOCK_LEN) ||
+      size_t(olen) != nblocks * AES_BLOCK_LEN)
+    log_crypto_abort("ecb_encryptor::encrypt_blocks");
+}
+
 void
 ecb_encryptor_noop_impl::encrypt(uint8_t *out, const uint8_t *in)
 {
   memcpy(out, in, AES_BLOCK_LEN);
 }
 
+void
+ecb_encryptor_noop_impl::encrypt_blocks(uint8_t *out, const uint8_t *in,
+                                        size_t nblocks)
+{
+  memcpy(out, in, nblocks * AES_BLOCK_LEN);
+}
+
 void
 ecb_decryptor_impl::decrypt(uint8_t *out, const uint8_t *in)
 {
@@ -305,6 +407,7 @@ namespace {
     virtual ~gcm_encryptor_impl();
     virtual void encrypt(uint8_t *out, const uint8_t *in, size_t inlen,
                          const uint8_t *nonce, size_t nlen);
+    virtual void encrypt_batch(const gcm_block *blocks, size_t n);
   };
 
   struct gcm_encryptor_noop_impl : gcm_encryptor
@@ -313,6 +416,7 @@ namespace {
     virtual ~gcm_encryptor_noop_impl();
     virtual void encrypt(uint8_t *out, const uint8_t *in, size_t inlen,
                          const uint8_t *nonce, size_t nlen);
+    virtual void encrypt_batch(const gcm_block *blocks, size_t n);
   };
 
   struct gcm_decryptor_impl : gcm_decryptor
@@ -322,6 +426,10 @@ namespace {
     virtual ~gcm_decryptor_impl();
     virtual int decrypt(uint8_t *out, const uint8_t *in, size_t inlen,
                         const uint8_t *nonce, size_t nlen);
+    virtual int decrypt_segments(uint8_t *out, size_t outlen,
+                                 const gcm_segment *in, size_t nseg,
+                                 size_t inlen,
+                                 const uint8_t *nonce, size_t nlen);
   };
 
   struct gcm_decryptor_noop_impl : gcm_decryptor
@@ -330,6 +438,10 @@ namespace {
     virtual ~gcm_decryptor_noop_impl();
     virtual int decrypt(uint8_t *out, const uint8_t *in, size_t inlen,
                         const uint8_t *nonce, size_t nlen);
+    virtual int decrypt_segments(uint8_t *out, size_t outlen,
+                                 const gcm_segment *in, size_t nseg,
+                                 size_t inlen,
+                                 const uint8_t *nonce, size_t nlen);
   };
 }
 
@@ -434,27 +546,61 @@ void
 gcm_encryptor_impl::encrypt(uint8_t *out, const uint8_t *in, size_t inlen,
                             const uint8_t *nonce, size_t nlen)
 {
-  log_assert(inlen <= size_t(INT_MAX));
+  gcm_block b = { out, in, inlen, 0, nonce, nlen };
+  encrypt_batch(&b, 1);
+}
 
-  if (nlen != size_t(EVP_CIPHER_CTX_iv_length(&ctx)))
-    if (!EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_GCM_SET_IVLEN, nlen, 0))
-      log_crypto_abort("gcm_encryptor::reset nonce length");
+// Source of the zeroes that pad out a block; padding is fed to the
+// cipher from here rather than being copied in after the data.
+static const uint8_t gcm_zero_padding[256] = { 0 };
+
+void
+gcm_encryptor_impl::encrypt_batch(const gcm_block *blocks, size_t n)
+{
+  // The key schedule was set up once, in create().  Per message we
+  // only have to load the nonce, run the data and padding through,
+  // and collect the tag.  The nonce length rarely changes within a
+  // batch, so only reset it when it does.
+  size_t ivlen = EVP_CIPHER_CTX_iv_length(&ctx);
+
+  for (size_t i = 0; i < n; i++) {
+    const gcm_block &b = blocks[i];
+    log_assert(b.inlen <= size_t(INT_MAX) &&
+               b.padlen <= size_t(INT_MAX) - b.inlen);
+
+    if (b.nlen != ivlen) {
+      if (!EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_GCM_SET_IVLEN, b.nlen, 0))
+        log_crypto_abort("gcm_encryptor::reset nonce length");
+      ivlen = b.nlen;
+    }
 
-  if (!EVP_EncryptInit_ex(&ctx, 0, 0, 0, nonce))
-    log_crypto_abort("gcm_encryptor::set nonce");
+    if (!EVP_EncryptInit_ex(&ctx, 0, 0, 0, b.nonce))
+      log_crypto_abort("gcm_encryptor::set nonce");
 
-  int olen;
-  if (!EVP_EncryptUpdate(&ctx, 0, &olen, (const uint8_t *)"", 0) || olen != 0)
-    log_crypto_abort("gcm_encryptor::set null AAD");
+    int olen;
+    uint8_t *out = b.out;
+    if (b.inlen) {
+      if (!EVP_EncryptUpdate(&ctx, out, &olen, b.in, b.inlen) ||
+          size_t(olen) != b.inlen)
+        log_crypto_abort("gcm_encryptor::encrypt");
+      out += b.inlen;
+    }
 
-  if (!EVP_EncryptUpdate(&ctx, out, &olen, in, inlen) || size_t(olen) != inlen)
-    log_crypto_abort("gcm_encryptor::encrypt");
+    for (size_t pad = b.padlen; pad > 0;) {
+      size_t chunk = std::min(pad, sizeof gcm_zero_padding);
+      if (!EVP_EncryptUpdate(&ctx, out, &olen, gcm_zero_padding, chunk) ||
+          size_t(olen) != chunk)
+        log_crypto_abort("gcm_encryptor::encrypt padding");
+      out += chunk;
+      pad -= chunk;
+    }
 
-  if (!EVP_EncryptFinal_ex(&ctx, out + inlen, &olen) || olen != 0)
-    log_crypto_abort("gcm_encryptor::finalize");
+    if (!EVP_EncryptFinal_ex(&ctx, out, &olen) || olen != 0)
+      log_crypto_abort("gcm_encryptor::finalize");
 
-  if (!EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_GCM_GET_TAG, 16, out + inlen))
-    log_crypto_abort("gcm_encryptor::write tag");
+    if (!EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_GCM_GET_TAG, GCM_TAG_LEN, out))
+      log_crypto_abort("gcm_encryptor::write tag");
+  }
 }
 
 void
@@ -465,6 +611,16 @@ gcm_encryptor_noop_impl::encrypt(uint8_t *out, const uint8_t *in, size_t inlen,
   memset(out + inlen, 0, 16);
 }
 
+void
+gcm_encryptor_noop_impl::encrypt_batch(const gcm_block *blocks, size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    memcpy(blocks[i].out, blocks[i].in, blocks[i].inlen);
+    memset(blocks[i].out + blocks[i].inlen, 0,
+           blocks[i].padlen + GCM_TAG_LEN);
+  }
+}
+
 int
 gcm_decryptor_impl::decrypt(uint8_t *out, const uint8_t *in, size_t inlen,
                             const uint8_t *nonce, size_t nlen)
@@ -508,6 +664,296 @@ gcm_decryptor_noop_impl::decrypt(uint8_t *out, const uint8_t *in, size_t inlen,
   return 0;
 }
 
+int
+gcm_decryptor_impl::decrypt_segments(uint8_t *out, size_t outlen,
+                                     const gcm_segment *in, size_t nseg,
+                                     size_t inlen,
+                                     const uint8_t *nonce, size_t nlen)
+{
+  log_assert(inlen >= 16 && inlen <= size_t(INT_MAX));
+  log_assert(outlen <= inlen - 16);
+
+  if (nlen != size_t(EVP_CIPHER_CTX_iv_length(&ctx)))
+    if (!EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_GCM_SET_IVLEN, nlen, 0))
+      log_crypto_abort("gcm_decryptor::reset nonce length");
+
+  if (!EVP_DecryptInit_ex(&ctx, 0, 0, 0, nonce))
+    return log_crypto_warn("gcm_decryptor::set nonce");
+
+  // Plaintext beyond 'outlen' is decrypted into this scratch space
+  // and thrown away; it still has to pass through the cipher so that
+  // the tag covers it.
+  uint8_t discard[256];
+  uint8_t tag[16];
+  size_t ctext = inlen - 16;
+  size_t taglen = 0;
+  int olen;
+
+  for (size_t i = 0; i < nseg && taglen < 16; i++) {
+    const uint8_t *p = in[i].data;
+    size_t len = in[i].len;
+
+    while (len > 0 && ctext > 0) {
+      size_t chunk = std::min(len, ctext);
+      uint8_t *dst;
+      if (outlen > 0) {
+        chunk = std::min(chunk, outlen);
+        dst = out;
+      } else {
+        chunk = std::min(chunk, sizeof discard);
+        dst = discard;
+      }
+      if (!EVP_DecryptUpdate(&ctx, dst, &olen, p, chunk) ||
+          size_t(olen) != chunk)
+        return log_crypto_warn("gcm_decryptor::decrypt");
+      if (outlen > 0) {
+        out += chunk;
+        outlen -= chunk;
+      }
+      p += chunk;
+      len -= chunk;
+      ctext -= chunk;
+    }
+
+    size_t t = std::min(len, 16 - taglen);
+    memcpy(tag + taglen, p, t);
+    taglen += t;
+  }
+
+  if (ctext > 0 || taglen < 16) {
+    log_warn("gcm_decryptor: %lu bytes of input expected, but not supplied",
+             (unsigned long)(ctext + 16 - taglen));
+    return -1;
+  }
+
+  if (!EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_GCM_SET_TAG, 16, tag))
+    return log_crypto_warn("gcm_decryptor::set tag");
+
+  if (!EVP_DecryptFinal_ex(&ctx, discard, &olen) || olen != 0) {
+    /* don't warn for simple MAC failures */
+    if (!ERR_peek_error())
+      return -1;
+    return log_crypto_warn("gcm_decryptor::check tag");
+  }
+
+  return 0;
+}
+
+int
+gcm_decryptor_noop_impl::decrypt_segments(uint8_t *out, size_t outlen,
+                                          const gcm_segment *in, size_t nseg,
+                                          size_t inlen,
+                                          const uint8_t *, size_t)
+{
+  log_assert(inlen >= 16 && outlen <= inlen - 16);
+
+  for (size_t i = 0; i < nseg && outlen > 0; i++) {
+    size_t chunk = std::min(in[i].len, outlen);
+    memcpy(out, in[i].data, chunk);
+    out += chunk;
+    outlen -= chunk;
+  }
+  return outlen > 0 ? -1 : 0;
+}
+
+// ChaCha20-Poly1305, as in RFC 7539 with no additional data, on
+// chacha.cc's primitives.  OpenSSL only has it from 1.1.0 on, and
+// there in its generic C on the CPUs that need it most.
+
+namespace {
+  struct chacha20_poly1305_encryptor_impl : gcm_encryptor
+  {
+    uint8_t key[CHACHA20_KEY_LEN];
+    chacha20_poly1305_encryptor_impl(const uint8_t *k)
+    { memcpy(key, k, sizeof key); }
+    virtual ~chacha20_poly1305_encryptor_impl();
+    virtual void encrypt(uint8_t *out, const uint8_t *in, size_t inlen,
+                         const uint8_t *nonce, size_t nlen);
+    virtual void encrypt_batch(const gcm_block *blocks, size_t n);
+  };
+
+  struct chacha20_poly1305_decryptor_impl : gcm_decryptor
+  {
+    uint8_t key[CHACHA20_KEY_LEN];
+    chacha20_poly1305_decryptor_impl(const uint8_t *k)
+    { memcpy(key, k, sizeof key); }
+    virtual ~chacha20_poly1305_decryptor_impl();
+    virtual int decrypt(uint8_t *out, const uint8_t *in, size_t inlen,
+                        const uint8_t *nonce, size_t nlen);
+    virtual int decrypt_segments(uint8_t *out, size_t outlen,
+                                 const gcm_segment *in, size_t nseg,
+                                 size_t inlen,
+                                 const uint8_t *nonce, size_t nlen);
+  };
+}
+
+gcm_encryptor *
+gcm_encryptor::create_chacha20_poly1305(const uint8_t *key, size_t keylen)
+{
+  if (keylen != CHACHA20_POLY1305_KEY_LEN)
+    log_abort("ChaCha20 only supports 32-byte keys");
+  return new chacha20_poly1305_encryptor_impl(key);
+}
+
+gcm_decryptor *
+gcm_decryptor::create_chacha20_poly1305(const uint8_t *key, size_t keylen)
+{
+  if (keylen != CHACHA20_POLY1305_KEY_LEN)
+    log_abort("ChaCha20 only supports 32-byte keys");
+  return new chacha20_poly1305_decryptor_impl(key);
+}
+
+chacha20_poly1305_encryptor_impl::~chacha20_poly1305_encryptor_impl()
+{ memset(key, 0, sizeof key); }
+
+chacha20_poly1305_decryptor_impl::~chacha20_poly1305_decryptor_impl()
+{ memset(key, 0, sizeof key); }
+
+/* Reduce NONCE to the 12 bytes ChaCha20 takes, and key the
+   authenticator with the first block of the keystream. */
+static void
+chacha20_poly1305_setup(uint8_t n12[CHACHA20_NONCE_LEN],
+                        uint8_t otk[CHACHA20_BLOCK_LEN],
+                        const uint8_t *key,
+                        const uint8_t *nonce, size_t nlen)
+{
+  log_assert(nlen >= CHACHA20_NONCE_LEN);
+  memcpy(n12, nonce, CHACHA20_NONCE_LEN);
+  for (size_t i = CHACHA20_NONCE_LEN; i < nlen; i++)
+    n12[i % CHACHA20_NONCE_LEN] ^= nonce[i];
+  chacha20_block(otk, key, 0, n12);
+}
+
+/* The end of the authenticated data: padding, and the lengths of the
+   (absent) additional data and of the ciphertext. */
+static void
+chacha20_poly1305_lengths(poly1305 &mac, size_t ctlen)
+{
+  uint8_t lengths[16];
+  memset(lengths, 0, sizeof lengths);
+  for (unsigned int i = 0; i < 8; i++)
+    lengths[8 + i] = uint8_t(uint64_t(ctlen) >> (8 * i));
+  mac.pad16();
+  mac.update(lengths, sizeof lengths);
+}
+
+void
+chacha20_poly1305_encryptor_impl::encrypt(uint8_t *out, const uint8_t *in,
+                                          size_t inlen,
+                                          const uint8_t *nonce, size_t nlen)
+{
+  gcm_block b = { out, in, inlen, 0, nonce, nlen };
+  encrypt_batch(&b, 1);
+}
+
+void
+chacha20_poly1305_encryptor_impl::encrypt_batch(const gcm_block *blocks,
+                                                size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    const gcm_block &b = blocks[i];
+    uint8_t n12[CHACHA20_NONCE_LEN];
+    uint8_t otk[CHACHA20_BLOCK_LEN];
+    chacha20_poly1305_setup(n12, otk, key, b.nonce, b.nlen);
+
+    poly1305 mac(otk);
+    chacha20_stream cipher(key, n12, 1);
+    size_t ctlen = b.inlen + b.padlen;
+
+    // Padding is zeroes, so its ciphertext is the bare keystream.
+    cipher.apply(b.out, b.in, b.inlen);
+    cipher.apply(b.out + b.inlen, 0, b.padlen);
+    mac.update(b.out, ctlen);
+    chacha20_poly1305_lengths(mac, ctlen);
+    mac.finish(b.out + ctlen);
+    memset(otk, 0, sizeof otk);
+  }
+}
+
+int
+chacha20_poly1305_decryptor_impl::decrypt(uint8_t *out, const uint8_t *in,
+                                          size_t inlen,
+                                          const uint8_t *nonce, size_t nlen)
+{
+  log_assert(inlen >= GCM_TAG_LEN);
+
+  uint8_t n12[CHACHA20_NONCE_LEN];
+  uint8_t otk[CHACHA20_BLOCK_LEN];
+  uint8_t tag[POLY1305_TAG_LEN];
+  chacha20_poly1305_setup(n12, otk, key, nonce, nlen);
+
+  // Here the whole message is at hand, so nothing is decrypted
+  // before it is known to be genuine.
+  size_t ctlen = inlen - GCM_TAG_LEN;
+  poly1305 mac(otk);
+  memset(otk, 0, sizeof otk);
+  mac.update(in, ctlen);
+  chacha20_poly1305_lengths(mac, ctlen);
+  mac.finish(tag);
+  if (CRYPTO_memcmp(tag, in + ctlen, GCM_TAG_LEN))
+    return -1;
+
+  chacha20_stream cipher(key, n12, 1);
+  cipher.apply(out, in, ctlen);
+  return 0;
+}
+
+int
+chacha20_poly1305_decryptor_impl::decrypt_segments(uint8_t *out,
+                                                   size_t outlen,
+                                                   const gcm_segment *in,
+                                                   size_t nseg,
+                                                   size_t inlen,
+                                                   const uint8_t *nonce,
+                                                   size_t nlen)
+{
+  log_assert(inlen >= GCM_TAG_LEN && outlen <= inlen - GCM_TAG_LEN);
+
+  uint8_t n12[CHACHA20_NONCE_LEN];
+  uint8_t otk[CHACHA20_BLOCK_LEN];
+  chacha20_poly1305_setup(n12, otk, key, nonce, nlen);
+  poly1305 mac(otk);
+  memset(otk, 0, sizeof otk);
+  chacha20_stream cipher(key, n12, 1);
+
+  // Unlike with GCM, the plaintext past 'outlen' need not be
+  // produced at all: the tag is over the ciphertext.
+  uint8_t tag[GCM_TAG_LEN], expected[POLY1305_TAG_LEN];
+  size_t ctlen = inlen - GCM_TAG_LEN;
+  size_t ctext = ctlen;
+  size_t taglen = 0;
+
+  for (size_t i = 0; i < nseg && taglen < GCM_TAG_LEN; i++) {
+    const uint8_t *p = in[i].data;
+    size_t len = in[i].len;
+
+    size_t chunk = std::min(len, ctext);
+    mac.update(p, chunk);
+    size_t wanted = std::min(chunk, outlen);
+    cipher.apply(out, p, wanted);
+    out += wanted;
+    outlen -= wanted;
+    p += chunk;
+    len -= chunk;
+    ctext -= chunk;
+
+    size_t t = std::min(len, GCM_TAG_LEN - taglen);
+    memcpy(tag + taglen, p, t);
+    taglen += t;
+  }
+
+  if (ctext > 0 || taglen < GCM_TAG_LEN) {
+    log_warn("chacha20_poly1305_decryptor: %lu bytes of input expected, "
+             "but not supplied",
+             (unsigned long)(ctext + GCM_TAG_LEN - taglen));
+    return -1;
+  }
+
+  chacha20_poly1305_lengths(mac, ctlen);
+  mac.finish(expected);
+  return CRYPTO_memcmp(tag, expected, GCM_TAG_LEN) ? -1 : 0;
+}
+
 // We use the slightly lower-level EC_* / ECDH_* routines for
 // ecdh_message, instead of the EVP_PKEY_* routines, because we don't
 // need algorithmic agility, and it means we only have to puzzle out
@@ -10,6 +10,7 @@ const size_t GCM_TAG_LEN   = 16;
 const size_t SHA256_LEN    = 32;
 const size_t EC_P224_LEN   = 28;
 const size_t MKE_MSG_LEN   = 21;
+const size_t CHACHA20_POLY1305_KEY_LEN = 32;
 
 /**
  * Initialize cryptography library.  Must be called before anything that
@@ -22,6 +23,19 @@ void init_crypto();
  */
 void free_crypto();
 
+/**
+ * Report the AES implementation this CPU lets OpenSSL use:
+ * "AES-NI+VAES", "AES-NI", "ARMv8 AES" or "generic".  OpenSSL picks
+ * it by itself, behind the EVP interfaces used below.
+ */
+const char *crypto_aes_backend();
+
+/**
+ * True if AES runs on dedicated instructions here.  Where it does
+ * not, ChaCha20-Poly1305 is much the faster AEAD.
+ */
+bool crypto_aes_accelerated();
+
 /**
  * Report a cryptography failure.
  * @msg should describe the operation that failed.
@@ -60,6 +74,12 @@ struct ecb_encryptor
       write the result to 'out'.  */
   virtual void encrypt(uint8_t *out, const uint8_t *in) = 0;
 
+  /** Encrypt 'nblocks' consecutive AES_BLOCK_LEN-byte blocks of data
+      in the buffer 'in' and write the result to 'out', in a single
+      call into the cipher.  */
+  virtual void encrypt_blocks(uint8_t *out, const uint8_t *in,
+                              size_t nblocks) = 0;
+
   virtual ~ecb_encryptor();
 protected:
   ecb_encryptor() {}
@@ -96,6 +116,20 @@ private:
   ecb_decryptor& operator=(const ecb_decryptor&) DELETE_METHOD;
 };
 
+/** One message in a batch for gcm_encryptor::encrypt_batch.  The
+    'inlen' bytes of data at 'in', followed by 'padlen' zero bytes,
+    are encrypted with nonce 'nonce' (of length 'nlen'); the result
+    plus an authentication tag is written to 'out', whose length must
+    be at least 'inlen'+'padlen'+16 bytes.  */
+struct gcm_block
+{
+  uint8_t *out;
+  const uint8_t *in;
+  size_t inlen;
+  size_t padlen;
+  const uint8_t *nonce;
+  size_t nlen;
+};
 
 struct gcm_encryptor
 {
@@ -113,6 +147,13 @@ struct gcm_encryptor
       For testing purposes only.  */
   static gcm_encryptor *create_noop();
 
+  /** Return a new ChaCha20-Poly1305 (RFC 7539) encryption state
+      using 'key' (of length 'keylen', which must be 32 bytes), with
+      the same interface as AES/GCM.  Nonces longer than the 12 bytes
+      ChaCha20 takes are folded into them with XOR.  */
+  static gcm_encryptor *create_chacha20_poly1305(const uint8_t *key,
+                                                 size_t keylen);
+
   /** Encrypt 'inlen' bytes of data in the buffer 'in', writing the
       result plus an authentication tag to the buffer 'out', whose
       length must be at least 'inlen'+16 bytes.  Use 'nonce'
@@ -121,6 +162,12 @@ struct gcm_encryptor
   virtual void encrypt(uint8_t *out, const uint8_t *in, size_t inlen,
                        const uint8_t *nonce, size_t nlen) = 0;
 
+  /** Encrypt each of the 'n' messages described by 'blocks', in
+      order.  This is equivalent to calling encrypt() once per
+      message, but the per-message cipher setup is kept to a minimum
+      and the padding never has to be materialized.  */
+  virtual void encrypt_batch(const gcm_block *blocks, size_t n) = 0;
+
   virtual ~gcm_encryptor();
 protected:
   gcm_encryptor() {}
@@ -129,6 +176,14 @@ private:
   gcm_encryptor& operator=(const gcm_encryptor&);
 };
 
+/** A contiguous piece of a message that is scattered over several
+    buffers; see gcm_decryptor::decrypt_segments.  */
+struct gcm_segment
+{
+  const uint8_t *data;
+  size_t len;
+};
+
 struct gcm_decryptor
 {
   /** Return a new AES/GCM decryption state using 'key' (of length 'keylen')
@@ -145,6 +200,12 @@ struct gcm_decryptor
       For testing purposes only.  */
   static gcm_decryptor *create_noop();
 
+  /** Return a new ChaCha20-Poly1305 decryption state using 'key' (of
+      length 'keylen', which must be 32 bytes); see
+      gcm_encryptor::create_chacha20_poly1305.  */
+  static gcm_decryptor *create_chacha20_poly1305(const uint8_t *key,
+                                                 size_t keylen);
+
   /** Decrypt 'inlen' bytes of data in the buffer 'in'; the last 16
       bytes of this buffer are assumed to be the authentication tag.
       Write the result to the buffer 'out', whose length must be at
@@ -154,6 +215,17 @@ struct gcm_decryptor
   virtual int decrypt(uint8_t *out, const uint8_t *in, size_t inlen,
                       const uint8_t *nonce, size_t nlen) = 0;
 
+  /** As decrypt(), but the 'inlen' bytes of input (again ending with
+      the authentication tag) are read, in order, from the 'nseg'
+      segments 'in', which may hold more data than that in total.
+      Only the first 'outlen' bytes of the result are written to
+      'out'; the rest are authenticated and then discarded.  'out'
+      must not overlap the input.  */
+  virtual int decrypt_segments(uint8_t *out, size_t outlen,
+                               const gcm_segment *in, size_t nseg,
+                               size_t inlen,
+                               const uint8_t *nonce, size_t nlen) = 0;
+
   virtual ~gcm_decryptor();
 protected:
   gcm_decryptor() {}
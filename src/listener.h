@@ -21,6 +21,14 @@ struct listener_t
 int listener_open(struct event_base *base, config_t *cfg);
 void listener_close_all(void);
 
+/* Take over FD, a downstream socket accepted by another worker for
+   listener INDEX of CFG, as if we had just accepted it ourselves;
+   PENDING holds whatever has already been read from it.  Takes
+   ownership of FD and PEERNAME. */
+void listener_adopt_connection(config_t *cfg, size_t index,
+                               evutil_socket_t fd, char *peername,
+                               struct evbuffer *pending);
+
 std::vector<listener_t *> const& get_all_listeners();
 
 #endif
@@ -12,6 +12,7 @@
 #include "protocol.h"
 #include "steg.h"
 #include "subprocess.h"
+#include "workers.h"
 
 #include <vector>
 #include <string>
@@ -39,6 +40,7 @@ static bool allow_kq = false;
 static bool daemon_mode = false;
 static string pidfile_name;
 static string registration_helper;
+static unsigned int n_workers = 1;
 
 /**
    Puts stegotorus's networking subsystem on "closing time" mode. This
@@ -62,6 +64,7 @@ start_shutdown(int barbaric, const char *label)
 
   listener_close_all();          /* prevent further connections */
   conn_start_shutdown(barbaric); /* possibly break existing connections */
+  workers_start_shutdown(barbaric); /* and tell the other workers */
 }
 
 /**
@@ -230,7 +233,8 @@ usage(void)
           "--registration-helper=<helper> ~ use <helper> to register with "
           "a relay database\n"
           "--pid-file=<file> ~ write process ID to <file> after startup\n"
-          "--daemon ~ run as a daemon\n");
+          "--daemon ~ run as a daemon\n"
+          "--workers=<n> ~ run <n> event loops, each on its own thread\n");
 
   exit(1);
 }
@@ -254,6 +258,7 @@ handle_generic_args(const char *const *argv)
   bool timestamps_set = false;
   bool registration_helper_set = false;
   bool pidfile_set = false;
+  bool workers_set = false;
   int i = 1;
 
   while (argv[i] &&
@@ -322,6 +327,19 @@ handle_generic_args(const char *const *argv)
         exit(1);
       }
       daemon_mode = true;
+    } else if (!strncmp(argv[i], "--workers=", 10)) {
+      if (workers_set) {
+        fprintf(stderr, "you've already set the number of workers!\n");
+        exit(1);
+      }
+      char *endp;
+      unsigned long n = strtoul(argv[i]+10, &endp, 10);
+      if (*endp || n < 1 || n > 1024) {
+        fprintf(stderr, "invalid number of workers '%s'\n", argv[i]+10);
+        exit(1);
+      }
+      n_workers = n;
+      workers_set = true;
     } else {
       fprintf(stderr, "unrecognizable argument '%s'\n", argv[i]);
       exit(1);
@@ -338,6 +356,26 @@ handle_generic_args(const char *const *argv)
   return i;
 }
 
+/**
+   Creates an event base, as configured by 'evcfg', with the priority
+   queues that connections.cc expects.  Succeeds or crashes.
+*/
+static struct event_base *
+new_event_base(struct event_config *evcfg)
+{
+  struct event_base *base = event_base_new_with_config(evcfg);
+  if (!base)
+    log_abort("failed to initialize networking (evbase)");
+
+  /* Most events are processed at the default priority (0), but
+     connection cleanup events are processed at low priority (1)
+     to ensure that all pending I/O is handled first.  */
+  if (event_base_priority_init(base, 2))
+    log_abort("failed to initialize networking (priority queues)");
+
+  return base;
+}
+
 int
 main(int, const char *const *argv)
 {
@@ -345,7 +383,8 @@ main(int, const char *const *argv)
   struct event *sig_int;
   struct event *sig_term;
   struct event *stdin_eof;
-  vector<config_t *> configs;
+  vector<vector<config_t *> > worker_configs;
+  const char *const *first;
   const char *const *begin;
   const char *const *end;
   struct stat st;
@@ -356,46 +395,55 @@ main(int, const char *const *argv)
   log_set_method(LOG_METHOD_STDERR, NULL);
 
   /* Handle optional non-protocol-specific arguments. */
-  begin = argv + handle_generic_args(argv);
+  first = argv + handle_generic_args(argv);
+  workers_setup(n_workers);
 
   /* Find the subsets of argv that define each configuration.
      Each configuration's subset consists of the entries in argv from
      its recognized protocol name, up to but not including the next
      recognized protocol name. */
-  if (!*begin || !config_is_supported(*begin))
+  if (!*first || !config_is_supported(*first))
     usage();
 
   //crypto should be initialized before protocol so the protocols
   //can use encryption
   init_crypto();
- 
-  do {
-    end = begin+1;
-    while (*end && !config_is_supported(*end))
-      end++;
-    if (log_do_debug()) {
-      string joined = *begin;
-      const char *const *p;
-      for (p = begin+1; p < end; p++) {
-        joined += " ";
-        joined += *p;
+
+  /* Every worker gets its own copy of every configuration, so that
+     nothing in them is shared between threads. */
+  worker_configs.resize(n_workers);
+  for (unsigned int w = 0; w < n_workers; w++) {
+    vector<config_t *>& configs = worker_configs[w];
+    begin = first;
+    do {
+      end = begin+1;
+      while (*end && !config_is_supported(*end))
+        end++;
+      if (w == 0 && log_do_debug()) {
+        string joined = *begin;
+        const char *const *p;
+        for (p = begin+1; p < end; p++) {
+          joined += " ";
+          joined += *p;
+        }
+        log_debug("configuration %lu: %s",
+                  (unsigned long)configs.size()+1, joined.c_str());
       }
-      log_debug("configuration %lu: %s",
-                (unsigned long)configs.size()+1, joined.c_str());
-    }
-    if (end == begin+1) {
-      log_warn("no arguments for configuration %lu",
-               (unsigned long)configs.size()+1);
-      usage();
-    } else {
-      config_t *cfg = config_create(end - begin, begin);
-      if (!cfg)
-        return 2; /* diagnostic already issued */
-      configs.push_back(cfg);
-    }
-    begin = end;
-  } while (*begin);
-  log_assert(configs.size() > 0);
+      if (end == begin+1) {
+        log_warn("no arguments for configuration %lu",
+                 (unsigned long)configs.size()+1);
+        usage();
+      } else {
+        config_t *cfg = config_create(end - begin, begin);
+        if (!cfg)
+          return 2; /* diagnostic already issued */
+        configs.push_back(cfg);
+      }
+      begin = end;
+    } while (*begin);
+    log_assert(configs.size() > 0);
+  }
+  vector<config_t *>& configs = worker_configs[0];
 
   /* Configurations have been established; proceed with initialization. */
   if (daemon_mode)
@@ -432,15 +480,7 @@ main(int, const char *const *argv)
   /* Possibly worth doing in the future: activating Windows IOCP and
      telling it how many CPUs to use. */
 
-  struct event_base *the_event_base = event_base_new_with_config(evcfg);
-  if (!the_event_base)
-    log_abort("failed to initialize networking (evbase)");
-
-  /* Most events are processed at the default priority (0), but
-     connection cleanup events are processed at low priority (1)
-     to ensure that all pending I/O is handled first.  */
-  if (event_base_priority_init(the_event_base, 2))
-    log_abort("failed to initialize networking (priority queues)");
+  struct event_base *the_event_base = new_event_base(evcfg);
 
   conn_global_init(the_event_base);
 
@@ -500,12 +540,17 @@ main(int, const char *const *argv)
   }
 
   /* Open listeners for each configuration. */
+  worker_adopt_main(the_event_base, configs);
   for (vector<config_t *>::iterator i = configs.begin(); i != configs.end();
        i++)
     if (!listener_open(the_event_base, *i))
       log_abort("failed to open listeners for configuration %lu",
                 (unsigned long)(i - configs.begin()) + 1);
 
+  /* The remaining workers, if any, open their own listeners. */
+  for (unsigned int w = 1; w < n_workers; w++)
+    worker_spawn(w, new_event_base(evcfg), worker_configs[w]);
+
   if (!registration_helper.empty())
     call_registration_helper(registration_helper);
 
@@ -519,6 +564,9 @@ main(int, const char *const *argv)
   /* We have landed. */
   log_info("exiting");
 
+  /* Wait for the other workers to finish as well. */
+  workers_join();
+
   /* By the time we get to this point, all listeners and connections
      have already been freed. */
 
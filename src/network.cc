@@ -9,6 +9,8 @@
 #include "connections.h"
 #include "socks.h"
 #include "protocol.h"
+#include "steg.h"
+#include "workers.h"
 
 #include <vector>
 
@@ -20,8 +22,8 @@
 
 using std::vector;
 
-/** All our listeners. */
-static vector<listener_t *> listeners;
+/** All of this worker's listeners. */
+static __thread vector<listener_t *> *listeners;
 
 static void listener_close(listener_t *lsn);
 
@@ -33,6 +35,10 @@ static void server_listener_cb(struct evconnlistener *evcl, evutil_socket_t fd,
                                struct sockaddr *sourceaddr, int socklen,
                                void *closure);
 
+static void server_conn_open(config_t *cfg, size_t index, const char *address,
+                             evutil_socket_t fd, char *peername,
+                             struct evbuffer *pending);
+
 static void upstream_read_cb(struct bufferevent *bev, void *arg);
 void downstream_read_cb(struct bufferevent *bev, void *arg);
 static void socks_read_cb(struct bufferevent *bev, void *arg);
@@ -48,7 +54,9 @@ static void create_outbound_connections_socks(circuit_t *ckt);
 
 vector<listener_t *> const& get_all_listeners()
 {
-  return listeners;
+  if (!listeners)
+    listeners = new vector<listener_t *>;
+  return *listeners;
 }
 
 /**
@@ -58,7 +66,7 @@ vector<listener_t *> const& get_all_listeners()
 int
 listener_open(struct event_base *base, config_t *cfg)
 {
-  const unsigned flags =
+  unsigned flags =
     LEV_OPT_CLOSE_ON_FREE|LEV_OPT_CLOSE_ON_EXEC|LEV_OPT_REUSEABLE;
   size_t i;
   listener_t *lsn;
@@ -70,6 +78,20 @@ listener_open(struct event_base *base, config_t *cfg)
   /* We can now record the event_base to be used with this configuration. */
   cfg->base = base;
 
+  /* Every worker binds its own listening socket to the same address;
+     the kernel distributes incoming connections among them. */
+  if (worker_count() > 1) {
+#ifdef LEV_OPT_REUSEABLE_PORT
+    flags |= LEV_OPT_REUSEABLE_PORT;
+#else
+    log_warn("this libevent cannot share listening sockets among workers");
+    return 0;
+#endif
+  }
+
+  if (!listeners)
+    listeners = new vector<listener_t *>;
+
   /* Open listeners for every address in the configuration. */
   for (i = 0; ; i++) {
     addrs = cfg->get_listen_addrs(i);
@@ -91,12 +113,16 @@ listener_open(struct event_base *base, config_t *cfg)
         return 0;
       }
 
-      listeners.push_back(lsn);
+      listeners->push_back(lsn);
       log_debug("now listening on %s for protocol %s",
                 lsn->address, cfg->name());
 
       addrs = addrs->ai_next;
     } while (addrs);
+
+    /* Let the steg module start any work it does in the background. */
+    if (cfg->get_steg(i))
+      const_cast<steg_config_t *>(cfg->get_steg(i))->listener_opened(base);
   }
 
   return 1;
@@ -123,10 +149,14 @@ listener_close_all(void)
 {
   log_info("closing all listeners");
 
-  for (vector<listener_t *>::iterator i = listeners.begin();
-       i != listeners.end(); i++)
+  if (!listeners)
+    return;
+
+  for (vector<listener_t *>::iterator i = listeners->begin();
+       i != listeners->end(); i++)
     listener_close(*i);
-  listeners.clear();
+  delete listeners;
+  listeners = 0;
 }
 
 /**
@@ -192,30 +222,56 @@ server_listener_cb(struct evconnlistener *, evutil_socket_t fd,
 {
   listener_t *lsn = (listener_t *)closure;
   char *peername = printable_address(peeraddr, peerlen);
-  struct bufferevent *buf;
-  conn_t *conn;
 
   log_assert(lsn->cfg->mode == LSN_SIMPLE_SERVER);
   log_info("%s: new connection to server from %s", lsn->address, peername);
 
-  buf = bufferevent_socket_new(lsn->cfg->base, fd, BEV_OPT_CLOSE_ON_FREE);
+  server_conn_open(lsn->cfg, lsn->index, lsn->address, fd, peername, NULL);
+}
+
+/**
+   This function is called when another worker hands us a server-mode
+   connection that belongs to one of our circuits.
+ */
+void
+listener_adopt_connection(config_t *cfg, size_t index, evutil_socket_t fd,
+                          char *peername, struct evbuffer *pending)
+{
+  log_assert(cfg->mode == LSN_SIMPLE_SERVER);
+  log_info("adopting connection to server from %s", peername);
+
+  server_conn_open(cfg, index, "(hand-off)", fd, peername, pending);
+}
+
+/**
+   Set up a new server-mode connection on socket FD.  If PENDING is not
+   NULL, its contents are treated as data already received on FD.
+ */
+static void
+server_conn_open(config_t *cfg, size_t index, const char *address,
+                 evutil_socket_t fd, char *peername, struct evbuffer *pending)
+{
+  struct bufferevent *buf;
+  conn_t *conn;
+
+  buf = bufferevent_socket_new(cfg->base, fd, BEV_OPT_CLOSE_ON_FREE);
   if (!buf) {
     log_warn("%s: failed to create buffer for new connection from %s",
-             lsn->address, peername);
+             address, peername);
     evutil_closesocket(fd);
     free(peername);
     return;
   }
 
-  conn = conn_create(lsn->cfg, lsn->index, buf, peername);
-  conn->connected = 1;
+  conn = conn_create(cfg, index, buf, peername);
   if (!conn) {
     log_warn("%s: failed to create connection structure for %s",
-             lsn->address, peername);
+             address, peername);
     bufferevent_free(buf);
     free(peername);
     return;
   }
+  conn->connected = 1;
 
   /* If appropriate at this point, connect to upstream. */
   if (conn->maybe_open_upstream() < 0) {
@@ -234,6 +290,15 @@ server_listener_cb(struct evconnlistener *, evutil_socket_t fd,
   bufferevent_setcb(buf, downstream_read_cb, downstream_flush_cb,
                     downstream_event_cb, conn);
   bufferevent_enable(conn->buffer, EV_READ|EV_WRITE);
+
+  if (pending && evbuffer_get_length(pending)) {
+    if (evbuffer_add_buffer(bufferevent_get_input(buf), pending)) {
+      log_warn(conn, "failed to replay data received by another worker");
+      conn->close();
+      return;
+    }
+    downstream_read_cb(buf, conn);
+  }
 }
 
 /**
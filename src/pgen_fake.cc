@@ -6,10 +6,13 @@
 #include "pgen.h"
 #include "rng.h"
 #include "base64.h"
+#include "steg/trace_db.h"
 
 #include <string>
 #include <sstream>
 
+#include <unistd.h>
+
 using std::string;
 using std::ostringstream;
 
@@ -658,9 +661,46 @@ gen_traces(unsigned long n, const char *fname,
   }
 }
 
+// Replace the trace in FNAME by a trace database compiled from it.
+static void
+compile_trace(const char *fname)
+{
+  string raw = string(fname) + ".raw";
+  if (rename(fname, raw.c_str())) {
+    perror(fname);
+    exit(1);
+  }
+  if (!trace_db_compile(raw.c_str(), fname)) {
+    fprintf(stderr, "%s: failed to compile trace database\n", fname);
+    exit(1);
+  }
+  remove(raw.c_str());
+}
+
 int
-main()
+main(int argc, char **argv)
 {
+  bool compile = false;
+  int c;
+
+  while ((c = getopt(argc, argv, "b")) != -1) {
+    switch (c) {
+    case 'b':
+      compile = true;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-b]\n"
+              "  -b  write trace databases instead of plain traces\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
   gen_traces(10000, "traces/client.out", gen_one_client_trace);
   gen_traces(10000, "traces/server.out", gen_one_server_trace);
+
+  if (compile) {
+    compile_trace("traces/client.out");
+    compile_trace("traces/server.out");
+  }
 }
@@ -5,6 +5,7 @@
 #include "util.h"
 #include "pgen.h"
 #include "compression.h"
+#include "steg/trace_db.h"
 
 #include <dirent.h>
 #include <signal.h>
@@ -74,15 +75,44 @@ static const char *argv0;
 
 static FILE *client_file;
 static FILE *server_file;
+static int compile_flag = 0;
 
 static void ATTR_NORETURN
 usage()
 {
-  fprintf(stderr, "Usage: %s [-d dumpdir] [-r dumpfile] \"bpf filter\"\n",
+  fprintf(stderr, "Usage: %s [-b] [-d dumpdir] [-r dumpfile] \"bpf filter\"\n"
+          "  -b  write trace databases instead of plain traces\n",
           argv0);
   exit(1);
 }
 
+/* The traces we write, and where they go first when -b has us
+   compile them afterward */
+static const char *const trace_fnames[2] =
+  { "traces/client.out", "traces/server.out" };
+static const char *const raw_fnames[2] =
+  { "traces/client.out.raw", "traces/server.out.raw" };
+
+static void
+finish_traces()
+{
+  if (fclose(client_file) || fclose(server_file)) {
+    perror("writing traces");
+    exit(1);
+  }
+  if (!compile_flag)
+    return;
+
+  for (int i = 0; i < 2; i++) {
+    if (!trace_db_compile(raw_fnames[i], trace_fnames[i])) {
+      fprintf(stderr, "%s: failed to compile trace database\n",
+              trace_fnames[i]);
+      exit(1);
+    }
+    remove(raw_fnames[i]);
+  }
+}
+
 static void ATTR_NORETURN
 terminate(int)
 {
@@ -94,6 +124,7 @@ terminate(int)
 
   printf("packets rcvd: %u, packets dropped: %u, interface drops: %u\n",
          ps.ps_recv, ps.ps_drop, ps.ps_ifdrop);
+  finish_traces();
   exit(1);
 }
 
@@ -583,8 +614,11 @@ main(int argc, char **argv)
 
   argv0 = argv[0];
 
-  while ((c = getopt (argc, argv, "r:d:")) != -1) {
+  while ((c = getopt (argc, argv, "br:d:")) != -1) {
     switch (c) {
+    case 'b':
+      compile_flag = 1;
+      break;
     case 'r':
       dumpfile = optarg;
       break;
@@ -602,14 +636,15 @@ main(int argc, char **argv)
 
   bp_filter = xstrdup(argv[optind]);
 
-  client_file = fopen("traces/client.out", "w");
+  const char *const *fnames = compile_flag ? raw_fnames : trace_fnames;
+  client_file = fopen(fnames[0], "w");
   if (!client_file) {
-    perror("traces/client.out");
+    perror(fnames[0]);
     return 1;
   }
-  server_file = fopen("traces/server.out", "w");
+  server_file = fopen(fnames[1], "w");
   if (!server_file) {
-    perror("traces/server.out");
+    perror(fnames[1]);
     return 1;
   }
 
@@ -623,5 +658,6 @@ main(int argc, char **argv)
   else
     handle_pcap_file(dumpfile);
 
+  finish_traces();
   return 0;
 }
@@ -5,6 +5,7 @@
 
 #include "util.h"
 #include "protocol.h"
+#include "timer_wheel.h"
 
 /**
    Return 1 if 'name' is the name of a supported protocol, otherwise 0.
@@ -39,4 +40,17 @@ config_create(int n_options, const char *const *options)
 
 /* Define this here rather than in the class definition so that the
    vtable will be emitted in only one place. */
-config_t::~config_t() {}
+config_t::~config_t()
+{
+  delete wheel;
+}
+
+timer_wheel *
+config_t::timers()
+{
+  if (!wheel) {
+    log_assert(base);
+    wheel = new timer_wheel(base);
+  }
+  return wheel;
+}
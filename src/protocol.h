@@ -12,6 +12,7 @@
 
 struct proto_module;
 struct steg_config_t;
+class timer_wheel;
 
 /** 
     Because it is the protocol which process user command line data 
@@ -37,10 +38,17 @@ struct config_t
   bool ignore_socks_destination : 1;
 
   std::map<std::string, user_config_dict_t> steg_mod_user_configs;
+  timer_wheel               *wheel; // see timers()
 
-  config_t() : base(0), mode((enum listen_mode)-1) {}
+  config_t() : base(0), mode((enum listen_mode)-1), wheel(0) {}
   virtual ~config_t();
 
+  /** Return the timer wheel that runs the timers of this
+      configuration's circuits and connections, from one libevent
+      timer on 'base'.  It is made on first use, which must come after
+      'base' is set. */
+  timer_wheel *timers();
+
   /** Return the name of the protocol associated with this
       configuration.  You do not have to define this method in your
       subclass, PROTO_DEFINE_MODULE does it for you. */
@@ -3,9 +3,9 @@
  */
 
 #include <algorithm>
+#include <map>
 #include <vector>
 
-#include <tr1/unordered_map>
 #include <sstream>
 #include <string>
 
@@ -17,15 +17,21 @@
 #include <event2/buffer.h>
 #include <event2/util.h>
 
+#include <sys/socket.h>
+
 
 #include "util.h"
+#include "compression.h"
 #include "crypt.h"
 #include "chop_blk.h"
+#include "chop_circuit_table.h"
 #include "chop_handshaker.h"
+#include "chop_rate_limit.h"
 #include "connections.h"
 #include "protocol.h"
 #include "rng.h"
 #include "steg.h"
+#include "workers.h"
 
 #include "transparent_proxy.h"
 
@@ -34,9 +40,14 @@
    being implemented, and may change incompatibly.  */
 
 #define MAX_CONN_PER_CIRCUIT 8
+/* The most blocks one steg transmission carries; see
+   chop_circuit_t::send_targeted(chop_conn_t *, size_t). */
+#define MAX_BLOCKS_PER_TRANSMISSION 8
+/* Length of each AES key a circuit is created with. */
+#define CIRCUIT_KEY_LEN 16
 
-using std::tr1::unordered_map;
 using std::tr1::unordered_set;
+using std::multimap;
 using std::vector;
 using std::make_pair;
 using std::min;
@@ -49,7 +60,11 @@ struct chop_conn_t;
 struct chop_circuit_t;
 struct chop_config_t;
 
-typedef unordered_map<uint32_t, chop_circuit_t *> chop_circuit_table;
+typedef circuit_table<chop_circuit_t> chop_circuit_table;
+
+/** Connections able to transmit, by the most they offer to carry
+    (not counting their handshake) */
+typedef multimap<size_t, chop_conn_t *> chop_room_index;
 
 struct chop_conn_t : conn_t
 {
@@ -57,21 +72,37 @@ struct chop_conn_t : conn_t
   chop_circuit_t *upstream;
   steg_t *steg;
   struct evbuffer *recv_pending;
-  uint8_t *originally_received; //Keep a copy of pending in case we need 
-  size_t received_length;
-  //to become a transparent proxy
-  struct event *must_send_timer;
+  struct evbuffer *raw_received; // everything read before the handshake
+  size_t raw_held;                // bytes at the front of inbound()
+                                  // that are already in raw_received
+  wheel_timer must_send_timer;
+  chop_room_index::iterator room_slot; // valid if has_room
   bool sent_handshake : 1;
   bool no_more_transmissions : 1;
+  bool has_room : 1;
 
   CONN_DECLARE_METHODS(chop);
 
   int recv_handshake();
+  int hand_off(uint32_t circuit_id);
+  /** Give up on a connection whose handshake failed: hand it to the
+      transparent proxy if there is one.  Returns what
+      recv_handshake() does in that case. */
+  int reject_handshake();
+  /** The source our peer is accounted to by the handshake rate
+      limit; 0 if unknown */
+  uint64_t source() const;
   int send(struct evbuffer *block);
 
+  /** True if we must keep a copy of the raw bytes received before the
+      handshake: they are needed to transparentize the connection or to
+      hand it to another worker. */
+  bool keeps_raw_data() const;
+  void hold_raw_data();
+
   void send();
   bool must_send_p() const;
-  static void must_send_timeout(evutil_socket_t, short, void *arg);
+  static void must_send_timeout(void *arg);
 
   /**
    In case the connection is transparentized or needed to be closed
@@ -88,18 +119,38 @@ struct chop_circuit_t : circuit_t
   transmit_queue tx_queue;
   reassembly_queue recv_queue;
   unordered_set<chop_conn_t *> downstreams;
-  gcm_encryptor *send_crypt;
-  ecb_encryptor *send_hdr_crypt;
-  gcm_decryptor *recv_crypt;
-  ecb_decryptor *recv_hdr_crypt;
+  chop_room_index rooms;
+  // Keys by key_slot() of the blocks they are for; see op_RKEY in
+  // chop_blk.h.  Slot 1 is empty until the first op_RKEY.
+  gcm_encryptor *send_crypt[2];
+  ecb_encryptor *send_hdr_crypt[2];
+  gcm_decryptor *recv_crypt[2];
+  ecb_decryptor *recv_hdr_crypt[2];
   chop_config_t *config;
 
   uint32_t circuit_id;
   uint32_t last_acked;
+  uint32_t rekey_seqno;   // of the last op_RKEY block received
   uint32_t dead_cycles;
+  wheel_timer rto_timer;
+  wheel_timer pace_timer;
+  wheel_timer ack_timer;
   bool received_fin : 1;
   bool sent_fin : 1;
   bool upstream_eof : 1;
+  bool parked_probed : 1; // downstreams not in rooms were asked again
+  bool ack_owed : 1;      // blocks other than ACKs came since our last ACK
+  bool peer_piggybacks : 1; // the peer understands op_ACK_DAT/op_ACK_FIN
+  bool peer_compresses : 1; // the peer takes compressed blocks
+  bool peer_rekeys : 1;     // the peer understands op_RKEY
+  bool chacha20 : 1;        // data keys are ChaCha20-Poly1305, not AES-GCM
+
+  // Adaptive compression: how many bytes the data compressed to per
+  // 256 lately, and how many blocks to leave alone after data that
+  // did not compress (doubling each time, up to 64).
+  uint32_t z_ratio;
+  uint32_t z_skip;
+  uint32_t z_backoff;
 
   //For debug and tracking performance we keep track of average room
   //desirable and offered size
@@ -110,6 +161,16 @@ struct chop_circuit_t : circuit_t
 
   //override the constructor so we can initialize the transmit queue
   chop_circuit_t(bool retransmit);
+
+  /**
+     Size the queues for a circuit whose client receives with a window
+     of PROPOSED blocks.  Both receive windows follow the client's
+     choice, which is the only one the client can know when it starts
+     sending; our own transmit window is further held to the
+     configured one.  Must be called before any block is sent or
+     received.
+  */
+  void set_window(uint32_t proposed);
   // Shortcut some unnecessary conversions for callers within this file.
   void add_downstream(chop_conn_t *conn);
   void drop_downstream(chop_conn_t *conn);
@@ -119,9 +180,79 @@ struct chop_circuit_t : circuit_t
   int send_targeted(chop_conn_t *conn, size_t blocksize);
   int send_targeted(chop_conn_t *conn, size_t d, size_t p, opcode_t f,
                     struct evbuffer *payload);
+  /** Enqueue a block of opcode *F with *D bytes of data taken from
+      PAYLOAD and *P bytes of padding, and append it, encrypted, to
+      OUT.  An ACK we owe may take the place of padding or data: *F,
+      *D and *P then describe the block as sent.  Its sequence number
+      goes to *SEQNO. */
+  int pack_block(size_t *d, size_t *p, opcode_t *f, struct evbuffer *payload,
+                 struct evbuffer *out, uint32_t *seqno);
+  /** Bookkeeping for a block made by pack_block, once CONN has sent
+      it. */
+  void block_sent(chop_conn_t *conn, uint32_t seqno, size_t d, size_t p,
+                  opcode_t f);
+  /** Send a block of BLOCKSIZE bytes carrying no data on CONN */
+  int send_chaff(chop_conn_t *conn, size_t blocksize);
   int maybe_send_ack();
+  int send_ack();
+  /** Generate the ACK for what we received, which is then no longer
+      owed */
+  evbuffer *take_ack();
+  /** The length of the ACK we would send now; 0 if none can be made */
+  size_t ack_len();
+  /** Put the ACK we owe in front of DATA, the data section being
+      built for a block of opcode *F with *D bytes of data and *P of
+      padding, if the block has room for it.  Only op_DAT blocks give
+      up data for it.  Adjusts *F, *D and *P and returns the number of
+      bytes added to DATA. */
+  size_t piggyback_ack(opcode_t *f, size_t *d, size_t *p, evbuffer *data);
+  /** Compress data from PAYLOAD into the *D bytes of data section
+      left in an op_DAT or op_ACK_DAT block, appending to DATA, if
+      more than *D bytes are waiting and they compress.  Adjusts *F
+      and *P, and returns the number of bytes taken from PAYLOAD: 0 if
+      the block is to be sent as is. */
+  size_t compress_data(opcode_t *f, size_t *d, size_t *p,
+                       evbuffer *payload, evbuffer *data);
+  /** Inflate the compressed data of a received block; NULL if they
+      are corrupt.  DATA is consumed either way. */
+  evbuffer *decompress_data(evbuffer *data);
+  void recv_ack(evbuffer *data, bool piggybacked);
+  /** Announce the next key epoch's keys in an op_RKEY block */
+  int send_rekey();
+  /** Take up the keys announced by the op_RKEY block SEQNO */
+  void recv_rekey(uint32_t seqno, evbuffer *data);
+  /** The slot of send_crypt and send_hdr_crypt for block SEQNO */
+  unsigned int send_slot(uint32_t seqno) const
+  { return peer_rekeys ? key_slot(seqno) : 0; }
+
+  /**
+     Retransmit every block the transmit queue holds due, for which a
+     connection can be found.
+
+     @return the number of blocks retransmitted, or -1 on failure
+  */
   int retransmit();
 
+  /** Current time for the retransmission machinery, in ms */
+  uint64_t now_ms() const;
+  /** Have rto_timeout called when the next sent block times out */
+  void arm_rto_timer();
+  /** The same, unless the timer is already running: it then runs
+      out no later than for a block just sent */
+  void start_rto_timer()
+  {
+    if (!rto_timer.pending())
+      arm_rto_timer();
+  }
+  static void rto_timeout(void *arg);
+
+  /** Have send() called again in DELAY ms, for the pacer */
+  void arm_pace_timer(uint64_t delay);
+  static void pace_timeout(void *arg);
+  /** Make sure what we received is acknowledged within ACK_DELAY */
+  void arm_ack_timer();
+  static void ack_timeout(void *arg);
+
   /** 
       check all conn for steg protocol data and send them
       if there's any
@@ -142,6 +273,19 @@ struct chop_circuit_t : circuit_t
   chop_conn_t* pick_connection(size_t desired, size_t minimum,
                                size_t *blocksize);
 
+  /**
+     Ask CONN how much it can carry now and file it in rooms
+     accordingly.  To be called whenever that may have changed: the
+     connection got its steg module, connected, transmitted or
+     received.
+  */
+  void update_room(chop_conn_t *conn);
+  void index_room(chop_conn_t *conn);
+  void unindex_room(chop_conn_t *conn);
+  /** Ask the downstreams missing from rooms again, once per pass;
+      returns true if any of them can now transmit. */
+  bool refresh_parked();
+
   int recv_block(uint32_t seqno, opcode_t op, evbuffer *payload, steg_config_t *steg_cfg);
   int process_queue();
   int check_for_eof();
@@ -203,6 +347,26 @@ struct chop_config_t : config_t
   bool trace_packet_data;
   bool encryption;
   bool retransmit;
+  /** Ask for, and send, compressed blocks */
+  bool compression;
+  /** Client: encrypt circuit data with ChaCha20-Poly1305 rather than
+      AES-GCM (the server follows the client) */
+  bool chacha20;
+  /** Client: the window to propose.  Server: the largest transmit
+      window to use, whatever the client proposes. */
+  uint32_t window_size;
+  /** The congestion controller for circuits, by name */
+  std::string congestion;
+  /** Received blocks are acknowledged after at most this many ms... */
+  uint32_t ack_delay;
+  /** ...or as soon as this many have come in; 0 for an eighth of the
+      receive window */
+  uint32_t ack_every;
+  /** Server: reject handshakes without the window and feature
+      announcements, from older clients */
+  bool strict_handshakes;
+  /** Server: failed handshakes per source */
+  source_rate_limit handshake_limit;
 
     /* Performance calculators */
   unsigned long total_transmited_data_bytes;
@@ -212,11 +376,33 @@ struct chop_config_t : config_t
   ecb_encryptor* handshake_encryptor;
   ecb_decryptor* handshake_decryptor;
 
+  /** The keys every circuit starts with, in the order they are drawn
+      from the passphrase: the server's AES data and header keys, then
+      the client's, then the server's and the client's ChaCha20-Poly1305
+      data keys.  They are the same for every circuit, and deriving
+      them takes 10000 rounds of PBKDF2, so that is done once, here,
+      rather than each time a circuit is created. */
+  uint8_t circuit_keys[4 * CIRCUIT_KEY_LEN + 2 * CHACHA20_POLY1305_KEY_LEN];
+
   /**
      create the approperiate block cipher with 
-     approperiate keys for the handshake
+     approperiate keys for the handshake, and derive circuit_keys
    */
   void init_handshake_encryption();
+  /**
+     Replace *GC and *EC with the keys derived from the passphrase
+     and NONCE, the data of an op_RKEY block: the sender's, or the
+     receiver's.
+   */
+  void rekey(const uint8_t *nonce, bool chacha,
+             gcm_encryptor **gc, ecb_encryptor **ec);
+  void rekey(const uint8_t *nonce, bool chacha,
+             gcm_decryptor **gc, ecb_decryptor **ec);
+  /** Give CKT the data keys it starts with: ChaCha20-Poly1305 ones
+      if CHACHA, else AES-GCM. */
+  void set_data_ciphers(chop_circuit_t *ckt, bool chacha);
+  /** Current time for the circuits' timers and the rate limit, in ms */
+  uint64_t now_ms() const;
   /* Transparent proxy and cover server */
   std::string cover_server_address; //is the server that is going to serve covers
   std::string cover_list; //is the name of the file the contain the url of the covers which are going to be used by the steg module
@@ -244,6 +430,13 @@ chop_config_t::chop_config_t()
   trace_packet_data = true;
   encryption = true;
   retransmit = true;
+  compression = true;
+  chacha20 = false;
+  strict_handshakes = false;
+  window_size = 0;
+  congestion = "aimd";
+  ack_delay = ACK_DELAY;
+  ack_every = 0;
   noise2signal = 0;
 }
 
@@ -267,7 +460,7 @@ chop_config_t::~chop_config_t()
   delete transparent_proxy;
   delete handshake_encryptor;
   delete handshake_decryptor;
-  
+  memset(circuit_keys, 0, sizeof circuit_keys);
 }
 
 bool
@@ -320,6 +513,74 @@ chop_config_t::init(unsigned int n_options, const char *const *options)
       retransmit = false;
     } else if (!strcmp(options[1], "--enable-retransmit")) {
       retransmit = true;
+    } else if (!strcmp(options[1], "--disable-compression")) {
+      compression = false;
+    } else if (!strcmp(options[1], "--enable-compression")) {
+      compression = true;
+    } else if (!strcmp(options[1], "--cipher")) {
+      if (n_options <= 2)
+        goto usage;
+
+      if (!strcmp(options[2], "aes"))
+        chacha20 = false;
+      else if (!strcmp(options[2], "chacha20"))
+        chacha20 = true;
+      else if (!strcmp(options[2], "auto"))
+        chacha20 = !crypto_aes_accelerated();
+      else {
+        log_warn("chop: unknown cipher '%s'", options[2]);
+        goto usage;
+      }
+      options++;
+      n_options--;
+    } else if (!strcmp(options[1], "--window")) {
+      if (n_options <= 2)
+        goto usage;
+
+      window_size = atoi(options[2]);
+      if (!window_size_valid(window_size)) {
+        log_warn("chop: window must be a power of two from %u to %u blocks",
+                 MIN_WINDOW, MAX_WINDOW);
+        goto usage;
+      }
+      options++;
+      n_options--;
+    } else if (!strcmp(options[1], "--congestion")) {
+      if (n_options <= 2)
+        goto usage;
+
+      congestion_control *cc = congestion_control::create(options[2]);
+      if (!cc) {
+        log_warn("chop: unknown congestion control '%s'", options[2]);
+        goto usage;
+      }
+      delete cc;
+      congestion = options[2];
+      options++;
+      n_options--;
+    } else if (!strcmp(options[1], "--strict-handshakes")) {
+      strict_handshakes = true;
+    } else if (!strcmp(options[1], "--handshake-rate")) {
+      if (n_options <= 2)
+        goto usage;
+
+      handshake_limit.set_rate(atoi(options[2]));
+      options++;
+      n_options--;
+    } else if (!strcmp(options[1], "--ack-delay")) {
+      if (n_options <= 2)
+        goto usage;
+
+      ack_delay = atoi(options[2]);
+      options++;
+      n_options--;
+    } else if (!strcmp(options[1], "--ack-every")) {
+      if (n_options <= 2)
+        goto usage;
+
+      ack_every = atoi(options[2]);
+      options++;
+      n_options--;
     } else if (!strcmp(options[1], "--minimum-noise-to-signal")) {
       noise2signal = atoi(options[2]);
       options++;
@@ -362,6 +623,11 @@ chop_config_t::init(unsigned int n_options, const char *const *options)
       
   }
 
+  // Unless told otherwise, clients keep to the window every peer
+  // supports and servers go along with whatever the client asks for.
+  if (!window_size)
+    window_size = mode == LSN_SIMPLE_SERVER ? MAX_WINDOW : MIN_WINDOW;
+
   //immidiately after options user needs to specifcy upstream address
   up_address = resolve_address_port(options[1], 1, listen_up, defport);
   if (!up_address) {
@@ -419,6 +685,27 @@ chop_config_t::init(unsigned int n_options, const char *const *options)
            "\t\tA steganographer is required for each down_address.\n"
            "\t\tsteganographer options follow the steganographer name.\n"
            "\t\tThe down_address list is still required in socks mode.\n"
+           "\t\t--window <blocks> sets the most blocks in flight, a power\n"
+           "\t\tof two from 256 to 32768: the client proposes it for the\n"
+           "\t\tcircuit, the server caps its own sending window with it.\n"
+           "\t\t--congestion aimd|none picks the congestion control\n"
+           "\t\t(aimd by default; none without retransmission).\n"
+           "\t\t--ack-delay <ms> and --ack-every <blocks> bound how long\n"
+           "\t\treceived blocks may wait for an ACK of their own when no\n"
+           "\t\tdata going back can carry it (200 ms, 1/8 window).\n"
+           "\t\t--handshake-rate <n> limits failed handshakes per second\n"
+           "\t\tand source address (64; 0 for no limit), and\n"
+           "\t\t--strict-handshakes shuts out clients that do not\n"
+           "\t\tannounce their window and features, and turns away\n"
+           "\t\tnearly all probes before hashing them; use it where\n"
+           "\t\tprobes are many (server only).\n"
+           "\t\t--disable-compression keeps data blocks uncompressed\n"
+           "\t\tboth ways (by default compression is used where it pays;\n"
+           "\t\tclients start once the server has sent compressed data).\n"
+           "\t\t--cipher aes|chacha20|auto picks the client's data cipher:\n"
+           "\t\tAES-GCM (the default), ChaCha20-Poly1305, which needs a\n"
+           "\t\tserver that supports it, or the latter only on CPUs\n"
+           "\t\twithout AES instructions.\n"
            "Examples:\n"
            "\tstegotorus chop client 127.0.0.1:5000 "
            "http 192.168.1.99:11253  skype 192.168.1.99:11254 \n"
@@ -463,31 +750,137 @@ chop_config_t::get_steg(size_t n) const
 
 // Circuit methods
 
+uint64_t
+chop_config_t::now_ms() const
+{
+  return monotonic_ms();
+}
+
 void
 chop_config_t::init_handshake_encryption()
 {
-  key_generator *kgen = 0;
+  if (encryption) {
+    key_generator *kgen =
+      key_generator::from_passphrase((const uint8_t *)passphrase.data(),
+                                     passphrase.length(),
+                                     0, 0, 0, 0);
+    size_t got = kgen->generate(circuit_keys, sizeof circuit_keys);
+    log_assert(got == sizeof circuit_keys);
+    delete kgen;
+  }
 
-  if (encryption)
-    kgen = key_generator::from_passphrase((const uint8_t *)passphrase.data(),
-                                          passphrase.length(),
-                                          0, 0, 0, 0);
+  // The handshake key is the first one drawn from the passphrase.
   if (mode == LSN_SIMPLE_SERVER) {
     if (encryption) {
-      handshake_decryptor = ecb_decryptor::create(kgen, 16);
+      handshake_decryptor = ecb_decryptor::create(circuit_keys,
+                                                  CIRCUIT_KEY_LEN);
     } else {
       handshake_decryptor = ecb_decryptor::create_noop();
     }
   } else {
     if (encryption) {
-      handshake_encryptor = ecb_encryptor::create(kgen, 16);
+      handshake_encryptor = ecb_encryptor::create(circuit_keys,
+                                                  CIRCUIT_KEY_LEN);
     } else {
       handshake_encryptor = ecb_encryptor::create_noop();
     }
   }
+}
+
+static const char REKEY_CONTEXT[] = "stegotorus chop rekey";
+
+void
+chop_config_t::rekey(const uint8_t *nonce, bool chacha,
+                     gcm_encryptor **gc, ecb_encryptor **ec)
+{
+  delete *gc;
+  delete *ec;
+  if (!encryption) {
+    *gc = gcm_encryptor::create_noop();
+    *ec = ecb_encryptor::create_noop();
+    return;
+  }
+
+  key_generator *kgen =
+    key_generator::from_passphrase((const uint8_t *)passphrase.data(),
+                                   passphrase.length(),
+                                   nonce, REKEY_NONCE_LEN,
+                                   (const uint8_t *)REKEY_CONTEXT,
+                                   sizeof REKEY_CONTEXT - 1);
+  if (chacha) {
+    uint8_t key[CHACHA20_POLY1305_KEY_LEN];
+    size_t got = kgen->generate(key, sizeof key);
+    log_assert(got == sizeof key);
+    *gc = gcm_encryptor::create_chacha20_poly1305(key, sizeof key);
+    memset(key, 0, sizeof key);
+  } else {
+    *gc = gcm_encryptor::create(kgen, 16);
+  }
+  *ec = ecb_encryptor::create(kgen, 16);
+  delete kgen;
+}
+
+void
+chop_config_t::rekey(const uint8_t *nonce, bool chacha,
+                     gcm_decryptor **gc, ecb_decryptor **ec)
+{
+  delete *gc;
+  delete *ec;
+  if (!encryption) {
+    *gc = gcm_decryptor::create_noop();
+    *ec = ecb_decryptor::create_noop();
+    return;
+  }
 
+  // The same keys, in the same order, as the sender's.
+  key_generator *kgen =
+    key_generator::from_passphrase((const uint8_t *)passphrase.data(),
+                                   passphrase.length(),
+                                   nonce, REKEY_NONCE_LEN,
+                                   (const uint8_t *)REKEY_CONTEXT,
+                                   sizeof REKEY_CONTEXT - 1);
+  if (chacha) {
+    uint8_t key[CHACHA20_POLY1305_KEY_LEN];
+    size_t got = kgen->generate(key, sizeof key);
+    log_assert(got == sizeof key);
+    *gc = gcm_decryptor::create_chacha20_poly1305(key, sizeof key);
+    memset(key, 0, sizeof key);
+  } else {
+    *gc = gcm_decryptor::create(kgen, 16);
+  }
+  *ec = ecb_decryptor::create(kgen, 16);
   delete kgen;
+}
+
+void
+chop_config_t::set_data_ciphers(chop_circuit_t *ckt, bool chacha)
+{
+  delete ckt->send_crypt[0];
+  delete ckt->recv_crypt[0];
+  ckt->chacha20 = chacha;
+
+  if (!encryption) {
+    ckt->send_crypt[0] = gcm_encryptor::create_noop();
+    ckt->recv_crypt[0] = gcm_decryptor::create_noop();
+    return;
+  }
 
+  bool server = mode == LSN_SIMPLE_SERVER;
+  if (chacha) {
+    const uint8_t *server_key = circuit_keys + 4 * CIRCUIT_KEY_LEN;
+    const uint8_t *client_key = server_key + CHACHA20_POLY1305_KEY_LEN;
+    ckt->send_crypt[0] = gcm_encryptor::create_chacha20_poly1305(
+      server ? server_key : client_key, CHACHA20_POLY1305_KEY_LEN);
+    ckt->recv_crypt[0] = gcm_decryptor::create_chacha20_poly1305(
+      server ? client_key : server_key, CHACHA20_POLY1305_KEY_LEN);
+  } else {
+    const uint8_t *server_key = circuit_keys;
+    const uint8_t *client_key = circuit_keys + 2 * CIRCUIT_KEY_LEN;
+    ckt->send_crypt[0] = gcm_encryptor::create(
+      server ? server_key : client_key, CIRCUIT_KEY_LEN);
+    ckt->recv_crypt[0] = gcm_decryptor::create(
+      server ? client_key : server_key, CIRCUIT_KEY_LEN);
+  }
 }
 
 circuit_t *
@@ -495,38 +888,35 @@ chop_config_t::circuit_create(size_t)
 {
   chop_circuit_t *ckt = new chop_circuit_t(retransmit);
   ckt->config = this;
-
-  key_generator *kgen = 0;
-
-  if (encryption)
-    kgen = key_generator::from_passphrase((const uint8_t *)passphrase.data(),
-                                          passphrase.length(),
-                                          0, 0, 0, 0);
-
-  if (mode == LSN_SIMPLE_SERVER) {
-    if (encryption) {
-      ckt->send_crypt     = gcm_encryptor::create(kgen, 16);
-      ckt->send_hdr_crypt = ecb_encryptor::create(kgen, 16);
-      ckt->recv_crypt     = gcm_decryptor::create(kgen, 16);
-      ckt->recv_hdr_crypt = ecb_decryptor::create(kgen, 16);
-    } else {
-      ckt->send_crypt     = gcm_encryptor::create_noop();
-      ckt->send_hdr_crypt = ecb_encryptor::create_noop();
-      ckt->recv_crypt     = gcm_decryptor::create_noop();
-      ckt->recv_hdr_crypt = ecb_decryptor::create_noop();
-    }
+  // Without retransmission there are no ACKs to open the window.
+  if (retransmit)
+    ckt->tx_queue.set_congestion_control(
+      congestion_control::create(congestion.c_str()));
+
+  const uint8_t *server_key = circuit_keys;
+  const uint8_t *client_key = circuit_keys + 2 * CIRCUIT_KEY_LEN;
+  bool server = mode == LSN_SIMPLE_SERVER;
+
+  if (encryption) {
+    ckt->send_hdr_crypt[0] =
+      ecb_encryptor::create((server ? server_key : client_key) +
+                            CIRCUIT_KEY_LEN, CIRCUIT_KEY_LEN);
+    ckt->recv_hdr_crypt[0] =
+      ecb_decryptor::create((server ? client_key : server_key) +
+                            CIRCUIT_KEY_LEN, CIRCUIT_KEY_LEN);
   } else {
-    if (encryption) {
-      ckt->recv_crypt     = gcm_decryptor::create(kgen, 16);
-      ckt->recv_hdr_crypt = ecb_decryptor::create(kgen, 16);
-      ckt->send_crypt     = gcm_encryptor::create(kgen, 16);
-      ckt->send_hdr_crypt = ecb_encryptor::create(kgen, 16);
-    } else {
-      ckt->recv_crypt     = gcm_decryptor::create_noop();
-      ckt->recv_hdr_crypt = ecb_decryptor::create_noop();
-      ckt->send_crypt     = gcm_encryptor::create_noop();
-      ckt->send_hdr_crypt = ecb_encryptor::create_noop();
-    }
+    ckt->send_hdr_crypt[0] = ecb_encryptor::create_noop();
+    ckt->recv_hdr_crypt[0] = ecb_decryptor::create_noop();
+  }
+  // The server learns from the handshake which data cipher the client
+  // uses; see chop_conn_t::recv_handshake.
+  set_data_ciphers(ckt, !server && chacha20);
+
+  if (!server) {
+    // A server that does not understand op_RKEY would take us past the
+    // end of the first key epoch, at 2^31 blocks, as far as before:
+    // sequence numbers did not wrap.
+    ckt->peer_rekeys = true;
 
     std::pair<chop_circuit_table::iterator, bool> out;
     do {
@@ -538,9 +928,9 @@ chop_config_t::circuit_create(size_t)
     } while (!out.second);
 
     out.first->second = ckt;
+    ckt->set_window(window_size);
   }
 
-  delete kgen;
   return ckt;
 }
 
@@ -554,17 +944,32 @@ inline chop_circuit_t::chop_circuit_t()
 }
 
 chop_circuit_t::chop_circuit_t(bool retransmit = true)
-  : tx_queue(retransmit), avg_desirable_size(0), avg_available_size(0),
+  : tx_queue(retransmit),
+    rto_timer(rto_timeout, this), pace_timer(pace_timeout, this),
+    ack_timer(ack_timeout, this),
+    z_ratio(128), z_skip(0), z_backoff(1),
+    avg_desirable_size(0), avg_available_size(0),
     number_of_room_requests(0)
 {
 }
 
+void
+chop_circuit_t::set_window(uint32_t proposed)
+{
+  recv_queue.resize(proposed);
+  tx_queue.resize(min(proposed, config->window_size));
+  log_debug(this, "window: receive %u, transmit %u",
+            recv_queue.size(), tx_queue.size());
+}
+
 chop_circuit_t::~chop_circuit_t()
 {
-  delete send_crypt;
-  delete send_hdr_crypt;
-  delete recv_crypt;
-  delete recv_hdr_crypt;
+  for (int i = 0; i < 2; i++) {
+    delete send_crypt[i];
+    delete send_hdr_crypt[i];
+    delete recv_crypt[i];
+    delete recv_hdr_crypt[i];
+  }
 }
 
 void
@@ -581,9 +986,11 @@ chop_circuit_t::close()
        i != downstreams.end(); i++) {
     chop_conn_t *conn = *i;
     conn->upstream = NULL;
+    conn->has_room = false;
     conn_do_flush(conn);
   }
   downstreams.clear();
+  rooms.clear();
 
   // The IDs for old circuits are preserved for a while (at present,
   // indefinitely; FIXME: purge them on a timer) against the
@@ -601,6 +1008,10 @@ chop_circuit_t::close()
   log_assert(out->second == this);
   out->second = NULL;
 
+  rto_timer.disarm();
+  pace_timer.disarm();
+  ack_timer.disarm();
+
   circuit_t::close();
 }
 
@@ -617,6 +1028,7 @@ chop_circuit_t::add_downstream(chop_conn_t *conn)
   log_assert(!conn->upstream);
   conn->upstream = this;
   downstreams.insert(conn);
+  update_room(conn);
 
   log_debug(this, "added connection <%d.%d> to %s, now %lu",
             serial, conn->serial, conn->peername,
@@ -637,6 +1049,7 @@ chop_circuit_t::drop_downstream(chop_conn_t *conn)
   log_assert(conn);
   log_assert(conn->upstream == this);
 
+  unindex_room(conn);
   conn->upstream = NULL;
   downstreams.erase(conn);
 
@@ -671,6 +1084,7 @@ int
 chop_circuit_t::send()
 {
   circuit_disarm_flush_timer(this);
+  parked_probed = false;
 
   //First we check if there's steg data that we need to send
   if (send_all_steg_data())
@@ -682,65 +1096,55 @@ chop_circuit_t::send()
   size_t avail = evbuffer_get_length(xmit_pending);
   size_t avail0 = avail;
   bool no_target_connection = false;
+  bool held = false; // the congestion controller kept data back
 
   if (downstreams.empty()) {
     log_debug(this, "no downstream connections");
     no_target_connection = true;
   } else {
+    // Blocks presumed lost go first; holding them back would stall
+    // the far side's window.
     bool did_retransmit = false;
-    if (avail == 0 && !(upstream_eof && !sent_fin) && config->retransmit) {
-      // Consider retransmission.
-      evbuffer *block = 0;
-      for (transmit_queue::iterator i = tx_queue.begin();
-           i != tx_queue.end();
-           ++i) {
-        transmit_elt &el = *i;
-        size_t lo = MIN_BLOCK_SIZE + el.hdr.dlen();
-        size_t room;
-        chop_conn_t *conn = pick_connection(lo, lo, &room);
-        if (!conn)
-          continue;
-        log_assert(lo <= room);
-
-        if (!block)
-          block = evbuffer_new();
-        if (!block)
-          log_abort("memory allocation failed");
-        if (tx_queue.retransmit(el, room - lo, block,
-                                *send_hdr_crypt, *send_crypt) ||
-            conn->send(block)) {
-          evbuffer_free(block);
-          return -1;
-        }
-
-        char fallbackbuf[4];
-        log_debug(conn, "retransmitted block %u <d=%lu p=%lu f=%s>",
-                  el.hdr.seqno(),
-                  (unsigned long)el.hdr.dlen(),
-                  (unsigned long)el.hdr.plen(),
-                  opname(el.hdr.opcode(), fallbackbuf));
+    if (config->retransmit) {
+      int n = retransmit();
+      if (n < 0)
+        return -1;
+      did_retransmit = n > 0;
+    }
 
-        if (config->trace_packets)
-          fprintf(stderr,
-                  "T:%.4f: ckt %u <ntp %u outq %lu>: "
-                  "resend %lu <d=%lu p=%lu f=%s>\n",
-                  log_get_timestamp(), this->serial,
-                  this->recv_queue.window(),
-                  (unsigned long)evbuffer_get_length(
-                                bufferevent_get_input(this->up_buffer)),
-                  (unsigned long)el.hdr.seqno(),
-                  (unsigned long)el.hdr.dlen(),
-                  (unsigned long)el.hdr.plen(),
-                  opname(el.hdr.opcode(), fallbackbuf));
+    // The peer has to have the next key epoch's keys before we get
+    // there.
+    if (tx_queue.should_rekey() && !tx_queue.full() && send_rekey())
+      return -1;
 
-        evbuffer_free(block);
-        did_retransmit = true;
-        break;
-      }
+    // New data waits for the congestion controller.  When the window
+    // is full, the cover goes on without data: the peer may depend on
+    // our transmissions to answer, and to acknowledge.  When it is the
+    // pacer that says wait, it will have send() called again.
+    uint64_t delay = 0;
+    if ((avail > 0 || (upstream_eof && !sent_fin)) &&
+        !tx_queue.may_send(now_ms(), &delay)) {
+      held = true;
+      if (delay)
+        arm_pace_timer(delay);
+      else
+        log_debug(this, "congestion window full, %lu bytes in flight",
+                  (unsigned long)tx_queue.in_flight());
     }
 
-    if (!did_retransmit && !tx_queue.full())
-    // Send at least one block, even if there is no real data to send.
+    // Send at least one block, even if there is no real data to send,
+    // unless retransmissions have already gone out.
+    if (held) {
+      if (!did_retransmit && !delay && !tx_queue.full()) {
+        size_t blocksize;
+        chop_conn_t *target = pick_connection(0, 0, &blocksize);
+        if (!target)
+          no_target_connection = true;
+        else if (send_chaff(target, blocksize))
+          return -1;
+      }
+    } else if ((avail > 0 || (upstream_eof && !sent_fin) || !did_retransmit) &&
+        !tx_queue.full())
       do {
         log_debug(this, "%lu bytes to send", (unsigned long)avail);
         size_t blocksize;
@@ -757,10 +1161,16 @@ chop_circuit_t::send()
           return -1;
 
         avail = evbuffer_get_length(xmit_pending);
+        if (avail > 0 && !tx_queue.may_send(now_ms(), &delay)) {
+          held = true;
+          if (delay)
+            arm_pace_timer(delay);
+          break;
+        }
       } while (avail > 0);
   }
 
-  if (avail0 == avail) { // no forward progress
+  if (avail0 == avail && !held) { // no forward progress
     dead_cycles++;
     log_debug(this, "%u dead cycles", dead_cycles);
 
@@ -952,7 +1362,8 @@ chop_circuit_t::send_special(opcode_t f, struct evbuffer *payload)
     log_warn(conn, "memory allocation failure");
     return -1;
   }
-  if (tx_queue.transmit(seqno, block, *send_hdr_crypt, *send_crypt)) {
+  unsigned int k = send_slot(seqno);
+  if (tx_queue.transmit(seqno, block, *send_hdr_crypt[k], *send_crypt[k])) {
     log_warn(conn, "encryption failure for block %u", seqno);
     evbuffer_free(block);
     return -1;
@@ -963,6 +1374,8 @@ chop_circuit_t::send_special(opcode_t f, struct evbuffer *payload)
     return -1;
   }
   evbuffer_free(block);
+  tx_queue.mark_sent(seqno, now_ms());
+  start_rto_timer();
 
   char fallbackbuf[4];
   log_debug(conn, "transmitted block %u <d=%lu p=%lu f=%s>",
@@ -998,21 +1411,34 @@ chop_circuit_t::send_targeted(chop_conn_t *conn)
 {
   //Priority with steg data
   bool steg_data_available = false;
+  bool held = false;
   size_t avail = evbuffer_get_length(conn->steg->cfg()->protocol_data_out);
   if (avail > 0)
     steg_data_available = true;
-  else
+  else {
     avail = evbuffer_get_length(bufferevent_get_input(up_buffer));
+    // We must send, but not necessarily data.
+    uint64_t delay;
+    if ((avail > 0 || (upstream_eof && !sent_fin)) &&
+        !tx_queue.may_send(now_ms(), &delay)) {
+      held = true;
+      avail = 0;
+      if (delay)
+        arm_pace_timer(delay);
+    }
+  }
 
-  if (avail == 0 && !(upstream_eof && !sent_fin) && config->retransmit) {
-    // Consider retransmission if we have nothing new to send.
-    evbuffer *block = evbuffer_new();
-    if (!block)
-      log_abort("memory allocation failed");
+  if (avail == 0 && (held || !(upstream_eof && !sent_fin)) &&
+      config->retransmit) {
+    // Consider retransmission if we have nothing new to send.  Blocks
+    // that are still in flight are not worth a connection.
+    evbuffer *block = NULL;
     for (transmit_queue::iterator i = tx_queue.begin();
          i != tx_queue.end();
          ++i) {
       transmit_elt &el = *i;
+      if (!tx_queue.due(el))
+        continue;
       size_t lo = MIN_BLOCK_SIZE + el.hdr.dlen();
       size_t hi = MAX_BLOCK_SIZE;
       if (!conn->sent_handshake) {
@@ -1021,14 +1447,21 @@ chop_circuit_t::send_targeted(chop_conn_t *conn)
       }
 
       size_t room = conn->steg->transmit_room(lo, lo, hi);
-      if (lo <= room && room <= hi &&
-          !tx_queue.retransmit(el, room - lo, block,
-                               *send_hdr_crypt, *send_crypt)) {
+      if (lo > room || room > hi)
+        continue;
+
+      if (!block && !(block = evbuffer_new()))
+        log_abort("memory allocation failed");
+      if (!tx_queue.retransmit(el, room - lo, block,
+                               *send_hdr_crypt[send_slot(el.hdr.seqno())],
+                               *send_crypt[send_slot(el.hdr.seqno())])) {
         if (conn->send(block)) {
           evbuffer_free(block);
           return -1;
         }
         evbuffer_free(block);
+        tx_queue.mark_sent(el, now_ms());
+        start_rto_timer();
 
         char fallbackbuf[4];
         log_debug(conn, "retransmitted block %u <d=%lu p=%lu f=%s>",
@@ -1053,10 +1486,12 @@ chop_circuit_t::send_targeted(chop_conn_t *conn)
         return 0;
       }
     }
+    if (block)
+      evbuffer_free(block);
   }
       
-  if (avail > SECTION_LEN)
-    avail = SECTION_LEN;
+  if (avail > MAX_BLOCK_SIZE - MIN_BLOCK_SIZE - 1)
+    avail = MAX_BLOCK_SIZE - MIN_BLOCK_SIZE - 1;
   avail += MIN_BLOCK_SIZE;
 
   // If we have any data to transmit, ensure we do not send a block
@@ -1081,9 +1516,25 @@ chop_circuit_t::send_targeted(chop_conn_t *conn)
   log_debug(conn, "requests %lu bytes (%s)", (unsigned long)room,
             conn->steg->cfg()->name());
 
-  return steg_data_available ? 
-    send_targeted_steg_data(conn, room) :
-    send_targeted(conn, room);
+  if (steg_data_available)
+    return send_targeted_steg_data(conn, room);
+  if (held)
+    return send_chaff(conn, room);
+  return send_targeted(conn, room);
+}
+
+int
+chop_circuit_t::send_chaff(chop_conn_t *conn, size_t blocksize)
+{
+  size_t lo = MIN_BLOCK_SIZE, hi = MAX_BLOCK_SIZE;
+  if (!conn->sent_handshake) {
+    lo += HANDSHAKE_LEN;
+    hi += HANDSHAKE_LEN;
+  }
+  log_assert(blocksize >= lo && blocksize <= hi);
+
+  return send_targeted(conn, 0, min(blocksize - lo, SECTION_LEN), op_DAT,
+                       bufferevent_get_input(up_buffer));
 }
 
 int
@@ -1097,24 +1548,112 @@ chop_circuit_t::send_targeted(chop_conn_t *conn, size_t blocksize)
   log_assert(blocksize >= lo && blocksize <= hi);
 
   struct evbuffer *xmit_pending = bufferevent_get_input(up_buffer);
-  size_t avail = evbuffer_get_length(xmit_pending);
-  opcode_t op = op_DAT;
-  
-  //The original code 
-  /*if (avail > blocksize - lo)
-    avail = blocksize - lo;
-    else if (avail > SECTION_LEN)
-    avail = SECTION_LEN;*/
+  struct evbuffer *block = evbuffer_new();
+  if (!block) {
+    log_warn(conn, "memory allocation failure");
+    return -1;
+  }
 
-  if (avail > blocksize - lo || avail > SECTION_LEN)
-    avail = min(blocksize - lo, SECTION_LEN);
-  else if (upstream_eof && !sent_fin)
-    // this block will carry the last byte of real data to be sent in
-    // this direction; mark it as such
-    op = op_FIN;
+  // Rather than pad out a roomy transmission, fill it with more
+  // blocks: an ACK we owe that the peer cannot take piggybacked, and
+  // as much data as the congestion controller lets go.  Each block
+  // costs another MIN_BLOCK_SIZE; whichever is last takes up the
+  // rest of the room as padding.
+  struct {
+    uint32_t seqno;
+    size_t d, p;
+    opcode_t f;
+  } batch[MAX_BLOCKS_PER_TRANSMISSION];
+  size_t n = 0;
+  size_t left = blocksize - (lo - MIN_BLOCK_SIZE);
+
+  if (ack_owed && !peer_piggybacks && config->retransmit &&
+      tx_queue.can_hold(2)) {
+    size_t alen = ack_len();
+    size_t need = evbuffer_get_length(xmit_pending) ? 1 : 0;
+    if (alen && 2 * MIN_BLOCK_SIZE + alen + need <= left) {
+      evbuffer *ackp = take_ack();
+      size_t d = alen, p = 0;
+      opcode_t f = op_ACK;
+      if (!ackp ||
+          pack_block(&d, &p, &f, ackp, block, &batch[n].seqno)) {
+        if (ackp)
+          evbuffer_free(ackp);
+        evbuffer_free(block);
+        return -1;
+      }
+      evbuffer_free(ackp);
+      batch[n].d = d;
+      batch[n].p = p;
+      batch[n].f = f;
+      n++;
+      left -= MIN_BLOCK_SIZE + alen;
+    }
+  }
 
-  return send_targeted(conn, avail, (blocksize - lo) - avail,
-                       op, xmit_pending);
+  // The congestion controller was asked before we got here; the
+  // blocks of one transmission count as one for it.
+  bool fin = false;
+  for (;;) {
+    size_t body = left - MIN_BLOCK_SIZE;
+    size_t avail = evbuffer_get_length(xmit_pending);
+    size_t d = avail, p;
+    opcode_t f = op_DAT;
+
+    if (avail > body || avail > SECTION_LEN)
+      d = min(body, SECTION_LEN);
+    else if (upstream_eof && !sent_fin && !fin)
+      // this block will carry the last byte of real data to be sent in
+      // this direction; mark it as such
+      f = op_FIN;
+
+    // Another block follows if it can carry data too, or if there is
+    // more padding than one block can hold.  If none can, this one
+    // takes what padding it can, and the transmission comes out short
+    // of the room.
+    bool more = false;
+    bool another = n + 1 < MAX_BLOCKS_PER_TRANSMISSION &&
+      tx_queue.can_hold(2);
+    p = body - d;
+    if (d < avail && p > MIN_BLOCK_SIZE && another) {
+      more = true;
+      p = 0;
+    } else if (p > SECTION_LEN) {
+      more = another;
+      p = another ? min(SECTION_LEN, p - MIN_BLOCK_SIZE) : SECTION_LEN;
+    }
+    left -= MIN_BLOCK_SIZE + d + p;
+    fin = fin || f == op_FIN;
+
+    if (pack_block(&d, &p, &f, xmit_pending, block, &batch[n].seqno)) {
+      evbuffer_free(block);
+      return -1;
+    }
+    batch[n].d = d;
+    batch[n].p = p;
+    batch[n].f = f;
+    n++;
+
+    if (!more)
+      break;
+    if (n == MAX_BLOCKS_PER_TRANSMISSION || tx_queue.full()) {
+      log_warn(conn, "no block left to fill the transmission");
+      evbuffer_free(block);
+      return -1;
+    }
+  }
+
+  if (conn->send(block)) {
+    evbuffer_free(block);
+    return -1;
+  }
+  evbuffer_free(block);
+
+  if (n > 1)
+    log_debug(conn, "%lu blocks in one transmission", (unsigned long)n);
+  for (size_t i = 0; i < n; i++)
+    block_sent(conn, batch[i].seqno, batch[i].d, batch[i].p, batch[i].f);
+  return 0;
 }
 
 int
@@ -1145,46 +1684,81 @@ int
 chop_circuit_t::send_targeted(chop_conn_t *conn, size_t d, size_t p, opcode_t f,
                               struct evbuffer *payload)
 {
-  log_assert(payload || d == 0);
-  log_assert(d <= SECTION_LEN);
-  log_assert(p <= SECTION_LEN);
-
   if (tx_queue.full()) {
     log_warn(conn, "transmit queue full, cannot send");
     return -1;
   }
 
-  struct evbuffer *data = evbuffer_new();
-  if (!data) {
+  struct evbuffer *block = evbuffer_new();
+  if (!block) {
     log_warn(conn, "memory allocation failure");
     return -1;
   }
 
-  if (evbuffer_remove_buffer(payload, data, d) != (int)d) {
-    log_warn(conn, "failed to extract payload");
-    evbuffer_free(data);
+  uint32_t seqno;
+  if (pack_block(&d, &p, &f, payload, block, &seqno)) {
+    evbuffer_free(block);
     return -1;
   }
 
-  // The transmit queue takes ownership of 'data' at this point.
-  uint32_t seqno = tx_queue.enqueue(f, data, p);
+  if (conn->send(block)) {
+    evbuffer_free(block);
+    return -1;
+  }
+  evbuffer_free(block);
+  block_sent(conn, seqno, d, p, f);
+  return 0;
+}
 
-  struct evbuffer *block = evbuffer_new();
-  if (!block) {
-    log_warn(conn, "memory allocation failure");
+int
+chop_circuit_t::pack_block(size_t *d, size_t *p, opcode_t *f,
+                           struct evbuffer *payload, struct evbuffer *out,
+                           uint32_t *seqno)
+{
+  log_assert(payload || *d == 0);
+  log_assert(*d <= SECTION_LEN);
+  log_assert(*p <= SECTION_LEN);
+
+  if (tx_queue.full()) {
+    log_warn(this, "transmit queue full, cannot send");
     return -1;
   }
-  if (tx_queue.transmit(seqno, block, *send_hdr_crypt, *send_crypt)) {
-    log_warn(conn, "encryption failure for block %u", seqno);
-    evbuffer_free(block);
+
+  struct evbuffer *data = evbuffer_new();
+  if (!data) {
+    log_warn(this, "memory allocation failure");
     return -1;
   }
 
-  if (conn->send(block)) {
-    evbuffer_free(block);
+  // An ACK we owe goes first, in place of padding if possible.
+  size_t overhead = piggyback_ack(f, d, p, data);
+
+  size_t raw = compress_data(f, d, p, payload, data);
+  if (!raw && evbuffer_remove_buffer(payload, data, *d) != (int)*d) {
+    log_warn(this, "failed to extract payload");
+    evbuffer_free(data);
     return -1;
   }
-  evbuffer_free(block);
+
+  // The transmit queue takes ownership of 'data' at this point.
+  *seqno = tx_queue.enqueue(*f, data, *p, overhead);
+  if (raw)
+    *d = raw;
+
+  unsigned int k = send_slot(*seqno);
+  if (tx_queue.transmit(*seqno, out, *send_hdr_crypt[k], *send_crypt[k])) {
+    log_warn(this, "encryption failure for block %u", *seqno);
+    return -1;
+  }
+  return 0;
+}
+
+void
+chop_circuit_t::block_sent(chop_conn_t *conn, uint32_t seqno, size_t d,
+                           size_t p, opcode_t f)
+{
+  tx_queue.mark_sent(seqno, now_ms());
+  start_rto_timer();
 
   //if we don't do retransmit we need to remove the block
   //from the queue not make full. because the only way that
@@ -1210,18 +1784,17 @@ chop_circuit_t::send_targeted(chop_conn_t *conn, size_t d, size_t p, opcode_t f,
     config->total_transmited_data_bytes += d;
     log_debug(this, "efficiency: %f", config->total_transmited_data_bytes/(double)(config->total_transmited_cover_bytes));
   }
-  if (f == op_FIN || f == op_STEG_FIN) {
+  if (f == op_FIN || f == op_ACK_FIN || f == op_STEG_FIN) {
     sent_fin = true;
     read_eof = true;
   }
-  if ((f == op_DAT && d > 0) || 
+  if (((f == op_DAT || f == op_ACK_DAT) && d > 0) ||
       (f == op_STEG0 && d > 0) ||
-      f == op_FIN ||
+      f == op_FIN || f == op_ACK_FIN ||
       f == op_STEG_FIN)
     // We are making forward progress if we are _either_ sending or
     // receiving data.
     dead_cycles = 0;
-  return 0;
 }
 
 // N.B. 'desired' is the desired size of the _data section_, and
@@ -1230,15 +1803,12 @@ chop_conn_t *
 chop_circuit_t::pick_connection(size_t desired, size_t minimum,
                                 size_t *blocksize)
 {
-  size_t maxbelow = 0;
-  size_t minabove = MAX_BLOCK_SIZE + 1;
-  chop_conn_t *targbelow = 0;
-  chop_conn_t *targabove = 0;
-
   log_assert(minimum <= SECTION_LEN);
 
-  if (desired > SECTION_LEN)
-    desired = SECTION_LEN;
+  // More than a block's worth of data goes in several blocks of the
+  // same transmission.
+  if (desired > MAX_BLOCK_SIZE - MIN_BLOCK_SIZE - 1)
+    desired = MAX_BLOCK_SIZE - MIN_BLOCK_SIZE - 1;
 
   // If we have any data to transmit, ensure we do not send a block
   // that contains no data at all.
@@ -1250,36 +1820,31 @@ chop_circuit_t::pick_connection(size_t desired, size_t minimum,
 
   log_debug(this, "target block size %lu bytes", (unsigned long)desired);
 
-  // Find the best fit for the desired transmission from all the
-  // outbound connections' transmit rooms.
-  for (unordered_set<chop_conn_t *>::iterator i = downstreams.begin();
-       i != downstreams.end(); i++) {
-    chop_conn_t *conn = *i;
-
-    //Keeping track of connection life length
-    log_debug(conn, "has been connected for %lu secs", (unsigned long)difftime(time(0), conn->creation_time));
-    // We cannot transmit on a connection whose steganography module has
-    // not yet been instantiated.  (This only ever happens server-side.)
-    if (!conn->steg) {
-      log_debug(conn, "offers 0 bytes (no steg)");
-      continue;
-    }
-
-    // We must not transmit on a connection that has not completed its
-    // TCP handshake.  (This only ever happens client-side.  If we try
-    // it anyway, the transmission gets silently dropped on the floor.)
-    if (!conn->connected) {
-      log_debug(conn, "offers 0 bytes (not connected)");
-      continue;
+  // The best fit is the connection with the least room that can take
+  // all the data; failing that, the one that can take the most of it.
+  // Only that connection is asked for its actual offer.
+  for (;;) {
+    chop_room_index::iterator i = rooms.lower_bound(desired);
+    if (i == rooms.end() &&
+        (i == rooms.begin() || (--i)->first < minimum)) {
+      if (refresh_parked())
+        continue;
+
+      // Callers know how to handle a NULL connection with blocksize 0.
+      log_debug(this, "no connection offers %lu bytes",
+                (unsigned long)minimum);
+      *blocksize = 0;
+      return NULL;
     }
 
+    chop_conn_t *conn = i->second;
     size_t shake = conn->sent_handshake ? 0 : HANDSHAKE_LEN;
     size_t room = conn->steg->transmit_room(desired + shake,
                                             minimum + shake,
                                             MAX_BLOCK_SIZE + shake);
     if (room == 0) {
-      log_debug(conn, "offers 0 bytes (%s)",
-        conn->steg->cfg()->name());
+      log_debug(conn, "offers 0 bytes (%s)", conn->steg->cfg()->name());
+      unindex_room(conn);
       continue;
     }
 
@@ -1292,8 +1857,6 @@ chop_circuit_t::pick_connection(size_t desired, size_t minimum,
     log_debug(conn, "offers %lu bytes (%s)", (unsigned long)room,
               conn->steg->cfg()->name());
 
-    //When we are here it means that our offer went through
-    
     //for debug reason only
     if (config->trace_packets) {
         avg_desirable_size += (-avg_desirable_size + (desired+shake))/((double)(number_of_room_requests+1));
@@ -1302,39 +1865,75 @@ chop_circuit_t::pick_connection(size_t desired, size_t minimum,
 
         log_debug(this, "no req: %lu avg des: %f avg act: %f", number_of_room_requests, avg_desirable_size, avg_available_size);
     }
-    
-    if (room >= desired + shake) {
-      if (room < minabove) {
-        minabove = room;
-        targabove = conn;
-      }
-    } else {
-      if (room > maxbelow) {
-        maxbelow = room;
-        targbelow = conn;
-      }
-    }
+
+    *blocksize = room;
+    return conn;
   }
+}
+
+void
+chop_circuit_t::update_room(chop_conn_t *conn)
+{
+  parked_probed = false;
+  index_room(conn);
+}
 
-  log_debug(this, "minabove %lu for <%u.%u> maxbelow %lu for <%u.%u>",
-            (unsigned long)minabove, serial, targabove ? targabove->serial :0,
-            (unsigned long)maxbelow, serial, targbelow ? targbelow->serial :0);
+void
+chop_circuit_t::index_room(chop_conn_t *conn)
+{
+  unindex_room(conn);
+
+  // We cannot transmit on a connection whose steganography module has
+  // not yet been instantiated.  (This only ever happens server-side.)
+  // Nor on one that has not completed its TCP handshake.  (This only
+  // ever happens client-side.  If we try it anyway, the transmission
+  // gets silently dropped on the floor.)
+  if (!conn->steg || !conn->connected)
+    return;
 
-  // If we have a connection that can take all the data, use it.
-  // Otherwise, use the connection that can take as much of the data
-  // as possible.  As a special case, if no connection can take data,
-  // targbelow, targabove, maxbelow, and minabove will all still have
-  // their initial values, so we'll return NULL and set blocksize to 0,
-  // which callers know how to handle.
-  if (targabove) {
-    *blocksize = minabove;
-    return targabove;
-  } else {
-    *blocksize = maxbelow;
-    return targbelow;
+  // Ask for as much as pick_connection ever may.
+  size_t shake = conn->sent_handshake ? 0 : HANDSHAKE_LEN;
+  size_t room = conn->steg->transmit_room(SECTION_LEN + MIN_BLOCK_SIZE + shake,
+                                          MIN_BLOCK_SIZE + shake,
+                                          MAX_BLOCK_SIZE + shake);
+  if (room == 0)
+    return;
+
+  if (room < MIN_BLOCK_SIZE + shake || room >= MAX_BLOCK_SIZE + shake)
+    log_abort(conn, "steg size request (%lu) out of range [%lu, %lu]",
+              (unsigned long)room,
+              (unsigned long)(MIN_BLOCK_SIZE + shake),
+              (unsigned long)(MAX_BLOCK_SIZE + shake));
+
+  conn->room_slot = rooms.insert(make_pair(room - shake, conn));
+  conn->has_room = true;
+}
+
+void
+chop_circuit_t::unindex_room(chop_conn_t *conn)
+{
+  if (conn->has_room) {
+    rooms.erase(conn->room_slot);
+    conn->has_room = false;
   }
 }
 
+bool
+chop_circuit_t::refresh_parked()
+{
+  if (parked_probed || rooms.size() == downstreams.size())
+    return false;
+
+  parked_probed = true;
+  size_t before = rooms.size();
+  for (unordered_set<chop_conn_t *>::iterator i = downstreams.begin();
+       i != downstreams.end(); i++)
+    if (!(*i)->has_room)
+      index_room(*i);
+
+  return rooms.size() > before;
+}
+
 /**
      checks the steg module of all connections to see if they have
      protocol data to send
@@ -1386,29 +1985,225 @@ chop_circuit_t::maybe_send_ack()
 {
   // Send acks aggressively if we are experiencing dead cycles *and*
   // there are blocks on the receive queue.  Otherwise, send them only
-  // every 64 blocks received.  This heuristic will probably need
-  // adjustment.
+  // every eighth of the receive window.  This heuristic will probably
+  // need adjustment.
   
   //If we don't retransmit we shouldn't send ACK either because it will consume
   //all the channel if a block is lost
   if (!config->retransmit)
     return 0;
   log_debug(this, "considering ACK");
-  if (recv_queue.window() - last_acked < 32 &&
+
+  // Data about to go the other way can carry the ACK, within its
+  // block or in a block of its own in the same transmission.
+  if (ack_owed &&
+      (evbuffer_get_length(bufferevent_get_input(up_buffer)) ||
+       (upstream_eof && !sent_fin))) {
+    log_debug(this, "ACK to go with data");
+    arm_ack_timer();
+    return 0;
+  }
+
+  uint32_t threshold = config->ack_every
+    ? min(config->ack_every, recv_queue.size()) : recv_queue.size() / 8;
+  if (recv_queue.window() - last_acked < threshold &&
       (!dead_cycles || recv_queue.empty()))
     {
       log_debug(this, "back log size only %u, not sending ACK", recv_queue.window() - last_acked);
+      if (ack_owed)
+        arm_ack_timer();
       return 0;
     }
 
+  return send_ack();
+}
+
+int
+chop_circuit_t::send_ack()
+{
+  evbuffer *ackp = take_ack();
+  if (!ackp)
+    return -1;
+  return send_special(op_ACK, ackp);
+}
+
+evbuffer *
+chop_circuit_t::take_ack()
+{
   evbuffer *ackp = recv_queue.gen_ack();
+  if (!ackp) {
+    log_warn(this, "failed to generate ACK");
+    return 0;
+  }
   if (log_do_debug()) {
     std::ostringstream ackdump;
     debug_ack_contents(ackp, ackdump);
     log_debug(this, "sending ACK: %s", ackdump.str().c_str());
   }
   last_acked = recv_queue.window();
-  return send_special(op_ACK, ackp);
+  ack_owed = false;
+  ack_timer.disarm();
+  return ackp;
+}
+
+size_t
+chop_circuit_t::ack_len()
+{
+  evbuffer *ackp = recv_queue.gen_ack();
+  if (!ackp)
+    return 0;
+  size_t len = evbuffer_get_length(ackp);
+  evbuffer_free(ackp);
+  return len;
+}
+
+size_t
+chop_circuit_t::piggyback_ack(opcode_t *f, size_t *d, size_t *p,
+                              evbuffer *data)
+{
+  if (!ack_owed || !peer_piggybacks || !config->retransmit ||
+      (*f != op_DAT && *f != op_FIN))
+    return 0;
+
+  // Only a few bytes, unless much is missing: measure before taking.
+  size_t alen = ack_len();
+  if (!alen)
+    return 0;
+  size_t extra = PIGGYBACK_LEN_LEN + alen;
+
+  size_t budget = *d + *p;
+  if (budget < extra)
+    return 0;
+  size_t nd = min(*d, min(budget - extra, SECTION_LEN - extra));
+  if (nd < *d && *f == op_FIN)
+    return 0;
+
+  evbuffer *ackp = take_ack();
+  if (!ackp)
+    return 0;
+  uint8_t len[PIGGYBACK_LEN_LEN] = {
+    uint8_t((extra - PIGGYBACK_LEN_LEN) >> 8),
+    uint8_t((extra - PIGGYBACK_LEN_LEN) & 0xFF)
+  };
+  if (evbuffer_add(data, len, sizeof len) ||
+      evbuffer_add_buffer(data, ackp)) {
+    log_warn(this, "failed to piggyback ACK");
+    evbuffer_free(ackp);
+    evbuffer_drain(data, evbuffer_get_length(data));
+    ack_owed = true;
+    return 0;
+  }
+  evbuffer_free(ackp);
+
+  *f = *f == op_FIN ? op_ACK_FIN : op_ACK_DAT;
+  *p = budget - extra - nd;
+  *d = nd;
+  return extra;
+}
+
+size_t
+chop_circuit_t::compress_data(opcode_t *f, size_t *d, size_t *p,
+                              evbuffer *payload, evbuffer *data)
+{
+  size_t avail = evbuffer_get_length(payload);
+  if (!config->compression || !peer_compresses ||
+      (*f != op_DAT && *f != op_ACK_DAT) ||
+      *d < COMPRESS_MIN_DATA || avail <= *d)
+    return 0;
+  if (z_skip) {
+    z_skip--;
+    return 0;
+  }
+
+  // Guess how much will compress to the room there is from how well
+  // data compressed lately, but always try a little more than fits
+  // uncompressed, or a bad guess would stick.  Too much, and we try
+  // again with proportionally less.
+  size_t room = *d;
+  size_t raw = min(avail, min(COMPRESS_MAX_INPUT,
+                              std::max(room * 256 / z_ratio,
+                                       room + room / 8)));
+  // Enough space for zlib's worst case.
+  size_t bound = raw + raw / 1000 + 64;
+  uint8_t *zbuf = (uint8_t *)xmalloc(bound);
+  for (int tries = 0; tries < 3 && raw > room; tries++) {
+    uint8_t *src = evbuffer_pullup(payload, raw);
+    if (!src) {
+      log_warn(this, "memory allocation failure");
+      break;
+    }
+    ssize_t clen = compress(src, raw, zbuf, bound, c_format_zlib);
+    if (clen <= 0)
+      break;
+    z_ratio = std::max(8u, min(256u, uint32_t((3 * uint64_t(z_ratio) +
+                                               size_t(clen) * 256 / raw)
+                                              / 4)));
+
+    if (size_t(clen) <= room) {
+      // Whatever room is left over becomes padding, if it can.
+      if (*p + room - clen > SECTION_LEN)
+        break;
+      if (evbuffer_add(data, zbuf, clen)) {
+        log_warn(this, "memory allocation failure");
+        free(zbuf);
+        return 0;
+      }
+      free(zbuf);
+      evbuffer_drain(payload, raw);
+
+      log_debug(this, "compressed %lu bytes to %lu",
+                (unsigned long)raw, (unsigned long)clen);
+      *f = *f == op_DAT ? op_ZDAT : op_ACK_ZDAT;
+      *p += room - clen;
+      *d = clen;
+      z_backoff = 1;
+      return raw;
+    }
+    raw = raw * room / clen * 15 / 16;
+  }
+  free(zbuf);
+
+  // Not worth it: leave the next few blocks alone.
+  log_debug(this, "data do not compress, skipping %u blocks", z_backoff);
+  z_skip = z_backoff;
+  z_backoff = min(z_backoff * 2, 64u);
+  return 0;
+}
+
+evbuffer *
+chop_circuit_t::decompress_data(evbuffer *data)
+{
+  evbuffer *out = evbuffer_new();
+  if (!out) {
+    log_warn(this, "memory allocation failure");
+    evbuffer_free(data);
+    return 0;
+  }
+
+  // Inflate the data where they lie in the block, a few chains at a
+  // time, straight into the result, which no sender could have made
+  // bigger than the limit.
+  inflater z;
+  int ret = z.ok() ? 0 : -1;
+  while (ret == 0 && evbuffer_get_length(data) > 0) {
+    struct evbuffer_iovec v[8];
+    int n = evbuffer_peek(data, -1, NULL, v, 8);
+    size_t used = 0;
+    for (int i = 0; i < n && i < 8 && ret == 0; i++) {
+      ret = z.write((const uint8_t *)v[i].iov_base, v[i].iov_len,
+                    out, COMPRESS_MAX_INPUT);
+      used += v[i].iov_len;
+    }
+    evbuffer_drain(data, used);
+  }
+  evbuffer_free(data);
+
+  if (ret != 1) {
+    log_warn(this, "protocol error: corrupt compressed block");
+    evbuffer_free(out);
+    return 0;
+  }
+  return out;
 }
 
 // Some blocks are to be processed immediately upon receipt.
@@ -1428,6 +2223,7 @@ chop_circuit_t::recv_block(uint32_t seqno, opcode_t op,
   case op_STEG_FIN:
 
     // No special handling required.
+    ack_owed = true;
     goto insert;
 
   case op_RST:
@@ -1438,20 +2234,58 @@ chop_circuit_t::recv_block(uint32_t seqno, opcode_t op,
     goto zap;
 
   case op_ACK:
-    if (log_do_debug()) {
-      std::ostringstream ackdump;
-      debug_ack_contents(data, ackdump);
-      log_debug(this, "received ACK: %s", ackdump.str().c_str());
-    }
-    if (tx_queue.process_ack(data))
-      log_warn(this, "protocol error: invalid ACK payload");
-    //The upstream data always has priority but there are occasions that 
-    //retransmitting is crucial for processing of the data 
-    // here is a place to force retransmission, even if upstream data 
-    // are coming
-    retransmit();
+    recv_ack(data, false);
     goto zap;
 
+  case op_RKEY:
+    recv_rekey(seqno, data);
+    ack_owed = true;
+    goto zap;
+
+  case op_ZDAT:
+  case op_ZFIN:
+    // A peer only sends these if it takes them too (servers have no
+    // other way to say so).
+    peer_compresses = true;
+    data = decompress_data(data);
+    if (!data)
+      goto zap;
+    op = op == op_ZDAT ? op_DAT : op_FIN;
+    ack_owed = true;
+    goto insert;
+
+  case op_ACK_DAT:
+  case op_ACK_FIN:
+  case op_ACK_ZDAT:
+  case op_ACK_ZFIN: {
+    // The ACK goes first; the rest is an ordinary op_DAT or op_FIN,
+    // or op_ZDAT or op_ZFIN.
+    peer_piggybacks = true;
+    uint8_t len[PIGGYBACK_LEN_LEN];
+    evbuffer *ackp = evbuffer_new();
+    size_t ack_len = 0;
+    if (ackp && evbuffer_remove(data, len, sizeof len) == sizeof len)
+      ack_len = (size_t(len[0]) << 8) | len[1];
+    if (!ackp || ack_len == 0 ||
+        evbuffer_remove_buffer(data, ackp, ack_len) != (int)ack_len) {
+      log_warn(this, "protocol error: malformed piggybacked ACK");
+      if (ackp)
+        evbuffer_free(ackp);
+      evbuffer_free(data);
+      goto zap;
+    }
+    recv_ack(ackp, true);
+    if (op == op_ACK_ZDAT || op == op_ACK_ZFIN) {
+      peer_compresses = true;
+      data = decompress_data(data);
+      if (!data)
+        goto zap;
+    }
+    op = (op == op_ACK_DAT || op == op_ACK_ZDAT) ? op_DAT : op_FIN;
+    ack_owed = true;
+    goto insert;
+  }
+
   case op_XXX:
   default:
     char fallbackbuf[4];
@@ -1471,6 +2305,74 @@ chop_circuit_t::recv_block(uint32_t seqno, opcode_t op,
   return 0;
 }
 
+int
+chop_circuit_t::send_rekey()
+{
+  uint8_t nonce[REKEY_NONCE_LEN];
+  rng_bytes(nonce, sizeof nonce);
+
+  struct evbuffer *payload = evbuffer_new();
+  if (!payload || evbuffer_add(payload, nonce, sizeof nonce)) {
+    log_warn(this, "memory allocation failure");
+    if (payload)
+      evbuffer_free(payload);
+    return -1;
+  }
+
+  // Nothing left on the transmit queue is from the epoch that last
+  // had the other slot; see should_rekey().
+  unsigned int k = key_slot(tx_queue.next_seqno()) ^ 1;
+  config->rekey(nonce, chacha20, &send_crypt[k], &send_hdr_crypt[k]);
+  log_debug(this, "new keys from block %u",
+            (tx_queue.next_seqno() / KEY_EPOCH + 1) * KEY_EPOCH);
+  return send_special(op_RKEY, payload);
+}
+
+void
+chop_circuit_t::recv_rekey(uint32_t seqno, evbuffer *data)
+{
+  uint8_t nonce[REKEY_NONCE_LEN];
+  if (evbuffer_remove(data, nonce, sizeof nonce) != (int)sizeof nonce ||
+      evbuffer_get_length(data) > 0) {
+    log_warn(this, "protocol error: malformed RKEY block");
+  } else if (seqno - recv_queue.window() < recv_queue.size() &&
+             seqno != rekey_seqno) {
+    // Blocks outside the receive window, and retransmissions, are
+    // old news.
+    config->rekey(nonce, chacha20, &recv_crypt[key_slot(seqno) ^ 1],
+                  &recv_hdr_crypt[key_slot(seqno) ^ 1]);
+    rekey_seqno = seqno;
+    log_debug(this, "new keys from block %u",
+              (seqno / KEY_EPOCH + 1) * KEY_EPOCH);
+  }
+  evbuffer_free(data);
+}
+
+void
+chop_circuit_t::recv_ack(evbuffer *data, bool piggybacked)
+{
+  if (log_do_debug()) {
+    std::ostringstream ackdump;
+    debug_ack_contents(data, ackdump);
+    log_debug(this, "received %sACK: %s", piggybacked ? "piggybacked " : "",
+              ackdump.str().c_str());
+  }
+  if (tx_queue.process_ack(data, now_ms())) {
+    // A block carrying data may be retransmitted long after the ACK
+    // it carries has been overtaken.
+    if (piggybacked)
+      log_debug(this, "ignoring stale piggybacked ACK");
+    else
+      log_warn(this, "protocol error: invalid ACK payload");
+  }
+  log_debug(this, "srtt %u ms, rto %u ms",
+            tx_queue.rtt().srtt(), tx_queue.rtt().rto());
+  // Blocks the ACK passed over can go again right away, even if
+  // upstream data are coming.
+  retransmit();
+  arm_rto_timer();
+}
+
 int
 chop_circuit_t::process_queue()
 {
@@ -1608,13 +2510,17 @@ chop_circuit_t::check_for_eof()
 int
 chop_circuit_t::retransmit()
 {
-  //bool did_retransmit = false;
-  // Consider retransmission.
+  parked_probed = false;
+  int count = 0;
+  uint64_t now = now_ms();
   evbuffer *block = 0;
   for (transmit_queue::iterator i = tx_queue.begin();
        i != tx_queue.end();
        ++i) {
     transmit_elt &el = *i;
+    if (!tx_queue.due(el))
+      continue;
+
     size_t lo = MIN_BLOCK_SIZE + el.hdr.dlen(); //we don't need to add the min block size as it is done in pick_connections, maybe we sends these with double headers
     size_t room;
     chop_conn_t *conn = pick_connection(lo, lo, &room);
@@ -1626,12 +2532,14 @@ chop_circuit_t::retransmit()
       block = evbuffer_new();
     if (!block)
       log_abort("memory allocation failed");
+    unsigned int k = send_slot(el.hdr.seqno());
     if (tx_queue.retransmit(el, room - lo, block,
-                            *send_hdr_crypt, *send_crypt) ||
+                            *send_hdr_crypt[k], *send_crypt[k]) ||
         conn->send(block)) {
       evbuffer_free(block);
       return -1;
     }
+    tx_queue.mark_sent(el, now);
     
     char fallbackbuf[4];
     log_debug(conn, "retransmitted block %u <d=%lu p=%lu f=%s>",
@@ -1653,13 +2561,92 @@ chop_circuit_t::retransmit()
               (unsigned long)el.hdr.plen(),
               opname(el.hdr.opcode(), fallbackbuf));
 
+    count++;
+  }
+
+  if (block)
     evbuffer_free(block);
-    //did_retransmit = true;
-    break;
+  if (count)
+    start_rto_timer();
+  return count;
+}
+
+uint64_t
+chop_circuit_t::now_ms() const
+{
+  return config->now_ms();
+}
+
+void
+chop_circuit_t::arm_rto_timer()
+{
+  if (!config->retransmit)
+    return;
+
+  uint64_t deadline = tx_queue.next_deadline();
+  if (!deadline) {
+    rto_timer.disarm();
+    return;
   }
-  
-  return 0;
+
+  uint64_t now = now_ms();
+  config->timers()->arm(&rto_timer, deadline > now ? deadline - now : 0);
+}
+
+/* static */ void
+chop_circuit_t::rto_timeout(void *arg)
+{
+  chop_circuit_t *ckt = static_cast<chop_circuit_t *>(arg);
+
+  if (ckt->tx_queue.expire(ckt->now_ms()))
+    log_debug(ckt, "retransmission timeout; rto now %u ms",
+              ckt->tx_queue.rtt().rto());
+
+  int n = ckt->retransmit();
+  if (n < 0) {
+    log_info(ckt, "error during retransmit");
+    ckt->close();
+    return;
+  }
+
+  // The client may need a fresh connection to get the lost blocks
+  // through; the server has to wait for the client to make one.
+  if (n == 0 && ckt->config->mode != LSN_SIMPLE_SERVER)
+    circuit_send(ckt);
+  else
+    ckt->arm_rto_timer();
 }
+
+void
+chop_circuit_t::arm_pace_timer(uint64_t delay)
+{
+  if (!pace_timer.pending())
+    config->timers()->arm(&pace_timer, delay);
+}
+
+/* static */ void
+chop_circuit_t::pace_timeout(void *arg)
+{
+  circuit_send(static_cast<chop_circuit_t *>(arg));
+}
+
+void
+chop_circuit_t::arm_ack_timer()
+{
+  if (!ack_timer.pending())
+    config->timers()->arm(&ack_timer, config->ack_delay);
+}
+
+/* static */ void
+chop_circuit_t::ack_timeout(void *arg)
+{
+  chop_circuit_t *ckt = static_cast<chop_circuit_t *>(arg);
+  if (ckt->ack_owed && ckt->send_ack()) {
+    log_info(ckt, "error sending ACK");
+    ckt->close();
+  }
+}
+
 // Connection methods
 
 conn_t *
@@ -1679,17 +2666,18 @@ chop_config_t::conn_create(size_t index)
 }
 
 chop_conn_t::chop_conn_t()
-  :upstream(NULL), must_send_timer(NULL), sent_handshake(false)
+  :upstream(NULL), must_send_timer(must_send_timeout, this),
+   sent_handshake(false)
 {
 }
 
 chop_conn_t::~chop_conn_t()
 {
-  if (this->must_send_timer)
-    event_free(this->must_send_timer);
   if (steg)
     delete steg;
   evbuffer_free(recv_pending);
+  if (raw_received)
+    evbuffer_free(raw_received);
 }
 
 void
@@ -1709,10 +2697,7 @@ chop_conn_t::close()
 void
 chop_conn_t::emancipate_from_upstream()
 {
-  if (this->must_send_timer) {
-    event_del(this->must_send_timer);
-    must_send_timer = NULL;
-  }
+  must_send_timer.disarm();
 
   if (upstream)
     upstream->drop_downstream(this);
@@ -1742,7 +2727,14 @@ chop_conn_t::send(struct evbuffer *block)
                 upstream ? upstream->circuit_id : 0);
     /*hear we need to cook the handshake */
     uint8_t conn_handshake[HANDSHAKE_LEN];
-    ChopHandshaker handshaker(upstream->circuit_id);
+    ChopHandshaker handshaker(upstream->circuit_id,
+                              ui64_log2(upstream->recv_queue.size()),
+                              CHOP_FEATURE_PIGGYBACK_ACK |
+                              CHOP_FEATURE_REKEY |
+                              (upstream->chacha20
+                               ? CHOP_FEATURE_CHACHA20 : 0) |
+                              (config->compression
+                               ? CHOP_FEATURE_COMPRESSION : 0));
     handshaker.generate(conn_handshake, *(config->handshake_encryptor));
     
     if (evbuffer_prepend(block, (void *)conn_handshake,
@@ -1760,10 +2752,9 @@ chop_conn_t::send(struct evbuffer *block)
 
   config->total_transmited_cover_bytes += transmission_size;
   sent_handshake = true;
-  if (must_send_timer) {
-    evtimer_del(must_send_timer);
-    must_send_timer = NULL;
-  }
+  must_send_timer.disarm();
+  if (upstream)
+    upstream->update_room(this);
   return 0;
 }
 
@@ -1778,16 +2769,135 @@ chop_conn_t::handshake()
   // to associate this new connection with.  Note that in some cases
   // it's possible for us to have _already_ sent something on this
   // connection by the time we get called back!  Don't do it twice.
+  if (upstream)
+    upstream->update_room(this);
   if (config->mode != LSN_SIMPLE_SERVER && !sent_handshake)
     send();
   return 0;
 }
 
+bool
+chop_conn_t::keeps_raw_data() const
+{
+  return config->mode == LSN_SIMPLE_SERVER &&
+    (config->transparent_proxy || worker_count() > 1);
+}
+
+/** Append to raw_received whatever has arrived in inbound() since
+    the last call.  The steg module may leave part of the input in
+    place between calls; raw_held says how much of that we already
+    have, so every byte is copied exactly once. */
+void
+chop_conn_t::hold_raw_data()
+{
+  struct evbuffer *in = inbound();
+  size_t len = evbuffer_get_length(in);
+
+  if (!raw_received) {
+    raw_received = evbuffer_new();
+    raw_held = 0;
+    if (!raw_received)
+      log_abort(this, "memory allocation failure");
+  }
+  if (len <= raw_held)
+    return;
+
+  struct evbuffer_ptr pos;
+  if (evbuffer_ptr_set(in, &pos, raw_held, EVBUFFER_PTR_SET))
+    log_abort(this, "was not able to make a copy of received data");
+
+  // A few chains at a time, however many the data arrived in.
+  size_t want = len - raw_held;
+  while (want > 0) {
+    struct evbuffer_iovec v[8];
+    int n = evbuffer_peek(in, want, &pos, v, 8);
+    if (n <= 0)
+      log_abort(this, "was not able to make a copy of received data");
+    size_t copied = 0;
+    for (int i = 0; i < n && i < 8 && want > 0; i++) {
+      size_t chunk = min(v[i].iov_len, want);
+      if (evbuffer_add(raw_received, v[i].iov_base, chunk))
+        log_abort(this, "was not able to make a copy of received data");
+      want -= chunk;
+      copied += chunk;
+    }
+    if (want > 0 &&
+        evbuffer_ptr_set(in, &pos, copied, EVBUFFER_PTR_ADD))
+      log_abort(this, "was not able to make a copy of received data");
+  }
+  raw_held = len;
+}
+
+/**
+ Passes this connection on to the worker that owns CIRCUIT_ID,
+ together with everything it has received so far, and detaches us
+ from the socket.  The caller should close this connection.
+
+ @return 0 success
+        -1 failed, please close the connection
+*/
+int
+chop_conn_t::hand_off(uint32_t circuit_id)
+{
+  unsigned int owner = worker_for_circuit(circuit_id);
+  size_t index = std::find(config->steg_targets.begin(),
+                           config->steg_targets.end(), steg->cfg())
+    - config->steg_targets.begin();
+  log_assert(index < config->steg_targets.size());
+
+  evutil_socket_t fd = bufferevent_getfd(buffer);
+  if (fd < 0)
+    return -1;
+
+  log_debug(this, "circuit %u belongs to worker %u, handing off",
+            circuit_id, owner);
+  emancipate_from_upstream();
+  bufferevent_disable(buffer, EV_READ|EV_WRITE);
+  if (bufferevent_setfd(buffer, -1))
+    return -1;
+
+  worker_handoff(owner, config, index, fd, peername, raw_received);
+  return 0;
+}
+
+int
+chop_conn_t::reject_handshake()
+{
+  //invalid handshake, if we have a transparent proxy we 
+  //we'll act as one for this connection
+
+  //so we need to axe the must send timer as the connection will be
+  //managed by the transparent proxy and also drop the connection from
+  //upstream circuit but not close it
+  emancipate_from_upstream();
+
+  if (config->transparent_proxy) {
+    log_debug("stegotorus turning into a transparent proxy.");
+    config->transparent_proxy->transparentize_connection(this, raw_received);
+    return 1;
+  }
+
+  return -1;
+}
+
+uint64_t
+chop_conn_t::source() const
+{
+  struct sockaddr_storage ss;
+  socklen_t sslen = sizeof ss;
+  evutil_socket_t fd = bufferevent_getfd(buffer);
+  if (fd < 0 || getpeername(fd, (struct sockaddr *)&ss, &sslen))
+    return 0;
+  return source_rate_limit::source_of((struct sockaddr *)&ss, sslen);
+}
+
 /**
  checks if the handshake is correctly authenticated
 
  @return 0 success
          1 failed, transparentized the connection
+         2 the circuit belongs to another worker, which now has the
+           connection; please close this one
         -1 failed, unrecoverable, please close the connection
 */
 int
@@ -1804,27 +2914,19 @@ chop_conn_t::recv_handshake()
                       HANDSHAKE_LEN) != (signed) HANDSHAKE_LEN)
     return -1;
 
-  if (!handshaker.verify_and_extract(conn_handshake, *(config->handshake_decryptor))) {
-    //invalid handshake, if we have a transparent proxy we 
-    //we'll act as one for this connection
+  if (!handshaker.verify_and_extract(conn_handshake,
+                                     *(config->handshake_decryptor),
+                                     config->strict_handshakes)) {
     log_warn("handshake authentication faild.");
-
-    //so we need to axe the must send timer as the connection will be
-    //managed by the transparent proxy and also drop the connection from
-    //upstream circuit but not close it
-    emancipate_from_upstream();
-    
-    if (config->transparent_proxy) {
-      log_debug("stegotorus turning into a transparent proxy.");
-      config->transparent_proxy->transparentize_connection(this, originally_received, received_length);
-      return 1;
-    }
-    
-    return -1;
+    config->handshake_limit.charge(source(), config->now_ms());
+    return reject_handshake();
   }
 
   circuit_id = handshaker.circuit_id;
 
+  if (worker_for_circuit(circuit_id) != worker_self())
+    return hand_off(circuit_id) ? -1 : 2;
+
   chop_circuit_table::value_type in(circuit_id, (chop_circuit_t *)0);
   std::pair<chop_circuit_table::iterator, bool> out
     = this->config->circuits.insert(in);
@@ -1843,6 +2945,27 @@ chop_conn_t::recv_handshake()
       log_warn(this, "failed to create new circuit");
       return -1;
     }
+
+    uint32_t proposed = handshaker.window_log2 < 32
+      ? uint32_t(1) << handshaker.window_log2 : 0;
+    if (!window_size_valid(proposed)) {
+      if (handshaker.window_log2)
+        log_info(this, "ignoring invalid window 2^%u",
+                 handshaker.window_log2);
+      proposed = MIN_WINDOW;
+    }
+    ck->set_window(proposed);
+    // The client learns that we piggyback ACKs when we do.
+    ck->peer_piggybacks =
+      (handshaker.features & CHOP_FEATURE_PIGGYBACK_ACK) != 0;
+    ck->peer_compresses =
+      (handshaker.features & CHOP_FEATURE_COMPRESSION) != 0;
+    ck->peer_rekeys = (handshaker.features & CHOP_FEATURE_REKEY) != 0;
+    if (!ck->peer_rekeys)
+      ck->tx_queue.forgo_rekeying();
+    if (handshaker.features & CHOP_FEATURE_CHACHA20)
+      config->set_data_ciphers(ck, true);
+
     if (circuit_open_upstream(ck)) {
       log_warn(this, "failed to begin upstream connection");
       ck->close();
@@ -1860,32 +2983,54 @@ chop_conn_t::recv_handshake()
 int
 chop_conn_t::recv()
 {
-  //TODO: This is too slow, we need to do it more cleverly.
-  //we keep a copy of value of recv_pending, in case we need to
-  //transparentize the connection
-  if (config->mode == LSN_SIMPLE_SERVER && config->transparent_proxy) {
-    received_length = evbuffer_get_length(bufferevent_get_input(buffer));
-    originally_received = new uint8_t[received_length];
-    log_assert(originally_received);
-    if (evbuffer_copyout(bufferevent_get_input(buffer), originally_received, received_length) != (ssize_t) received_length)
-      log_abort("was not able to make a copy of received data");
+  // Until the handshake succeeds we may yet need everything the
+  // client has sent, either to transparentize the connection or to
+  // hand it to another worker.  After that, nothing is kept.
+  bool holding = keeps_raw_data() && !upstream;
+  if (holding)
+    hold_raw_data();
+
+  // A source that keeps failing handshakes is not worth decoding any
+  // more of until its rate limit lets it try again.
+  bool pre_handshake = !upstream && config->mode == LSN_SIMPLE_SERVER;
+  if (pre_handshake &&
+      !config->handshake_limit.allowed(source(), config->now_ms())) {
+    log_debug(this, "source over its handshake rate");
+    int rejected = reject_handshake();
+    if (raw_received) {
+      evbuffer_free(raw_received);
+      raw_received = NULL;
+    }
+    return rejected == 1 ? 0 : -1;
   }
 
-  if (steg->receive(recv_pending)) {
-    if ((config->mode == LSN_SIMPLE_SERVER ) && config->transparent_proxy) {
+  int steg_failed = steg->receive(recv_pending);
+  if (holding)
+    raw_held = evbuffer_get_length(inbound());
+
+  if (steg_failed) {
+    if (pre_handshake)
+      config->handshake_limit.charge(source(), config->now_ms());
+    if ((config->mode == LSN_SIMPLE_SERVER ) && config->transparent_proxy &&
+        raw_received) {
       //If steg fails in recovering the data
       //then maybe it wasn't an steg data to begin with
       //so we have transparent proxy we will become 
       //transparent at this moment
       log_debug("stegotorus turning into a transparent proxy.");
-      config->transparent_proxy->transparentize_connection(this, originally_received, received_length);
+      config->transparent_proxy->transparentize_connection(this, raw_received);
 
-      delete[] originally_received;
+      evbuffer_free(raw_received);
+      raw_received = NULL;
       return 0;
     }
     else
       return -1;
   }
+  // Receiving may have let the steg module answer.
+  if (upstream)
+    upstream->update_room(this);
+
   // If that succeeded but did not copy anything into recv_pending,
   // wait for more data.
   if (evbuffer_get_length(recv_pending) == 0)
@@ -1906,8 +3051,10 @@ chop_conn_t::recv()
 
     // We're the server. Try to receive a handshake.
     int handshake_result = recv_handshake();
-    if (config->transparent_proxy) 
-      delete [] originally_received; //done with this
+    if (raw_received) { //done with this
+      evbuffer_free(raw_received);
+      raw_received = NULL;
+    }
 
     switch(handshake_result) 
       {
@@ -1915,6 +3062,10 @@ chop_conn_t::recv()
         //this connection was transparentized return 0 and don't 
         //worry about it any more
         return 0;
+      case 2:
+        //another worker has taken over the socket
+        close();
+        return 0;
       case -1:
         //unrecoverable error, close the connection
         return -1;
@@ -1938,6 +3089,10 @@ chop_conn_t::recv()
   }
 
   log_debug(this, "circuit to %s", upstream->up_peer);
+  // The chains of recv_pending that a block body spans; as many as the
+  // peer's writes made, so these live on the heap.
+  std::vector<struct evbuffer_iovec> vec;
+  std::vector<gcm_segment> segs;
   for (;;) {
     size_t avail = evbuffer_get_length(recv_pending);
     if (avail == 0)
@@ -1957,11 +3112,23 @@ chop_conn_t::recv()
       break;
     }
 
-    header hdr(ciphr_hdr, *upstream->recv_hdr_crypt,
-               upstream->recv_queue.window());
+    // The block is in the receive window's key epoch, as a rule, or
+    // in the next one, ahead of the window, or in the one before, if
+    // it was retransmitted; only the right keys make a valid header.
+    unsigned int k = key_slot(upstream->recv_queue.window());
+    if (!upstream->recv_hdr_crypt[k])
+      k ^= 1;
+    uint32_t window = upstream->recv_queue.window();
+    uint32_t window_size = upstream->recv_queue.size();
+    header hdr(ciphr_hdr, *upstream->recv_hdr_crypt[k], window, window_size);
+    if (!hdr.valid() && upstream->recv_hdr_crypt[k ^ 1]) {
+      k ^= 1;
+      hdr = header(ciphr_hdr, *upstream->recv_hdr_crypt[k],
+                   window, window_size);
+    }
     if (!hdr.valid()) {
       uint8_t c[HEADER_LEN];
-      upstream->recv_hdr_crypt->decrypt(c, ciphr_hdr);
+      upstream->recv_hdr_crypt[k]->decrypt(c, ciphr_hdr);
       char fallbackbuf[4];
       log_info(this, "invalid block header: "
                "%02x%02x%02x%02x|%02x%02x|%02x%02x|%s|%02x|"
@@ -1990,17 +3157,55 @@ chop_conn_t::recv()
       break;
     }
 
-    uint8_t decodebuf[MAX_BLOCK_SIZE];
-    if (evbuffer_drain(recv_pending, HEADER_LEN) ||
-        evbuffer_remove(recv_pending, decodebuf, hdr.total_len() - HEADER_LEN)
-        != (ssize_t)(hdr.total_len() - HEADER_LEN)) {
-      log_warn(this, "failed to copy block to decode buffer");
+    // Decrypt the block straight out of recv_pending into space
+    // reserved in the evbuffer that will carry its data to the
+    // reassembly queue; only then is it drained from recv_pending.
+    size_t body_len = hdr.total_len() - HEADER_LEN;
+    struct evbuffer_ptr body;
+    if (evbuffer_ptr_set(recv_pending, &body, HEADER_LEN, EVBUFFER_PTR_SET)) {
+      log_warn(this, "failed to locate block body");
+      return -1;
+    }
+    int nvec = evbuffer_peek(recv_pending, body_len, &body, NULL, 0);
+    if (nvec <= 0) {
+      log_warn(this, "failed to locate block body");
+      return -1;
+    }
+    vec.resize(nvec);
+    segs.resize(nvec);
+    evbuffer_peek(recv_pending, body_len, &body, &vec[0], nvec);
+    for (int i = 0; i < nvec; i++) {
+      segs[i].data = (const uint8_t *)vec[i].iov_base;
+      segs[i].len = vec[i].iov_len;
+    }
+
+    evbuffer *data = evbuffer_new();
+    struct evbuffer_iovec dv;
+    dv.iov_base = 0;
+    dv.iov_len = hdr.dlen();
+    if (!data ||
+        (hdr.dlen() && (evbuffer_reserve_space(data, hdr.dlen(), &dv, 1) != 1 ||
+                        dv.iov_len < hdr.dlen()))) {
+      log_warn(this, "failed to allocate space for block data");
+      if (data)
+        evbuffer_free(data);
       return -1;
     }
-    if (upstream->recv_crypt->decrypt(decodebuf,
-                                      decodebuf, hdr.total_len() - HEADER_LEN,
-                                      ciphr_hdr, HEADER_LEN)) {
+    dv.iov_len = hdr.dlen();
+    uint8_t *decoded = (uint8_t *)dv.iov_base;
+
+    if (upstream->recv_crypt[k]->decrypt_segments(decoded, hdr.dlen(),
+                                                  &segs[0], nvec, body_len,
+                                                  ciphr_hdr, HEADER_LEN)) {
       log_info("MAC verification failure");
+      evbuffer_free(data);
+      return -1;
+    }
+
+    if ((hdr.dlen() && evbuffer_commit_space(data, &dv, 1)) ||
+        evbuffer_drain(recv_pending, hdr.total_len())) {
+      log_warn(this, "failed to extract data from receive buffer");
+      evbuffer_free(data);
       return -1;
     }
 
@@ -2025,20 +3230,13 @@ chop_conn_t::recv()
         if (config->trace_packet_data && hdr.dlen())
           {
             char* data_4_log =  new char[hdr.dlen() + 1];
-            memcpy(data_4_log, decodebuf, hdr.dlen());
+            memcpy(data_4_log, decoded, hdr.dlen());
             data_4_log[hdr.dlen()] = '\0';
             log_debug("Data received: %s",  data_4_log);
             
           }
       }
     
-    evbuffer *data = evbuffer_new();
-    if (!data || (hdr.dlen() && evbuffer_add(data, decodebuf, hdr.dlen()))) {
-      log_warn(this, "failed to extract data from decode buffer");
-      evbuffer_free(data);
-      return -1;
-    }
-
     if (upstream->recv_block(hdr.seqno(), hdr.opcode(), data, this->steg->cfg()))
       return -1; // insert() logs an error
   }
@@ -2083,10 +3281,7 @@ void
 chop_conn_t::cease_transmission()
 {
   no_more_transmissions = true;
-  if (must_send_timer) {
-    evtimer_del(must_send_timer);
-    must_send_timer = NULL;
-  }
+  must_send_timer.disarm();
   
   conn_do_flush(this);
 }
@@ -2094,25 +3289,14 @@ chop_conn_t::cease_transmission()
 void
 chop_conn_t::transmit_soon(unsigned long milliseconds)
 {
-  struct timeval tv;
-
   log_debug(this, "must send within %lu milliseconds", milliseconds);
-
-  tv.tv_sec = milliseconds / 1000;
-  tv.tv_usec = (milliseconds % 1000) * 1000;
-
-  if (!must_send_timer)
-    must_send_timer = evtimer_new(config->base, must_send_timeout, this);
-  evtimer_add(must_send_timer, &tv);
+  config->timers()->arm(&must_send_timer, milliseconds);
 }
 
 void
 chop_conn_t::send()
 {
-  if (must_send_timer) {
-    evtimer_del(must_send_timer);
-    must_send_timer = NULL;
-  }
+  must_send_timer.disarm();
 
   if (!steg) {
     log_warn(this, "send() called with no steg module available");
@@ -2183,11 +3367,11 @@ chop_conn_t::send()
 bool
 chop_conn_t::must_send_p() const
 {
-  return must_send_timer && evtimer_pending(must_send_timer, 0);
+  return must_send_timer.pending();
 }
 
 /* static */ void
-chop_conn_t::must_send_timeout(evutil_socket_t, short, void *arg)
+chop_conn_t::must_send_timeout(void *arg)
 {
   static_cast<chop_conn_t *>(arg)->send();
 }
@@ -8,6 +8,7 @@
 #include "connections.h"
 
 #include <event2/buffer.h>
+#include <algorithm>
 #include <iomanip>
 #include <limits>
 
@@ -41,6 +42,13 @@ opname(unsigned int o, char fallbackbuf[c_genric_opname_buffer_size])
   case op_FIN: return "FIN";
   case op_RST: return "RST";
   case op_ACK: return "ACK";
+  case op_ACK_DAT: return "ACK+DAT";
+  case op_ACK_FIN: return "ACK+FIN";
+  case op_RKEY: return "RKEY";
+  case op_ZDAT: return "ZDAT";
+  case op_ZFIN: return "ZFIN";
+  case op_ACK_ZDAT: return "ACK+ZDAT";
+  case op_ACK_ZFIN: return "ACK+ZFIN";
   case op_STEG0: return "STEG DAT";
   case op_STEG_FIN: return "STEG FIN";
   default:
@@ -77,7 +85,7 @@ debug_ack_contents(evbuffer *payload, std::ostream& os)
     return;
 
   size_t i;
-  for (i = 0; i < 32; i++) {
+  for (i = 0; i < MAX_WINDOW / 8; i++) {
     if (i + 4 >= len)
       break;
 
@@ -95,9 +103,32 @@ debug_ack_contents(evbuffer *payload, std::ostream& os)
     os << (unsigned int)buf[i];
 }
 
+const uint8_t opcode_validity[op_LAST + 1] = {
+  // op_DAT -- op_RKEY
+  0, 1, 1, 1, 1, 1, 1, 1,  0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0,  0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0,  0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0,  0, 0, 0, 0, 0, 0, 0, 0,
+  // op_ZDAT, op_ZFIN, op_ACK_ZDAT, op_ACK_ZFIN
+  0, 1, 1, 0, 0, 1, 1, 0,  0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0,  0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0,  0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0,  0, 0, 0, 0, 0, 0, 0, 0,
+  // op_STEG0 -- op_LAST
+  1, 1, 1, 1, 1, 1, 1, 1,  1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1,  1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1,  1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1,  1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1,  1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1,  1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1,  1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1,  1, 1, 1, 1, 1, 1, 1, 1
+};
+
 // Note: this function must take exactly the same amount of time to
 // execute regardless of its inputs.
-header::header(const uint8_t *ciphr, ecb_decryptor &dc, uint32_t window)
+header::header(const uint8_t *ciphr, ecb_decryptor &dc, uint32_t window,
+               uint32_t window_size)
 {
   uint8_t clear[16];
   dc.decrypt(clear, ciphr);
@@ -118,12 +149,15 @@ header::header(const uint8_t *ciphr, ecb_decryptor &dc, uint32_t window)
   bool checkOK = !(clear[10] | clear[11] | clear[12] |
                    clear[13] | clear[14] | clear[15]);
 
-  uint32_t delta = s_ - window;
-  bool deltaOK = !(delta & ~uint32_t(0xFF));
+  // Sequence numbers wrap, so the window may straddle two key
+  // epochs; the delta is taken modulo 2^32 either way.
+  uint32_t delta = s_ - (window - window_size);
+  bool deltaOK = !(delta & ~(2 * window_size - 1));
 
-  bool fOK = ((f >= op_RESERVED0) & (f < op_STEG0));
+  bool fOK = opcode_validity[f_] != 0;
 
-  bool ok = (checkOK | deltaOK | fOK);
+  // This is also what tells the keys of two key epochs apart.
+  bool ok = checkOK & deltaOK & fOK;
 
   if (ok) {
     s = s_;
@@ -144,7 +178,13 @@ void
 header::encode(uint8_t *ciphr, ecb_encryptor &ec) const
 {
   uint8_t clear[16];
+  pack(clear);
+  ec.encrypt(ciphr, clear);
+}
 
+void
+header::pack(uint8_t *clear) const
+{
   clear[ 0] = (s >> 24) & 0xFF;
   clear[ 1] = (s >> 16) & 0xFF;
   clear[ 2] = (s >>  8) & 0xFF;
@@ -166,8 +206,6 @@ header::encode(uint8_t *ciphr, ecb_encryptor &ec) const
   clear[13] = 0;
   clear[14] = 0;
   clear[15] = 0;
-
-  ec.encrypt(ciphr, clear);
 }
 
 bool
@@ -180,10 +218,12 @@ header::prepare_retransmit(uint16_t new_plen)
   return true;
 }
 
-ack_payload::ack_payload(evbuffer *wire, uint32_t hfloor)
-  : hsn_(-1), maxusedbyte(0)
+ack_payload::ack_payload(evbuffer *wire, uint32_t hfloor,
+                         uint32_t window_size)
+  : hsn_(0), valid_(false), maxusedbyte(0), nbits(window_size)
 {
-  memset(window, 0, sizeof window);
+  log_assert(window_size_valid(window_size));
+  memset(window, 0, nbits / 8);
 
   uint8_t hsnwire[4];
   if (evbuffer_remove(wire, hsnwire, 4) != 4) {
@@ -196,16 +236,16 @@ ack_payload::ack_payload(evbuffer *wire, uint32_t hfloor)
           uint32_t(hsnwire[2]) <<  8 |
           uint32_t(hsnwire[3]));
 
-  maxusedbyte = evbuffer_remove(wire, window, sizeof window);
+  maxusedbyte = evbuffer_remove(wire, window, nbits / 8);
+  valid_ = true;
 
   // there shouldn't be any _more_ data than that, the hsn should
-  // be in the range [hfloor-1, hfloor+256), and the first bit of the
-  // window should be zero.
+  // be in the range [hfloor-1, hfloor+window size), modulo 2^32, and
+  // the first bit of the window should be zero.
   if (evbuffer_get_length(wire) > 0 ||
-      (hfloor >= 1 && hsn_ < hfloor-1) ||
-      hsn_ >= hfloor+256 ||
+      hsn_ + 1 - hfloor > nbits ||
       block_received(hsn_ + 1))
-    hsn_ = -1; // invalidate
+    valid_ = false;
 
   evbuffer_free(wire);
 }
@@ -239,90 +279,170 @@ ack_payload::serialize() const
   return wire;
 }
 
-transmit_queue::transmit_queue(bool intend_to_retransmit = true)
-  : next_to_ack(0), next_to_send(0), overwrite_allowed(not intend_to_retransmit)
+void
+rtt_estimator::sample(uint32_t rtt)
+{
+  if (rtt == 0)
+    rtt = 1;
+
+  if (!srtt_) {
+    srtt_ = rtt;
+    rttvar_ = rtt / 2;
+  } else {
+    uint32_t err = srtt_ > rtt ? srtt_ - rtt : rtt - srtt_;
+    rttvar_ = (3 * uint64_t(rttvar_) + err) / 4;
+    srtt_ = (7 * uint64_t(srtt_) + rtt) / 8;
+  }
+
+  uint64_t rto = srtt_ + 4 * uint64_t(rttvar_);
+  rto_ = rto < MIN_RTO ? MIN_RTO : rto > MAX_RTO ? MAX_RTO : rto;
+}
+
+transmit_queue::transmit_queue(bool intend_to_retransmit = true,
+                               uint32_t window_size)
+  : cbuf(0), mask(0), next_to_ack(0), next_to_send(0),
+    overwrite_allowed(not intend_to_retransmit),
+    rekey_(true), rekeying(false), rekey_seqno(0), key_limit(KEY_EPOCH),
+    cc_(congestion_control::create("none")), in_flight_(0)
 {
+  resize(window_size);
 }
 
 transmit_queue::~transmit_queue()
 {
-  for (int i = 0; i < 256; i++)
+  for (uint32_t i = 0; i <= mask; i++)
     if (cbuf[i].data)
       evbuffer_free(cbuf[i].data);
+  delete [] cbuf;
+  delete cc_;
+}
+
+void
+transmit_queue::set_congestion_control(congestion_control *cc)
+{
+  log_assert(cc);
+  delete cc_;
+  cc_ = cc;
+}
+
+void
+transmit_queue::resize(uint32_t window_size)
+{
+  log_assert(window_size_valid(window_size));
+  log_assert(next_to_send == 0);
+
+  if (cbuf && window_size == size())
+    return;
+  delete [] cbuf;
+  cbuf = new transmit_elt[window_size];
+  mask = window_size - 1;
 }
 
 uint32_t
-transmit_queue::enqueue(opcode_t f, evbuffer *data, uint16_t padding)
+transmit_queue::enqueue(opcode_t f, evbuffer *data, uint16_t padding,
+                        size_t overhead)
 {
   log_assert(opcode_valid(f));
   log_assert(evbuffer_get_length(data) <= numeric_limits<uint16_t>::max());
   log_assert(!full());
 
   uint32_t seqno = next_to_send;
-  transmit_elt &elt = cbuf[seqno & 0xFF];
+  transmit_elt &elt = slot(seqno);
 
   if (elt.data) {
+    leave_flight(elt);
     evbuffer_free(elt.data);
     elt.data = 0;      
   }
 
   elt.hdr = header(seqno, evbuffer_get_length(data), padding, f);
   elt.data = data;
+  elt.sent_at = 0;
+  elt.sack_skips = 0;
+  elt.lost = false;
+  elt.charged = f != op_ACK && f != op_RKEY && elt.hdr.dlen() > overhead;
+
+  // Without ACKs, there is no knowing whether the peer got the keys;
+  // the block might as well be taken as acknowledged.
+  if (f == op_RKEY) {
+    if (overwrite_allowed) {
+      key_limit += KEY_EPOCH;
+    } else {
+      rekeying = true;
+      rekey_seqno = seqno;
+    }
+  }
 
   next_to_send++;
   return seqno;
 }
 
 int
-transmit_queue::transmit(transmit_elt &elt,
+transmit_queue::transmit(transmit_elt *const *elts, size_t n,
                          evbuffer *output,
                          ecb_encryptor &ec,
                          gcm_encryptor &gc)
 {
-  log_assert(elt.data);
+  log_assert(n > 0);
 
-  struct evbuffer *block = evbuffer_new();
-  if (!block) {
-    log_warn("memory allocation failure");
-    return -1;
+  size_t total = 0;
+  for (size_t i = 0; i < n; i++) {
+    log_assert(elts[i]->data);
+    total += elts[i]->hdr.total_len();
   }
 
-  size_t d = elt.hdr.dlen();
-  size_t p = elt.hdr.plen();
-  size_t blocksize = elt.hdr.total_len();
   struct evbuffer_iovec v;
-  if (evbuffer_reserve_space(block, blocksize, &v, 1) != 1 ||
-      v.iov_len < blocksize) {
+  if (evbuffer_reserve_space(output, total, &v, 1) != 1 ||
+      v.iov_len < total) {
     log_warn("memory allocation failure");
-    evbuffer_free(block);
     return -1;
   }
-  v.iov_len = blocksize;
-
-  elt.hdr.encode((uint8_t *)v.iov_base, ec);
+  v.iov_len = total;
 
-  uint8_t encodebuf[d + p];
-  if (evbuffer_copyout(elt.data, encodebuf, d) != (ssize_t)d) {
-    log_warn("failed to extract data");
-    evbuffer_free(block);
-    return -1;
-  }
-  memset(encodebuf + d, 0, p);
-  gc.encrypt((uint8_t *)v.iov_base + HEADER_LEN,
-             encodebuf, d + p, (uint8_t *)v.iov_base, HEADER_LEN);
-  if (evbuffer_commit_space(block, &v, 1)) {
-    log_warn("failed to commit block buffer");
-    evbuffer_free(block);
-    return -1;
+  // The headers go through ECB together; each encrypted header is
+  // then the GCM nonce for its own block.
+  uint8_t clear[TRANSMIT_BATCH_MAX * HEADER_LEN];
+  uint8_t ciphr[TRANSMIT_BATCH_MAX * HEADER_LEN];
+  gcm_block blocks[TRANSMIT_BATCH_MAX];
+  uint8_t *p = (uint8_t *)v.iov_base;
+  for (size_t base = 0; base < n; base += TRANSMIT_BATCH_MAX) {
+    size_t m = std::min(n - base, TRANSMIT_BATCH_MAX);
+    for (size_t i = 0; i < m; i++)
+      elts[base + i]->hdr.pack(clear + i * HEADER_LEN);
+    ec.encrypt_blocks(ciphr, clear, m);
+
+    for (size_t i = 0; i < m; i++) {
+      transmit_elt &elt = *elts[base + i];
+      size_t d = elt.hdr.dlen();
+
+      // The block body is encrypted straight out of the queued data;
+      // this is normally a single chunk already, and if not, it stays
+      // contiguous for any retransmissions.
+      const uint8_t *data = (const uint8_t *)"";
+      if (d > 0) {
+        data = evbuffer_pullup(elt.data, d);
+        if (!data || evbuffer_get_length(elt.data) < d) {
+          log_warn("failed to extract data");
+          return -1;
+        }
+      }
+
+      memcpy(p, ciphr + i * HEADER_LEN, HEADER_LEN);
+      blocks[i].out = p + HEADER_LEN;
+      blocks[i].in = data;
+      blocks[i].inlen = d;
+      blocks[i].padlen = elt.hdr.plen();
+      blocks[i].nonce = p;
+      blocks[i].nlen = HEADER_LEN;
+      p += elt.hdr.total_len();
+    }
+    gc.encrypt_batch(blocks, m);
   }
 
-  if (evbuffer_add_buffer(output, block)) {
-    log_warn("failed to transfer block to output queue");
-    evbuffer_free(block);
+  if (evbuffer_commit_space(output, &v, 1)) {
+    log_warn("failed to commit block buffer");
     return -1;
   }
-
-  evbuffer_free(block);
   return 0;
 }
 
@@ -341,59 +461,137 @@ transmit_queue::retransmit(transmit_elt &elt,
 }
 
 int
-transmit_queue::process_ack(evbuffer *data)
+transmit_queue::process_ack(evbuffer *data, uint64_t now)
 {
 
-  ack_payload ack(data, next_to_ack);
+  ack_payload ack(data, next_to_ack, size());
 
   ack.log_info_window();
 
   if (!ack.valid()) return -1;
 
   uint32_t hsn = ack.hsn();
-  if (hsn >= next_to_send) return -1;
-
-  for (; next_to_ack <= hsn; next_to_ack++) {
-    uint8_t j = next_to_ack & 0xFF;
-    if (cbuf[j].data) {
-      evbuffer_free(cbuf[j].data);
-      cbuf[j].data = 0;
+  if (hsn + 1 - next_to_ack > next_to_send - next_to_ack) return -1;
+
+  // The latest transmission among the blocks acknowledged now, and
+  // among those of them that went out only once and so can be timed.
+  uint64_t latest_sent = 0;
+  uint64_t latest_timed = 0;
+  size_t acked = 0;
+
+  for (uint32_t i = next_to_ack; i != next_to_send; i++) {
+    transmit_elt &elt = slot(i);
+    if (!elt.data || !ack.block_received(i))
+      continue;
+
+    if (rekeying && i == rekey_seqno) {
+      rekeying = false;
+      key_limit += KEY_EPOCH;
     }
+
+    if (elt.sent_at > latest_sent)
+      latest_sent = elt.sent_at;
+    if (elt.hdr.rcount() == 0 && elt.sent_at > latest_timed)
+      latest_timed = elt.sent_at;
+
+    if (in_flight(elt))
+      acked += elt.hdr.total_len();
+    leave_flight(elt);
+    evbuffer_free(elt.data);
+    elt.data = 0;
   }
 
-  if (next_to_ack == next_to_send)
-    return 0;
+  next_to_ack = hsn + 1;
+
+  if (latest_timed && now >= latest_timed)
+    rtt_.sample(now - latest_timed);
+
+  // Whatever went out before a block that made it, and did not make
+  // it itself, was probably lost.
+  if (latest_sent)
+    for (uint32_t i = next_to_ack; i != next_to_send; i++) {
+      transmit_elt &elt = slot(i);
+      if (elt.data && elt.sent_at && !elt.lost &&
+          elt.sent_at <= latest_sent &&
+          ++elt.sack_skips >= FAST_RETRANSMIT_SKIPS) {
+        leave_flight(elt);
+        elt.lost = true;
+        cc_->on_loss(elt.sent_at, now);
+      }
+    }
+
+  if (acked)
+    cc_->on_ack(acked, latest_sent, rtt_.srtt(), now);
+  return 0;
+}
+
+uint64_t
+transmit_queue::next_deadline() const
+{
+  uint64_t deadline = 0;
+  for (uint32_t i = next_to_ack; i != next_to_send; i++) {
+    const transmit_elt &elt = slot(i);
+    if (elt.data && elt.sent_at && !elt.lost &&
+        (!deadline || elt.sent_at + rtt_.rto() < deadline))
+      deadline = elt.sent_at + rtt_.rto();
+  }
+  return deadline;
+}
 
-  for (uint32_t i = next_to_ack; i < next_to_send; i++) {
-    uint8_t j = i & 0xFF;
-    if (cbuf[j].data && ack.block_received(i)) {
-      evbuffer_free(cbuf[j].data);
-      cbuf[j].data = 0;
+bool
+transmit_queue::expire(uint64_t now)
+{
+  bool expired = false;
+  for (uint32_t i = next_to_ack; i != next_to_send; i++) {
+    transmit_elt &elt = slot(i);
+    if (elt.data && elt.sent_at && !elt.lost &&
+        now >= elt.sent_at + rtt_.rto()) {
+      leave_flight(elt);
+      elt.lost = true;
+      expired = true;
     }
   }
 
-  return 0;
+  if (expired) {
+    rtt_.backoff();
+    cc_->on_timeout(now);
+  }
+  return expired;
 }
 
-reassembly_queue::reassembly_queue()
-  : next_to_process(0), count(0)
+reassembly_queue::reassembly_queue(uint32_t window_size)
+  : cbuf(0), mask(0), next_to_process(0), count(0)
 {
-  memset(cbuf, 0, sizeof cbuf);
+  resize(window_size);
 }
 
 reassembly_queue::~reassembly_queue()
 {
-  if (count == 0) return; // short cut for ideal case
-  for (int i = 0; i < 256; i++)
-    if (cbuf[i].data)
-      evbuffer_free(cbuf[i].data);
+  if (count != 0) // short cut for ideal case
+    for (uint32_t i = 0; i <= mask; i++)
+      if (cbuf[i].data)
+        evbuffer_free(cbuf[i].data);
+  delete [] cbuf;
+}
+
+void
+reassembly_queue::resize(uint32_t window_size)
+{
+  log_assert(window_size_valid(window_size));
+  log_assert(count == 0 && next_to_process == 0);
+
+  if (cbuf && window_size == size())
+    return;
+  delete [] cbuf;
+  cbuf = new reassembly_elt[window_size];
+  mask = window_size - 1;
 }
 
 reassembly_elt
 reassembly_queue::remove_next()
 {
   reassembly_elt rv = { 0, op_DAT, NULL, false };
-  uint8_t front = next_to_process & 0xFF;
+  uint32_t front = next_to_process & mask;
   char fallbackbuf[4];
 
   log_debug("next_to_process=%d data=%p op=%s",
@@ -416,13 +614,12 @@ bool
 reassembly_queue::insert(uint32_t seqno, opcode_t op, 
                          evbuffer *data, steg_config_t *steg_cfg)
 {
-  if (seqno - window() > 255) {
+  if (seqno - window() > mask) {
     log_debug("block outside receive window");
     evbuffer_free(data);
     return false;
   }
-  uint8_t front = next_to_process & 0xFF;
-  uint8_t pos = front + (seqno - window());
+  uint32_t pos = seqno & mask;
   if (cbuf[pos].data) {
     log_debug("duplicate block");
     evbuffer_free(data);
@@ -440,7 +637,7 @@ void
 reassembly_queue::reset()
 {
   log_assert(count == 0);
-  for (int i = 0; i < 256; i++) {
+  for (uint32_t i = 0; i <= mask; i++) {
     log_assert(!cbuf[i].data);
   }
   next_to_process = 0;
@@ -449,16 +646,19 @@ reassembly_queue::reset()
 evbuffer *
 reassembly_queue::gen_ack() //const
 {
-  ack_payload payload(next_to_process == 0 ? 0 : next_to_process - 1);
-  uint8_t front = next_to_process & 0xFF;
-  uint8_t pos = front;
-  do {
-    if (cbuf[pos].data) {
-      payload.set_block_received(next_to_process + (pos - front));
-      cbuf[pos].do_ack = false;
+  ack_payload payload(next_to_process - 1, size());
+  // Stop as soon as every queued block has been seen: with a large
+  // window, the queue is mostly empty.
+  uint32_t seen = 0;
+  for (uint32_t seqno = next_to_process;
+       seen < count && seqno - next_to_process <= mask; seqno++) {
+    reassembly_elt &elt = cbuf[seqno & mask];
+    if (elt.data) {
+      payload.set_block_received(seqno);
+      elt.do_ack = false;
+      seen++;
     }
-    pos++;
-  } while (pos != front);
+  }
 
   return payload.serialize();
 }
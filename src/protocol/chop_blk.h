@@ -8,6 +8,8 @@
 #include <tr1/unordered_set>
 #include <ostream>
 
+#include "chop_congestion.h"
+
 struct steg_config_t;
 
 namespace chop_blk
@@ -24,24 +26,26 @@ namespace chop_blk
 
    The header is encrypted with AES in ECB mode: this is safe because
    the header is exactly one AES block long, the sequence number +
-   retransmit count is never repeated, the header-encryption key is
-   not used for anything else, and the high 24 bits of the sequence
-   number, plus the check field, constitute an 72-bit MAC.  The
-   receiver maintains a 256-element sliding window of acceptable
-   sequence numbers, which begins one after the highest sequence
-   number so far _processed_ (not received).  If the sequence number
-   is outside this window, or the check field is not all-bits-zero,
-   the packet is discarded.  An attacker's odds of being able to
-   manipulate the D, P, F, or R fields or the low bits of the sequence
-   number are therefore less than one in 2^72.  (This is weak compared
-   to our default security parameter of 2^128, but should be sufficient
-   for the protection of this small amount of data.)
-
-   Unlike TCP, our sequence numbers always start at zero on a new (or
-   freshly rekeyed) circuit, and increment by one per _block_, not per
-   byte of data.  Furthermore, they do not wrap: a rekeying cycle
-   (which resets the sequence number) is required to occur before the
-   highest-received sequence number reaches 2^32.
+   retransmit count is never repeated under one key, the
+   header-encryption key is not used for anything else, and the check
+   field, plus the opcode, constitute a MAC of more than 48 bits.  If
+   the check field is not all-bits-zero, or the opcode is not defined,
+   the packet is rejected.  The receiver maintains a sliding window of
+   acceptable sequence numbers, 256 to 32768 of them (a power of two,
+   agreed upon in the circuit's handshake), which begins one after the
+   highest sequence number so far _processed_ (not received); packets
+   outside it are discarded.  (This is weak compared to our default
+   security parameter of 2^128, but should be sufficient for the
+   protection of this small amount of data.)
+
+   Unlike TCP, our sequence numbers always start at zero on a new
+   circuit, and increment by one per _block_, not per byte of data.
+   They wrap around from 2^32-1 to zero, and are compared modulo 2^32.
+   To keep sequence numbers from repeating under one key, each half of
+   the sequence space, or key epoch, has keys of its own: the sender
+   announces the next epoch's keys in an op_RKEY block halfway through
+   the current one, and does not go past the end of the current one
+   until that block is acknowledged (see below).
 
    Following the header are two variable-length payload sections,
    "data" and "padding", whose length in bytes are given by the D and
@@ -62,6 +66,37 @@ const size_t MAX_BLOCK_SIZE = MIN_BLOCK_SIZE + SECTION_LEN*2;
 
 //const size_t HANDSHAKE_LEN; //defined in the ChopHandshaker = sizeof(uint32_t);
 
+/* Bounds on the size of the window of sequence numbers which may be
+   in flight.  Window sizes are powers of two.  MIN_WINDOW is also
+   what a peer that does not announce a window gets. */
+const uint32_t MIN_WINDOW = 256;
+const uint32_t MAX_WINDOW = 32768;
+
+/** True if W is a window size the protocol allows. */
+inline bool
+window_size_valid(uint32_t w)
+{
+  return w >= MIN_WINDOW && w <= MAX_WINDOW && !(w & (w - 1));
+}
+
+/* Retransmission timeout bounds, in milliseconds (cf. RFC 6298).  The
+   cover channel answers on its own schedule, so these are generous. */
+const uint32_t INITIAL_RTO = 3000;
+const uint32_t MIN_RTO = 1000;
+const uint32_t MAX_RTO = 60000;
+
+/* A block is presumed lost, without waiting for its timeout, once
+   this many ACKs have acknowledged blocks sent after it but not it.
+   Blocks travel over several connections and may overtake each other,
+   so one such ACK is not enough. */
+const unsigned int FAST_RETRANSMIT_SKIPS = 2;
+
+/* Received blocks are acknowledged within this many milliseconds (by
+   default; see --ack-delay) even if not enough of them have piled up
+   to be worth an ACK of their own, and no block going the other way
+   could carry it; the peer's congestion window depends on it. */
+const uint32_t ACK_DELAY = 200;
+
 enum opcode_t
 {
   op_XXX = 0,       // Permanently invalid opcode
@@ -69,7 +104,14 @@ enum opcode_t
   op_FIN = 2,       // No further transmissions (pass data along if any)
   op_RST = 3,       // Protocol error, close circuit now
   op_ACK = 4,       // Acknowledge data received
-  op_RESERVED0 = 5, // 4 -- 127 reserved for future definition
+  op_ACK_DAT = 5,   // ACK followed by data to pass along (see below)
+  op_ACK_FIN = 6,   // ACK followed by the last data to pass along
+  op_RKEY = 7,      // Keys for the next key epoch (see below)
+  op_RESERVED0 = 8, // 8 -- 127 reserved for future definition, but:
+  op_ZDAT = 65,     // op_DAT, op_FIN, op_ACK_DAT and op_ACK_FIN with
+  op_ZFIN = 66,     // op_COMPRESSED set: the data are compressed
+  op_ACK_ZDAT = 69, // (see below)
+  op_ACK_ZFIN = 70,
   op_STEG0 = 128,   // 128 -- 255 reserved for steganography modules
   op_STEG_FIN = 129,
   op_LAST = 255
@@ -82,17 +124,58 @@ enum opcode_t
  */
 extern const char *opname(unsigned int o, char fallbackbuf[4]);
 
+/* The data section of an op_ACK_DAT or op_ACK_FIN block begins with
+   the length of an ACK payload, as a 16-bit number in network byte
+   order, followed by the ACK payload.  The rest is handled as the data
+   section of an op_DAT or op_FIN block respectively.  This lets an ACK
+   ride along with data going the other way instead of taking a block
+   (and with most steg modules, a cover) of its own.  Only peers that
+   said they understand these opcodes get them; see chop_handshaker.h. */
+const size_t PIGGYBACK_LEN_LEN = 2;
+
+/* With op_COMPRESSED set, the data of an op_DAT, op_FIN, op_ACK_DAT
+   or op_ACK_FIN block (after the piggybacked ACK, if any) are a zlib
+   stream (RFC 1950) of at most COMPRESS_MAX_INPUT bytes.  The sender
+   decides block by block whether compression pays: it does when the
+   cover leaves less room than there are data waiting, and they
+   compress.  Blocks with less room for data than COMPRESS_MIN_DATA are
+   not tried.  Only peers that asked for compressed blocks get them;
+   see chop_handshaker.h. */
+const unsigned int op_COMPRESSED = 64;
+const size_t COMPRESS_MAX_INPUT = 4 * SECTION_LEN;
+const size_t COMPRESS_MIN_DATA = 128;
+
+/* Key epochs are KEY_EPOCH blocks long; the keys for a block are in
+   slot key_slot(seqno) of the two each side keeps per direction.  The
+   data section of an op_RKEY block is REKEY_NONCE_LEN random bytes,
+   from which, with the passphrase, both sides derive the sender's keys
+   for the epoch after the block's own (see chop.cc).  The sender
+   installs them in the other slot, which the epoch before last had,
+   on sending the block; the receiver on receiving it, which it must
+   have done for the block to be acknowledged. */
+const uint32_t KEY_EPOCH = 0x80000000u;
+const size_t REKEY_NONCE_LEN = 32;
+
+inline unsigned int
+key_slot(uint32_t seqno)
+{
+  return seqno / KEY_EPOCH;
+}
+
 /**
  * Decode an ACK payload (directly from the wire format) and report
  * its contents in human-readable form.
  */
 extern void debug_ack_contents(evbuffer *payload, std::ostream& os);
 
+/* Nonzero for the opcodes a block may carry.  A table, so that
+   checking an opcode takes the same time whatever it is. */
+extern const uint8_t opcode_validity[op_LAST + 1];
+
 inline bool
 opcode_valid(unsigned int o)
 {
-  return ((o > op_XXX && o < op_RESERVED0) ||
-          (o >= op_STEG0 && o <= op_LAST));
+  return (o <= op_LAST) & (opcode_validity[o & op_LAST] != 0);
 }
 
 class header
@@ -118,11 +201,21 @@ public:
   }
 
   // Decode from wire format.  'ciphr' must point to 16 bytes of data.
-  header(const uint8_t *ciphr, ecb_decryptor &dc, uint32_t window);
+  // 'window' is the lowest sequence number the receiver still wants
+  // and 'window_size' (a power of two) the number of acceptable ones;
+  // retransmissions of up to 'window_size' blocks already received
+  // pass too.  The header is also invalid if 'dc' is not the key it
+  // was encrypted with, or it was tampered with.
+  header(const uint8_t *ciphr, ecb_decryptor &dc, uint32_t window,
+         uint32_t window_size);
 
   // Encode to wire format.  'ciphr' must point to 16 bytes of space.
   void encode(uint8_t *ciphr, ecb_encryptor &ec) const;
 
+  // Write the unencrypted wire format to 'clear', which must point to
+  // 16 bytes of space.  Used to encrypt several headers at once.
+  void pack(uint8_t *clear) const;
+
   // Returns false if incrementing the retransmit count has caused it
   // to wrap around to zero.  If this happens, we have to stop trying
   // to retransmit the block.
@@ -149,39 +242,46 @@ public:
 /**
  * An ACK payload begins with a 32-bit number (network byte order as
  * usual) which is the highest sequence number so far processed
- * (henceforth HSN).  After that are up to 32 octets of bitmask, laid
- * out in *little*-endian order, corresponding to the 256-element
+ * (henceforth HSN).  After that are up to window-size/8 octets of
+ * bitmask, laid out in *little*-endian order, corresponding to the
  * block receive window.  Bits set in this bitmask indicate blocks
  * past the HSN that have in fact been received.  If the bitmask is
- * shorter than 32 octets it is implicitly zero-filled out to its
- * maximum size.  By construction, the lowest bit in the bitmask will
- * always be zero, because if block HSN+1 had been received, HSN would
- * be higher; but it is transmitted anyway.
+ * shorter than that it is implicitly zero-filled out to its maximum
+ * size; in practice it only runs up to the last block received.  By
+ * construction, the lowest bit in the bitmask will always be zero,
+ * because if block HSN+1 had been received, HSN would be higher; but
+ * it is transmitted anyway.
  */
 class ack_payload
 {
   uint32_t hsn_;
+  bool valid_;
   uint32_t maxusedbyte;
-  uint8_t  window[32];
+  uint32_t nbits;  // size of the window the bitmask covers
+  uint8_t  window[MAX_WINDOW / 8];
 
 public:
   /**
-   * Create a new ack_payload object, specifying its HSN.  For the
-   * sake of testing, this *can* be used to create an explicitly
-   * invalid ack_payload (by passing uint32_t(-1)), unlike set_hsn()
-   * below.
+   * Create a new ack_payload object, specifying its HSN and the size
+   * of the receive window.  Before anything has been processed, the
+   * HSN is one less than zero, i.e. 2^32-1.
    */
-  ack_payload(uint32_t h) : hsn_(h), maxusedbyte(0)
-  { memset(window, 0, sizeof window); }
+  ack_payload(uint32_t h, uint32_t window_size = MIN_WINDOW)
+    : hsn_(h), valid_(true), maxusedbyte(0), nbits(window_size)
+  {
+    log_assert(window_size_valid(window_size));
+    memset(window, 0, nbits / 8);
+  }
 
   /**
    * Decode an ack_payload from the wire format.  HFLOOR is a lower
-   * bound on the expected HSN.  Before doing anything else with the
-   * object constructed, you must check whether valid() returns true;
-   * all the other functions will trigger a fatal assertion if called
-   * on an invalid ack_payload.
+   * bound on the expected HSN, and WINDOW_SIZE the size of the
+   * sender's window, past which nothing can have been received.
+   * Before doing anything else with the object constructed, you must
+   * check whether valid() returns true; all the other functions will
+   * trigger a fatal assertion if called on an invalid ack_payload.
    */
-  ack_payload(evbuffer *wire, uint32_t hfloor);
+  ack_payload(evbuffer *wire, uint32_t hfloor, uint32_t window_size);
 
   /**
    * Serialize this ack_payload to the wire format.
@@ -191,7 +291,7 @@ public:
   /**
    * Report whether a wire-decoded ack_payload is valid.
    */
-  bool valid() const { return hsn_ != uint32_t(-1); }
+  bool valid() const { return valid_; }
 
   /**
    * Returns the HSN for this ack_payload object.
@@ -204,11 +304,10 @@ public:
 
   /**
    * Change the HSN for this ack_payload object.
-   * This cannot be used to make an ack_payload invalid.
    */
   void set_hsn(uint32_t h)
   {
-    log_assert(valid() && h != uint32_t(-1));
+    log_assert(valid());
     hsn_ = h;
   }
 
@@ -220,11 +319,12 @@ public:
   {
     log_assert(valid());
 
-    if (seq <= hsn_)
-      return true;
-
+    // Sequence numbers wrap: SEQ is at or before the HSN if it is
+    // within half the sequence space below it.
     uint32_t delta = (seq - hsn_) - 1;
-    if (delta >= 256)
+    if (delta >= 0x80000000u)
+      return true;
+    if (delta >= nbits)
       return false;
 
     return window[delta / 8] & (1 << (delta % 8));
@@ -232,14 +332,14 @@ public:
 
   /**
    * Mark the block with sequence number SEQ (which must be in the range
-   * [hsn+1, hsn+256]) as having been received.
+   * [hsn+1, hsn+window size]) as having been received.
    */
   void set_block_received(uint32_t seq)
   {
     log_assert(valid());
 
     uint32_t delta = (seq - hsn_) - 1;
-    if (delta >= 256)
+    if (delta >= nbits)
       log_abort("seq %u too high (hsn %u)", seq, hsn_);
 
     window[delta/8] |= (1 << (delta % 8));
@@ -248,28 +348,55 @@ public:
   }
 
   /**
-   * Print out the whole window array in hex format for debug
-   * purpose
+   * Print out the used part of the window array in hex format for
+   * debug purpose
    */
   void log_info_window()
-  {  
-    char log_ack_stat[1024] = {};
-    char curstat[] = "00";
-    for (int i = 0; i < 32; i++) {
-      sprintf(curstat, "%02x", window[i]);
-      strcat(log_ack_stat, curstat);
+  {
+    static const char hex[] = "0123456789abcdef";
+    char log_ack_stat[sizeof window * 2 + 1];
+    for (uint32_t i = 0; i < maxusedbyte; i++) {
+      log_ack_stat[2*i] = hex[window[i] >> 4];
+      log_ack_stat[2*i + 1] = hex[window[i] & 0xF];
     }
-    
+    log_ack_stat[2*maxusedbyte] = '\0';
+
     log_info("ack status: %s hsn: %u", log_ack_stat, hsn_);
   }
 
 };
 
+/**
+ * Round-trip time estimation and retransmission timeout computation
+ * after RFC 6298.  All times are in milliseconds.
+ */
+class rtt_estimator
+{
+  uint32_t srtt_;   // 0 until the first sample
+  uint32_t rttvar_;
+  uint32_t rto_;
+
+public:
+  rtt_estimator() : srtt_(0), rttvar_(0), rto_(INITIAL_RTO) {}
+
+  /** Account for one measured round trip of RTT.  Callers must not
+      measure blocks that were retransmitted (Karn's algorithm). */
+  void sample(uint32_t rtt);
+
+  /** A retransmission timer expired: back the timeout off. */
+  void backoff()
+  { rto_ = rto_ >= MAX_RTO / 2 ? MAX_RTO : rto_ * 2; }
+
+  uint32_t srtt() const { return srtt_; }
+  uint32_t rto() const { return rto_; }
+};
+
 /* The transmit queue holds blocks that we have transmitted at least
-   once but do not know have been received.  It is a 256-element circular
-   buffer of 'transmit_elt' structs, corresponding to the 256-element
-   sliding window of sequence numbers which may legitimately be
-   transmitted at any time.
+   once but do not know have been received.  It is a circular buffer
+   of 'transmit_elt' structs, as long as the sliding window of
+   sequence numbers which may legitimately be transmitted at any time:
+   a power of two between MIN_WINDOW and MAX_WINDOW, MIN_WINDOW until
+   the circuit's handshake says otherwise.
 
    Once a block is on the transmit queue, its payload length cannot
    change, but it can be repadded if necessary.  Zero-data blocks
@@ -281,25 +408,75 @@ public:
  {
    header hdr;
    evbuffer *data;
-
-   transmit_elt() : hdr(), data(0) {}
+   uint64_t sent_at;    // ms, of the latest transmission; 0 if none yet
+   uint8_t sack_skips;  // ACKs since then that passed this block over
+   bool lost;           // presumed lost since then
+   bool charged;        // counts against the congestion window
+
+   transmit_elt()
+     : hdr(), data(0), sent_at(0), sack_skips(0), lost(false), charged(false)
+   {}
  };
 
+ /* The most blocks transmit_queue::transmit encrypts in one go. */
+ const size_t TRANSMIT_BATCH_MAX = 16;
+
  class transmit_queue
  {
-   transmit_elt cbuf[256];
+   transmit_elt *cbuf;
+   uint32_t mask;     // window size - 1
    uint32_t next_to_ack;
    uint32_t next_to_send;
 
    bool overwrite_allowed;
 
+   bool rekey_;           // keys change with the key epoch
+   bool rekeying;         // the op_RKEY block is not yet acknowledged
+   uint32_t rekey_seqno;  // of that block
+   uint32_t key_limit;    // the start of the first epoch without keys
+
+   rtt_estimator rtt_;
+   congestion_control *cc_;
+   size_t in_flight_;  // bytes of the blocks for which in_flight() holds
+
    transmit_queue(const transmit_queue&) DELETE_METHOD;
    transmit_queue& operator=(const transmit_queue&) DELETE_METHOD;
 
+   transmit_elt &slot(uint32_t seqno) { return cbuf[seqno & mask]; }
+   const transmit_elt &slot(uint32_t seqno) const { return cbuf[seqno & mask]; }
+
+   /* SEQNO has been enqueued and not yet discarded, modulo 2^32. */
+   bool queued(uint32_t seqno) const
+   { return seqno - next_to_ack < next_to_send - next_to_ack; }
+
+   /* Sent, and neither acknowledged nor presumed lost.  Only blocks
+      carrying data count: ACKs and chaff keep the cover going and are
+      not held back by congestion control, so they are not charged
+      against its window either. */
+   static bool in_flight(const transmit_elt &elt)
+   {
+     return elt.data && elt.sent_at && !elt.lost && elt.charged;
+   }
+   void leave_flight(transmit_elt &elt)
+   {
+     if (in_flight(elt))
+       in_flight_ -= elt.hdr.total_len();
+   }
+
  public:
-   transmit_queue(bool intend_to_retransmit);
+   transmit_queue(bool intend_to_retransmit,
+                  uint32_t window_size = MIN_WINDOW);
    ~transmit_queue();
 
+   /**
+    * Change the size of the window to WINDOW_SIZE, which must be
+    * valid.  Only allowed before anything has been enqueued.
+    */
+   void resize(uint32_t window_size);
+
+   /** The size of the window. */
+   uint32_t size() const { return mask + 1; }
+
    /**
     * Return the sequence number to use for the next block to be
     * transmitted.
@@ -309,25 +486,53 @@ public:
    /**
     * True if the transmit queue is full, i.e. we cannot transmit
     * anything right now.  (This does not necessarily mean that all
-    * 256 slots are occupied; selective acknowledgment may have
-    * cleared some of them.)
+    * the slots are occupied; selective acknowledgment may have
+    * cleared some of them.)  The queue is also full at the end of a
+    * key epoch until the peer has the next one's keys.
     */
    bool full() const
-   { return (not overwrite_allowed) and (next_to_send - next_to_ack > 255); }
+   {
+     return ((not overwrite_allowed) and (next_to_send - next_to_ack > mask))
+       or (rekey_ and next_to_send == key_limit);
+   }
+
+   /** True if N more blocks can be enqueued. */
+   bool can_hold(uint32_t n) const
+   {
+     return (overwrite_allowed or next_to_send - next_to_ack + n <= size())
+       and (not rekey_ or key_limit - next_to_send >= n);
+   }
+
+   /**
+    * True if an op_RKEY block ought to be enqueued now: we are at
+    * least halfway through the current key epoch, and have not yet
+    * announced the next one's keys.
+    */
+   bool should_rekey() const
+   {
+     return rekey_ and not rekeying
+       and key_limit - next_to_send <= KEY_EPOCH / 2;
+   }
 
    /**
-    * True if we ought to rekey soon, i.e. the sequence number is in
-    * danger of wrapping around.
+    * Keep the keys of the first epoch throughout, for a peer that does
+    * not understand op_RKEY.  Sequence numbers then repeat under the
+    * same key after 2^32 blocks.  Only allowed before anything has
+    * been enqueued.
     */
-   bool should_rekey() const { return next_to_send >= 0x80000000u; }
+   void forgo_rekeying() { rekey_ = false; }
 
    /**
     * Push a block on the end of the transmit queue.  The block has
     * opcode F, carries all of the data in DATA, and is padded with
-    * PADDING bytes at the end.  Returns the sequence number of the
-    * new block.  Must not be called when full() is true.
+    * PADDING bytes at the end.  The first OVERHEAD bytes of DATA are
+    * not upstream data (e.g. a piggybacked ACK); a block that carries
+    * nothing else is not subject to congestion control.  Returns the
+    * sequence number of the new block.  Must not be called when
+    * full() is true.
     */
-   uint32_t enqueue(opcode_t f, evbuffer *data, uint16_t padding);
+   uint32_t enqueue(opcode_t f, evbuffer *data, uint16_t padding,
+                    size_t overhead = 0);
 
    /**
     * Encrypt the block with sequence number SEQNO and append it to
@@ -340,31 +545,121 @@ public:
    int transmit(uint32_t seqno,
                 evbuffer *output, ecb_encryptor &ec, gcm_encryptor &gc)
    {
-     log_assert(seqno >= next_to_ack && seqno < next_to_send);
-     transmit_elt &elt = cbuf[seqno & 0xFF];
+     log_assert(queued(seqno));
+     transmit_elt &elt = slot(seqno);
      return transmit(elt, output, ec, gc);
    }
    int transmit(transmit_elt &elt,
+                evbuffer *output, ecb_encryptor &ec, gcm_encryptor &gc)
+   {
+     transmit_elt *elts[1] = { &elt };
+     return transmit(elts, 1, output, ec, gc);
+   }
+
+   /**
+    * Encrypt the N blocks ELTS, all of which must already be on the
+    * transmit queue, and append them, in order, to the evbuffer
+    * OUTPUT.  The blocks are encrypted directly into space reserved
+    * in OUTPUT, and all the headers and all the bodies are each
+    * encrypted in one call into the cipher.  Returns 0 on success,
+    * -1 on failure, in which case OUTPUT is unchanged.  The ciphers
+    * are called for up to TRANSMIT_BATCH_MAX blocks at a time.
+    */
+   int transmit(transmit_elt *const *elts, size_t n,
                 evbuffer *output, ecb_encryptor &ec, gcm_encryptor &gc);
 
    int retransmit(uint32_t seqno, uint16_t new_padding,
                   evbuffer *output, ecb_encryptor &ec, gcm_encryptor &gc)
    {
-     log_assert(seqno >= next_to_ack && seqno < next_to_send);
-     transmit_elt &elt = cbuf[seqno & 0xFF];
+     log_assert(queued(seqno));
+     transmit_elt &elt = slot(seqno);
      return retransmit(elt, new_padding, output, ec, gc);
    }
    int retransmit(transmit_elt &elt, uint16_t new_padding,
                   evbuffer *output, ecb_encryptor &ec, gcm_encryptor &gc);
 
+   /**
+    * Record that the block with sequence number SEQNO (or ELT) went
+    * out on the wire at time NOW (in milliseconds).  Its retransmission
+    * timer runs from then.
+    */
+   void mark_sent(uint32_t seqno, uint64_t now)
+   {
+     log_assert(queued(seqno));
+     mark_sent(slot(seqno), now);
+   }
+   void mark_sent(transmit_elt &elt, uint64_t now)
+   {
+     leave_flight(elt);
+     elt.sent_at = now;
+     elt.sack_skips = 0;
+     elt.lost = false;
+     if (in_flight(elt))
+       in_flight_ += elt.hdr.total_len();
+     cc_->on_sent(elt.hdr.total_len(), now);
+   }
+
    /**
     * Process an acknowledgment, advancing the last_fully_acked
     * counter and discarding blocks that have definitely been received
-    * on the far side.  Returns -1 for failure or 0 for success:
-    * failure indicates an ill-formed ack payload on the wire.
-    * Consumes DATA regardless of success or failure.
+    * on the far side.  NOW is the time of arrival, in milliseconds; it
+    * feeds the round-trip time estimate, and blocks sent before one
+    * acknowledged here but not acknowledged themselves are counted
+    * as passed over, for fast retransmission.  Returns -1 for failure
+    * or 0 for success: failure indicates an ill-formed ack payload on
+    * the wire.  Consumes DATA regardless of success or failure.
     */
-   int process_ack(evbuffer *data);
+   int process_ack(evbuffer *data, uint64_t now);
+
+   /**
+    * True if ELT should be (re)transmitted: it was never sent, or it
+    * is presumed lost, because it timed out (see expire()) or because
+    * enough ACKs passed it over.
+    */
+   bool due(const transmit_elt &elt) const
+   {
+     return elt.data && (!elt.sent_at || elt.lost);
+   }
+
+   /**
+    * The earliest time at which a block that has been sent, and is not
+    * yet presumed lost, will time out; 0 if there is no such block.
+    */
+   uint64_t next_deadline() const;
+
+   /**
+    * Called when the retransmission timer fires at time NOW.  If any
+    * block has in fact timed out, marks those blocks lost, backs the
+    * timeout off, and returns true.
+    */
+   bool expire(uint64_t now);
+
+   const rtt_estimator& rtt() const { return rtt_; }
+
+   /**
+    * Replace the congestion controller, which the queue then owns.
+    * The queue starts out with the "none" controller.
+    */
+   void set_congestion_control(congestion_control *cc);
+   const congestion_control& congestion() const { return *cc_; }
+
+   /** Bytes of blocks sent and neither acknowledged nor presumed lost. */
+   size_t in_flight() const { return in_flight_; }
+
+   /**
+    * True if the congestion controller lets a new block go out at NOW.
+    * Otherwise, *DELAY is set to the number of milliseconds the pacer
+    * wants to wait, or to 0 if it is the window that is full, in which
+    * case an ACK has to arrive first.
+    */
+   bool may_send(uint64_t now, uint64_t *delay) const
+   {
+     *delay = 0;
+     if (in_flight_ >= cc_->window())
+       return false;
+     *delay = cc_->pacing_delay(now);
+     return *delay == 0;
+   }
 
    /**
     * Iteration over the transmit queue produces each block which has
@@ -385,12 +680,12 @@ public:
      bool operator!=(const iterator& o)
      { return queue != o.queue || seqno != o.seqno; }
 
-     transmit_elt& operator*() { return queue->cbuf[seqno & 0xFF]; }
+     transmit_elt& operator*() { return queue->slot(seqno); }
      iterator operator++()
      {
        do
          seqno++;
-       while (seqno < queue->next_to_send && !queue->cbuf[seqno & 0xFF].data);
+       while (seqno != queue->next_to_send && !queue->slot(seqno).data);
        return *this;
      }
      iterator operator++(int)
@@ -412,9 +707,9 @@ public:
    evbuffer, for simplicity's sake: a reassembly queue element holds a
    received block if and only if its data pointer is non-null.
 
-   The reassembly queue is also a 256-element circular buffer, of
-   'reassembly_elt' structs, following the same logic as the transmit
-   queue. 
+   The reassembly queue is also a circular buffer, of 'reassembly_elt'
+   structs, as long as the receive window and following the same
+   logic as the transmit queue.
    
    the pointer to the conn in the reassembly element has been added
    because if the element contain op_STEG (steg protocol) data, it 
@@ -434,7 +729,8 @@ struct reassembly_elt
 
 class reassembly_queue
 {
-  reassembly_elt cbuf[256];
+  reassembly_elt *cbuf;
+  uint32_t mask;   // window size - 1
   uint32_t next_to_process;
   uint32_t count; // only a uint8_t is _necessary_, but that's a false
                   // economy; using a uint32_t means we don't have to
@@ -445,9 +741,18 @@ class reassembly_queue
   reassembly_queue& operator=(const reassembly_queue&) DELETE_METHOD;
 
 public:
-  reassembly_queue();
+  reassembly_queue(uint32_t window_size = MIN_WINDOW);
   ~reassembly_queue();
 
+  /**
+   * Change the size of the window to WINDOW_SIZE, which must be
+   * valid.  Only allowed before any block has been received.
+   */
+  void resize(uint32_t window_size);
+
+  /** The size of the window. */
+  uint32_t size() const { return mask + 1; }
+
   /**
    * Remove the next block to be processed from the reassembly queue
    * and return it.  If we are out of blocks or the next block to
@@ -481,7 +786,8 @@ public:
 
   /**
    * Reset the expected next sequence number to zero.  The queue must
-   * be empty.  This is done as the last step of a rekeying cycle.
+   * be empty.  (Rekeying does not need this: sequence numbers just
+   * wrap around.)
    */
   void reset();
 
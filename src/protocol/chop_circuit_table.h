@@ -0,0 +1,125 @@
+/* See LICENSE for other credits and copying information
+ */
+
+#ifndef CHOP_CIRCUIT_TABLE_H
+#define CHOP_CIRCUIT_TABLE_H
+
+#include <utility>
+
+namespace chop_blk
+{
+
+/**
+ * The circuits of a chop configuration, by circuit ID: a hash table
+ * with open addressing and linear probing, in one array of (ID,
+ * circuit) pairs.  A lookup is a multiplication and, almost always,
+ * one or two adjacent slots, with no allocation; this is on the path
+ * of every connection the server accepts.
+ *
+ * Circuit ID 0 is never used and marks empty slots.  Entries are
+ * never removed: a closed circuit leaves its ID behind with a NULL
+ * circuit, against late connections for it.  The array doubles when
+ * it is half full.  The interface is the part of std::map's that the
+ * chopper uses.
+ */
+template <class T>
+class circuit_table
+{
+public:
+  typedef std::pair<uint32_t, T *> value_type;
+
+  class iterator
+  {
+    value_type *p, *end_;
+
+    void skip_empty() { while (p != end_ && !p->first) p++; }
+
+  public:
+    iterator() : p(0), end_(0) {}
+    iterator(value_type *p_, value_type *e) : p(p_), end_(e) { skip_empty(); }
+
+    value_type &operator*() const { return *p; }
+    value_type *operator->() const { return p; }
+    iterator &operator++() { p++; skip_empty(); return *this; }
+    iterator operator++(int) { iterator i(*this); ++*this; return i; }
+    bool operator==(const iterator &o) const { return p == o.p; }
+    bool operator!=(const iterator &o) const { return p != o.p; }
+  };
+
+private:
+  value_type *slots;
+  uint32_t mask;   // number of slots, minus one
+  uint32_t count;  // slots in use
+
+  circuit_table(const circuit_table&) DELETE_METHOD;
+  circuit_table& operator=(const circuit_table&) DELETE_METHOD;
+
+  // Fibonacci hashing: IDs are random, but they come from the peer.
+  uint32_t home(uint32_t id) const { return (id * 0x9E3779B1u) & mask; }
+
+  value_type *probe(uint32_t id) const
+  {
+    uint32_t i = home(id);
+    while (slots[i].first && slots[i].first != id)
+      i = (i + 1) & mask;
+    return &slots[i];
+  }
+
+  void grow()
+  {
+    value_type *old = slots;
+    uint32_t old_size = mask + 1;
+    mask = mask * 2 + 1;
+    slots = new value_type[mask + 1];
+    for (uint32_t i = 0; i < old_size; i++)
+      if (old[i].first)
+        *probe(old[i].first) = old[i];
+    delete [] old;
+  }
+
+public:
+  circuit_table() : slots(new value_type[64]), mask(63), count(0) {}
+  ~circuit_table() { delete [] slots; }
+
+  iterator begin() const { return iterator(slots, slots + mask + 1); }
+  iterator end() const
+  { return iterator(slots + mask + 1, slots + mask + 1); }
+  size_t size() const { return count; }
+
+  iterator find(uint32_t id) const
+  {
+    if (!id)
+      return end();
+    value_type *v = probe(id);
+    return v->first ? iterator(v, slots + mask + 1) : end();
+  }
+
+  /** Add V unless its ID is there already; either way, return where
+      the ID is, and whether V went in. */
+  std::pair<iterator, bool> insert(const value_type &v)
+  {
+    log_assert(v.first);
+    value_type *s = probe(v.first);
+    if (s->first)
+      return std::make_pair(iterator(s, slots + mask + 1), false);
+
+    if (2 * (count + 1) > mask + 1) {
+      grow();
+      s = probe(v.first);
+    }
+    *s = v;
+    count++;
+    return std::make_pair(iterator(s, slots + mask + 1), true);
+  }
+};
+
+} // namespace chop_blk
+
+#endif /* chop_circuit_table.h */
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// c-file-style: "gnu"
+// c-file-offsets: ((innamespace . 0) (brace-list-open . 0))
+// End:
@@ -0,0 +1,135 @@
+/* See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "chop_congestion.h"
+
+#include <algorithm>
+#include <limits>
+
+using std::max;
+using std::min;
+using std::numeric_limits;
+
+namespace chop_blk
+{
+
+namespace {
+
+/** No congestion control: whatever the transmit queue can hold goes
+    out at once.  This is how chop always behaved. */
+class null_control : public congestion_control
+{
+public:
+  const char *name() const { return "none"; }
+  size_t window() const { return numeric_limits<size_t>::max(); }
+  uint64_t pacing_rate() const { return 0; }
+  void on_ack(size_t, uint64_t, uint32_t, uint64_t) {}
+  void on_loss(uint64_t, uint64_t) {}
+  void on_timeout(uint64_t) {}
+};
+
+/** Additive increase, multiplicative decrease, after TCP Reno (RFC
+    5681) with byte counting: slow start up to ssthresh, then
+    AIMD_INCREASE per round trip; halve the window once per loss
+    episode, and fall back to the minimum on timeout.  Paced at twice
+    the window per round trip in slow start and 1.25 times after
+    that, as Linux does. */
+class aimd_control : public congestion_control
+{
+  size_t cwnd;
+  size_t ssthresh;
+  uint32_t srtt;
+  uint64_t recovery_start; // losses of blocks sent before are known
+
+public:
+  aimd_control()
+    : cwnd(AIMD_INITIAL_WINDOW),
+      ssthresh(numeric_limits<size_t>::max()),
+      srtt(0), recovery_start(0)
+  {}
+
+  const char *name() const { return "aimd"; }
+  size_t window() const { return cwnd; }
+
+  uint64_t pacing_rate() const
+  {
+    if (!srtt)
+      return 0;
+    uint64_t gain_pct = cwnd < ssthresh ? 200 : 125;
+    return uint64_t(cwnd) * 1000 * gain_pct / 100 / srtt;
+  }
+
+  void on_ack(size_t acked, uint64_t latest_sent, uint32_t srtt_, uint64_t)
+  {
+    srtt = srtt_;
+    // No growth until the ACKs reach past the loss episode.
+    if (latest_sent <= recovery_start)
+      return;
+
+    if (cwnd < ssthresh)
+      cwnd += acked;
+    else
+      cwnd += max<size_t>(uint64_t(AIMD_INCREASE) * acked / cwnd, 1);
+    cwnd = min(cwnd, AIMD_MAX_WINDOW);
+  }
+
+  void on_loss(uint64_t sent_at, uint64_t now)
+  {
+    if (sent_at <= recovery_start)
+      return;
+    recovery_start = now;
+    ssthresh = max(cwnd / 2, AIMD_MIN_WINDOW);
+    cwnd = ssthresh;
+  }
+
+  void on_timeout(uint64_t now)
+  {
+    recovery_start = now;
+    ssthresh = max(cwnd / 2, AIMD_MIN_WINDOW);
+    cwnd = AIMD_MIN_WINDOW;
+  }
+};
+
+} // anonymous namespace
+
+congestion_control *
+congestion_control::create(const char *name)
+{
+  if (!strcmp(name, "none"))
+    return new null_control;
+  if (!strcmp(name, "aimd"))
+    return new aimd_control;
+  return 0;
+}
+
+void
+congestion_control::on_sent(size_t bytes, uint64_t now)
+{
+  uint64_t rate = pacing_rate();
+  if (!rate) {
+    next_send_us = 0;
+    return;
+  }
+
+  // An idle pacer does not save up: the next block is spaced from
+  // this one, not from the last.
+  next_send_us = max(next_send_us, now * 1000) + bytes * 1000000 / rate;
+}
+
+uint64_t
+congestion_control::pacing_delay(uint64_t now) const
+{
+  if (next_send_us <= now * 1000)
+    return 0;
+  return (next_send_us - now * 1000 + 999) / 1000;
+}
+
+} // namespace chop_blk
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// c-file-style: "gnu"
+// c-file-offsets: ((innamespace . 0) (brace-list-open . 0))
+// End:
@@ -0,0 +1,85 @@
+/* See LICENSE for other credits and copying information
+ */
+
+#ifndef CHOP_CONGESTION_H
+#define CHOP_CONGESTION_H
+
+namespace chop_blk
+{
+
+/* Congestion control settings for the "aimd" controller, in bytes of
+   whole blocks.  A circuit may always have one block in flight, so
+   the minimum only matters for small blocks. */
+const size_t AIMD_INITIAL_WINDOW = 128 * 1024;
+const size_t AIMD_MIN_WINDOW = 32 * 1024;
+const size_t AIMD_MAX_WINDOW = 64 * 1024 * 1024;
+/* Growth per round trip, once out of slow start */
+const size_t AIMD_INCREASE = 16 * 1024;
+
+/**
+ * A congestion controller decides how many bytes of blocks a circuit
+ * may have in flight, and how fast they may go out.  The transmit
+ * queue keeps the books and tells its controller about every
+ * transmission, acknowledgment, loss and timeout; the circuit asks it
+ * before sending new data.  Controllers are made by name, with
+ * create().
+ *
+ * Pacing is common to all controllers: each block sent pushes the
+ * time the next may go back by its length over pacing_rate().
+ */
+class congestion_control
+{
+  uint64_t next_send_us; // the pacer's earliest time for the next block
+
+  congestion_control(const congestion_control&) DELETE_METHOD;
+  congestion_control& operator=(const congestion_control&) DELETE_METHOD;
+
+protected:
+  congestion_control() : next_send_us(0) {}
+
+public:
+  virtual ~congestion_control() {}
+
+  /** Make the controller called NAME; NULL if there is none. */
+  static congestion_control *create(const char *name);
+
+  virtual const char *name() const = 0;
+
+  /** Bytes allowed in flight. */
+  virtual size_t window() const = 0;
+
+  /** Bytes per second the pacer lets out; 0 to not pace. */
+  virtual uint64_t pacing_rate() const = 0;
+
+  /**
+   * An ACK arrived at NOW, acknowledging ACKED bytes that were in
+   * flight.  LATEST_SENT is when the most recently sent of them went
+   * out; SRTT is the smoothed round-trip time after this ACK (0 if
+   * still unknown).  All times are in milliseconds.
+   */
+  virtual void on_ack(size_t acked, uint64_t latest_sent, uint32_t srtt,
+                      uint64_t now) = 0;
+
+  /** A block sent at SENT_AT was found lost at NOW. */
+  virtual void on_loss(uint64_t sent_at, uint64_t now) = 0;
+
+  /** The retransmission timer ran out at NOW. */
+  virtual void on_timeout(uint64_t now) = 0;
+
+  /** A block of BYTES bytes went out at NOW. */
+  void on_sent(size_t bytes, uint64_t now);
+
+  /** Milliseconds until the pacer lets another block out, from NOW. */
+  uint64_t pacing_delay(uint64_t now) const;
+};
+
+} // namespace chop_blk
+
+#endif /* chop_congestion.h */
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// c-file-style: "gnu"
+// c-file-offsets: ((innamespace . 0) (brace-list-open . 0))
+// End:
@@ -24,6 +24,23 @@
    | 0 | 1 | 2 | 3 | 4 | 5 | 6 | 7 | 8 | 9 | A | B | C | D | E | F |
    | Enc_ecb(Circuit ID + Padding) | SHA-256(Circuit ID + Padding) |
 
+   The first four bytes of the padding announce the size of the
+   client's block window: the tag "win" followed by its base 2
+   logarithm.  The next four announce the protocol features the client
+   supports: the tag "ext" followed by a bit mask of CHOP_FEATURE_*.
+   They are covered by the encryption and the digest like the rest.  A
+   handshake without a tag (from an older client, which sent random
+   bytes there) announces nothing in its place.
+
+   Before computing the digest, the receiver checks what it can
+   cheaply: the circuit ID must not be 0 and, if there is a "win" tag,
+   the window must be in range.  By default that is all, as untagged
+   handshakes from older clients are let in, so it turns away only
+   about one in 2^24 random handshakes (as sent by active probes); the
+   rest cost a SHA-256.  With --strict-handshakes both tags must be
+   there too, which turns away all but about one in 2^50 for the price
+   of the decryption.
+
    It is not the most secure header more secure header out-there
    TODO: Make a secure header with Elligator algorithm
 
@@ -34,14 +51,40 @@ const size_t NO_ENCRYPTED_WORDS = 4;
 const size_t CIRCUIT_ID_LEN = sizeof(uint32_t);
 const size_t PADDING_LEN = 12;
 const size_t HANDSHAKE_DIGEST_LENGTH = HANDSHAKE_LEN - CIRCUIT_ID_LEN - PADDING_LEN;
+const size_t WINDOW_ANNOUNCE_LEN = 4;
+const uint8_t WINDOW_TAG[WINDOW_ANNOUNCE_LEN - 1] = { 'w', 'i', 'n' };
+const size_t FEATURES_ANNOUNCE_LEN = 4;
+const uint8_t FEATURES_TAG[FEATURES_ANNOUNCE_LEN - 1] = { 'e', 'x', 't' };
+
+/* Announced windows are from 2^MIN_WINDOW_LOG2 to 2^MAX_WINDOW_LOG2
+   blocks (see chop_blk.h) */
+const uint8_t MIN_WINDOW_LOG2 = 8;
+const uint8_t MAX_WINDOW_LOG2 = 15;
+
+/* The client understands op_ACK_DAT and op_ACK_FIN */
+const uint8_t CHOP_FEATURE_PIGGYBACK_ACK = 0x01;
+/* The client wants blocks with compressed data (op_COMPRESSED) */
+const uint8_t CHOP_FEATURE_COMPRESSION = 0x02;
+/* The client understands op_RKEY, and takes the keys it announces */
+const uint8_t CHOP_FEATURE_REKEY = 0x04;
+/* The client encrypts the circuit's data with ChaCha20-Poly1305
+   instead of AES-GCM, and wants the server to do the same */
+const uint8_t CHOP_FEATURE_CHACHA20 = 0x08;
 
 class ChopHandshaker
 {
 
 public:
   uint32_t circuit_id;
-   
-  ChopHandshaker(uint32_t conn_circuit_id = 0) : circuit_id(conn_circuit_id) {};
+  /** log2 of the client's window size; 0 if it is not announced */
+  uint8_t window_log2;
+  /** CHOP_FEATURE_* the client supports */
+  uint8_t features;
+
+  ChopHandshaker(uint32_t conn_circuit_id = 0, uint8_t conn_window_log2 = 0,
+                 uint8_t conn_features = 0)
+    : circuit_id(conn_circuit_id), window_log2(conn_window_log2),
+      features(conn_features) {};
 
   /** 
      Generates the handshake for a connection whose circuit_id is already
@@ -57,6 +100,16 @@ public:
     log_debug("circ id to send %u", circuit_id);
     id_cat_padding[0] = circuit_id;
     rng_bytes((uint8_t*)(id_cat_padding + 1),  PADDING_LEN);
+    uint8_t *announce = (uint8_t*)(id_cat_padding + 1);
+    if (window_log2) {
+      memcpy(announce, WINDOW_TAG, sizeof WINDOW_TAG);
+      announce[sizeof WINDOW_TAG] = window_log2;
+    }
+    if (features) {
+      announce += WINDOW_ANNOUNCE_LEN;
+      memcpy(announce, FEATURES_TAG, sizeof FEATURES_TAG);
+      announce[sizeof FEATURES_TAG] = features;
+    }
     ec.encrypt(handshake, (const uint8_t*)id_cat_padding);
     sha256((uint8_t*)(id_cat_padding), CIRCUIT_ID_LEN + PADDING_LEN, digest_buffer);
     memcpy((uint8_t*)(handshake + CIRCUIT_ID_LEN + PADDING_LEN), digest_buffer, HANDSHAKE_DIGEST_LENGTH);
@@ -65,22 +118,53 @@ public:
   }
 
   /**
-     Verifies the handshake and extract the circuit id and store
-     it in the class member circuit_id
+     Checks what can be checked of a decrypted handshake without
+     computing its digest.  Unless STRICT, handshakes without
+     announcements, from older clients, pass.
+  */
+  static bool plausible(const uint32_t* id_cat_padding, bool strict)
+  {
+    if (!id_cat_padding[0])
+      return false;
+    const uint8_t *announce = (const uint8_t*)(id_cat_padding + 1);
+    if (memcmp(announce, WINDOW_TAG, sizeof WINDOW_TAG))
+      return !strict;
+    if (announce[sizeof WINDOW_TAG] < MIN_WINDOW_LOG2 ||
+        announce[sizeof WINDOW_TAG] > MAX_WINDOW_LOG2)
+      return false;
+    announce += WINDOW_ANNOUNCE_LEN;
+    return !strict || !memcmp(announce, FEATURES_TAG, sizeof FEATURES_TAG);
+  }
+
+  /**
+     Verifies the handshake and extract the circuit id, the announced
+     window and features and store them in the class members
+     circuit_id, window_log2 and features.  With STRICT, handshakes
+     from clients that do not announce them are rejected; either way
+     implausible ones are, before their digest is computed.
 
      @return false in case verification fails 
   */
-  bool verify_and_extract(uint8_t* handshake, ecb_decryptor& dc)
+  bool verify_and_extract(uint8_t* handshake, ecb_decryptor& dc,
+                          bool strict = false)
   {
     uint32_t id_cat_padding[NO_ENCRYPTED_WORDS];
     uint8_t verify_buf[SHA256_DIGEST_LENGTH];
 
     dc.decrypt((uint8_t*)id_cat_padding,handshake);
+    if (!plausible(id_cat_padding, strict))
+      return false;
     sha256((uint8_t*)id_cat_padding, CIRCUIT_ID_LEN + PADDING_LEN, verify_buf);
     if (memcmp(verify_buf, handshake + (CIRCUIT_ID_LEN + PADDING_LEN), HANDSHAKE_DIGEST_LENGTH))
       return false; //not a valid handshake
 
     circuit_id = id_cat_padding[0];
+    const uint8_t *announce = (const uint8_t*)(id_cat_padding + 1);
+    window_log2 = memcmp(announce, WINDOW_TAG, sizeof WINDOW_TAG)
+      ? 0 : announce[sizeof WINDOW_TAG];
+    announce += WINDOW_ANNOUNCE_LEN;
+    features = memcmp(announce, FEATURES_TAG, sizeof FEATURES_TAG)
+      ? 0 : announce[sizeof FEATURES_TAG];
     log_debug("retrieved circ id %u", circuit_id);
     return true;
     
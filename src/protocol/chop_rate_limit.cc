@@ -0,0 +1,90 @@
+/* See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "rng.h"
+#include "chop_rate_limit.h"
+
+#include <netinet/in.h>
+
+namespace chop_blk
+{
+
+source_rate_limit::source_rate_limit(uint32_t rate_)
+  : buckets(new bucket[N_BUCKETS]), key(0), rate(0), burst(0)
+{
+  rng_bytes((uint8_t *)&key, sizeof key);
+  key |= 1;
+  set_rate(rate_);
+}
+
+source_rate_limit::~source_rate_limit()
+{
+  delete [] buckets;
+}
+
+void
+source_rate_limit::set_rate(uint32_t rate_)
+{
+  rate = rate_;
+  burst = rate * 4;
+}
+
+uint64_t
+source_rate_limit::source_of(const struct sockaddr *addr, size_t addrlen)
+{
+  uint64_t source = 0;
+  if (addr->sa_family == AF_INET && addrlen >= sizeof(struct sockaddr_in)) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+    memcpy(&source, &sin->sin_addr, sizeof sin->sin_addr);
+    source |= uint64_t(AF_INET) << 48;
+  } else if (addr->sa_family == AF_INET6 &&
+             addrlen >= sizeof(struct sockaddr_in6)) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
+    memcpy(&source, &sin6->sin6_addr, sizeof source);
+  }
+  return source;
+}
+
+source_rate_limit::bucket &
+source_rate_limit::find(uint64_t source, uint64_t now)
+{
+  uint64_t h = (source ^ key) * 0x9E3779B97F4A7C15ull;
+  bucket &b = buckets[(h >> 32) % N_BUCKETS];
+  if (b.source != source) {
+    b.source = source;
+    b.stamp = now;
+    b.tokens = burst * 1000;
+  } else if (now > b.stamp) {
+    uint64_t t = b.tokens + (now - b.stamp) * rate;
+    b.tokens = t > uint64_t(burst) * 1000 ? burst * 1000 : uint32_t(t);
+    b.stamp = now;
+  }
+  return b;
+}
+
+bool
+source_rate_limit::allowed(uint64_t source, uint64_t now)
+{
+  if (!rate || !source)
+    return true;
+  return find(source, now).tokens >= 1000;
+}
+
+void
+source_rate_limit::charge(uint64_t source, uint64_t now)
+{
+  if (!rate || !source)
+    return;
+  bucket &b = find(source, now);
+  b.tokens = b.tokens >= 1000 ? b.tokens - 1000 : 0;
+}
+
+} // namespace chop_blk
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// c-file-style: "gnu"
+// c-file-offsets: ((innamespace . 0) (brace-list-open . 0))
+// End:
@@ -0,0 +1,77 @@
+/* See LICENSE for other credits and copying information
+ */
+
+#ifndef CHOP_RATE_LIMIT_H
+#define CHOP_RATE_LIMIT_H
+
+struct sockaddr;
+
+namespace chop_blk
+{
+
+/* Handshakes that fail to authenticate are limited by default to
+   this many per second and source address, after a burst of four
+   seconds' worth. */
+const uint32_t HANDSHAKE_RATE = 64;
+
+/**
+ * Token buckets for the sources of incoming connections, to keep any
+ * one of them from taking more than its share of the server's time.
+ * Sources are IPv4 addresses, or IPv6 /64 prefixes, since a host
+ * gets at least that many.
+ *
+ * The buckets are in a fixed array indexed by a keyed hash of the
+ * source, and one that collides with another takes its bucket over:
+ * memory stays bounded however many sources there are, and a
+ * source can at worst get a fresh bucket, not spend another's.
+ */
+class source_rate_limit
+{
+  struct bucket
+  {
+    uint64_t source;  // 0 for an unused bucket
+    uint64_t stamp;   // ms, when tokens was last brought up to date
+    uint32_t tokens;  // in thousandths
+  };
+
+  static const size_t N_BUCKETS = 4096;
+
+  bucket *buckets;
+  uint64_t key;       // for the hash, so that collisions can't be chosen
+  uint32_t rate;      // tokens per second; 0 for no limit
+  uint32_t burst;
+
+  source_rate_limit(const source_rate_limit&) DELETE_METHOD;
+  source_rate_limit& operator=(const source_rate_limit&) DELETE_METHOD;
+
+  bucket &find(uint64_t source, uint64_t now);
+
+public:
+  source_rate_limit(uint32_t rate = HANDSHAKE_RATE);
+  ~source_rate_limit();
+
+  /** Change the rate; RATE 0 lifts the limit. */
+  void set_rate(uint32_t rate);
+
+  /** Reduce ADDR (of ADDRLEN bytes) to the source it is accounted
+      to; 0 if it is of an unknown family. */
+  static uint64_t source_of(const struct sockaddr *addr, size_t addrlen);
+
+  /** True if SOURCE has a token left at NOW (in ms).  Source 0 always
+      has. */
+  bool allowed(uint64_t source, uint64_t now);
+
+  /** Take a token from SOURCE at NOW. */
+  void charge(uint64_t source, uint64_t now);
+};
+
+} // namespace chop_blk
+
+#endif /* chop_rate_limit.h */
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// c-file-style: "gnu"
+// c-file-offsets: ((innamespace . 0) (brace-list-open . 0))
+// End:
@@ -5,14 +5,76 @@
 
 #include "util.h"
 #include "rng.h"
+#include "chacha.h"
 
 #include <cmath>
 #include <algorithm>
 
 #include <openssl/rand.h>
 
-/* OpenSSL's rng is global, automatically seeds itself, and does not
-   appear to need to be torn down explicitly. */
+/* Random bytes come from a ChaCha20 keystream, buffered per thread,
+   under a key that is replaced from the keystream itself at every
+   refill ("fast key erasure") so that past output cannot be
+   recovered from the state, and that is stirred with fresh bytes
+   from OpenSSL's rng (which seeds itself) every RNG_RESEED bytes.
+   Callers asking for a handful of bytes at a time, which is nearly
+   all of them, then cost a copy out of the buffer instead of a trip
+   through RAND_bytes and its locks.
+
+   Output is wiped from the buffer as it is handed out.  Nothing
+   forks without exec'ing once the generator is in use, so the
+   children never share a stream with their parent. */
+
+namespace {
+
+const size_t RNG_KEYLEN = CHACHA20_KEY_LEN;
+const size_t RNG_BLOCKS = 16;   // ChaCha20 blocks per refill
+const size_t RNG_BUFLEN = RNG_BLOCKS * CHACHA20_BLOCK_LEN - RNG_KEYLEN;
+const size_t RNG_RESEED = 1 << 20;
+
+struct rng_state
+{
+  uint8_t key[RNG_KEYLEN];
+  uint8_t buf[RNG_BUFLEN];
+  size_t avail;          // unread bytes, at the end of buf
+  size_t since_reseed;   // bytes generated since the key was stirred
+  bool seeded;
+};
+
+} // anonymous namespace
+
+static __thread rng_state rng;
+
+/** Refill this thread's buffer, and take the next key from it. */
+static void
+rng_refill()
+{
+  if (!rng.seeded || rng.since_reseed >= RNG_RESEED) {
+    uint8_t fresh[RNG_KEYLEN];
+    int rv = RAND_bytes(fresh, (int)sizeof fresh);
+    log_assert(rv);
+    for (size_t i = 0; i < RNG_KEYLEN; i++)
+      rng.key[i] ^= fresh[i];
+    memset(fresh, 0, sizeof fresh);
+    rng.seeded = true;
+    rng.since_reseed = 0;
+  }
+
+  // Each key is used for one refill only, so a zero nonce will do.
+  static const uint8_t nonce[CHACHA20_NONCE_LEN] = { 0 };
+  uint8_t block[CHACHA20_BLOCK_LEN];
+
+  chacha20_block(block, rng.key, 0, nonce);
+  memcpy(rng.key, block, RNG_KEYLEN);
+  memcpy(rng.buf, block + RNG_KEYLEN, CHACHA20_BLOCK_LEN - RNG_KEYLEN);
+  for (uint32_t i = 1; i < RNG_BLOCKS; i++)
+    chacha20_block(rng.buf + i*CHACHA20_BLOCK_LEN - RNG_KEYLEN,
+                   rng.key, i, nonce);
+  memset(block, 0, sizeof block);
+
+  rng.avail = RNG_BUFLEN;
+  rng.since_reseed += RNG_BUFLEN;
+}
 
 /**
  * Fills 'buf' with 'buflen' random bytes.  Cannot fail.
@@ -20,9 +82,18 @@
 void
 rng_bytes(uint8_t *buf, size_t buflen)
 {
-  log_assert(buflen < INT_MAX);
-  int rv = RAND_bytes(buf, (int)buflen);
-  log_assert(rv);
+  while (buflen) {
+    if (!rng.avail)
+      rng_refill();
+
+    size_t n = std::min(buflen, rng.avail);
+    uint8_t *src = rng.buf + RNG_BUFLEN - rng.avail;
+    memcpy(buf, src, n);
+    memset(src, 0, n);
+    rng.avail -= n;
+    buf += n;
+    buflen -= n;
+  }
 }
 
 /**
@@ -116,8 +187,8 @@ rng_double()
     bool get()
     {
       if (n == 0) {
-        rng_bytes((uint8_t *)&bits, 1);
-        n = CHAR_BIT;
+        rng_bytes((uint8_t *)&bits, sizeof bits);
+        n = CHAR_BIT * sizeof bits;
       }
       bool rv = bits & 1;
       bits >>= 1;
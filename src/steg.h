@@ -68,6 +68,15 @@ struct steg_config_t
               //to send as the result of the (non)process
   }
 
+  /** Called when a listener using this configuration has been opened
+      on the event loop BASE, which will also serve its connections.
+      Modules with work to do before the first connection arrives
+      (e.g. fetching covers) can start it here.  */
+  virtual void listener_opened(struct event_base *base)
+  {
+    (void) base;
+  }
+
 };
 
 /** A 'steg_t' object handles the actual steganography for one
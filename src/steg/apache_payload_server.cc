@@ -1,4 +1,5 @@
 ﻿#include <fstream>
+#include <iterator>
 #include <sstream>
 #include <vector>
 #include <boost/filesystem.hpp>
@@ -12,6 +13,8 @@ using namespace boost::filesystem;
 #include "crypt.h"
 #include "rng.h"
 #include "apache_payload_server.h"
+#include "cover_fetcher.h"
+#include "workers.h"
 
 #include "http_steg_mods/file_steg.h"
 #include "http_steg_mods/jpgSteg.h"
@@ -28,8 +31,12 @@ ApachePayloadServer::ApachePayloadServer(MachineSide init_side, const string& da
   :PayloadServer(init_side),_database_filename(database_filename),
    _apache_host_name((cover_server.empty()) ? "127.0.0.1" : cover_server),
    c_max_buffer_size(HTTP_MSG_BUF_SIZE),
+   _cover_fetcher(NULL),
    _payload_cache(this, &ApachePayloadServer::fetch_hashed_url, 
-   c_PAYLOAD_CACHE_ELEMENT_CAPACITY),   
+   c_PAYLOAD_CACHE_BYTE_CAPACITY / worker_count()),   
+   _warmup_total(0),
+   _warmup_done(0),
+   _warmup_in_flight(0),
    chosen_payload_choice_strategy(/*c_random_payload_choice*/c_most_efficient_payload_choice)
 {
   /* Ideally this should check the side and on client side
@@ -83,7 +90,7 @@ ApachePayloadServer::ApachePayloadServer(MachineSide init_side, const string& da
 
         
       _payload_database.payloads.insert(pair<string, PayloadInfo>(cur_payload_info.url_hash, cur_payload_info));
-      _payload_database.sorted_payloads.push_back(EfficiencyIndicator(cur_payload_info.url_hash, cur_payload_info.length));
+      _payload_database.type_index[cur_payload_info.type].add(cur_payload_info.url_hash, cur_payload_info.length, cur_payload_info.capacity);
                                                   
       //update type related global data 
       _payload_database.type_detail[cur_payload_info.type].count++;
@@ -95,7 +102,8 @@ ApachePayloadServer::ApachePayloadServer(MachineSide init_side, const string& da
     if (payload_info_stream.bad())
       log_abort("payload info file corrupted.");
         
-    _payload_database.sorted_payloads.sort();
+    for (auto cur_index = _payload_database.type_index.begin(); cur_index != _payload_database.type_index.end(); cur_index++)
+      cur_index->second.build();
     
     log_debug("loaded %ld payloads from %s\n", _payload_database.payloads.size(), _database_filename.c_str());
     
@@ -139,7 +147,7 @@ ApachePayloadServer::find_client_payload(char* buf, int len, int type)
 int
 ApachePayloadServer::get_payload( int contentType, int cap, char** buf, int* size, double noise2signal, std::string* payload_id_hash)
 {
-  int found = 0, numCandidate = 0;
+  int found = 0;
 
   //log_debug("contentType = %d, initTypePayload = %d, typePayloadCount = %d",
   //            contentType, pl.initTypePayload[contentType],
@@ -151,61 +159,66 @@ ApachePayloadServer::get_payload( int contentType, int cap, char** buf, int* siz
   assert(cap != 0); //why do you ask for zero capacity?
   PayloadInfo* itr_first, *cur_payload_candidate, *itr_best = NULL;
   if (chosen_payload_choice_strategy == c_most_efficient_payload_choice) {
-    list<EfficiencyIndicator>::iterator  itr_payloads = _payload_database.sorted_payloads.begin();
-    
-    cur_payload_candidate = &_payload_database.payloads[itr_payloads->url_hash];
-    while(itr_payloads != _payload_database.sorted_payloads.end() && 
-          (cur_payload_candidate->corrupted ||
-           cur_payload_candidate->capacity < (unsigned int)cap || 
-           cur_payload_candidate->type != (unsigned int)contentType || 
-           cur_payload_candidate->length/(double)cap < noise2signal)) {
-    itr_payloads++; numCandidate++;
-    cur_payload_candidate = &_payload_database.payloads[itr_payloads->url_hash];
-    
-    }
-
-    if (itr_payloads != _payload_database.sorted_payloads.end() && cur_payload_candidate->length < c_max_buffer_size)
+    const string* best_hash = _payload_database.type_index[contentType].find(cap, noise2signal);
+    if (best_hash) {
+      cur_payload_candidate = &_payload_database.payloads[*best_hash];
+      if (cur_payload_candidate->length < c_max_buffer_size)
       {
         found = true;
         itr_first = itr_best = cur_payload_candidate;
       }
+    }
   }
   else { //    c_random_payload_choice
-    PayloadDict::iterator itr_payloads;
-      while(numCandidate < MAX_CANDIDATE_PAYLOADS) {
-        itr_payloads = _payload_database.payloads.begin();
-        advance(itr_payloads, rng_int(_payload_database.payloads.size()));  
-        if ((*itr_payloads).second.corrupted ||
-            (*itr_payloads).second.capacity <= (unsigned int)cap || 
-            (*itr_payloads).second.type != (unsigned int)contentType || 
-            (*itr_payloads).second.length > c_max_buffer_size || 
-            (*itr_payloads).second.length/(double)cap < noise2signal)
-            continue;
-
-        found = true;
-        itr_first = &((*itr_payloads).second);
-        numCandidate++;
-
-        if (itr_best == NULL)
-          itr_best = itr_first;
-        else if (itr_best->length > itr_first->length)
-          itr_best = itr_first;
-
-      }
+    const string* best_hash = _payload_database.type_index[contentType].sample(cap, noise2signal, c_max_buffer_size);
+    if (best_hash) {
+      found = true;
+      itr_first = itr_best = &_payload_database.payloads[*best_hash];
+    }
   }
 
   if (found)
     {
-      log_debug("cur payload size=%d, best payload size=%d, num candidate=%d for transmiting %d bytes\n",
+      log_debug("cur payload size=%d, best payload size=%d for transmiting %d bytes\n",
                 itr_first->length,
                 itr_best->length,
-                numCandidate,
                 cap);
 
-      string& best_payload = _payload_cache((itr_best->absolute_url_is_absolute ? "" : "http://" + _apache_host_name + "/") + (itr_best->absolute_url)); //this is a permanent object in cache so it is ok to get a reference to it.
+      string* best_payload;
+      if (!_cover_fetcher) {
+        best_payload = &_payload_cache(itr_best->url_hash); //this is a permanent object in cache so it is ok to get a reference to it.
+        if (best_payload->empty()) {
+          //curl failed, don't offer this one again
+          disqualify_payload(itr_best->url_hash);
+        }
+      }
+      else if (!(best_payload = _payload_cache.find(itr_best->url_hash))) {
+        //not at hand: fetch it for next time and make do with what we have.
+        //if the transfer cannot even be set up, that is a local problem
+        //(out of descriptors, say), not the cover's: it stays eligible,
+        //and only a failed transfer (see cover_fetched) disqualifies it
+        bool fetching = _cover_fetcher->fetch(itr_best->url_hash, payload_url(*itr_best));
+
+        const string* substitute_hash = find_cached_substitute(contentType, cap, noise2signal);
+        if (!substitute_hash) {
+          if (!fetching) {
+            log_warn("could not start fetching payload %s and have nothing cached to use instead", itr_best->url.c_str());
+            return 0;
+          }
+          log_debug("waiting for the cover server to deliver payload %s", itr_best->url.c_str());
+          if (payload_id_hash)
+            *payload_id_hash = itr_best->url_hash;
+          return PAYLOAD_PENDING;
+        }
+
+        itr_best = &_payload_database.payloads[*substitute_hash];
+        best_payload = _payload_cache.find(*substitute_hash);
+        log_debug("using cached payload %s of size %d meanwhile", itr_best->url.c_str(), itr_best->length);
+      }
+
       //if curl fails the size will be zero.
-      *buf = (char*)best_payload.c_str();
-      *size = best_payload.length();
+      *buf = (char*)best_payload->c_str();
+      *size = best_payload->length();
       if (payload_id_hash)
         *payload_id_hash = itr_best->url_hash;
 
@@ -217,24 +230,190 @@ ApachePayloadServer::get_payload( int contentType, int cap, char** buf, int* siz
   return 0;
 }
 
+const string*
+ApachePayloadServer::find_cached_substitute(int contentType, int cap, double noise2signal)
+{
+  vector<string> cached_hashes;
+  _payload_cache.get_keys(back_inserter(cached_hashes), MAX_CANDIDATE_PAYLOADS);
+
+  const string* best_hash = NULL;
+  unsigned long best_length = 0;
+  for (vector<string>::iterator cur_hash = cached_hashes.begin(); cur_hash != cached_hashes.end(); cur_hash++) {
+    PayloadDict::iterator cur_payload = _payload_database.payloads.find(*cur_hash);
+    if (cur_payload == _payload_database.payloads.end())
+      continue;
+
+    const PayloadInfo& candidate = cur_payload->second;
+    if (candidate.corrupted || (int)candidate.type != contentType ||
+        candidate.capacity < (unsigned int)cap ||
+        candidate.length < noise2signal * cap ||
+        candidate.length >= c_max_buffer_size ||
+        _payload_cache.peek(*cur_hash)->empty())
+      continue;
+
+    if (!best_hash || candidate.length < best_length) {
+      best_hash = &cur_payload->first;
+      best_length = candidate.length;
+    }
+  }
+
+  return best_hash;
+}
+
+string
+ApachePayloadServer::payload_url(const PayloadInfo& payload)
+{
+  return (payload.absolute_url_is_absolute ? "" : "http://" + _apache_host_name + "/") + payload.absolute_url;
+}
+
+void
+ApachePayloadServer::attach_event_base(struct event_base* base)
+{
+  if (_cover_fetcher || !base)
+    return;
+
+  _cover_fetcher = new CoverFetcher(base, cover_fetched, this);
+}
+
+void
+ApachePayloadServer::warm_up(size_t covers_per_type, size_t byte_budget)
+{
+  if (!_cover_fetcher || _side != server_side) {
+    log_warn("cover warm-up needs the server side and an event loop");
+    return;
+  }
+
+  //every worker has a server and a cache of its own and warms it up
+  //itself. Any of them may be asked for any cover, so each takes the
+  //same covers, but the bytes fetched are shared out, so that the
+  //total is as asked
+  byte_budget /= worker_count();
+
+  //no point fetching what the cache would evict right away
+  byte_budget = min(byte_budget, _payload_cache.capacity());
+
+  vector< vector<const string*> > type_covers;
+  size_t max_rank = 0;
+  for (auto cur_index = _payload_database.type_index.begin(); cur_index != _payload_database.type_index.end(); cur_index++) {
+    type_covers.push_back(vector<const string*>());
+    max_rank = max(max_rank, cur_index->second.most_efficient(covers_per_type, c_max_buffer_size, type_covers.back()));
+  }
+
+  //take the types in turn so that each gets its share of the budget
+  size_t planned_bytes = 0;
+  for (size_t rank = 0; rank < max_rank; rank++)
+    for (auto cur_type = type_covers.begin(); cur_type != type_covers.end(); cur_type++) {
+      if (rank >= cur_type->size())
+        continue;
+
+      const PayloadInfo& cover = _payload_database.payloads[*(*cur_type)[rank]];
+      if (planned_bytes + cover.length > byte_budget)
+        continue;
+
+      planned_bytes += cover.length;
+      _warmup_queue.push_back(cover.url_hash);
+    }
+
+  _warmup_total += _warmup_queue.size();
+  log_info("warming up the payload cache with %lu covers of %lu bytes in total",
+           (unsigned long)_warmup_queue.size(), (unsigned long)planned_bytes);
+
+  while (_warmup_in_flight < c_WARMUP_PARALLEL_FETCHES && !_warmup_queue.empty())
+    warmup_next();
+}
+
+void
+ApachePayloadServer::warmup_next()
+{
+  while (!_warmup_queue.empty()) {
+    string url_hash = _warmup_queue.front();
+    _warmup_queue.pop_front();
+
+    const PayloadInfo& cover = _payload_database.payloads[url_hash];
+    if (cover.corrupted || _payload_cache.peek(url_hash)) {
+      warmup_progress();
+      continue;
+    }
+
+    //a fetch that cannot be started says nothing about the cover
+    if (!_cover_fetcher->fetch(url_hash, payload_url(cover))) {
+      warmup_progress();
+      continue;
+    }
+
+    _cover_fetcher->wait(url_hash, warmup_fetched, this);
+    _warmup_in_flight++;
+    return;
+  }
+}
+
+void
+ApachePayloadServer::warmup_progress()
+{
+  _warmup_done++;
+  if (_warmup_done == _warmup_total)
+    log_info("cover warm-up done: the cache holds %lu bytes in %lu payloads",
+             (unsigned long)_payload_cache.stats().bytes,
+             (unsigned long)_payload_cache.stats().entries);
+  else if (_warmup_done * 10 / _warmup_total != (_warmup_done - 1) * 10 / _warmup_total)
+    log_info("cover warm-up: %lu of %lu covers fetched",
+             (unsigned long)_warmup_done, (unsigned long)_warmup_total);
+}
+
+void
+ApachePayloadServer::warmup_fetched(void* arg)
+{
+  ApachePayloadServer* payload_server = (ApachePayloadServer*) arg;
+
+  payload_server->_warmup_in_flight--;
+  payload_server->warmup_progress();
+  payload_server->warmup_next();
+}
+
+void
+ApachePayloadServer::cover_fetched(const string& url_hash, const string& response, void* arg)
+{
+  ApachePayloadServer* payload_server = (ApachePayloadServer*) arg;
+
+  if (response.empty()) {
+    log_warn("Failed fetch the payload %s", url_hash.c_str());
+    payload_server->disqualify_payload(url_hash);
+    return;
+  }
+
+  payload_server->_payload_cache.store(url_hash, response);
+}
+
+bool
+ApachePayloadServer::wait_for_payload(const string& payload_id_hash, payload_ready_cb cb, void* arg)
+{
+  return _cover_fetcher && _cover_fetcher->wait(payload_id_hash, cb, arg);
+}
+
+void
+ApachePayloadServer::cancel_payload_wait(void* arg)
+{
+  if (_cover_fetcher)
+    _cover_fetcher->cancel(arg);
+}
 
 /**
    This function is supposed to be given to the cache class to be used to retrieve the
-   the element when it isn't in the hash table
+   the element when it isn't in the hash table. It blocks, so it is
+   only used until an event loop is attached.
 
    @param url_hash the sha-1 hash of the url
  */
 string
-ApachePayloadServer::fetch_hashed_url(const string& url)
+ApachePayloadServer::fetch_hashed_url(const string& url_hash)
 {
   stringstream tmp_stream_buf;
-  string payload_uri = url;
+  string payload_uri = payload_url(_payload_database.payloads[url_hash]);
 
   log_debug("asking cover server for payload %s", payload_uri.c_str());
   size_t payload_size = fetch_url_raw(_curl_obj, payload_uri, tmp_stream_buf);
   if (payload_size == 0) {
-    log_warn("Failed fetch the url %s", payload_uri.c_str()); //here we should signal that we failed
-    //to retreieve the file and mark it as unacceptable
+    log_warn("Failed fetch the url %s", payload_uri.c_str()); //the caller disqualifies it
     return string();
   }
 
@@ -341,6 +520,15 @@ ApachePayloadServer::store_dict(char* dict_buf, size_t dict_buf_size)
 
 ApachePayloadServer::~ApachePayloadServer()
 {
+  log_debug("payload cache: %lu hits, %lu misses, %lu evictions, "
+            "holding %lu bytes in %lu payloads",
+            _payload_cache.stats().hits, _payload_cache.stats().misses,
+            _payload_cache.stats().evictions,
+            (unsigned long)_payload_cache.stats().bytes,
+            (unsigned long)_payload_cache.stats().entries);
+
+  delete _cover_fetcher;
+
   /* always cleanup */ 
   log_debug("cleaning up curl easy handle for payload retrieval");
   curl_easy_cleanup(_curl_obj);
@@ -2,11 +2,14 @@
 #define _APACHE_PAYLOAD_SERVER_H
 
 #include <openssl/sha.h> 
+#include <deque>
 #include <unordered_map>
 
 #include "payload_lru_cache.h"
 #include "payload_server.h"
 
+class CoverFetcher;
+
 
 class PayloadScraper; /* Just tell ApachePayloadServer that such a
                         class exists */
@@ -39,6 +42,8 @@ class ApachePayloadServer: public PayloadServer
   
   const unsigned long c_max_buffer_size;
   CURL* _curl_obj; //this is used to communicate with http server
+                   //when no event loop has been attached
+  CoverFetcher* _cover_fetcher; //non-blocking retrieval, once attached
 
   //This is too keep the dict in sync between client and server
   uint8_t _uri_dict_mac[SHA256_DIGEST_LENGTH];
@@ -51,12 +56,12 @@ class ApachePayloadServer: public PayloadServer
   */
   const uint8_t* compute_uri_dict_mac();
 
-  //Cache stuff
-  static const size_t c_PAYLOAD_CACHE_ELEMENT_CAPACITY = 500;
+  //Cache stuff: the byte budget for the whole process, split evenly
+  //among the workers' caches
+  static const size_t c_PAYLOAD_CACHE_BYTE_CAPACITY = 64 * 1024 * 1024;
   /**
      LRU cache to prevent out of memory when there are lots of payload
-     on the server, for now we work with number of payload and can 
-     be improved to the limit by total size
+     on the server, limited by the total size of the cached payloads
    */
   PayloadLRUCache<std::string, std::string, ApachePayloadServer, unordered_map> _payload_cache;
   /**
@@ -67,6 +72,37 @@ class ApachePayloadServer: public PayloadServer
   */
   string fetch_hashed_url(const string& url_hash);
 
+  /** the url the cover server serves the payload at */
+  string payload_url(const PayloadInfo& payload);
+
+  /**
+     Among the most recently used covers in the cache, find the
+     shortest one which is eligible for the request, to stand in for
+     a cover which is still being fetched.
+
+     @return the url_hash of the cover or NULL if none is cached
+  */
+  const string* find_cached_substitute(int contentType, int cap, double noise2signal);
+
+  /**
+     Called by the cover fetcher when a cover arrives: stores it in the
+     cache or, if it could not be retrieved, disqualifies it.
+  */
+  static void cover_fetched(const string& url_hash, const string& response, void* arg);
+
+  //Warm-up stuff
+  static const size_t c_WARMUP_PARALLEL_FETCHES = 8;
+  deque<string> _warmup_queue; //url_hashes of the covers yet to be fetched
+  size_t _warmup_total;
+  size_t _warmup_done;
+  size_t _warmup_in_flight;
+
+  /** start fetching the next cover in the warm-up queue, if any */
+  void warmup_next();
+  /** count a warm-up cover as done and log the progress */
+  void warmup_progress();
+  static void warmup_fetched(void* arg);
+
  public:
   enum PayloadChoiceStrategy {
     c_most_efficient_payload_choice,
@@ -120,9 +156,28 @@ class ApachePayloadServer: public PayloadServer
     */
   ApachePayloadServer(MachineSide init_side, const string& database_filename, const string& cover_server, const string& cover_list); 
 
+  /**
+     From now on fetch covers without blocking, on the event loop
+     BASE.  Until this is called (e.g. by the scraper), covers are
+     fetched synchronously.  Later calls are ignored.
+  */
+  void attach_event_base(struct event_base* base);
+
+  /**
+     Prefetch into the cache, in the background and a few at a time,
+     the covers_per_type most efficient covers of each type (those
+     get_payload picks first), within byte_budget bytes of payload
+     length. With several workers, each warms up its own cache with
+     the same covers, and byte_budget is shared among them. Progress
+     is logged. Needs an attached event loop.
+  */
+  void warm_up(size_t covers_per_type, size_t byte_budget);
+
   /** virtual functions */
   virtual unsigned int find_client_payload(char* buf, int len, int type);
   virtual int get_payload (int contentType, int cap, char** buf, int* size, double noise2signal = 0, std::string* payload_id_hash = NULL);
+  virtual bool wait_for_payload(const std::string& payload_id_hash, payload_ready_cb cb, void* arg);
+  virtual void cancel_payload_wait(void* arg);
 
   /**
      Gets \0 ended uri char* and determines its type based on
@@ -142,11 +197,9 @@ class ApachePayloadServer: public PayloadServer
      overload this function.
    */
   virtual void disqualify_payload(const std::string& payload_id_hash) {
-    _payload_database.payloads[payload_id_hash].corrupted = true;
-
-    //if the disqualified cover is the highest capacity cover then we need to
-    //decrease the max capacity
-    _payload_database.adjust_type_max_capacity(payload_id_hash);
+    //also decreases the max capacity if the disqualified cover was the
+    //highest capacity cover
+    _payload_database.disqualify_payload(payload_id_hash);
   }
 
   /** 
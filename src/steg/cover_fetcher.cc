@@ -0,0 +1,251 @@
+/* See LICENSE for other credits and copying information
+ *
+ * Non-blocking retrieval of covers from the cover server: curl multi
+ * driven by libevent, following the socket/timer callback scheme
+ * described in libcurl's hiperfifo example.
+ */
+#include <event2/event.h>
+
+#include "util.h"
+#include "cover_fetcher.h"
+
+using std::string;
+using std::vector;
+
+CoverFetcher::CoverFetcher(struct event_base *base, fetched_cb on_fetched,
+                           void *on_fetched_arg)
+  : base(base), running(0),
+    on_fetched(on_fetched), on_fetched_arg(on_fetched_arg),
+    completing(NULL)
+{
+  log_assert(base);
+
+  if (!(multi = curl_multi_init()))
+    log_abort("failed to initiate curl multi object for cover retrieval");
+
+  if (!(timer = evtimer_new(base, timer_event_cb, this)))
+    log_abort("failed to create the cover retrieval timer");
+
+  curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, socket_cb);
+  curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, this);
+  curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, timer_cb);
+  curl_multi_setopt(multi, CURLMOPT_TIMERDATA, this);
+}
+
+CoverFetcher::~CoverFetcher()
+{
+  if (!transfers.empty())
+    log_debug("abandoning %lu cover transfers", (unsigned long)transfers.size());
+
+  for (std::map<string, transfer_t *>::iterator i = transfers.begin();
+       i != transfers.end(); i++) {
+    // removing the handle makes curl release its sockets, and with
+    // them the events we were keeping for them
+    curl_multi_remove_handle(multi, i->second->easy);
+    curl_easy_cleanup(i->second->easy);
+    delete i->second;
+  }
+  transfers.clear();
+
+  curl_multi_cleanup(multi);
+  event_free(timer);
+}
+
+bool
+CoverFetcher::fetch(const string& key, const string& url)
+{
+  if (in_flight(key))
+    return true;
+
+  transfer_t *t = new transfer_t;
+  t->key = key;
+  if (!(t->easy = curl_easy_init())) {
+    log_warn("failed to initiate curl to fetch %s", url.c_str());
+    delete t;
+    return false;
+  }
+
+  curl_easy_setopt(t->easy, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(t->easy, CURLOPT_HEADER, 1L);
+  curl_easy_setopt(t->easy, CURLOPT_HTTP_CONTENT_DECODING, 0L);
+  curl_easy_setopt(t->easy, CURLOPT_HTTP_TRANSFER_DECODING, 0L);
+  curl_easy_setopt(t->easy, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(t->easy, CURLOPT_WRITEFUNCTION, write_cb);
+  curl_easy_setopt(t->easy, CURLOPT_WRITEDATA, t);
+  curl_easy_setopt(t->easy, CURLOPT_PRIVATE, t);
+
+  CURLMcode rc = curl_multi_add_handle(multi, t->easy);
+  if (rc != CURLM_OK) {
+    log_warn("failed to start fetching %s: %s", url.c_str(),
+             curl_multi_strerror(rc));
+    curl_easy_cleanup(t->easy);
+    delete t;
+    return false;
+  }
+
+  log_debug("asking cover server for payload %s", url.c_str());
+  transfers[key] = t;
+  return true;
+}
+
+bool
+CoverFetcher::wait(const string& key, waiter_cb cb, void *arg)
+{
+  std::map<string, transfer_t *>::iterator i = transfers.find(key);
+  if (i == transfers.end())
+    return false;
+
+  waiter_t w = { cb, arg };
+  i->second->waiters.push_back(w);
+  return true;
+}
+
+void
+CoverFetcher::cancel(void *arg)
+{
+  for (std::map<string, transfer_t *>::iterator i = transfers.begin();
+       i != transfers.end(); i++)
+    for (vector<waiter_t>::iterator w = i->second->waiters.begin();
+         w != i->second->waiters.end(); )
+      if (w->arg == arg)
+        w = i->second->waiters.erase(w);
+      else
+        w++;
+
+  if (completing)
+    for (vector<waiter_t>::iterator w = completing->begin();
+         w != completing->end(); w++)
+      if (w->arg == arg)
+        w->cb = NULL;
+}
+
+/* Report and dispose of every transfer curl is done with */
+void
+CoverFetcher::check_done()
+{
+  CURLMsg *msg;
+  int msgs_left;
+
+  while ((msg = curl_multi_info_read(multi, &msgs_left))) {
+    if (msg->msg != CURLMSG_DONE)
+      continue;
+
+    CURL *easy = msg->easy_handle;
+    CURLcode res = msg->data.result;
+    transfer_t *t;
+    curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **)&t);
+
+    curl_multi_remove_handle(multi, easy);
+    curl_easy_cleanup(easy);
+    transfers.erase(t->key);
+
+    if (res != CURLE_OK) {
+      log_debug("fetching cover %s failed: %s", t->key.c_str(),
+                curl_easy_strerror(res));
+      t->response.clear();
+    } else {
+      log_debug("read total bytes of : %lu:",
+                (unsigned long)t->response.size());
+    }
+
+    on_fetched(t->key, t->response, on_fetched_arg);
+
+    // A waiter may cancel others (e.g. by closing their connections)
+    // or start new transfers; neither may disturb this loop.
+    vector<waiter_t> *outer = completing;
+    completing = &t->waiters;
+    for (size_t i = 0; i < t->waiters.size(); i++)
+      if (t->waiters[i].cb)
+        t->waiters[i].cb(t->waiters[i].arg);
+    completing = outer;
+
+    delete t;
+  }
+}
+
+/* Called by curl to tell us what to wait for on socket S */
+int
+CoverFetcher::socket_cb(CURL *, curl_socket_t s, int what,
+                        void *userp, void *socketp)
+{
+  CoverFetcher *f = (CoverFetcher *)userp;
+  struct event *ev = (struct event *)socketp;
+
+  if (what == CURL_POLL_REMOVE) {
+    if (ev)
+      event_free(ev);
+    curl_multi_assign(f->multi, s, NULL);
+    return 0;
+  }
+
+  short kind = ((what & CURL_POLL_IN) ? EV_READ : 0) |
+    ((what & CURL_POLL_OUT) ? EV_WRITE : 0) | EV_PERSIST;
+
+  if (ev) {
+    event_del(ev);
+    event_assign(ev, f->base, s, kind, socket_event_cb, f);
+  } else {
+    ev = event_new(f->base, s, kind, socket_event_cb, f);
+    if (!ev)
+      log_abort("failed to create an event for cover retrieval");
+    curl_multi_assign(f->multi, s, ev);
+  }
+  event_add(ev, NULL);
+  return 0;
+}
+
+/* Called by curl to tell us when it wants to be woken up next */
+int
+CoverFetcher::timer_cb(CURLM *, long timeout_ms, void *userp)
+{
+  CoverFetcher *f = (CoverFetcher *)userp;
+
+  if (timeout_ms < 0) {
+    evtimer_del(f->timer);
+    return 0;
+  }
+
+  struct timeval tv;
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+  evtimer_add(f->timer, &tv);
+  return 0;
+}
+
+void
+CoverFetcher::socket_event_cb(evutil_socket_t fd, short what, void *arg)
+{
+  CoverFetcher *f = (CoverFetcher *)arg;
+  int action =
+    ((what & EV_READ) ? CURL_CSELECT_IN : 0) |
+    ((what & EV_WRITE) ? CURL_CSELECT_OUT : 0);
+
+  CURLMcode rc = curl_multi_socket_action(f->multi, fd, action, &f->running);
+  if (rc != CURLM_OK)
+    log_warn("error while fetching covers: %s", curl_multi_strerror(rc));
+
+  f->check_done();
+  if (f->running <= 0)
+    evtimer_del(f->timer);
+}
+
+void
+CoverFetcher::timer_event_cb(evutil_socket_t, short, void *arg)
+{
+  CoverFetcher *f = (CoverFetcher *)arg;
+
+  CURLMcode rc = curl_multi_socket_action(f->multi, CURL_SOCKET_TIMEOUT, 0,
+                                          &f->running);
+  if (rc != CURLM_OK)
+    log_warn("error while fetching covers: %s", curl_multi_strerror(rc));
+
+  f->check_done();
+}
+
+size_t
+CoverFetcher::write_cb(char *ptr, size_t size, size_t nmemb, void *userp)
+{
+  transfer_t *t = (transfer_t *)userp;
+  t->response.append(ptr, size * nmemb);
+  return size * nmemb;
+}
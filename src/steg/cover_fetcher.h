@@ -0,0 +1,107 @@
+/* See LICENSE for other credits and copying information
+ *
+ * Non-blocking retrieval of covers from the cover server
+ */
+#ifndef _COVER_FETCHER_H
+#define _COVER_FETCHER_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <curl/curl.h>
+#include <event2/util.h>
+
+/**
+   Fetches urls with curl multi, driven by a libevent event_base, so
+   that waiting for the cover server never blocks the event loop.
+
+   Each transfer is known by a key chosen by the caller.  Asking for a
+   key that is already being fetched does not start a second
+   transfer.  When a transfer finishes, the fetched_cb given to the
+   constructor receives the response (headers and body, or an empty
+   string if the transfer failed), and then every waiter registered
+   for that key with wait() is called, in the order they were added.
+
+   A fetcher belongs to one event_base and hence to one worker; it is
+   not thread safe.
+ */
+class CoverFetcher
+{
+ public:
+  typedef void (*fetched_cb)(const std::string& key,
+                             const std::string& response, void *arg);
+  typedef void (*waiter_cb)(void *arg);
+
+  CoverFetcher(struct event_base *base, fetched_cb on_fetched,
+               void *on_fetched_arg);
+  ~CoverFetcher();
+
+  /**
+     Start fetching URL under KEY, unless KEY is already being fetched.
+
+     @return false if the transfer could not be started
+  */
+  bool fetch(const std::string& key, const std::string& url);
+
+  /**
+     Have CB(ARG) called once the transfer for KEY is over.
+
+     @return false if KEY is not being fetched
+  */
+  bool wait(const std::string& key, waiter_cb cb, void *arg);
+
+  /** Forget every waiter registered with ARG.  Transfers go on. */
+  void cancel(void *arg);
+
+  bool in_flight(const std::string& key) const
+  {
+    return transfers.find(key) != transfers.end();
+  }
+
+  /** Number of transfers in flight */
+  size_t size() const { return transfers.size(); }
+
+ private:
+  struct waiter_t
+  {
+    waiter_cb cb;
+    void *arg;
+  };
+
+  struct transfer_t
+  {
+    std::string key;
+    std::string response;
+    CURL *easy;
+    std::vector<waiter_t> waiters;
+  };
+
+  struct event_base *base;
+  CURLM *multi;
+  struct event *timer;
+  int running; //number of transfers curl is still working on
+
+  fetched_cb on_fetched;
+  void *on_fetched_arg;
+
+  std::map<std::string, transfer_t *> transfers;
+
+  /** Waiters of the transfer being reported, so that cancel() can
+      reach them while they are being called */
+  std::vector<waiter_t> *completing;
+
+  void check_done();
+
+  static int socket_cb(CURL *easy, curl_socket_t s, int what,
+                       void *userp, void *socketp);
+  static int timer_cb(CURLM *multi, long timeout_ms, void *userp);
+  static void socket_event_cb(evutil_socket_t fd, short what, void *arg);
+  static void timer_event_cb(evutil_socket_t fd, short what, void *arg);
+  static size_t write_cb(char *ptr, size_t size, size_t nmemb, void *userp);
+
+  CoverFetcher(const CoverFetcher&) DELETE_METHOD;
+  CoverFetcher& operator=(const CoverFetcher&) DELETE_METHOD;
+};
+
+#endif
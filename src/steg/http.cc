@@ -89,6 +89,16 @@ http_steg_config_t::store_options(const std::vector<string>& options)
       http_steg_user_configs["cover_list"] = *(cur_option + 1);
       cur_option++;
       
+    } else if (*cur_option == "--cover-warmup" ||
+               *cur_option == "--cover-warmup-budget") {
+      if (cur_option + 1 == options.end() || (cur_option + 1)->empty() ||
+          strspn((cur_option + 1)->c_str(), "0123456789") != (cur_option + 1)->size()) {
+        log_warn("http_steg: option %s requires a number", cur_option->c_str());
+        goto usage;
+      }
+      http_steg_user_configs[*cur_option == "--cover-warmup" ? "cover_warmup" : "cover_warmup_budget"] = *(cur_option + 1);
+      cur_option++;
+
     } else {
       log_warn("chop: unrecognized option '%s'", cur_option->c_str());
       goto usage;
@@ -102,6 +112,9 @@ usage:
            "\thttp <down_address> [steg-options]\n"
            "\t\tdown_address ~ host:port\n"
            "\t\tsteg-options ~ --stegmod \n"
+           "\t\t               --cover-warmup <covers per type>\n"
+           "\t\t               --cover-warmup-budget <bytes>\n"
+           "\t\t(every worker warms up the covers; the bytes are shared)\n"
            "Examples:\n"
            "http 192.168.1.99:11253 stegmod javascript\n"
            "http 192.168.1.99:11253");
@@ -228,13 +241,17 @@ buf_dump(unsigned char* buf, int len, FILE *out)
 
 http_steg_t::http_steg_t(http_steg_config_t *cf, conn_t *cn)
   : config(cf), conn(cn),
-    have_transmitted(false), have_received(false)
+    have_transmitted(false), have_received(false), held_source(NULL)
 {
   memset(peer_dnsname, 0, sizeof peer_dnsname);
 }
 
 http_steg_t::~http_steg_t()
 {
+  if (held_source) {
+    config->payload_server->cancel_payload_wait(this);
+    evbuffer_free(held_source);
+  }
 }
 
 steg_config_t *
@@ -642,8 +659,7 @@ http_steg_t::transmit(struct evbuffer *source)
       return rval;
     }
 
-    log_assert(config->file_steg_mods.find(type) != config->file_steg_mods.end()); //sanity check
-    rval = config->file_steg_mods[type]->http_server_transmit(source, conn);
+    rval = http_server_transmit(source);
 
     // switch(type) {
 
@@ -669,19 +685,70 @@ http_steg_t::transmit(struct evbuffer *source)
     //   break;
     // }
 
-    if (rval >= 0) {
-      have_transmitted = 1;
-      if (type == -1) {
-        log_debug(conn, "have transmited with invalid type!!!");
+    if (rval == FileStegMod::c_TRANSMIT_PENDING)
+      return 0; //as far as the protocol is concerned, the data is on its way
+    return rval;
+  }
+}
+
+int
+http_steg_t::http_server_transmit(struct evbuffer *source)
+{
+  log_assert(config->file_steg_mods.find(type) != config->file_steg_mods.end()); //sanity check
+  int rval = config->file_steg_mods[type]->http_server_transmit(source, conn, resume_server_transmit, this);
+
+  if (rval == FileStegMod::c_TRANSMIT_PENDING) {
+    // Nothing more goes on this connection, but we can't let go of
+    // it till the cover arrives; the data has to outlive source.
+    have_transmitted = 1;
+    if (!held_source) {
+      if (!(held_source = evbuffer_new()) ||
+          evbuffer_add_buffer(held_source, source)) {
+        log_warn(conn, "failed to hold the data till the cover arrives");
+        config->payload_server->cancel_payload_wait(this);
+        return -1;
       }
-          
-      // FIXME: should decide whether or not to do this based on the
-      // Connection: header.  (Needs additional changes elsewhere, esp.
-      // in transmit_room.)
-      conn->cease_transmission();
     }
+    log_debug(conn, "waiting for the cover to transmit %lu bytes",
+              (unsigned long)evbuffer_get_length(held_source));
     return rval;
   }
+
+  if (rval >= 0) {
+    have_transmitted = 1;
+    if (type == -1) {
+      log_debug(conn, "have transmited with invalid type!!!");
+    }
+          
+    // FIXME: should decide whether or not to do this based on the
+    // Connection: header.  (Needs additional changes elsewhere, esp.
+    // in transmit_room.)
+    conn->cease_transmission();
+  }
+  return rval;
+}
+
+/**
+   Called by the payload server when the cover we have been waiting for
+   has arrived.
+*/
+void
+http_steg_t::resume_server_transmit(void *arg)
+{
+  http_steg_t *steg = (http_steg_t *)arg;
+  struct evbuffer *source = steg->held_source;
+  log_assert(source);
+
+  int rval = steg->http_server_transmit(source);
+  if (rval == FileStegMod::c_TRANSMIT_PENDING)
+    return; //still waiting, possibly for another cover
+
+  steg->held_source = NULL;
+  evbuffer_free(source);
+  if (rval < 0) {
+    log_warn(steg->conn, "failed to transmit held data");
+    conn_do_flush(steg->conn);
+  }
 }
 
 int
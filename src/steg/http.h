@@ -65,9 +65,23 @@ lookup_peer_name_from_ip(const char* p_ip, char* p_name);
     bool have_received : 1;
     int type;
 
+    /* data handed to us for transmission while the cover for it is
+       being fetched; NULL otherwise */
+    struct evbuffer *held_source;
+
     http_steg_t(http_steg_config_t *cf, conn_t *cn);
     STEG_DECLARE_METHODS(http);
 
+    /**
+       embeds source in a cover of our type and queues it for the
+       client, or holds on to the data until the cover is fetched
+
+       @return the size of the cover, FileStegMod::c_TRANSMIT_PENDING
+               if the data is being held or < 0 in case of other errors
+    */
+    int http_server_transmit(struct evbuffer *source);
+    static void resume_server_transmit(void *steg);
+
     size_t clamp(size_t val, size_t lo, size_t hi);
     virtual int http_client_uri_transmit (struct evbuffer *source, conn_t *conn);
     virtual int http_client_cookie_transmit (struct evbuffer *source, conn_t *conn);
@@ -84,6 +84,10 @@ namespace  {
     */
     size_t send_dict_to_peer();
 
+    /** server side: fetch covers on BASE from now on, and warm up the
+        payload cache if the user asked for it */
+    virtual void listener_opened(struct event_base *base);
+
     STEG_CONFIG_DECLARE_METHODS(http_apache);
   };
 
@@ -222,6 +226,22 @@ http_apache_steg_config_t::~http_apache_steg_config_t()
 
 }
 
+void
+http_apache_steg_config_t::listener_opened(struct event_base *base)
+{
+  if (is_clientside)
+    return;
+
+  ApachePayloadServer* apache_payload_server = (ApachePayloadServer*)payload_server;
+  apache_payload_server->attach_event_base(base);
+
+  if (!http_steg_user_configs["cover_warmup"].empty()) {
+    size_t warmup_budget = http_steg_user_configs["cover_warmup_budget"].empty() ?
+      SIZE_MAX : strtoul(http_steg_user_configs["cover_warmup_budget"].c_str(), NULL, 10);
+    apache_payload_server->warm_up(strtoul(http_steg_user_configs["cover_warmup"].c_str(), NULL, 10), warmup_budget);
+  }
+}
+
 steg_t *
 http_apache_steg_config_t::steg_create(conn_t *conn)
 {
@@ -106,7 +106,8 @@ FileStegMod::extract_appropriate_respones_body(evbuffer* payload_buf)
    @param data_len: the payload should be able to accomodate this length
    @param payload_buf: the buff that is going to contain the chosen payloa
 
-   @return payload size or < 0 in case of error
+   @return payload size, 0 if the chosen payload (identified by
+           cover_id_hash) is still being fetched, or < 0 in case of error
 */
 ssize_t FileStegMod::pick_appropriate_cover_payload(size_t data_len, char** payload_buf, string& cover_id_hash)
 {
@@ -125,10 +126,13 @@ ssize_t FileStegMod::pick_appropriate_cover_payload(size_t data_len, char** payl
 
   ssize_t payload_size = 0;
   do {
-    if (_payload_server->get_payload(c_content_type, data_len, payload_buf,
-                                     (int*)&payload_size, noise2signal, &cover_id_hash) == 1) {
+    int found = _payload_server->get_payload(c_content_type, data_len, payload_buf,
+                                             (int*)&payload_size, noise2signal, &cover_id_hash);
+    if (found == 1) {
       log_debug("SERVER found the next HTTP response template with size %d",
                 (int)payload_size);
+    } else if (found == PAYLOAD_PENDING) {
+      return 0;
     } else { //we can't do much here anymore, we need to add payload to payload
       //database unless if the payload_server is serving randomly which means
       //next time probably won't serve a corrupted payload
@@ -148,11 +152,14 @@ ssize_t FileStegMod::pick_appropriate_cover_payload(size_t data_len, char** payl
 
    @param source the data to be transmitted
    @param conn the connection over which the data is going to be transmitted
+   @param resume called with resume_arg when the cover we have to wait
+          for arrives
 
    @return the number of bytes transmitted
 */
 int
-FileStegMod::http_server_transmit(evbuffer *source, conn_t *conn)
+FileStegMod::http_server_transmit(evbuffer *source, conn_t *conn,
+                                  payload_ready_cb resume, void *resume_arg)
 {
 
   uint8_t* data1;
@@ -187,6 +194,15 @@ FileStegMod::http_server_transmit(evbuffer *source, conn_t *conn)
       return -1;
     }
 
+    if (cnt == 0) { //the cover server has yet to deliver, source stays as is
+      delete [] data1;
+      if (!_payload_server->wait_for_payload(payload_id_hash, resume, resume_arg)) {
+        log_warn("Failed to wait for payload.");
+        return -1;
+      }
+      return c_TRANSMIT_PENDING;
+    }
+
     //we shouldn't touch the cover as there is only one copy of it in the
     //the cache
     //log_debug("cover body: %s",cover_payload);
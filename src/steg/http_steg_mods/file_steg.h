@@ -43,7 +43,9 @@ protected:
      @param data_len: the payload should be able to accomodate this length
      @param payload_buf: the evbuffer that is going to contain the chosen payload
 
-     @return payload size or < 0 in case of error
+     @return payload size, 0 if the chosen payload (identified by
+             cover_id_hash) is still being fetched, or < 0 in case of
+             error
   */
   ssize_t pick_appropriate_cover_payload(size_t data_len, char** payload_buf, string& cover_id_hash);
   
@@ -78,6 +80,7 @@ protected:
  public:
   static const size_t c_HTTP_MSG_BUF_SIZE = HTTP_MSG_BUF_SIZE; //TODO: one constant
   static const  size_t c_MAX_MSG_BUF_SIZE = 131101;
+  static const int c_TRANSMIT_PENDING = -3; //waiting for the cover, see http_server_transmit
   /**
      embed the data in the cover buffer, the assumption is that
      the function doesn't expand the buffer size
@@ -114,10 +117,16 @@ protected:
      to its typex
      @param source the data to be transmitted
      @param conn the connection over which the data is going to be transmitted
+     @param resume if the cover has to be fetched first, nothing is
+            transmitted (and source is left untouched) but
+            resume(resume_arg) is called once it is ready, to try again
 
-     @return the actual number of bytes (cover size) transmitted
+     @return the actual number of bytes (cover size) transmitted,
+             c_TRANSMIT_PENDING if we are waiting for the cover or < 0
+             in case of other errors
   */
-  virtual int http_server_transmit(evbuffer *source, conn_t *conn);
+  virtual int http_server_transmit(evbuffer *source, conn_t *conn,
+                                   payload_ready_cb resume, void *resume_arg);
 
   /**
      Tries to extract the embeded data in source buffer and put them
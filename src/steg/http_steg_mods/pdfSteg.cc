@@ -274,20 +274,17 @@ strInBinaryRewind (const char *pattern, unsigned int patternLen,
 
 int PDFSteg::encode(uint8_t* data, size_t data_len, uint8_t* cover_payload, size_t cover_len)
 {
-  size_t data2size = 2*cover_len+10; 
-  // see rfc 1950 for zlib format, in addition to compressed data, we have
-  // 2-byte compression method and flags +
-  // 4-byte dict ID +
-  // 4-byte ADLER32 checksum
-   uint8_t data2[data2size];
+  const char stream_meta_data[] = " <<\n/Length %d\n/Filter /FlateDecode\n>>\nstream\n";
+  const char end_stream_flag[] = "\nendstream";
+  // room for the meta data with any length filled in, and its NUL
+  const size_t meta_max = sizeof stream_meta_data + 3*sizeof(int);
+  const size_t end_len = sizeof end_stream_flag - 1;
   const char *tp, *plimit;
-  char *op;
   char *streamStart, *streamEnd, *filterStart;
-  size_t data2len, size;
   int np;
 
   assert(HTTP_MSG_BUF_SIZE < SIZE_T_CEILING); //zlib offsetting limit
-  if (cover_len > SIZE_T_CEILING || data_len > SIZE_T_CEILING) 
+  if (cover_len > c_HTTP_MSG_BUF_SIZE || data_len > SIZE_T_CEILING) 
     return -1;
 
    if (headless_capacity((char*)cover_payload, cover_len) <  (int) data_len) {
@@ -295,98 +292,88 @@ int PDFSteg::encode(uint8_t* data, size_t data_len, uint8_t* cover_payload, size
     return -1; //not enough capacity is an error because you should have check     //before requesting
   }
 
-  data2len = compress((const uint8_t *)data, data_len, 
-                     data2, data2size, c_format_zlib);
-  if ((int)data2len < 0) {
-    log_warn("compress failed and returned %lu", (unsigned long)data2len);
-    return -1;
-  }
-
-  char* temp_out_buf = new char[c_HTTP_MSG_BUF_SIZE];  // current pointer for output buffer
-  op = (char*) temp_out_buf;
-  tp = (const char*) cover_payload;  // current pointer for http msg template, replace with payloadbuf?
+  tp = (const char*) cover_payload;  // current pointer for http msg template
   plimit = (const char *) (cover_payload+cover_len);
 
   //vmon: Here obviously the intent was to break data and put it in different chunks 
   //(as the capcaity function suggests but they got lazy and dumped everything in the
   //first chunk
-  while (tp < plimit) {
-    // find the next stream obj
-    streamStart = strInBinary(STREAM_BEGIN, STREAM_BEGIN_SIZE, tp, plimit-tp);
-    if (streamStart == NULL) {
-      log_warn("Cannot find stream in pdf");
-      return -1;
-    }
+  // find the first stream obj
+  streamStart = strInBinary(STREAM_BEGIN, STREAM_BEGIN_SIZE, tp, plimit-tp);
+  if (streamStart == NULL) {
+    log_warn("Cannot find stream in pdf");
+    return -1;
+  }
 
-    streamEnd = strInBinary(STREAM_END, STREAM_END_SIZE, tp,  plimit-tp);
-    if (streamEnd == NULL) {
-      log_warn("Cannot find endstream in pdf");
-      return -1;
-    }
+  streamEnd = strInBinary(STREAM_END, STREAM_END_SIZE, tp,  plimit-tp);
+  if (streamEnd == NULL) {
+    log_warn("Cannot find endstream in pdf");
+    return -1;
+  }
 
-    filterStart = strInBinaryRewind(" obj", 4, tp, streamStart-tp);
-    if (filterStart == NULL) {
-      log_warn("Cannot find obj\n");
-      delete[] temp_out_buf;
-      return -1;
-    } else {
-      const char stream_meta_data[] = " <<\n/Length %d\n/Filter /FlateDecode\n>>\nstream\n";
-      const char end_stream_flag[] = "\nendstream";
-      // copy everything between tp and up and and including "obj" to outbuf
-
-      //but first check if we are overflowing our limit
-      size = filterStart - tp + 4;
-      if (size + strlen(stream_meta_data) + sizeof(int)*(8.0/3.0) + data2len  + (plimit - streamEnd) > c_HTTP_MSG_BUF_SIZE) {
-        log_warn("pdf encoding would results in buffer overflow, tell SRI to fix their encoding to use all available chunks instead of dumping evenything in the first chunk.");
-        delete[] temp_out_buf;
-        return -1;
-      }
+  filterStart = strInBinaryRewind(" obj", 4, tp, streamStart-tp);
+  if (filterStart == NULL) {
+    log_warn("Cannot find obj\n");
+    return -1;
+  }
 
-      memcpy(op, tp, size);
-      op[size] = 0;
-      op += size;
+  // The result is built in the cover buffer itself (which has
+  // c_HTTP_MSG_BUF_SIZE bytes).  Everything up to and including "obj"
+  // stays where it is; the rest of the template after the stream is
+  // moved to the end of the buffer, and the data are compressed into
+  // the space between, after room for the stream meta data.  Then the
+  // pieces are closed up.
+  char *buf = (char *)cover_payload;
+  char *op = filterStart + 4;
+  const char *rest = streamEnd + STREAM_END_SIZE;
+  size_t rest_len = plimit - rest;
+  size_t reserved = (op - buf) + meta_max + end_len + rest_len;
+  if (reserved >= c_HTTP_MSG_BUF_SIZE) {
+    log_warn("pdf encoding would results in buffer overflow, tell SRI to fix their encoding to use all available chunks instead of dumping evenything in the first chunk.");
+    return -1;
+  }
 
-      // write meta-data for stream object
-      np = sprintf(op, stream_meta_data, (int)data2len);
-      if (np < 0) {
-        log_warn("sprintf failed\n");
-        delete[] temp_out_buf;
-        return -1;
-      }
-      op += np;
-
-      // copy compressed data to outbuf 
-      memcpy(op, data2, data2len);
-      op += data2len;
-
-      // write endstream to outbuf
-      np = sprintf(op, end_stream_flag);
-      if (np < 0) {
-        log_warn("sprintf failed\n");
-        delete[] temp_out_buf;
-        return -1;
-      }
-      op += np;
-    }
+  char *rest_saved = buf + c_HTTP_MSG_BUF_SIZE - rest_len;
+  memmove(rest_saved, rest, rest_len);
 
-    // done with encoding data
-    tp = streamEnd+STREAM_END_SIZE;
-    break;
+  uint8_t *zp = (uint8_t *)op + meta_max;
+  deflater z(c_format_zlib);
+  if (!z.ok())
+    return -1;
+  z.set_output(zp, c_HTTP_MSG_BUF_SIZE - reserved);
+  int ret = z.write(data, data_len);
+  if (ret == 0)
+    ret = z.finish();
+  if (ret == -2) {
+    log_warn("pdf encoding would results in buffer overflow, tell SRI to fix their encoding to use all available chunks instead of dumping evenything in the first chunk.");
+    return -1;
+  } else if (ret) {
+    log_warn("compress failed and returned %d", ret);
+    return -1;
+  }
+  size_t data2len = z.total_out();
+
+  // write meta-data for stream object, then move the compressed data
+  // up behind it
+  np = sprintf(op, stream_meta_data, (int)data2len);
+  if (np < 0) {
+    log_warn("sprintf failed\n");
+    return -1;
   }
+  op += np;
+  memmove(op, zp, data2len);
+  op += data2len;
+
+  // write endstream, and the rest of pdfTemplate
+  memcpy(op, end_stream_flag, end_len);
+  op += end_len;
 
-  // copy the rest of pdfTemplate to outbuf
-  size = plimit-tp;
   log_debug("copying the rest of pdfTemplate to outbuf (size %lu)",
-            (unsigned long)size);
-  memcpy(op, tp, size);
-  op += size;
-
-  //now we need to copy the new buffer into what we were given
-  size_t  encoded_pdf_size = op - temp_out_buf;
-  memcpy(cover_payload, temp_out_buf, encoded_pdf_size);
-  delete[]temp_out_buf;
-  
-  return encoded_pdf_size;
+            (unsigned long)rest_len);
+  memmove(op, rest_saved, rest_len);
+  op += rest_len;
+
+  return op - buf;
 
 }
 
@@ -23,41 +23,36 @@ static const char http_response_1[] =
 //unsigned int
 //swf_wrap(PayloadServer* pl, char* inbuf, int in_len, char* outbuf, int out_sz) {
 int SWFSteg::encode(uint8_t* data, size_t data_len, uint8_t* cover_payload, size_t cover_len) {
-  char* tmp_buf;
-  int out_swf_len;
-  //int in_swf_len;
-
-  //char* rend;
-  //char hdr[512];
-  //unsigned int hdr_len;
-
-  //char* tmp_buf2;
-  //char* resp;
-  //int resp_len;
-
   if (headless_capacity((char*)cover_payload, cover_len) <  (int) data_len) {
     log_warn("not enough cover capacity to embed data");
     return -1; //not enough capacity is an error because you should have check     //before requesting
   }
 
-  tmp_buf = (char *)xmalloc(data_len + SWF_SAVE_HEADER_LEN + SWF_SAVE_FOOTER_LEN);
-  //tmp_buf2 = (char *)xmalloc(data_len);
-  
   //we skip the first 8 bytes, because we don't want to compress them
-  //4 bytes magic and 4 bytes are the the length of the compressed blob
-  memcpy(tmp_buf, cover_payload+8, SWF_SAVE_HEADER_LEN); //look at get_payload in trace_payload_server. 
-  memcpy(tmp_buf+SWF_SAVE_HEADER_LEN, data, data_len);
-  memcpy(tmp_buf+SWF_SAVE_HEADER_LEN+data_len, cover_payload + cover_len - SWF_SAVE_FOOTER_LEN, SWF_SAVE_FOOTER_LEN);
-  out_swf_len =
-    compress((const uint8_t *)tmp_buf,
-             SWF_SAVE_HEADER_LEN + data_len + SWF_SAVE_FOOTER_LEN,
-             (uint8_t *)cover_payload+8,
-             data_len + SWF_SAVE_HEADER_LEN + SWF_SAVE_FOOTER_LEN + 512-8,
-             c_format_zlib);
+  //4 bytes magic and 4 bytes are the the length of the compressed blob.
+  //the compressed body overwrites the cover from there on, so only the
+  //header and footer we keep are set aside; the data are compressed
+  //from where they are
+  uint8_t saved[SWF_SAVE_HEADER_LEN + SWF_SAVE_FOOTER_LEN];
+  memcpy(saved, cover_payload+8, SWF_SAVE_HEADER_LEN); //look at get_payload in trace_payload_server. 
+  memcpy(saved+SWF_SAVE_HEADER_LEN, cover_payload + cover_len - SWF_SAVE_FOOTER_LEN, SWF_SAVE_FOOTER_LEN);
+
+  deflater z(c_format_zlib);
+  if (!z.ok())
+    return -1;
+
+  z.set_output(cover_payload+8,
+               data_len + SWF_SAVE_HEADER_LEN + SWF_SAVE_FOOTER_LEN + 512-8);
+  if (z.write(saved, SWF_SAVE_HEADER_LEN) ||
+      z.write(data, data_len) ||
+      z.write(saved+SWF_SAVE_HEADER_LEN, SWF_SAVE_FOOTER_LEN) ||
+      z.finish()) {
+    log_warn("swf compression failed");
+    return -1;
+  }
+  int out_swf_len = z.total_out();
 
   ((int*) (cover_payload))[1] = out_swf_len; //this is not a good practice, implementation becomes machine dependent little/big indian wise.
-  
-  free(tmp_buf);
 
   return out_swf_len + 8;
 
@@ -65,32 +60,24 @@ int SWFSteg::encode(uint8_t* data, size_t data_len, uint8_t* cover_payload, size
 
 ssize_t SWFSteg::decode(const uint8_t *cover_payload, size_t cover_len, uint8_t* data)
 {
-  int inf_len;
-  size_t tmp_len = cover_len * 32; //asset later?
-  char* tmp_buf = (char *)xmalloc(tmp_len);
-
-  for (;;) {
-    inf_len = decompress(cover_payload + 8, cover_len - 8,
-                         (uint8_t *)tmp_buf, tmp_len);
-    if (inf_len != -2)
-      break;
-    tmp_len *= 2;
-    tmp_buf = (char *)xrealloc(tmp_buf, tmp_len);
+  //the payload sits between the saved header and footer of the
+  //inflated body; skip the header while inflating and let the rest,
+  //footer included, land directly in data (c_HTTP_MSG_BUF_SIZE bytes,
+  //which encode never fills beyond)
+  if (cover_len < 8) {
+    log_warn("swf cover too short: %lu", (unsigned long)cover_len);
+    return -1;
   }
 
-  if (inf_len < 0 /*|| //no need for this check it always comes this big
-      sizeof(data) < c_HTTP_MSG_BUF_SIZE */) {
-    fprintf(stderr, "inf_len = %d\n", inf_len);
-    free(tmp_buf);
+  ssize_t inf_len = decompress_skip(cover_payload + 8, cover_len - 8,
+                                    SWF_SAVE_HEADER_LEN,
+                                    data, c_HTTP_MSG_BUF_SIZE);
+  if (inf_len < SWF_SAVE_FOOTER_LEN) {
+    log_warn("swf decompression failed: %ld", (long)inf_len);
     return -1;
   }
 
-  memcpy(data, tmp_buf + SWF_SAVE_HEADER_LEN,
-         inf_len - SWF_SAVE_HEADER_LEN - SWF_SAVE_FOOTER_LEN);
-  
-tmp_len= inf_len - SWF_SAVE_HEADER_LEN - SWF_SAVE_FOOTER_LEN; //reassigned to existing variable
-
-return (ssize_t)tmp_len; //added for new return type
+  return inf_len - SWF_SAVE_FOOTER_LEN;
 }
 
 ssize_t SWFSteg::headless_capacity(char *cover_body, int body_length)
@@ -2,17 +2,38 @@
 #define _PAYLOAD_LRU_CACHE_H
  
 #include <cassert> 
-#include <list> 
+#include <string>
 
 #include <util.h> 
-// Class providing fixed-size (by number of records) 
-// LRU-replacement cache of a function with signature 
-// V f(K). 
+
+// Number of bytes a cached value accounts for.  Overload this for
+// value types other than std::string.
+inline size_t
+payload_cache_value_size(const std::string& v)
+{
+  return v.size();
+}
+
+// Class providing LRU-replacement cache of a function with
+// signature V f(K), bounded by the total size of the cached values
+// (as reported by payload_cache_value_size) rather than by their
+// number.
 // MAP should be one of std::map or std::unordered_map. 
 // Variadic template args used to deal with the 
 // different type argument signatures of those 
 // containers; the default comparator/hash/allocator 
 // will be used. 
+//
+// The recency list is threaded through the map's own entries, so
+// each key is stored once, and a hit costs one lookup and a few
+// pointer updates.  Both kinds of MAP keep their elements in place
+// when other elements are inserted or erased, which is what makes
+// this safe.
+//
+// The cache is not thread safe.  It is meant to be owned by a steg
+// configuration, and every worker thread has its own copy of those,
+// so each worker has a separate cache; the owner is expected to give
+// each its share of the byte budget.
 template < 
   typename K, 
   typename V,
@@ -24,127 +45,209 @@ public:
   typedef K key_type; 
   typedef V value_type; 
  
-  // Key access history, most recent at back 
-  typedef std::list<key_type> key_tracker_type; 
+  // Usage counters, for logging and tuning the byte budget
+  struct stats_type
+  {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    size_t bytes;       // currently held
+    size_t entries;     // currently held
+  };
  
-  // Key to value and key history iterator 
-  typedef MAP< 
-    key_type, 
-    std::pair< 
-      value_type, 
-      typename key_tracker_type::iterator 
-      > 
-  > key_to_value_type; 
+private:
+  // A cached value, linked into the recency list: most recent at
+  // _newest, least recent at _oldest.
+  struct entry_type
+  {
+    value_type value;
+    size_t size;
+    const key_type* key;  // points at the map's copy of the key
+    entry_type* newer;
+    entry_type* older;
+
+    entry_type(const value_type& v)
+      : value(v), size(payload_cache_value_size(v)), key(NULL),
+        newer(NULL), older(NULL)
+    { }
+  };
 
+  typedef MAP<key_type, entry_type> key_to_value_type;
+
+public:
   // Constuctor specifies the cached function and 
-  // the maximum number of records to be stored 
+  // the maximum number of bytes of values to be stored
   PayloadLRUCache( 
   RETRIEVER* retriever_object,
   value_type (RETRIEVER::*f)(const key_type&),
-    size_t c 
+    size_t byte_capacity
   ) 
     :retriever(retriever_object),
      _fn(f),
-    _capacity(c) 
+    _capacity(byte_capacity),
+    _newest(NULL),
+    _oldest(NULL)
   
   { 
     assert(_capacity!=0); 
+    _stats.hits = _stats.misses = _stats.evictions = 0;
+    _stats.bytes = _stats.entries = 0;
   } 
  
-  // Obtain reference to the value of the cached function for k
+  // Obtain reference to the value of the cached function for k.
+  // The reference stays valid until the next call.
   value_type& operator()(const key_type& k) { 
  
     // Attempt to find existing record 
     typename key_to_value_type::iterator it 
       =_key_to_value.find(k); 
  
+    entry_type* e;
     if (it==_key_to_value.end()) { 
+      _stats.misses++;
       log_debug("payload cache MISS");
       
-      // We don't have it: 
- 
-      // Evaluate function and create new record 
-      const value_type v = (retriever->*_fn)(k); 
-      insert(k,v); 
- 
-      // now we should be able to find this key
-      // in the cache.
-      it = _key_to_value.find(k);
+      // We don't have it: evaluate function and create new record
+      e = insert(k, (retriever->*_fn)(k));
  
     } else { 
       // We do have it: 
+      _stats.hits++;
       log_debug("payload cache HIT");
 
+      e = &it->second;
+      unlink(e);
+      link_newest(e);
     }
   
-    assert(it != _key_to_value.end());
-    // Update access record by moving 
-    // accessed key to back of list 
-    _key_tracker.splice( 
-                        _key_tracker.end(), 
-                        _key_tracker, 
-                        (*it).second.second 
-                         ); 
-
     // Return the retrieved value 
-    return (*it).second.first; 
+    return e->value;
 
   } 
+
+  // Look k up without calling the retriever.  A hit counts as a use
+  // of the value; a miss is only counted.  The pointer stays valid
+  // until the next call that may insert or evict.
+  value_type* find(const key_type& k) {
+    typename key_to_value_type::iterator it = _key_to_value.find(k);
+    if (it == _key_to_value.end()) {
+      _stats.misses++;
+      return NULL;
+    }
+
+    _stats.hits++;
+    entry_type* e = &it->second;
+    unlink(e);
+    link_newest(e);
+    return &e->value;
+  }
+
+  // Look k up without touching the recency list or the counters.
+  const value_type* peek(const key_type& k) const {
+    typename key_to_value_type::const_iterator it = _key_to_value.find(k);
+    return it == _key_to_value.end() ? NULL : &it->second.value;
+  }
+
+  // Record a value obtained elsewhere (e.g. asynchronously) for k,
+  // replacing any value already held for it.
+  value_type& store(const key_type& k, const value_type& v) {
+    typename key_to_value_type::iterator it = _key_to_value.find(k);
+    if (it != _key_to_value.end())
+      erase(&it->second);
+
+    return insert(k, v)->value;
+  }
+
+  const stats_type& stats() const { return _stats; }
+
+  size_t capacity() const { return _capacity; }
  
   // Obtain the cached keys, most recently used element 
   // at head, least recently used at tail. 
   // This method is provided purely to support testing. 
   template <typename IT> void get_keys(IT dst) const { 
-    typename key_tracker_type::const_reverse_iterator src 
-      =_key_tracker.rbegin(); 
-    while (src!=_key_tracker.rend()) { 
-      *dst++ = *src++; 
-    } 
+    get_keys(dst, _stats.entries);
+  }
+
+  // The same, but only the max_keys most recently used ones.
+  template <typename IT> void get_keys(IT dst, size_t max_keys) const {
+    for (const entry_type* e = _newest; e && max_keys; e = e->older, max_keys--)
+      *dst++ = *e->key;
   } 
  
 private: 
  
   // Record a fresh key-value pair in the cache 
-  void insert(const key_type& k, const value_type& v) { 
+  entry_type* insert(const key_type& k, const value_type& v) {
  
-    // Method is only called on cache misses 
+    // Method is only called for keys that are not held
     assert(_key_to_value.find(k)==_key_to_value.end()); 
  
-log_debug("payload cache is holding %lu elements of %lu capacity", _key_to_value.size(),_capacity);
-    // Make space if necessary 
-    if (_key_to_value.size()==_capacity) 
+    // Make space if necessary.  A value bigger than the whole
+    // budget is still kept, alone, so that the caller's reference
+    // stays good.
+    size_t size = payload_cache_value_size(v);
+    while (_oldest && _stats.bytes + size > _capacity)
       evict(); 
  
-    // Record k as most-recently-used key 
-    typename key_tracker_type::iterator it 
-      =_key_tracker.insert(_key_tracker.end(),k); 
- 
-    // Create the key-value entry, 
-    // linked to the usage record. 
-    _key_to_value.insert( 
-      std::make_pair( 
-        k, 
-        std::make_pair(v,it) 
-      ) 
-    ); 
+    typename key_to_value_type::iterator it = _key_to_value.insert(
+      std::make_pair(k, entry_type(v))).first;
     // No need to check return, 
     // given previous assert. 
+
+    entry_type* e = &it->second;
+    e->key = &it->first;
+    link_newest(e);
+
+    _stats.bytes += e->size;
+    _stats.entries++;
+    log_debug("payload cache is holding %lu bytes in %lu elements of %lu bytes capacity",
+              (unsigned long)_stats.bytes, (unsigned long)_stats.entries,
+              (unsigned long)_capacity);
+    return e;
   } 
  
   // Purge the least-recently-used element in the cache 
   void evict() { 
  
     // Assert method is never called when cache is empty 
-    assert(!_key_tracker.empty()); 
+    assert(_oldest);
  
-    // Identify least recently used key 
-    const typename key_to_value_type::iterator it 
-      =_key_to_value.find(_key_tracker.front()); 
-    assert(it!=_key_to_value.end()); 
+    _stats.evictions++;
+    erase(_oldest);
+  }
  
-    // Erase both elements to completely purge record 
-    _key_to_value.erase(it); 
-    _key_tracker.pop_front(); 
+  // Drop an element, whatever its place in the recency list
+  void erase(entry_type* e) {
+    unlink(e);
+    _stats.bytes -= e->size;
+    _stats.entries--;
+
+    // Erasing the entry also frees the key it points to, so look
+    // it up through a copy.
+    _key_to_value.erase(key_type(*e->key));
+  }
+
+  void unlink(entry_type* e) {
+    if (e->newer)
+      e->newer->older = e->older;
+    else
+      _newest = e->older;
+    if (e->older)
+      e->older->newer = e->newer;
+    else
+      _oldest = e->newer;
+    e->newer = e->older = NULL;
+  }
+
+  void link_newest(entry_type* e) {
+    e->newer = NULL;
+    e->older = _newest;
+    if (_newest)
+      _newest->newer = e;
+    _newest = e;
+    if (!_oldest)
+      _oldest = e;
   } 
 
     //pointer to the object that owns the _fn functions
@@ -152,15 +255,19 @@ log_debug("payload cache is holding %lu elements of %lu capacity", _key_to_value
   // The function to be cached 
   value_type (RETRIEVER::*_fn)(const key_type&); 
  
-  // Maximum number of key-value pairs to be retained 
+  // Maximum number of bytes of values to be retained
   const size_t _capacity; 
  
-  // Key access history 
-  key_tracker_type _key_tracker; 
+  // Key-to-value lookup, which also holds the recency list
+  key_to_value_type _key_to_value;
  
-  // Key-to-value lookup 
-  key_to_value_type _key_to_value; 
+  entry_type* _newest;
+  entry_type* _oldest;
+
+  stats_type _stats;
+
+  PayloadLRUCache(const PayloadLRUCache&) DELETE_METHOD;
+  PayloadLRUCache& operator=(const PayloadLRUCache&) DELETE_METHOD;
 }; 
  
 #endif
-
@@ -4,6 +4,7 @@
  */
 
 #include "util.h"
+#include "rng.h"
 #include "payload_server.h"
 #include "file_steg.h"
 #include "http_steg_mods/swfSteg.h"
@@ -11,6 +12,162 @@
 //#include "http_steg_mods/jsSteg.h"
 #include <ctype.h>
 #include <time.h>
+#include <limits>
+
+void
+CoverIndex::add(const string& url_hash, unsigned long length, unsigned int capacity)
+{
+  log_assert(!leaves);
+  by_length.push_back(EfficiencyIndicator(url_hash, length));
+  capacities.push_back(capacity);
+}
+
+void
+CoverIndex::build()
+{
+  //sort by length, keeping the order of addition among equal lengths
+  vector<size_t> order(by_length.size());
+  for (size_t i = 0; i < order.size(); i++)
+    order[i] = i;
+  stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+      return by_length[a].length < by_length[b].length;
+    });
+
+  vector<EfficiencyIndicator> sorted;
+  sorted.reserve(by_length.size());
+  for (leaves = 1; leaves < order.size(); leaves *= 2);
+  tree.assign(2 * leaves, 0);
+  position.clear();
+
+  for (size_t i = 0; i < order.size(); i++) {
+    sorted.push_back(by_length[order[i]]);
+    tree[leaves + i] = capacities[order[i]];
+    position[sorted[i].url_hash] = i;
+  }
+  for (size_t node = leaves - 1; node > 0; node--)
+    tree[node] = max(tree[2 * node], tree[2 * node + 1]);
+
+  by_length.swap(sorted);
+  capacities.clear();
+}
+
+/**
+   The first leaf at or after BEGIN, within the subtree NODE which
+   covers leaves [NODE_BEGIN, NODE_END), whose capacity is at least
+   MIN_CAPACITY; -1 if there is none.  Whole subtrees whose maximum is
+   too small are skipped, which keeps this logarithmic.
+*/
+long
+CoverIndex::first_fit(size_t node, size_t node_begin, size_t node_end,
+                      size_t begin, unsigned int min_capacity) const
+{
+  if (node_end <= begin || tree[node] < min_capacity)
+    return -1;
+  if (node_end - node_begin == 1)
+    return node_begin;
+
+  size_t middle = (node_begin + node_end) / 2;
+  long found = first_fit(2 * node, node_begin, middle, begin, min_capacity);
+  if (found >= 0)
+    return found;
+  return first_fit(2 * node + 1, middle, node_end, begin, min_capacity);
+}
+
+const string*
+CoverIndex::find(unsigned int cap, double noise2signal) const
+{
+  if (!leaves || by_length.empty())
+    return NULL;
+
+  //covers which would be too short for the noise to signal ratio
+  //come first, skip them
+  size_t begin = partition_point(by_length.begin(), by_length.end(),
+                                 [cap, noise2signal](const EfficiencyIndicator& cover) {
+                                   return cover.length/(double)cap < noise2signal;
+                                 }) - by_length.begin();
+
+  long found = first_fit(1, 0, leaves, begin, max(cap, 1u));
+  return found < 0 ? NULL : &by_length[found].url_hash;
+}
+
+const string*
+CoverIndex::sample(unsigned int cap, double noise2signal,
+                   unsigned long max_length, size_t max_candidates) const
+{
+  if (!leaves || by_length.empty() || cap == numeric_limits<unsigned int>::max())
+    return NULL;
+
+  //the covers of acceptable length form the range [begin, end)
+  size_t begin = partition_point(by_length.begin(), by_length.end(),
+                                 [cap, noise2signal](const EfficiencyIndicator& cover) {
+                                   return cover.length/(double)cap < noise2signal;
+                                 }) - by_length.begin();
+  size_t end = upper_bound(by_length.begin() + begin, by_length.end(),
+                           max_length,
+                           [](unsigned long length, const EfficiencyIndicator& cover) {
+                             return length < cover.length;
+                           }) - by_length.begin();
+
+  //if nothing in the range qualifies, say so instead of drawing
+  long shortest = first_fit(1, 0, leaves, begin, cap + 1);
+  if (shortest < 0 || (size_t)shortest >= end)
+    return NULL;
+
+  size_t best = end, candidates = 0;
+  for (size_t draws = 0;
+       draws < MAX_CANDIDATE_DRAWS && candidates < max_candidates; draws++) {
+    size_t drawn = begin + rng_int(end - begin);
+    if (tree[leaves + drawn] <= cap)
+      continue;
+
+    candidates++;
+    best = min(best, drawn);
+  }
+
+  //out of luck, fall back on the one we know about
+  if (best == end)
+    best = shortest;
+
+  return &by_length[best].url_hash;
+}
+
+size_t
+CoverIndex::most_efficient(size_t max_covers, unsigned long max_length,
+                           vector<const string*>& covers) const
+{
+  if (!leaves)
+    return 0;
+
+  size_t found = 0;
+  unsigned int best_capacity = 0;
+  for (size_t i = 0; i < by_length.size() && found < max_covers; i++) {
+    if (by_length[i].length >= max_length)
+      break;
+
+    //a cover is only ever the most efficient choice if no shorter one
+    //can carry as much
+    if (tree[leaves + i] > best_capacity) {
+      best_capacity = tree[leaves + i];
+      covers.push_back(&by_length[i].url_hash);
+      found++;
+    }
+  }
+
+  return found;
+}
+
+void
+CoverIndex::disqualify(const string& url_hash)
+{
+  map<string, size_t>::const_iterator cover = position.find(url_hash);
+  if (cover == position.end())
+    return;
+
+  size_t node = leaves + cover->second;
+  tree[node] = 0;
+  for (node /= 2; node > 0; node /= 2)
+    tree[node] = max(tree[2 * node], tree[2 * node + 1]);
+}
 
 /*
  * capacityJS3 is the next iteration for capacityJS
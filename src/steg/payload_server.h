@@ -18,12 +18,19 @@ using namespace std;
 
 #define NO_NEXT_STATE -1
 
+// get_payload's answer when the chosen cover is still being fetched
+// and no other suitable one is at hand; see wait_for_payload
+#define PAYLOAD_PENDING 2
+
 #define MAX_PAYLOADS 10000
 #define MAX_RESP_HDR_SIZE 8192
 
 // max number of payloads that have enough capacity from which
 // we choose the best fit
 #define MAX_CANDIDATE_PAYLOADS 100
+// max number of random draws, including rejected ones, made while
+// looking for those candidates
+#define MAX_CANDIDATE_DRAWS (4 * MAX_CANDIDATE_PAYLOADS)
 
 // jsSteg-specific defines
 #define JS_DELIMITER '?'
@@ -150,6 +157,76 @@ class EfficiencyIndicator
   }
 };
 
+/**
+   Index of the covers of one content type, answering "which is the
+   shortest usable cover with at least this much capacity" in
+   logarithmic time.  The covers are kept sorted by length (ties in
+   the order they were added), and a max segment tree over that order
+   holds the capacity of each cover, or zero once the cover has been
+   disqualified.  Covers are added with add() and the index becomes
+   usable after build(); after that only disqualify() may change it.
+*/
+class CoverIndex
+{
+ protected:
+  vector<EfficiencyIndicator> by_length;
+  vector<unsigned int> capacities; //covers' capacities in by_length order, only needed till build()
+  vector<unsigned int> tree; //tree[1] is the root, leaves start at tree[leaves]
+  size_t leaves;
+  map<string, size_t> position; //url_hash -> index in by_length
+
+  long first_fit(size_t node, size_t node_begin, size_t node_end,
+                 size_t begin, unsigned int min_capacity) const;
+
+ public:
+  CoverIndex() : leaves(0) {}
+
+  void add(const string& url_hash, unsigned long length, unsigned int capacity);
+  void build();
+
+  /**
+     Find the shortest cover with capacity of at least CAP whose
+     length is at least NOISE2SIGNAL times CAP.
+
+     @return the url_hash of the cover, or NULL if there is none
+  */
+  const string* find(unsigned int cap, double noise2signal = 0) const;
+
+  /**
+     Draw covers at random, uniformly, among those whose capacity is
+     greater than CAP and whose length is at least NOISE2SIGNAL times
+     CAP and at most MAX_LENGTH, until MAX_CANDIDATES of them have
+     been found or MAX_CANDIDATE_DRAWS draws have been made, and
+     return the shortest one found.  Each draw takes constant time.
+     If there is no such cover at all, or the draws were all unlucky,
+     this is known without drawing (or after the budget runs out) and
+     NULL, or respectively the shortest such cover, is returned.
+
+     @return the url_hash of the cover, or NULL if there is none
+  */
+  const string* sample(unsigned int cap, double noise2signal,
+                       unsigned long max_length,
+                       size_t max_candidates = MAX_CANDIDATE_PAYLOADS) const;
+
+  /**
+     Append to COVERS, shortest first, the first MAX_COVERS covers
+     shorter than MAX_LENGTH which find() can return, i.e. those with
+     more capacity than every shorter cover.
+
+     @return the number of covers appended
+  */
+  size_t most_efficient(size_t max_covers, unsigned long max_length,
+                        vector<const string*>& covers) const;
+
+  /** Take the cover out of consideration for good. */
+  void disqualify(const string& url_hash);
+
+  /** Largest capacity among the covers that have not been disqualified */
+  unsigned int max_capacity() const { return leaves ? tree[1] : 0; }
+
+  size_t size() const { return by_length.size(); }
+};
+
 /** 
     The initiation process needs to fill up the
     fields of this class
@@ -188,7 +265,7 @@ class PayloadDatabase{
 
   //pentry_header payload_hdrs[MAX_PAYLOADS];
   PayloadDict payloads;
-  list<EfficiencyIndicator> sorted_payloads;
+  map<unsigned int, CoverIndex> type_index; //one per content type
 
   map<unsigned int, TypeDetail> type_detail;
 
@@ -205,29 +282,22 @@ class PayloadDatabase{
   }
 
   /**
-   reduce the maximum capacity of a specific type in case the cover with
-   maximum capacity get marked as corrupted 
+   mark the payload as corrupted, take it out of its type's index and
+   reduce the maximum capacity of its type if it was the cover with
+   the maximum capacity
 
    @param payload_id_hash id_hash of the payload which got corrupted/became unavailable
 
   */
-  void adjust_type_max_capacity(const std::string&  payload_id_hash ){
-      //see if adjustment is needed.
-    if (payloads[payload_id_hash].corrupted &&
-        payloads[payload_id_hash].capacity >= typed_maximum_capacity(payloads[payload_id_hash].type)) {
-      //then we need to probably decrease the maximum capacity
-      const unsigned int affected_type = payloads[payload_id_hash].type;
-      //searching for new max capacity among all eligible covers
-      type_detail[affected_type].max_capacity = 0;
-      for(auto cur_payload = payloads.begin(); cur_payload != payloads.end(); cur_payload++)
-        {
-          if ((cur_payload->second.type == affected_type) &&
-              (!cur_payload->second.corrupted) &&
-              (cur_payload->second.capacity > type_detail[affected_type].max_capacity)) {
-            type_detail[affected_type].max_capacity = cur_payload->second.capacity;
-          }
-        }
-    }
+  void disqualify_payload(const std::string&  payload_id_hash ){
+    PayloadDict::iterator payload = payloads.find(payload_id_hash);
+    if (payload == payloads.end() || payload->second.corrupted)
+      return;
+
+    payload->second.corrupted = true;
+    CoverIndex& index = type_index[payload->second.type];
+    index.disqualify(payload_id_hash);
+    type_detail[payload->second.type].max_capacity = index.max_capacity();
   }
   
 };
@@ -239,6 +309,10 @@ enum MachineSide
     server_side
   };
 
+/* Called when a cover get_payload had to wait for is available (or
+   has been given up on) */
+typedef void (*payload_ready_cb)(void* arg);
+
 class PayloadServer
 {
  protected:
@@ -274,9 +348,33 @@ class PayloadServer
      @param payload_id_hash if payload_id_has is not NULL, then the function
             copy the payload identifier hash into for further reference like
             disqualifiying the payload
+
+     @return 1 if a payload was found, 0 if there is none, or
+             PAYLOAD_PENDING if the payload identified by
+             payload_id_hash needs to be fetched first
    */
   virtual int get_payload (int contentType, int cap, char** buf, int* size, double noise2signal=0, std::string* payload_id_hash = NULL) = 0;
 
+  /**
+     Have CB(ARG) called once the payload get_payload answered
+     PAYLOAD_PENDING for is ready, at which point get_payload should be
+     asked again.  Payload servers which never answer PAYLOAD_PENDING
+     need not overload this.
+
+     @return false if the payload is not being waited for
+   */
+  virtual bool wait_for_payload(const std::string& payload_id_hash, payload_ready_cb cb, void* arg) {
+    (void) payload_id_hash;
+    (void) cb;
+    (void) arg;
+    return false;
+  }
+
+  /** Forget every wait_for_payload request made with ARG */
+  virtual void cancel_payload_wait(void* arg) {
+    (void) arg; //nop
+  }
+
   /**
      turn on the corrupted flag for the payload identified by payload_id_hash
      
@@ -0,0 +1,67 @@
+/* See LICENSE for other credits and copying information
+ */
+#ifndef _TRACE_DB_H
+#define _TRACE_DB_H
+
+#include <stdint.h>
+
+/**
+   A trace database is a payload trace (as written by pgen_fake or
+   pgen_pcap) compiled into a form TracePayloadServer can mmap and use
+   as is: content lengths are already fixed up, and the covers usable
+   for each content type, with their capacities, are listed in the
+   index.  Loading one takes constant time and every process using the
+   same file shares one read-only copy of it.
+
+   The file is laid out as
+
+     trace_db_header
+     trace_db_entry[payload_count]
+     trace_db_cover[cover_count[t]], for each content type t
+     the payloads, each followed by a NUL
+
+   Offsets are from the beginning of the file.  Integers are in the
+   byte order of the host that compiled the trace; a database compiled
+   elsewhere is rejected rather than converted.
+*/
+
+#define TRACE_DB_MAGIC "STTRCDB"  /* 8 bytes, with the NUL */
+#define TRACE_DB_VERSION 1
+#define TRACE_DB_BYTE_ORDER 0x01020304
+#define TRACE_DB_CONTENT_TYPES 11 /* must be MAX_CONTENT_TYPE */
+
+struct trace_db_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t file_size;
+  uint32_t payload_count;
+  uint32_t reserved;
+  uint64_t entries_offset;
+  uint64_t cover_offset[TRACE_DB_CONTENT_TYPES];
+  uint32_t cover_count[TRACE_DB_CONTENT_TYPES];
+  uint32_t max_capacity[TRACE_DB_CONTENT_TYPES];
+};
+
+struct trace_db_entry
+{
+  uint64_t offset;
+  uint32_t length;  /* after fixing up Content-Length */
+  uint16_t ptype;
+  uint16_t port;    /* network format */
+};
+
+struct trace_db_cover
+{
+  uint32_t payload; /* index of the trace_db_entry */
+  uint32_t capacity;
+};
+
+/**
+   Compile the trace in TRACE_FNAME into a trace database in DB_FNAME.
+   Returns true on success.
+*/
+bool trace_db_compile(const char *trace_fname, const char *db_fname);
+
+#endif
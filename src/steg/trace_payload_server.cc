@@ -5,10 +5,34 @@
 //#include "http_steg_mods/swfSteg.h"
 #include "http_steg_mods/pdfSteg.h"
 
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::vector;
+
 
 TracePayloadServer::TracePayloadServer(MachineSide init_side, string fname)
-  : PayloadServer(init_side), c_max_buffer_size(1000000)
+  : PayloadServer(init_side), c_max_buffer_size(1000000),
+    _db(NULL), _db_size(0), _db_header(NULL), _db_entries(NULL)
 {
+  memset(_db_covers, 0, sizeof(_db_covers));
+
+  if (map_trace_db(fname.c_str())) {
+    // everything init_*_payload_pool would work out is in the index
+    srand(time(NULL));
+    for (int t = 0; t < MAX_CONTENT_TYPE; t++) {
+      pl.initTypePayload[t] = 1;
+      if (_db_header->cover_count[t] || _db_header->max_capacity[t])
+        _payload_database.type_detail[t] =
+          TypeDetail(_db_header->max_capacity[t], _db_header->cover_count[t]);
+    }
+    return;
+  }
 
   load_payloads(fname.c_str());
 
@@ -30,6 +54,178 @@ TracePayloadServer::TracePayloadServer(MachineSide init_side, string fname)
 
 }
 
+TracePayloadServer::~TracePayloadServer()
+{
+  if (_db) {
+    munmap((void *)_db, _db_size);
+    return;
+  }
+
+  for (int r = 0; r < pl.payload_count; r++)
+    free(pl.payloads[r]);
+}
+
+bool
+TracePayloadServer::map_trace_db(const char* fname)
+{
+  static_assert(TRACE_DB_CONTENT_TYPES == MAX_CONTENT_TYPE,
+                "trace database and payload server disagree on content types");
+
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    return false; // load_payloads will complain
+
+  struct stat st;
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(trace_db_header)) {
+    close(fd);
+    return false;
+  }
+
+  void* m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) {
+    log_warn("failed to map %s: %s", fname, strerror(errno));
+    return false;
+  }
+
+  const trace_db_header* h = (const trace_db_header*)m;
+  if (memcmp(h->magic, TRACE_DB_MAGIC, sizeof(h->magic))) {
+    // a plain trace
+    munmap(m, st.st_size);
+    return false;
+  }
+
+  // Only the header and the bounds of the tables are checked here, so
+  // that loading does not depend on the size of the trace; db_entry
+  // and db_cover check each entry as it is used.
+  size_t size = st.st_size;
+  bool ok = h->version == TRACE_DB_VERSION &&
+    h->byte_order == TRACE_DB_BYTE_ORDER &&
+    h->file_size == size &&
+    h->entries_offset <= size &&
+    h->payload_count <= (size - h->entries_offset) / sizeof(trace_db_entry);
+  for (int t = 0; ok && t < MAX_CONTENT_TYPE; t++)
+    ok = h->cover_offset[t] <= size &&
+      h->cover_count[t] <= (size - h->cover_offset[t]) / sizeof(trace_db_cover);
+
+  if (!ok)
+    log_abort("%s is not a trace database this build can use; "
+              "recompile it from its trace", fname);
+
+  _db = (const uint8_t*)m;
+  _db_size = size;
+  _db_header = h;
+  _db_entries = (const trace_db_entry*)(_db + h->entries_offset);
+  for (int t = 0; t < MAX_CONTENT_TYPE; t++)
+    _db_covers[t] = (const trace_db_cover*)(_db + h->cover_offset[t]);
+
+  log_debug("mapped %u payloads from trace database %s",
+            h->payload_count, fname);
+  return true;
+}
+
+const trace_db_entry&
+TracePayloadServer::db_entry(int r) const
+{
+  log_assert(r >= 0 && (uint32_t)r < _db_header->payload_count);
+
+  // every payload is followed by a NUL (see write_trace_db)
+  const trace_db_entry& e = _db_entries[r];
+  if (e.offset >= _db_size || e.length >= _db_size - e.offset ||
+      _db[e.offset + e.length] != '\0')
+    log_abort("payload %d of the trace database lies outside it; "
+              "recompile it from its trace", r);
+  return e;
+}
+
+const trace_db_cover&
+TracePayloadServer::db_cover(int contentType, int i) const
+{
+  log_assert(contentType >= 0 && contentType < MAX_CONTENT_TYPE);
+  log_assert(i >= 0 && (uint32_t)i < _db_header->cover_count[contentType]);
+
+  const trace_db_cover& c = _db_covers[contentType][i];
+  if (c.payload >= _db_header->payload_count)
+    log_abort("cover %d of type %d in the trace database names no payload; "
+              "recompile it from its trace", i, contentType);
+  return c;
+}
+
+bool
+TracePayloadServer::write_trace_db(const char* fname)
+{
+  trace_db_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, TRACE_DB_MAGIC, sizeof(h.magic));
+  h.version = TRACE_DB_VERSION;
+  h.byte_order = TRACE_DB_BYTE_ORDER;
+  h.payload_count = payload_count();
+
+  uint64_t offset = sizeof(h);
+  h.entries_offset = offset;
+  offset += (uint64_t)h.payload_count * sizeof(trace_db_entry);
+
+  for (int t = 0; t < MAX_CONTENT_TYPE; t++) {
+    h.cover_offset[t] = offset;
+    if (_db || pl.initTypePayload[t])
+      h.cover_count[t] = type_payload_count(t);
+    if (_payload_database.type_detail.count(t))
+      h.max_capacity[t] = _payload_database.type_detail[t].max_capacity;
+    offset += (uint64_t)h.cover_count[t] * sizeof(trace_db_cover);
+  }
+
+  vector<trace_db_entry> entries(h.payload_count);
+  for (int r = 0; r < (int)h.payload_count; r++) {
+    entries[r].offset = offset;
+    entries[r].length = payload_length(r);
+    entries[r].ptype = payload_type(r);
+    entries[r].port = _db ? _db_entries[r].port : pl.payload_hdrs[r].port;
+    offset += entries[r].length + 1;
+  }
+  h.file_size = offset;
+
+  FILE* f = fopen(fname, "wb");
+  if (!f) {
+    log_warn("cannot open %s for writing: %s", fname, strerror(errno));
+    return false;
+  }
+
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+  if (ok && h.payload_count)
+    ok = fwrite(&entries[0], sizeof(trace_db_entry), h.payload_count, f)
+      == h.payload_count;
+
+  for (int t = 0; ok && t < MAX_CONTENT_TYPE; t++)
+    for (unsigned int i = 0; ok && i < h.cover_count[t]; i++) {
+      trace_db_cover c;
+      c.payload = type_payload(t, i);
+      c.capacity = type_payload_capacity(t, i);
+      ok = fwrite(&c, sizeof(c), 1, f) == 1;
+    }
+
+  for (int r = 0; ok && r < (int)h.payload_count; r++)
+    ok = fwrite(payload(r), 1, entries[r].length + 1, f)
+      == entries[r].length + 1;
+
+  if (fclose(f) || !ok) {
+    log_warn("failed to write trace database %s", fname);
+    return false;
+  }
+
+  log_debug("wrote %u payloads to trace database %s", h.payload_count, fname);
+  return true;
+}
+
+bool
+trace_db_compile(const char* trace_fname, const char* db_fname)
+{
+  // the payload tables are too big for the stack
+  TracePayloadServer* trace = new TracePayloadServer(server_side, trace_fname);
+  bool ok = trace->write_trace_db(db_fname);
+  delete trace;
+  return ok;
+}
+
 
 /*
  * init_payload_pool initializes the arrays pertaining to 
@@ -352,11 +548,11 @@ int TracePayloadServer::get_payload (int contentType, int cap, char** buf, int*
 
   log_debug("contentType = %d, initTypePayload = %d, typePayloadCount = %d",
             contentType, pl.initTypePayload[contentType],
-            pl.typePayloadCount[contentType]);
+            type_payload_count(contentType));
 
   if ((!is_activated_valid_content_type(contentType)) ||
       pl.initTypePayload[contentType] == 0 ||
-      pl.typePayloadCount[contentType] == 0
+      type_payload_count(contentType) == 0
       )
     //|| (cap <= 0) //why should you ask for no or negative capacity?
     //Aparently negative capacity means your cap doesn't matter
@@ -364,7 +560,7 @@ int TracePayloadServer::get_payload (int contentType, int cap, char** buf, int*
     //swf format.
     return 0;
 
-  cnt = pl.typePayloadCount[contentType];
+  cnt = type_payload_count(contentType);
   r = rand() % cnt;
   best = r;
   first = r;
@@ -378,14 +574,14 @@ int TracePayloadServer::get_payload (int contentType, int cap, char** buf, int*
 
     //If the cap <= 0 is asked then we are not responsible for the consequence
     if (cap > 0)
-      if (pl.typePayloadCap[contentType][current] <= cap || pl.payload_hdrs[pl.typePayload[contentType][current]].length/(double)cap < noise2signal) {
-        //log_debug("payload %d only offer %d bytes \n", current, pl.typePayloadCap[contentType][current]);
+      if (type_payload_capacity(contentType, current) <= cap || payload_length(type_payload(contentType, current))/(double)cap < noise2signal) {
+        //log_debug("payload %d only offer %d bytes \n", current, type_payload_capacity(contentType, current));
         continue;
       }
 
     if (found) {
-      if (pl.payload_hdrs[pl.typePayload[contentType][best]].length >
-          pl.payload_hdrs[pl.typePayload[contentType][current]].length)
+      if (payload_length(type_payload(contentType, best)) >
+          payload_length(type_payload(contentType, current)))
         best = current;
     } else {
       first = current;
@@ -397,11 +593,11 @@ int TracePayloadServer::get_payload (int contentType, int cap, char** buf, int*
 
   if (found) {
     log_debug("first payload size=%d, best payload size=%d, num candidate=%d\n",
-      pl.payload_hdrs[pl.typePayload[contentType][first]].length,
-      pl.payload_hdrs[pl.typePayload[contentType][best]].length,
+      payload_length(type_payload(contentType, first)),
+      payload_length(type_payload(contentType, best)),
       numCandidate);
-    *buf = pl.payloads[pl.typePayload[contentType][best]];
-    *size = pl.payload_hdrs[pl.typePayload[contentType][best]].length;
+    *buf = payload(type_payload(contentType, best));
+    *size = payload_length(type_payload(contentType, best));
     return 1;
   } else {
     log_warn("couldn't find payload with desired capacity: r=%d, checked %d payloads\n", r, i);
@@ -491,16 +687,16 @@ void TracePayloadServer::load_payloads(const char* fname)
 
 
 unsigned int TracePayloadServer::find_client_payload(char* buf, int len, int type) {
-  int r = rand() % pl.payload_count;
+  int count = payload_count();
+  int r = rand() % count;
   int cnt = 0;
   char* inbuf;
 
   log_debug("trying payload %d", r);
   while (1) {
-    pentry_header* p = &pl.payload_hdrs[r];
-    if (p->ptype == type) {
-      inbuf = pl.payloads[r];
-      int requested_uri_type = find_uri_type(inbuf, p->length);
+    if (payload_type(r) == type) {
+      inbuf = payload(r);
+      int requested_uri_type = find_uri_type(inbuf, payload_length(r));
       //we also need to check if the user has restricted the type,
       //empty active type list means no restriciton
       if (!is_activated_valid_content_type(requested_uri_type)) {
@@ -510,27 +706,27 @@ unsigned int TracePayloadServer::find_client_payload(char* buf, int len, int typ
 
       log_debug("found payload %d of actived type %d", r, requested_uri_type);
       
-      if (p->length > len) {
+      if (payload_length(r) > len) {
         fprintf(stderr, "BUFFER TOO SMALL... \n");
         goto next;
       }
       else
-        len = p->length;
+        len = payload_length(r);
       break;
     }
   next:
-    r = (r+1) % pl.payload_count;
+    r = (r+1) % count;
 
     // no matching payloads...
-    if (cnt++ == pl.payload_count) {
+    if (cnt++ == count) {
       log_warn("no matching payloads");
       return 0;
     }
   }
 
-  inbuf[len] = 0;
+  // payloads are NUL terminated however they were loaded, and a
+  // mapped one must not be written to
 
   // clean up the buffer...
   return parse_client_headers(inbuf, buf, len);
 }
-
@@ -5,6 +5,7 @@
 #define _TRACE_PAYLOAD_SERVER_H
 
 #include "payload_server.h"
+#include "trace_db.h"
 //#include "http_steg_mods/pdfSteg.h"
 /* struct for reading in the payload_gen dump file */
 /* Our PayloadInfo class in payload_server should become universal enough 
@@ -47,9 +48,54 @@ class TracePayloadServer: public PayloadServer
   payloads pl;
   const unsigned long c_max_buffer_size;
 
+  /* the mapped trace database, if we were given one instead of a
+     trace; pl is unused then */
+  const uint8_t* _db;
+  size_t _db_size;
+  const trace_db_header* _db_header;
+  const trace_db_entry* _db_entries;
+  const trace_db_cover* _db_covers[MAX_CONTENT_TYPE];
+
   /** called by the constructor to load the payloads */
   void load_payloads(const char* fname);
 
+  /**
+     called by the constructor to map fname if it is a trace database
+
+     @return false if it is not one (or not a usable one)
+  */
+  bool map_trace_db(const char* fname);
+
+  /* The entry for payload r and the i-th cover of contentType in the
+     trace database, checked against the mapping as they are used */
+  const trace_db_entry& db_entry(int r) const;
+  const trace_db_cover& db_cover(int contentType, int i) const;
+
+  /* Uniform access to the payloads, however they were loaded */
+  int payload_count() const {
+    return _db ? _db_header->payload_count : pl.payload_count;
+  }
+  char* payload(int r) const {
+    //the mapping is read only, which suits every user of the payloads
+    return _db ? (char*)_db + db_entry(r).offset : pl.payloads[r];
+  }
+  int payload_length(int r) const {
+    return _db ? db_entry(r).length : pl.payload_hdrs[r].length;
+  }
+  PacketType payload_type(int r) const {
+    return _db ? db_entry(r).ptype : pl.payload_hdrs[r].ptype;
+  }
+  int type_payload_count(int contentType) const {
+    return _db ? _db_header->cover_count[contentType] : pl.typePayloadCount[contentType];
+  }
+  /** index of the i-th cover of contentType */
+  int type_payload(int contentType, int i) const {
+    return _db ? db_cover(contentType, i).payload : pl.typePayload[contentType][i];
+  }
+  int type_payload_capacity(int contentType, int i) const {
+    return _db ? db_cover(contentType, i).capacity : pl.typePayloadCap[contentType][i];
+  }
+
  public:
 
   /**
@@ -58,6 +104,16 @@ class TracePayloadServer: public PayloadServer
     */
   TracePayloadServer(MachineSide init_side, string fname); 
 
+  virtual ~TracePayloadServer();
+
+  /**
+     Writes the loaded payloads, with the covers of each type and their
+     capacities, as a trace database (see trace_db.h).
+
+     @return true on success
+  */
+  bool write_trace_db(const char* fname);
+
   /**virtual functions */
   unsigned int find_client_payload(char* buf, int len, int type);
 
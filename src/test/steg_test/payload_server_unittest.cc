@@ -0,0 +1,314 @@
+/* Copyright 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "payload_server.h"
+#include "payload_lru_cache.h"
+#include "trace_payload_server.h"
+
+#include <iterator>
+#include <unordered_map>
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+
+class CoverIndexTest : public testing::Test {
+ protected:
+  CoverIndex index;
+
+  virtual void SetUp() {
+    // url_hash, length, capacity
+    index.add("c", 3000, 200);
+    index.add("a", 1000, 100);
+    index.add("e", 5000, 500);
+    index.add("b", 2000, 50);
+    index.add("d", 3000, 400);
+    index.build();
+  }
+
+  string found(unsigned int cap, double noise2signal = 0) {
+    const string* hash = index.find(cap, noise2signal);
+    return hash ? *hash : "";
+  }
+};
+
+TEST_F(CoverIndexTest, shortest_with_enough_capacity) {
+  EXPECT_EQ("a", found(1));
+  EXPECT_EQ("a", found(100));
+  EXPECT_EQ("c", found(101));
+  EXPECT_EQ("d", found(300));   // same length as c, but only d fits
+  EXPECT_EQ("e", found(500));
+  EXPECT_EQ("", found(501));
+  EXPECT_EQ(500u, index.max_capacity());
+}
+
+TEST_F(CoverIndexTest, noise2signal) {
+  EXPECT_EQ("b", found(50, 40));  // b is exactly 40 * 50
+  EXPECT_EQ("c", found(50, 41));  // a and b are shorter than 41 * 50
+  EXPECT_EQ("e", found(100, 40));
+  EXPECT_EQ("", found(100, 51));
+}
+
+TEST_F(CoverIndexTest, disqualify) {
+  index.disqualify("a");
+  EXPECT_EQ("b", found(1));
+  EXPECT_EQ("c", found(51));
+
+  index.disqualify("e");
+  EXPECT_EQ(400u, index.max_capacity());
+  EXPECT_EQ("", found(401));
+
+  index.disqualify("no such cover");
+  EXPECT_EQ("d", found(201));
+}
+
+static string
+joined(const vector<const string*>& covers)
+{
+  string all;
+  for (size_t i = 0; i < covers.size(); i++)
+    all += *covers[i];
+  return all;
+}
+
+TEST_F(CoverIndexTest, most_efficient) {
+  vector<const string*> covers;
+  // b is never chosen: a is shorter and carries more
+  EXPECT_EQ(4u, index.most_efficient(10, 10000, covers));
+  EXPECT_EQ("acde", joined(covers));
+
+  covers.clear();
+  EXPECT_EQ(2u, index.most_efficient(2, 10000, covers));
+  EXPECT_EQ("ac", joined(covers));
+
+  covers.clear();
+  EXPECT_EQ(3u, index.most_efficient(10, 5000, covers));
+  EXPECT_EQ("acd", joined(covers));
+
+  covers.clear();
+  index.disqualify("c");
+  index.most_efficient(10, 10000, covers);
+  EXPECT_EQ("ade", joined(covers));
+}
+
+TEST(CoverIndexEmptyTest, empty) {
+  CoverIndex index;
+  EXPECT_EQ(NULL, index.find(1));
+  index.build();
+  EXPECT_EQ(NULL, index.find(1));
+  EXPECT_EQ(0u, index.max_capacity());
+  vector<const string*> covers;
+  EXPECT_EQ(0u, index.most_efficient(10, 10000, covers));
+}
+
+TEST_F(CoverIndexTest, sample) {
+  // only e has more than 400 capacity
+  for (int i = 0; i < 20; i++)
+    EXPECT_EQ("e", *index.sample(400, 0, 10000));
+
+  // d and e qualify; with enough draws the shorter one wins
+  for (int i = 0; i < 20; i++)
+    EXPECT_EQ("d", *index.sample(300, 0, 10000));
+
+  // e is too long, or both are too short for the noise to signal ratio
+  EXPECT_EQ("d", *index.sample(300, 0, 4000));
+  EXPECT_EQ(NULL, index.sample(450, 0, 4000));
+  EXPECT_EQ(NULL, index.sample(300, 17, 10000));
+  EXPECT_EQ(NULL, index.sample(500, 0, 10000));
+
+  index.disqualify("d");
+  EXPECT_EQ("e", *index.sample(300, 0, 10000));
+  EXPECT_EQ(NULL, index.sample(300, 0, 4000));
+}
+
+/* Stands in for the cover server: the payload for a key is as many
+   bytes as the key says, and every retrieval is counted. */
+class Retriever
+{
+ public:
+  unsigned int fetches;
+
+  Retriever() : fetches(0) {}
+
+  string fetch(const string& key) {
+    fetches++;
+    return string(atoi(key.c_str()), 'x');
+  }
+};
+
+typedef PayloadLRUCache<string, string, Retriever, unordered_map> TestCache;
+
+static vector<string>
+cached_keys(const TestCache& cache)
+{
+  vector<string> keys;
+  cache.get_keys(back_inserter(keys));
+  return keys;
+}
+
+TEST(PayloadLRUCacheTest, byte_budget) {
+  Retriever retriever;
+  TestCache cache(&retriever, &Retriever::fetch, 100);
+
+  EXPECT_EQ(40u, cache("40").size());
+  EXPECT_EQ(30u, cache("30").size());
+  EXPECT_EQ(40u, cache("40").size());  // hit, 40 is now the newest
+  EXPECT_EQ(2u, retriever.fetches);
+  EXPECT_EQ(70u, cache.stats().bytes);
+
+  // 50 more bytes do not fit: the oldest, 30, has to go
+  cache("50");
+  vector<string> keys = cached_keys(cache);
+  ASSERT_EQ(2u, keys.size());
+  EXPECT_EQ("50", keys[0]);
+  EXPECT_EQ("40", keys[1]);
+  EXPECT_EQ(90u, cache.stats().bytes);
+
+  EXPECT_EQ(1ul, cache.stats().hits);
+  EXPECT_EQ(3ul, cache.stats().misses);
+  EXPECT_EQ(1ul, cache.stats().evictions);
+}
+
+TEST(PayloadLRUCacheTest, oversized_value) {
+  Retriever retriever;
+  TestCache cache(&retriever, &Retriever::fetch, 100);
+
+  cache("10");
+  cache("20");
+
+  // bigger than the whole budget: kept, but alone
+  string& big = cache("150");
+  EXPECT_EQ(150u, big.size());
+  vector<string> keys = cached_keys(cache);
+  ASSERT_EQ(1u, keys.size());
+  EXPECT_EQ("150", keys[0]);
+  EXPECT_EQ(2ul, cache.stats().evictions);
+
+  cache("10");
+  EXPECT_EQ(1u, cache.stats().entries);
+  EXPECT_EQ(10u, cache.stats().bytes);
+}
+
+TEST(PayloadLRUCacheTest, find_and_store) {
+  Retriever retriever;
+  TestCache cache(&retriever, &Retriever::fetch, 100);
+
+  EXPECT_EQ(NULL, cache.find("10"));
+  EXPECT_EQ(NULL, cache.peek("10"));
+
+  // values fetched elsewhere go in without the retriever
+  cache.store("10", string(10, 'y'));
+  cache.store("20", string(20, 'y'));
+  EXPECT_EQ(0u, retriever.fetches);
+  ASSERT_TRUE(cache.find("10") != NULL);
+  EXPECT_EQ(string(10, 'y'), *cache.find("10"));
+  EXPECT_EQ("10", cached_keys(cache)[0]);
+
+  // peeking does not count as a use
+  EXPECT_EQ(20u, cache.peek("20")->size());
+  EXPECT_EQ("10", cached_keys(cache)[0]);
+
+  // storing again replaces the value
+  cache.store("10", string(70, 'z'));
+  EXPECT_EQ(90u, cache.stats().bytes);
+  EXPECT_EQ(2u, cache.stats().entries);
+  EXPECT_EQ(70u, cache("10").size());
+  EXPECT_EQ(0u, retriever.fetches);
+
+  vector<string> newest;
+  cache.get_keys(back_inserter(newest), 1);
+  ASSERT_EQ(1u, newest.size());
+  EXPECT_EQ("10", newest[0]);
+}
+
+/* A trace of a request and two SWF responses, compiled into a trace
+   database; the database must serve what the trace does. */
+class TraceDbTest : public testing::Test {
+ protected:
+  string trace_fname, db_fname;
+
+  static void write_entry(FILE* f, PacketType ptype, const string& msg) {
+    pentry_header pentry;
+    memset(&pentry, 0, sizeof(pentry));
+    pentry.ptype = htons(ptype);
+    pentry.length = htonl(msg.size());
+    ASSERT_EQ(1u, fwrite(&pentry, sizeof(pentry), 1, f));
+    ASSERT_EQ(1u, fwrite(msg.data(), msg.size(), 1, f));
+  }
+
+  static string swf_response(size_t body_len) {
+    char hdr[128];
+    snprintf(hdr, sizeof(hdr),
+             "HTTP/1.1 200 OK\r\n"
+             "Content-Type: application/x-shockwave-flash\r\n"
+             "Content-Length: %u\r\n\r\n", (unsigned int)body_len);
+    return string(hdr) + string(body_len, 'F');
+  }
+
+  virtual void SetUp() {
+    char tag[32];
+    snprintf(tag, sizeof(tag), "%d", (int)getpid());
+    trace_fname = string("/tmp/trace_db_test_") + tag + ".trace";
+    db_fname = string("/tmp/trace_db_test_") + tag + ".db";
+
+    FILE* f = fopen(trace_fname.c_str(), "wb");
+    ASSERT_TRUE(f != NULL);
+    write_entry(f, TYPE_SERVICE_DATA, "GET /a.swf HTTP/1.1\r\n\r\n");
+    write_entry(f, TYPE_HTTP_RESPONSE, swf_response(5000));
+    write_entry(f, TYPE_HTTP_RESPONSE, swf_response(4000));
+    fclose(f);
+
+    ASSERT_TRUE(trace_db_compile(trace_fname.c_str(), db_fname.c_str()));
+  }
+
+  virtual void TearDown() {
+    unlink(trace_fname.c_str());
+    unlink(db_fname.c_str());
+  }
+
+  static string shortest_swf(TracePayloadServer& server) {
+    char* buf = NULL;
+    int size = 0;
+    // every SWF cover has capacity enough, so the shortest is chosen
+    if (!server.get_payload(HTTP_CONTENT_SWF, 1, &buf, &size))
+      return "";
+    return string(buf, size);
+  }
+};
+
+TEST_F(TraceDbTest, round_trip) {
+  TracePayloadServer* trace = new TracePayloadServer(server_side, trace_fname);
+  TracePayloadServer* db = new TracePayloadServer(server_side, db_fname);
+
+  string expected = shortest_swf(*trace);
+  EXPECT_EQ(swf_response(4000), expected);
+  EXPECT_EQ(expected, shortest_swf(*db));
+
+  delete trace;
+  delete db;
+}
+
+TEST_F(TraceDbTest, corrupt_entry) {
+  // point the first payload past the end of the file
+  FILE* f = fopen(db_fname.c_str(), "r+b");
+  ASSERT_TRUE(f != NULL);
+  trace_db_header h;
+  ASSERT_EQ(1u, fread(&h, sizeof(h), 1, f));
+  trace_db_entry e;
+  ASSERT_EQ(0, fseek(f, h.entries_offset + sizeof(e), SEEK_SET));
+  ASSERT_EQ(1u, fread(&e, sizeof(e), 1, f));
+  e.offset = h.file_size;
+  ASSERT_EQ(0, fseek(f, h.entries_offset + sizeof(e), SEEK_SET));
+  ASSERT_EQ(1u, fwrite(&e, sizeof(e), 1, f));
+  fclose(f);
+
+  TracePayloadServer* db = new TracePayloadServer(server_side, db_fname);
+  EXPECT_DEATH(shortest_swf(*db), "");
+  delete db;
+}
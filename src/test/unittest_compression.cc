@@ -7,6 +7,8 @@
 
 #include "compression.h"
 
+#include <event2/buffer.h>
+
 // Smoke tests for zlib.
 // Compressed strings generated with Python's 'zlib' and 'gzip'
 // modules, which wrap zlib, so they only constitute a round-trip
@@ -425,6 +427,170 @@ test_decompress_gzip(void *)
  end:;
 }
 
+static void
+test_decompress_skip(void *)
+{
+  /* Long enough that the skipped part spans several scratch buffers. */
+  uint8_t text[5000], zbuf[6000], obuf[5000];
+  for (size_t i = 0; i < sizeof text; i++)
+    text[i] = uint8_t((i * 7) ^ (i >> 5));
+  ssize_t zlen = compress(text, sizeof text, zbuf, sizeof zbuf, c_format_zlib);
+  tt_int_op(zlen, >, 0);
+
+  static const size_t skips[] = { 0, 1, 1023, 1024, 1500, 4999, 5000 };
+  for (size_t i = 0; i < sizeof skips / sizeof skips[0]; i++) {
+    size_t skip = skips[i];
+    ssize_t n = decompress_skip(zbuf, zlen, skip, obuf, sizeof obuf);
+    tt_int_op(n, ==, sizeof text - skip);
+    tt_mem_op(obuf, ==, text + skip, sizeof text - skip);
+  }
+
+  /* Too little room after the skip, and too short a stream. */
+  tt_int_op(decompress_skip(zbuf, zlen, 1500, obuf, 100), ==, -2);
+  tt_int_op(decompress_skip(zbuf, zlen, 5001, obuf, sizeof obuf), ==, -1);
+  tt_int_op(decompress_skip(zbuf, zlen / 2, 10, obuf, sizeof obuf), ==, -1);
+
+  /* Gzip is detected as by decompress(). */
+  zlen = compress(text, sizeof text, zbuf, sizeof zbuf, c_format_gzip);
+  tt_int_op(zlen, >, 0);
+  tt_int_op(decompress_skip(zbuf, zlen, 1500, obuf, sizeof obuf), ==, 3500);
+  tt_mem_op(obuf, ==, text + 1500, 3500);
+
+ end:;
+}
+
+static void
+test_deflater(void *)
+{
+  /* Input in three pieces, and output space handed over 100 bytes at
+     a time; the result must be what compress() makes of the whole. */
+  uint8_t text[5000], obuf[6000], expect[6000], back[5000];
+  for (size_t i = 0; i < sizeof text; i++)
+    text[i] = uint8_t((i * 7) ^ (i >> 5));
+  ssize_t elen = compress(text, sizeof text, expect, sizeof expect,
+                          c_format_zlib);
+  struct evbuffer *eb = evbuffer_new();
+  tt_int_op(elen, >, 0);
+
+  {
+    static const size_t cuts[] = { 0, 1500, 3500, 5000 };
+    deflater z(c_format_zlib);
+    size_t used = 0;
+    int ret;
+    tt_assert(z.ok());
+    for (size_t i = 0; i + 1 < sizeof cuts / sizeof cuts[0]; i++) {
+      z.set_output(obuf + used, 100);
+      ret = z.write(text + cuts[i], cuts[i+1] - cuts[i]);
+      for (;;) {
+        used = z.total_out();
+        if (ret != -2)
+          break;
+        z.set_output(obuf + used, 100);
+        ret = z.write(0, 0);
+      }
+      tt_int_op(ret, ==, 0);
+    }
+    z.set_output(obuf + used, 100);
+    while ((ret = z.finish()) == -2)
+      z.set_output(obuf + z.total_out(), 100);
+    tt_int_op(ret, ==, 0);
+    tt_uint_op(z.total_out(), ==, elen);
+    tt_mem_op(obuf, ==, expect, elen);
+  }
+
+  /* The same into an evbuffer, in gzip format. */
+  {
+    deflater z(c_format_gzip);
+    tt_assert(z.ok());
+    tt_int_op(z.write(text, 2000, eb), ==, 0);
+    tt_int_op(z.write(text + 2000, 3000, eb), ==, 0);
+    tt_int_op(z.finish(eb), ==, 0);
+    size_t glen = evbuffer_get_length(eb);
+    tt_uint_op(glen, ==, z.total_out());
+    tt_int_op(decompress(evbuffer_pullup(eb, glen), glen,
+                         back, sizeof back), ==, sizeof text);
+    tt_mem_op(back, ==, text, sizeof text);
+  }
+
+ end:
+  evbuffer_free(eb);
+}
+
+static void
+test_inflater(void *)
+{
+  uint8_t text[20000], zbuf[20000], obuf[20001];
+  for (size_t i = 0; i < sizeof text; i++)
+    text[i] = uint8_t((i * 7) ^ (i >> 5));
+  ssize_t zlen = compress(text, sizeof text, zbuf, sizeof zbuf,
+                          c_format_zlib);
+  struct evbuffer *eb = evbuffer_new();
+  tt_int_op(zlen, >, 0);
+
+  /* One byte of input at a time, into a buffer with room to spare
+     (with none, the last few bytes would find it used up). */
+  {
+    inflater z;
+    int ret = 0;
+    tt_assert(z.ok());
+    z.set_output(obuf, sizeof obuf);
+    for (ssize_t i = 0; i < zlen; i++) {
+      ret = z.write(zbuf + i, 1);
+      if (i + 1 < zlen)
+        tt_int_op(ret, ==, 0);
+    }
+    tt_int_op(ret, ==, 1);
+    tt_uint_op(z.total_out(), ==, sizeof text);
+    tt_mem_op(obuf, ==, text, sizeof text);
+  }
+
+  /* Two pieces into an evbuffer, which grows a chunk at a time. */
+  {
+    inflater z;
+    tt_int_op(z.write(zbuf, zlen / 2, eb, sizeof text), ==, 0);
+    tt_int_op(z.write(zbuf + zlen / 2, zlen - zlen / 2, eb, sizeof text),
+              ==, 1);
+    tt_uint_op(evbuffer_get_length(eb), ==, sizeof text);
+    tt_mem_op(evbuffer_pullup(eb, -1), ==, text, sizeof text);
+    evbuffer_drain(eb, sizeof text);
+  }
+
+  /* One byte at a time into an evbuffer limited to exactly the
+     output: the end of the stream still gets read at the limit. */
+  {
+    inflater z;
+    int ret = 0;
+    for (ssize_t i = 0; i < zlen; i++) {
+      ret = z.write(zbuf + i, 1, eb, sizeof text);
+      if (i + 1 < zlen)
+        tt_int_op(ret, ==, 0);
+    }
+    tt_int_op(ret, ==, 1);
+    tt_uint_op(evbuffer_get_length(eb), ==, sizeof text);
+    tt_mem_op(evbuffer_pullup(eb, -1), ==, text, sizeof text);
+    evbuffer_drain(eb, sizeof text);
+  }
+
+  /* The limit is enforced. */
+  {
+    inflater z;
+    tt_int_op(z.write(zbuf, zlen, eb, sizeof text - 1), ==, -2);
+    tt_uint_op(evbuffer_get_length(eb), ==, sizeof text - 1);
+    evbuffer_drain(eb, sizeof text);
+  }
+
+  /* Corrupt input is refused. */
+  {
+    inflater z;
+    zbuf[zlen / 2] ^= 0x55;
+    zbuf[zlen / 2 + 1] ^= 0xaa;
+    tt_int_op(z.write(zbuf, zlen, eb, sizeof text), ==, -1);
+  }
+
+ end:
+  evbuffer_free(eb);
+}
+
 #define T(name) \
   { #name, test_##name, 0, 0, 0 }
 
@@ -433,5 +599,8 @@ struct testcase_t zlib_tests[] = {
   T(decompress_zlib),
   T(compress_gzip),
   T(decompress_gzip),
+  T(decompress_skip),
+  T(deflater),
+  T(inflater),
   END_OF_TESTCASES
 };
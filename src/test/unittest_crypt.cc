@@ -5,6 +5,7 @@
 #include "util.h"
 #include "unittest.h"
 #include "crypt.h"
+#include "chacha.h"
 #include "rng.h"
 
 // AES/ECB test vectors from
@@ -834,6 +835,262 @@ test_crypt_aesgcm_bad_dec(void *)
  end:;
 }
 
+/* The batch interfaces must produce exactly what the one-at-a-time
+   interfaces do, with the padding treated as trailing zero bytes. */
+
+static void
+test_crypt_batch_enc(void *)
+{
+  const size_t lens[] = { 0, 1, 37, 300 };
+  const size_t pads[] = { 16, 0, 500, 3 };
+  const size_t N = sizeof lens / sizeof lens[0];
+
+  uint8_t key[16], nonces[N][16], in[300];
+  uint8_t clear[1024], expect[1024], got[N][1024];
+  uint8_t hdrs_one[N * 16], hdrs_batch[N * 16];
+  gcm_block blocks[N];
+  size_t i;
+
+  ecb_encryptor *ec = 0;
+  gcm_encryptor *gc = 0;
+
+  rng_bytes(key, sizeof key);
+  rng_bytes(in, sizeof in);
+  rng_bytes((uint8_t *)nonces, sizeof nonces);
+
+  ec = ecb_encryptor::create(key, 16);
+  tt_int_op(ec, !=, 0);
+  for (i = 0; i < N; i++)
+    ec->encrypt(hdrs_one + i * 16, nonces[i]);
+  ec->encrypt_blocks(hdrs_batch, (const uint8_t *)nonces, N);
+  tt_mem_op(hdrs_one, ==, hdrs_batch, sizeof hdrs_one);
+
+  gc = gcm_encryptor::create(key, 16);
+  tt_int_op(gc, !=, 0);
+  for (i = 0; i < N; i++) {
+    blocks[i].out = got[i];
+    blocks[i].in = in;
+    blocks[i].inlen = lens[i];
+    blocks[i].padlen = pads[i];
+    blocks[i].nonce = nonces[i];
+    blocks[i].nlen = 16;
+  }
+  gc->encrypt_batch(blocks, N);
+
+  for (i = 0; i < N; i++) {
+    memcpy(clear, in, lens[i]);
+    memset(clear + lens[i], 0, pads[i]);
+    gc->encrypt(expect, clear, lens[i] + pads[i], nonces[i], 16);
+    tt_mem_op(got[i], ==, expect, lens[i] + pads[i] + 16);
+  }
+
+ end:
+  delete ec;
+  delete gc;
+}
+
+static void
+test_crypt_segment_dec(void *)
+{
+  uint8_t key[16], nonce[16], clear[200], ciphr[300], out[200];
+  gcm_segment segs[4];
+
+  gcm_encryptor *ec = 0;
+  gcm_decryptor *dc = 0;
+
+  rng_bytes(key, sizeof key);
+  rng_bytes(nonce, sizeof nonce);
+  rng_bytes(clear, sizeof clear);
+
+  ec = gcm_encryptor::create(key, 16);
+  dc = gcm_decryptor::create(key, 16);
+  tt_int_op(ec, !=, 0);
+  tt_int_op(dc, !=, 0);
+  memset(ciphr, 0, sizeof ciphr);
+  ec->encrypt(ciphr, clear, sizeof clear, nonce, 16);
+
+  /* Split the input unevenly, with the tag straddling two segments
+     and trailing junk after it. */
+  segs[0].data = ciphr;       segs[0].len = 1;
+  segs[1].data = ciphr + 1;   segs[1].len = 150;
+  segs[2].data = ciphr + 151; segs[2].len = 57;
+  segs[3].data = ciphr + 208; segs[3].len = 8 + 50;
+
+  memset(out, 0, sizeof out);
+  tt_int_op(dc->decrypt_segments(out, 120, segs, 4, sizeof clear + 16,
+                                 nonce, 16), ==, 0);
+  tt_mem_op(out, ==, clear, 120);
+  tt_int_op(out[120], ==, 0);
+
+  tt_int_op(dc->decrypt_segments(out, 0, segs, 4, sizeof clear + 16,
+                                 nonce, 16), ==, 0);
+
+  /* Missing input and a damaged tag must both be rejected. */
+  tt_int_op(dc->decrypt_segments(out, 120, segs, 2, sizeof clear + 16,
+                                 nonce, 16), ==, -1);
+  ciphr[210] ^= 0x01;
+  tt_int_op(dc->decrypt_segments(out, 120, segs, 4, sizeof clear + 16,
+                                 nonce, 16), ==, -1);
+
+ end:
+  delete ec;
+  delete dc;
+}
+
+/* ChaCha20 and Poly1305 test vectors from RFC 7539. */
+
+static void
+test_crypt_chacha20_block(void *)
+{
+  /* Section 2.3.2 */
+  uint8_t key[32], out[64];
+  const uint8_t nonce[12] = {
+    0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x4a, 0x00, 0x00, 0x00, 0x00
+  };
+  const char *expected =
+    "\x10\xf1\xe7\xe4\xd1\x3b\x59\x15\x50\x0f\xdd\x1f\xa3\x20\x71\xc4"
+    "\xc7\xd1\xf4\xc7\x33\xc0\x68\x03\x04\x22\xaa\x9a\xc3\xd4\x6c\x4e"
+    "\xd2\x82\x64\x46\x07\x9f\xaa\x09\x14\xc2\xd7\x05\xd9\x8b\x02\xa2"
+    "\xb5\x12\x9c\xd1\xde\x16\x4e\xb9\xcb\xd0\x83\xe8\xa2\x50\x3c\x4e";
+
+  for (unsigned int i = 0; i < sizeof key; i++)
+    key[i] = i;
+  chacha20_block(out, key, 1, nonce);
+  tt_mem_op(out, ==, expected, 64);
+
+ end:;
+}
+
+static void
+test_crypt_poly1305(void *)
+{
+  /* Section 2.5.2, fed in uneven pieces */
+  const uint8_t *key = (const uint8_t *)
+    "\x85\xd6\xbe\x78\x57\x55\x6d\x33\x7f\x44\x52\xfe\x42\xd5\x06\xa8"
+    "\x01\x03\x80\x8a\xfb\x0d\xb2\xfd\x4a\xbf\xf6\xaf\x41\x49\xf5\x1b";
+  const uint8_t *msg = (const uint8_t *)"Cryptographic Forum Research Group";
+  uint8_t tag[16];
+
+  poly1305 mac(key);
+  mac.update(msg, 5);
+  mac.update(msg + 5, 20);
+  mac.update(msg + 25, 9);
+  mac.finish(tag);
+  tt_mem_op(tag, ==, "\xa8\x06\x1d\xc1\x30\x51\x36\xc6"
+                     "\xc2\x2b\x8b\xaf\x0c\x01\x27\xa9", 16);
+
+ end:;
+}
+
+static void
+test_crypt_chacha20_poly1305(void *)
+{
+  /* The key, nonce and plaintext of section 2.8.2, but without the
+     additional data, which only changes the tag. */
+  uint8_t key[32], obuf[130], dbuf[130];
+  const uint8_t nonce[12] = {
+    0x07, 0x00, 0x00, 0x00, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47
+  };
+  const char *pt =
+    "Ladies and Gentlemen of the class of '99: If I could offer you "
+    "only one tip for the future, sunscreen would be it.";
+  const char *ct =
+    "\xd3\x1a\x8d\x34\x64\x8e\x60\xdb\x7b\x86\xaf\xbc\x53\xef\x7e\xc2"
+    "\xa4\xad\xed\x51\x29\x6e\x08\xfe\xa9\xe2\xb5\xa7\x36\xee\x62\xd6"
+    "\x3d\xbe\xa4\x5e\x8c\xa9\x67\x12\x82\xfa\xfb\x69\xda\x92\x72\x8b"
+    "\x1a\x71\xde\x0a\x9e\x06\x0b\x29\x05\xd6\xa5\xb6\x7e\xcd\x3b\x36"
+    "\x92\xdd\xbd\x7f\x2d\x77\x8b\x8c\x98\x03\xae\xe3\x28\x09\x1b\x58"
+    "\xfa\xb3\x24\xe4\xfa\xd6\x75\x94\x55\x85\x80\x8b\x48\x31\xd7\xbc"
+    "\x3f\xf4\xde\xf0\x8e\x4b\x7a\x9d\xe5\x76\xd2\x65\x86\xce\xc6\x4b"
+    "\x61\x16"
+    "\x6a\x23\xa4\x68\x1f\xd5\x94\x56\xae\xa1\xd2\x9f\x82\x47\x72\x16";
+  const size_t len = 114;
+
+  gcm_encryptor *ec = 0;
+  gcm_decryptor *dc = 0;
+
+  for (unsigned int i = 0; i < sizeof key; i++)
+    key[i] = 0x80 + i;
+  ec = gcm_encryptor::create_chacha20_poly1305(key, sizeof key);
+  dc = gcm_decryptor::create_chacha20_poly1305(key, sizeof key);
+  tt_int_op(ec, !=, 0);
+  tt_int_op(dc, !=, 0);
+
+  ec->encrypt(obuf, (const uint8_t *)pt, len, nonce, 12);
+  tt_mem_op(obuf, ==, ct, len + 16);
+
+  tt_int_op(dc->decrypt(dbuf, obuf, len + 16, nonce, 12), ==, 0);
+  tt_mem_op(dbuf, ==, pt, len);
+
+  obuf[len + 3] ^= 0x20;
+  tt_int_op(dc->decrypt(dbuf, obuf, len + 16, nonce, 12), ==, -1);
+
+ end:
+  delete ec;
+  delete dc;
+}
+
+static void
+test_crypt_chacha20_poly1305_chop(void *)
+{
+  /* As chop uses it: 16-byte nonces, batches with padding, and
+     decryption of part of a block out of several segments. */
+  const size_t lens[] = { 0, 1, 37, 300 };
+  const size_t pads[] = { 16, 0, 500, 3 };
+  const size_t N = sizeof lens / sizeof lens[0];
+
+  uint8_t key[32], nonces[N][16], in[300];
+  uint8_t clear[1024], expect[1024], got[N][1024], out[1024];
+  gcm_block blocks[N];
+  gcm_segment segs[3];
+  size_t i;
+
+  gcm_encryptor *ec = 0;
+  gcm_decryptor *dc = 0;
+
+  rng_bytes(key, sizeof key);
+  rng_bytes(in, sizeof in);
+  rng_bytes((uint8_t *)nonces, sizeof nonces);
+
+  ec = gcm_encryptor::create_chacha20_poly1305(key, sizeof key);
+  dc = gcm_decryptor::create_chacha20_poly1305(key, sizeof key);
+  for (i = 0; i < N; i++) {
+    blocks[i].out = got[i];
+    blocks[i].in = in;
+    blocks[i].inlen = lens[i];
+    blocks[i].padlen = pads[i];
+    blocks[i].nonce = nonces[i];
+    blocks[i].nlen = 16;
+  }
+  ec->encrypt_batch(blocks, N);
+
+  for (i = 0; i < N; i++) {
+    size_t total = lens[i] + pads[i] + 16;
+    memcpy(clear, in, lens[i]);
+    memset(clear + lens[i], 0, pads[i]);
+    ec->encrypt(expect, clear, lens[i] + pads[i], nonces[i], 16);
+    tt_mem_op(got[i], ==, expect, total);
+
+    segs[0].data = got[i];             segs[0].len = total / 3;
+    segs[1].data = got[i] + total / 3; segs[1].len = total / 3;
+    segs[2].data = got[i] + 2 * (total / 3);
+    segs[2].len = total - 2 * (total / 3);
+
+    memset(out, 0, sizeof out);
+    tt_int_op(dc->decrypt_segments(out, lens[i], segs, 3, total,
+                                   nonces[i], 16), ==, 0);
+    tt_mem_op(out, ==, in, lens[i]);
+
+    got[i][total - 1] ^= 0x01;
+    tt_int_op(dc->decrypt_segments(out, lens[i], segs, 3, total,
+                                   nonces[i], 16), ==, -1);
+  }
+
+ end:
+  delete ec;
+  delete dc;
+}
+
 /* ECDH/P224 test vectors from
    http://csrc.nist.gov/groups/STM/cavp/documents/keymgmt/kastestvectors.zip
    specifically, the P224 vectors in
@@ -1419,6 +1676,12 @@ struct testcase_t crypt_tests[] = {
   T(aesgcm_enc),
   T(aesgcm_good_dec),
   T(aesgcm_bad_dec),
+  T(batch_enc),
+  T(segment_dec),
+  T(chacha20_block),
+  T(poly1305),
+  T(chacha20_poly1305),
+  T(chacha20_poly1305_chop),
   T(ecdh_p224_good),
   T(ecdh_p224_bad),
   T(hkdf),
@@ -0,0 +1,63 @@
+/* See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "rng.h"
+
+static void
+test_rng_bytes(void *)
+{
+  /* Requests of every size up to well past a refill, so that some
+     straddle one, should all come back different and not all zero. */
+  uint8_t a[3000], b[3000], zero[3000];
+  memset(zero, 0, sizeof zero);
+
+  for (size_t n = 16; n <= sizeof a; n += 37) {
+    memset(a, 0, sizeof a);
+    memset(b, 0, sizeof b);
+    rng_bytes(a, n);
+    rng_bytes(b, n);
+    tt_assert(memcmp(a, zero, n));
+    tt_assert(memcmp(a, b, n));
+    tt_mem_op(a + n, ==, zero, sizeof a - n);
+  }
+
+ end:;
+}
+
+static void
+test_rng_int(void *)
+{
+  unsigned int hits[7];
+  memset(hits, 0, sizeof hits);
+
+  for (int i = 0; i < 7000; i++) {
+    int r = rng_int(7);
+    tt_int_op(r, >=, 0);
+    tt_int_op(r, <, 7);
+    hits[r]++;
+  }
+  for (int i = 0; i < 7; i++)
+    tt_uint_op(hits[i], >, 700);
+
+  for (int i = 0; i < 1000; i++) {
+    int r = rng_range(100, 103);
+    tt_int_op(r, >=, 100);
+    tt_int_op(r, <, 103);
+    r = rng_range_geom(1000, 50);
+    tt_int_op(r, >=, 0);
+    tt_int_op(r, <, 1000);
+  }
+
+ end:;
+}
+
+#define T(name) \
+  { #name, test_rng_##name, 0, 0, 0 }
+
+struct testcase_t rng_tests[] = {
+  T(bytes),
+  T(int),
+  END_OF_TESTCASES
+};
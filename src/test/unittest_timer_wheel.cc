@@ -0,0 +1,177 @@
+/* See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "timer_wheel.h"
+
+#include <event2/event.h>
+
+/* Each timer records when it went off, by the time run() was given. */
+struct fired_timer
+{
+  wheel_timer t;
+  uint64_t *clock;
+  uint64_t fired_at;
+  unsigned int count;
+
+  fired_timer() : t(on_fire, this), clock(0), fired_at(0), count(0) {}
+
+  static void on_fire(void *arg)
+  {
+    fired_timer *f = static_cast<fired_timer *>(arg);
+    f->fired_at = *f->clock;
+    f->count++;
+  }
+};
+
+static void
+test_timer_wheel_levels(void *)
+{
+  /* Delays on either side of each level's reach, so that timers are
+     moved down one or more levels before they go off. */
+  static const uint64_t delays[] = {
+    0, 1, 7, 255, 256, 257, 1000, 16383, 16384, 16385, 50000,
+    1048575, 1048576, 3000000
+  };
+  const size_t n = sizeof delays / sizeof delays[0];
+  const uint64_t slack = 50;  // for arming after base was read
+
+  struct event_base *eb = event_base_new();
+  timer_wheel *w = new timer_wheel(eb);
+  fired_timer *timers = new fired_timer[n];
+  uint64_t clock = w->now();
+  uint64_t base = clock;
+
+  for (size_t i = 0; i < n; i++) {
+    timers[i].clock = &clock;
+    w->arm(&timers[i].t, delays[i]);
+    tt_assert(timers[i].t.pending());
+  }
+  tt_uint_op(w->size(), ==, n);
+
+  /* Step through the next hour a few ms at a time, around the
+     interesting points, and in larger strides elsewhere. */
+  while (clock < base + 3600000) {
+    uint64_t step = clock - base < 20000 ? 3 : 997;
+    clock += step;
+    w->run(clock);
+    for (size_t i = 0; i < n; i++) {
+      if (timers[i].count) {
+        tt_uint_op(timers[i].count, ==, 1);
+        tt_assert(timers[i].fired_at >= base + delays[i]);
+        tt_assert(timers[i].fired_at <= base + delays[i] + slack + step);
+        tt_assert(!timers[i].t.pending());
+      } else {
+        tt_assert(clock < base + delays[i] + slack);
+      }
+    }
+  }
+  tt_uint_op(w->size(), ==, 0);
+
+ end:
+  delete [] timers;
+  delete w;
+  event_base_free(eb);
+}
+
+static void
+test_timer_wheel_disarm(void *)
+{
+  struct event_base *eb = event_base_new();
+  timer_wheel *w = new timer_wheel(eb);
+  fired_timer a, b, c;
+  uint64_t clock = w->now();
+  uint64_t base = clock;
+
+  a.clock = b.clock = c.clock = &clock;
+  w->arm(&a.t, 10);
+  w->arm(&b.t, 10);
+  w->arm(&c.t, 20000);
+  tt_uint_op(w->size(), ==, 3);
+
+  a.t.disarm();
+  c.t.disarm();
+  tt_assert(!a.t.pending());
+  tt_assert(!c.t.pending());
+  tt_uint_op(w->size(), ==, 1);
+
+  /* Disarming twice is harmless. */
+  a.t.disarm();
+  tt_uint_op(w->size(), ==, 1);
+
+  /* Rearming moves a timer rather than adding it again. */
+  w->arm(&b.t, 5000);
+  tt_uint_op(w->size(), ==, 1);
+
+  for (clock = base; clock < base + 30000; clock += 100)
+    w->run(clock);
+
+  tt_uint_op(a.count, ==, 0);
+  tt_uint_op(b.count, ==, 1);
+  tt_uint_op(c.count, ==, 0);
+  tt_assert(b.fired_at >= base + 5000);
+
+ end:
+  delete w;
+  event_base_free(eb);
+}
+
+/* A timer that rearms itself from its own callback until it has gone
+   off LIMIT times, then stops the event loop. */
+struct repeating_timer
+{
+  wheel_timer t;
+  timer_wheel *w;
+  struct event_base *eb;
+  unsigned int count;
+  unsigned int limit;
+
+  repeating_timer(timer_wheel *w_, struct event_base *eb_, unsigned int l)
+    : t(on_fire, this), w(w_), eb(eb_), count(0), limit(l) {}
+
+  static void on_fire(void *arg)
+  {
+    repeating_timer *r = static_cast<repeating_timer *>(arg);
+    if (++r->count < r->limit)
+      r->w->arm(&r->t, 1);
+    else
+      event_base_loopexit(r->eb, 0);
+  }
+};
+
+static void
+test_timer_wheel_dispatch(void *)
+{
+  struct event_base *eb = event_base_new();
+  timer_wheel *w = new timer_wheel(eb);
+  repeating_timer r(w, eb, 20);
+  fired_timer never;
+  uint64_t clock = 0;
+
+  /* A timer that outlives the loop, and then the wheel. */
+  never.clock = &clock;
+  w->arm(&never.t, 3600000);
+
+  w->arm(&r.t, 0);
+  tt_int_op(event_base_dispatch(eb), ==, 0);
+  tt_uint_op(r.count, ==, 20);
+  tt_assert(!r.t.pending());
+  tt_uint_op(never.count, ==, 0);
+  tt_assert(never.t.pending());
+  tt_uint_op(w->size(), ==, 1);
+
+ end:
+  delete w;
+  event_base_free(eb);
+}
+
+#define T(name) \
+  { #name, test_timer_wheel_##name, 0, 0, 0 }
+
+struct testcase_t timer_wheel_tests[] = {
+  T(levels),
+  T(disarm),
+  T(dispatch),
+  END_OF_TESTCASES
+};
@@ -0,0 +1,226 @@
+/* See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "timer_wheel.h"
+
+#include <event2/event.h>
+
+/* The shift that gives an expiry's slot at LEVEL, the span of a slot
+   there, and how far ahead the level reaches. */
+static inline unsigned int
+slot_shift(unsigned int level)
+{
+  return level ? 8 + 6 * (level - 1) : 0;
+}
+
+static inline uint64_t
+slot_span(unsigned int level)
+{
+  return uint64_t(1) << slot_shift(level);
+}
+
+static inline uint64_t
+level_reach(unsigned int level)
+{
+  return uint64_t(1) << (8 + 6 * level);
+}
+
+timer_wheel::timer_wheel(struct event_base *base_)
+  : base(base_), tick(0), cur(0), next_wake(0), armed(0)
+{
+  memset(counts, 0, sizeof counts);
+  memset(slots, 0, sizeof slots);
+  tick = evtimer_new(base, tick_cb, this);
+  if (!tick)
+    log_abort("failed to create the timer wheel's timer");
+  cur = now();
+}
+
+timer_wheel::~timer_wheel()
+{
+  // Timers still pending must not try to disarm themselves later.
+  for (unsigned int i = 0; i < N_SLOTS; i++)
+    for (wheel_timer *t = slots[i]; t; t = t->next)
+      t->pprev = 0;
+  event_free(tick);
+}
+
+uint64_t
+timer_wheel::now() const
+{
+  return monotonic_ms();
+}
+
+void
+timer_wheel::place(wheel_timer *t)
+{
+  uint64_t e = t->expires < cur ? cur : t->expires;
+  uint64_t delta = e - cur;
+
+  unsigned int level = 0;
+  while (level < LEVELS - 1 && delta >= level_reach(level))
+    level++;
+  if (delta >= level_reach(level))
+    e = cur + level_reach(level) - 1;
+
+  unsigned int i = level
+    ? (1 << L0_BITS) + (level - 1) * (1 << LN_BITS) +
+      ((e >> slot_shift(level)) & ((1 << LN_BITS) - 1))
+    : e & ((1 << L0_BITS) - 1);
+
+  t->next = slots[i];
+  if (t->next)
+    t->next->pprev = &t->next;
+  slots[i] = t;
+  t->pprev = &slots[i];
+  t->level = level;
+  counts[level]++;
+  armed++;
+}
+
+void
+timer_wheel::unlink(wheel_timer *t)
+{
+  *t->pprev = t->next;
+  if (t->next)
+    t->next->pprev = t->pprev;
+  t->next = 0;
+  t->pprev = 0;
+  counts[t->level]--;
+  armed--;
+}
+
+void
+timer_wheel::arm(wheel_timer *t, uint64_t milliseconds)
+{
+  log_assert(!t->pprev || t->wheel == this);
+  if (t->pprev)
+    unlink(t);
+
+  // An idle wheel need not catch up on the time it spent idle.
+  uint64_t n = now();
+  if (!armed && n > cur)
+    cur = n;
+
+  t->wheel = this;
+  t->expires = n + milliseconds;
+  place(t);
+
+  // Timers above level 0 first need moving down at the next turn.
+  if (t->level)
+    schedule((cur | ((1 << L0_BITS) - 1)) + 1);
+  else
+    schedule(t->expires > cur ? t->expires : cur);
+}
+
+void
+timer_wheel::disarm(wheel_timer *t)
+{
+  if (!t->pprev)
+    return;
+  log_assert(t->wheel == this);
+  unlink(t);
+  if (!armed)
+    evtimer_del(tick);
+}
+
+void
+timer_wheel::cascade(unsigned int level)
+{
+  unsigned int i = (1 << L0_BITS) + (level - 1) * (1 << LN_BITS) +
+    ((cur >> slot_shift(level)) & ((1 << LN_BITS) - 1));
+
+  wheel_timer *t = slots[i];
+  slots[i] = 0;
+  while (t) {
+    wheel_timer *next = t->next;
+    counts[level]--;
+    armed--;
+    place(t);
+    t = next;
+  }
+}
+
+void
+timer_wheel::run(uint64_t now_)
+{
+  const uint64_t l0_mask = (1 << L0_BITS) - 1;
+
+  while (cur <= now_) {
+    // At each turn of level 0, bring down the timers in the next slot
+    // of every level that has come around, highest first.
+    if (!(cur & l0_mask))
+      for (unsigned int level = LEVELS - 1; level > 0; level--)
+        if (!(cur & (slot_span(level) - 1)))
+          cascade(level);
+
+    if (!counts[0]) {
+      uint64_t turn = (cur | l0_mask) + 1;
+      if (turn > now_) {
+        cur = now_ + 1;
+        break;
+      }
+      cur = turn;
+      continue;
+    }
+
+    // Detach the slot first: the callbacks may arm and disarm timers,
+    // these among them, and whatever they arm now is for later.
+    wheel_timer *due = slots[cur & l0_mask];
+    slots[cur & l0_mask] = 0;
+    if (due)
+      due->pprev = &due;
+    cur++;
+    while (due) {
+      wheel_timer *t = due;
+      unlink(t);
+      t->cb(t->arg);
+    }
+  }
+
+  evtimer_del(tick);
+  if (armed)
+    schedule(next_work());
+}
+
+uint64_t
+timer_wheel::next_work() const
+{
+  const uint64_t l0_mask = (1 << L0_BITS) - 1;
+  uint64_t turn = (cur | l0_mask) + 1;
+  if (counts[0])
+    for (uint64_t t = cur; t < turn; t++)
+      if (slots[t & l0_mask])
+        return t;
+  return turn;
+}
+
+void
+timer_wheel::schedule(uint64_t when)
+{
+  if (evtimer_pending(tick, NULL) && next_wake <= when)
+    return;
+  next_wake = when;
+
+  uint64_t n = now();
+  uint64_t delay = when > n ? when - n : 0;
+  struct timeval tv;
+  tv.tv_sec = delay / 1000;
+  tv.tv_usec = (delay % 1000) * 1000;
+  evtimer_add(tick, &tv);
+}
+
+/* static */ void
+timer_wheel::tick_cb(evutil_socket_t, short, void *arg)
+{
+  timer_wheel *w = static_cast<timer_wheel *>(arg);
+  w->run(w->now());
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// c-file-style: "gnu"
+// c-file-offsets: ((innamespace . 0) (brace-list-open . 0))
+// End:
@@ -0,0 +1,125 @@
+/* See LICENSE for other credits and copying information
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+class timer_wheel;
+
+/**
+   A one-shot timer run by a timer_wheel, to be embedded in the
+   object it belongs to.  It calls CB(ARG) when it goes off.  A timer
+   that is destroyed while pending is disarmed first.
+ */
+class wheel_timer
+{
+public:
+  typedef void (*callback)(void *arg);
+
+  wheel_timer(callback cb_ = 0, void *arg_ = 0)
+    : next(0), pprev(0), wheel(0), expires(0), level(0), cb(cb_), arg(arg_)
+  {}
+  ~wheel_timer() { disarm(); }
+
+  void set_callback(callback cb_, void *arg_) { cb = cb_; arg = arg_; }
+
+  /** Cancel the timer, if it is pending. */
+  inline void disarm();
+
+  /** True if the timer is armed and has not gone off yet. */
+  bool pending() const { return pprev != 0; }
+
+private:
+  friend class timer_wheel;
+
+  wheel_timer *next;
+  wheel_timer **pprev;  // what points to us; NULL if not pending
+  timer_wheel *wheel;
+  uint64_t expires;     // in ms
+  unsigned int level;
+  callback cb;
+  void *arg;
+
+  wheel_timer(const wheel_timer&) DELETE_METHOD;
+  wheel_timer& operator=(const wheel_timer&) DELETE_METHOD;
+};
+
+/**
+   A hierarchical timer wheel with a resolution of one millisecond,
+   driven by a single libevent timer, for the many timers that
+   circuits and connections arm and cancel all the time.  Arming and
+   disarming take constant time, where libevent's own timers would
+   each be an operation on its heap.
+
+   Level 0 has a slot for each of the next 256 ms; each further level
+   has 64 slots, each as long as the whole of the level below.  A
+   timer goes in the lowest level whose span reaches its expiry, and
+   is moved down a level, or fires, when the wheel comes around to
+   its slot.  Timers more than about 49 days off wait at the top.
+
+   One wheel serves one event_base, and is not thread-safe.
+ */
+class timer_wheel
+{
+public:
+  timer_wheel(struct event_base *base);
+  ~timer_wheel();
+
+  /** Have T go off in MILLISECONDS ms, or rearm it if it is already
+      pending.  T may not be pending on another wheel. */
+  void arm(wheel_timer *t, uint64_t milliseconds);
+
+  /** Cancel T, if it is pending. */
+  void disarm(wheel_timer *t);
+
+  /** Fire every timer due at time NOW (in ms). */
+  void run(uint64_t now);
+
+  /** The time, in ms, by the monotonic clock (see monotonic_ms). */
+  uint64_t now() const;
+
+  /** The number of pending timers. */
+  size_t size() const { return armed; }
+
+private:
+  static const unsigned int LEVELS = 5;
+  static const unsigned int L0_BITS = 8;
+  static const unsigned int LN_BITS = 6;
+  static const unsigned int N_SLOTS = (1 << L0_BITS) +
+                                      (LEVELS - 1) * (1 << LN_BITS);
+
+  struct event_base *base;
+  struct event *tick;
+  uint64_t cur;        // the next millisecond to process
+  uint64_t next_wake;  // when tick is set to go off, if it is pending
+  size_t armed;
+  size_t counts[LEVELS];
+  wheel_timer *slots[N_SLOTS];
+
+  timer_wheel(const timer_wheel&) DELETE_METHOD;
+  timer_wheel& operator=(const timer_wheel&) DELETE_METHOD;
+
+  void place(wheel_timer *t);
+  void unlink(wheel_timer *t);
+  void cascade(unsigned int level);
+  /** The first millisecond at or after cur when there is work. */
+  uint64_t next_work() const;
+  void schedule(uint64_t when);
+  static void tick_cb(evutil_socket_t, short, void *arg);
+};
+
+inline void
+wheel_timer::disarm()
+{
+  if (pprev)
+    wheel->disarm(this);
+}
+
+#endif
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// c-file-style: "gnu"
+// c-file-offsets: ((innamespace . 0) (brace-list-open . 0))
+// End:
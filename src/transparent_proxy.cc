@@ -40,7 +40,7 @@ static double drop_rate = 0; //do not drop anything by default
 #include "transparent_proxy.h"
 
 
-std::unordered_map<bufferevent *, conn_t*> TransparentProxy::transparentized_connections;
+__thread std::unordered_map<bufferevent *, conn_t*> *TransparentProxy::worker_transparentized_connections;
 #define MAX_OUTPUT (512*1024)
 bool TransparentProxy::trace_packet_data = false;
 
@@ -230,7 +230,7 @@ TransparentProxy::accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
   bufferevent_enable(b_out, EV_READ|EV_WRITE);
 }
 
-void TransparentProxy::transparentize_connection(conn_t* conn_in, uint8_t* apriori_data, size_t apriori_data_length)
+void TransparentProxy::transparentize_connection(conn_t* conn_in, struct evbuffer* apriori_data)
 {
   assert(conn_in->buffer);
   struct bufferevent *b_out, *b_in = conn_in->buffer;
@@ -250,11 +250,11 @@ void TransparentProxy::transparentize_connection(conn_t* conn_in, uint8_t* aprio
   assert(b_in && b_out);
 
   //sanity check, you can't transparentize a connection twice
-  log_assert(transparentized_connections.find(b_in) == transparentized_connections.end());
+  log_assert(transparentized_connections().find(b_in) == transparentized_connections().end());
 
   //keep track of the connection object as the clean up should be done by the connection
   //manager not us.
-  transparentized_connections[b_in] = conn_in;
+  transparentized_connections()[b_in] = conn_in;
 
   //TODO:we need to deal with this if it is blocking (or not)
   if (bufferevent_socket_connect(b_out, (struct sockaddr*)&connect_to_addr, 
@@ -275,7 +275,7 @@ void TransparentProxy::transparentize_connection(conn_t* conn_in, uint8_t* aprio
   //in the buffer.
   //readcb(b_in, b_out);
   evbuffer* dst = bufferevent_get_output(b_out);
-  evbuffer_add(dst, apriori_data, apriori_data_length);
+  evbuffer_add_buffer(dst, apriori_data);
 
   if (evbuffer_get_length(dst) >= MAX_OUTPUT) {
     /* We're giving the other side data faster than it can
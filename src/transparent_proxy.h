@@ -24,17 +24,23 @@ protected:
   struct sockaddr_storage listen_on_addr;
   struct evconnlistener *listener;
 
-  static std::unordered_map<bufferevent *, conn_t*> transparentized_connections; //we need to keep track of these connections
-  //to close them approperiately
+  //we need to keep track of these connections to close them
+  //approperiately. Every worker thread has its own table.
+  static __thread std::unordered_map<bufferevent *, conn_t*> *worker_transparentized_connections;
+  static std::unordered_map<bufferevent *, conn_t*>& transparentized_connections() {
+    if (!worker_transparentized_connections)
+      worker_transparentized_connections = new std::unordered_map<bufferevent *, conn_t*>;
+    return *worker_transparentized_connections;
+  }
 
   //based on the fact if the connection was given to us or we have
   //create it we either close it or free it
   static void free_or_close(struct bufferevent *bev) {
-    if (transparentized_connections.find(bev) == transparentized_connections.end())
+    if (transparentized_connections().find(bev) == transparentized_connections().end())
       bufferevent_free(bev);
     else {
-      transparentized_connections[bev]->close();
-      transparentized_connections.erase(bev);
+      transparentized_connections()[bev]->close();
+      transparentized_connections().erase(bev);
     }
   }
     
@@ -52,9 +58,11 @@ public:
      This will receive a chop_conn that failed/ignored to handshake
      and turn it into a transparent circuit to the cover server, hence
      it acts similar to accept_cb except that the downstream connection
-     is already established.
+     is already established.  Everything in APRIORI_DATA (what the
+     client had sent before we gave up on it) is moved to the cover
+     server first.
    */
-  void transparentize_connection(conn_t* conn_in, uint8_t* apriori_data, size_t apriori_data_length);
+  void transparentize_connection(conn_t* conn_in, struct evbuffer* apriori_data);
 
   void set_upstream_address(const std::string& upstream_address)
   {
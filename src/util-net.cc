@@ -118,7 +118,8 @@ printable_address(struct sockaddr *addr, socklen_t addrlen)
   return xstrdup(apbuf);
 }
 
-static struct evdns_base *the_evdns_base = NULL;
+/* Each worker thread has its own resolver, bound to its own event base. */
+static __thread struct evdns_base *the_evdns_base = NULL;
 
 struct evdns_base *
 get_evdns_base(void)
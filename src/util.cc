@@ -11,6 +11,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <event2/buffer.h>
@@ -656,6 +657,15 @@ int timeval_subtract(struct timeval *x, struct timeval *y,
   return x->tv_sec < y->tv_sec;
 }
 
+uint64_t
+monotonic_ms()
+{
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    log_abort("clock_gettime(CLOCK_MONOTONIC): %s", strerror(errno));
+  return uint64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
 /**
   convert char* buffer to hex string to be encoded in a text only
   covers like js.
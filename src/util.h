@@ -311,6 +311,10 @@ void buf2hex(uint8_t* buf, size_t len, std::string& res);
 int timeval_subtract(struct timeval *x, struct timeval *y,
 		     struct timeval *result);
 
+/** Milliseconds by CLOCK_MONOTONIC, which steps of the wall clock do
+    not move; for timers and for measuring intervals. **/
+uint64_t monotonic_ms();
+
 /**
    Convert the evbuffer into a consecutive memory block
 
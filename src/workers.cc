@@ -0,0 +1,313 @@
+/* Copyright 2011, 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "workers.h"
+
+#include "connections.h"
+#include "listener.h"
+#include "protocol.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <errno.h>
+#include <pthread.h>
+
+#include <event2/buffer.h>
+#include <event2/dns.h>
+#include <event2/event.h>
+#include <event2/thread.h>
+
+using std::vector;
+
+namespace {
+
+/** A connection in transit from one worker to another. */
+struct handoff_t
+{
+  size_t config_no;
+  size_t index;
+  evutil_socket_t fd;
+  char *peername;
+  struct evbuffer *data;
+};
+
+struct worker_t
+{
+  unsigned int id;
+  struct event_base *base;
+  vector<config_t *> configs;
+  pthread_t thread;
+
+  /** Protects everything below, which other workers may touch. */
+  pthread_mutex_t lock;
+
+  /** Connections handed to us, not yet picked up. */
+  vector<handoff_t *> pending;
+
+  /** Activated by other threads when 'pending' is nonempty or a
+      shutdown has been requested. */
+  struct event *mailbox;
+
+  /** Nonzero once this worker has begun shutting down: no further
+      connections will be accepted. 2 means barbaric. */
+  int draining;
+  bool shutdown_requested;
+
+  worker_t(unsigned int id, struct event_base *base,
+           vector<config_t *> const& configs);
+  ~worker_t();
+
+  worker_t(const worker_t&) DELETE_METHOD;
+  worker_t& operator=(const worker_t&) DELETE_METHOD;
+};
+
+} // anonymous namespace
+
+/** All workers; fixed after workers_setup. */
+static vector<worker_t *> workers;
+
+/** The worker running on the calling thread. */
+static __thread worker_t *this_worker;
+
+static void worker_mailbox_cb(evutil_socket_t, short, void *arg);
+
+worker_t::worker_t(unsigned int id, struct event_base *base,
+                   vector<config_t *> const& configs)
+  : id(id), base(base), configs(configs), draining(0),
+    shutdown_requested(false)
+{
+  pthread_mutex_init(&lock, NULL);
+  mailbox = event_new(base, -1, 0, worker_mailbox_cb, this);
+  if (!mailbox)
+    log_abort("worker %u: failed to create mailbox event", id);
+}
+
+worker_t::~worker_t()
+{
+  for (vector<handoff_t *>::iterator i = pending.begin();
+       i != pending.end(); i++) {
+    evutil_closesocket((*i)->fd);
+    free((*i)->peername);
+    evbuffer_free((*i)->data);
+    delete *i;
+  }
+  if (mailbox)
+    event_free(mailbox);
+  pthread_mutex_destroy(&lock);
+}
+
+void
+workers_setup(unsigned int n)
+{
+  log_assert(workers.empty());
+  log_assert(n > 0);
+
+  if (n > 1 && evthread_use_pthreads())
+    log_abort("failed to enable thread support in libevent");
+
+  workers.resize(n, (worker_t *)0);
+}
+
+unsigned int
+worker_count()
+{
+  return workers.empty() ? 1 : workers.size();
+}
+
+unsigned int
+worker_self()
+{
+  return this_worker ? this_worker->id : 0;
+}
+
+void
+worker_adopt_main(struct event_base *base, vector<config_t *> const& configs)
+{
+  if (workers.empty())
+    workers_setup(1);
+
+  log_assert(!workers[0]);
+  workers[0] = new worker_t(0, base, configs);
+  this_worker = workers[0];
+}
+
+static void *
+worker_main(void *arg)
+{
+  worker_t *w = (worker_t *)arg;
+  this_worker = w;
+
+  conn_global_init(w->base);
+  if (init_evdns_base(w->base))
+    log_abort("worker %u: failed to initialize DNS resolver", w->id);
+
+  for (vector<config_t *>::iterator i = w->configs.begin();
+       i != w->configs.end(); i++)
+    if (!listener_open(w->base, *i))
+      log_abort("worker %u: failed to open listeners for configuration %lu",
+                w->id, (unsigned long)(i - w->configs.begin()) + 1);
+
+  log_debug("worker %u running", w->id);
+  event_base_dispatch(w->base);
+  log_debug("worker %u exiting", w->id);
+
+  /* By the time we get to this point, all listeners and connections
+     belonging to this worker have already been freed. */
+  for (vector<config_t *>::iterator i = w->configs.begin();
+       i != w->configs.end(); i++)
+    delete *i;
+  w->configs.clear();
+
+  evdns_base_free(get_evdns_base(), 0);
+
+  pthread_mutex_lock(&w->lock);
+  event_free(w->mailbox);
+  w->mailbox = NULL;
+  event_base_free(w->base);
+  w->base = NULL;
+  pthread_mutex_unlock(&w->lock);
+
+  return 0;
+}
+
+void
+worker_spawn(unsigned int id, struct event_base *base,
+             vector<config_t *> const& configs)
+{
+  log_assert(id > 0 && id < workers.size());
+  log_assert(!workers[id]);
+
+  worker_t *w = new worker_t(id, base, configs);
+  workers[id] = w;
+  if (pthread_create(&w->thread, NULL, worker_main, w))
+    log_abort("failed to start worker %u: %s", id, strerror(errno));
+}
+
+/** Mark W as draining; must be called with W's lock held.  Returns
+    true if W was not already draining. */
+static bool
+worker_begin_draining(worker_t *w, int barbaric)
+{
+  int was = w->draining;
+  w->draining = std::max(w->draining, barbaric ? 2 : 1);
+  return w->draining != was;
+}
+
+void
+workers_start_shutdown(int barbaric)
+{
+  for (vector<worker_t *>::iterator i = workers.begin();
+       i != workers.end(); i++) {
+    worker_t *w = *i;
+    if (!w)
+      continue;
+
+    pthread_mutex_lock(&w->lock);
+    if (worker_begin_draining(w, barbaric) && w != this_worker &&
+        w->mailbox) {
+      w->shutdown_requested = true;
+      event_active(w->mailbox, 0, 0);
+    }
+    pthread_mutex_unlock(&w->lock);
+  }
+}
+
+void
+workers_join()
+{
+  for (vector<worker_t *>::iterator i = workers.begin();
+       i != workers.end(); i++) {
+    worker_t *w = *i;
+    if (!w)
+      continue;
+    if (w->id != 0)
+      pthread_join(w->thread, NULL);
+    delete w;
+    *i = 0;
+  }
+  this_worker = 0;
+}
+
+void
+worker_handoff(unsigned int target, config_t *cfg, size_t index,
+               evutil_socket_t fd, const char *peername,
+               struct evbuffer *data)
+{
+  log_assert(this_worker);
+  log_assert(target < workers.size() && target != this_worker->id);
+
+  vector<config_t *>::iterator c =
+    std::find(this_worker->configs.begin(), this_worker->configs.end(), cfg);
+  log_assert(c != this_worker->configs.end());
+
+  handoff_t *h = new handoff_t;
+  h->config_no = c - this_worker->configs.begin();
+  h->index = index;
+  h->fd = fd;
+  h->peername = xstrdup(peername);
+  h->data = evbuffer_new();
+  if (!h->data || evbuffer_add_buffer(h->data, data))
+    log_abort("failed to move %lu bytes for hand-off",
+              (unsigned long)evbuffer_get_length(data));
+
+  worker_t *w = workers[target];
+  pthread_mutex_lock(&w->lock);
+  if (w->draining || !w->mailbox) {
+    pthread_mutex_unlock(&w->lock);
+    log_info("worker %u is shutting down; dropping connection from %s",
+             target, peername);
+    evutil_closesocket(h->fd);
+    free(h->peername);
+    evbuffer_free(h->data);
+    delete h;
+    return;
+  }
+
+  bool need_event = w->pending.empty();
+  w->pending.push_back(h);
+  if (need_event)
+    event_active(w->mailbox, 0, 0);
+  pthread_mutex_unlock(&w->lock);
+}
+
+static void
+worker_mailbox_cb(evutil_socket_t, short, void *arg)
+{
+  worker_t *w = (worker_t *)arg;
+  vector<handoff_t *> pending;
+  bool shutdown_requested;
+  int draining;
+
+  pthread_mutex_lock(&w->lock);
+  pending.swap(w->pending);
+  shutdown_requested = w->shutdown_requested;
+  w->shutdown_requested = false;
+  draining = w->draining;
+  pthread_mutex_unlock(&w->lock);
+
+  for (vector<handoff_t *>::iterator i = pending.begin();
+       i != pending.end(); i++) {
+    handoff_t *h = *i;
+    if (draining) {
+      evutil_closesocket(h->fd);
+      free(h->peername);
+    } else {
+      log_debug("worker %u: adopting connection from %s",
+                w->id, h->peername);
+      listener_adopt_connection(w->configs.at(h->config_no), h->index,
+                                h->fd, h->peername, h->data);
+    }
+    evbuffer_free(h->data);
+    delete h;
+  }
+
+  if (shutdown_requested) {
+    log_info("worker %u: %s shutdown requested", w->id,
+             draining > 1 ? "barbaric" : "normal");
+    listener_close_all();
+    conn_start_shutdown(draining > 1);
+  }
+}
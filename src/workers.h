@@ -0,0 +1,75 @@
+/* Copyright 2011, 2012 SRI International
+ * See LICENSE for other credits and copying information
+ */
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <vector>
+
+/**
+   A worker is one event loop, with its own copy of every
+   configuration, its own listeners, and its own connection and
+   circuit tables.  Worker 0 runs on the main thread; any others each
+   get a thread of their own.  Nothing is shared between workers
+   except the process-wide logging and crypto state, so protocol and
+   steg code need no locking as long as every connection and circuit
+   stays on the worker that created it.
+
+   All workers listen on the same addresses (with SO_REUSEPORT), so
+   the kernel spreads incoming connections among them.  A server-side
+   protocol that multiplexes several connections onto one circuit
+   must therefore send each connection to the worker that owns the
+   circuit; see worker_for_circuit and worker_handoff.
+ */
+
+/** Prepare for N workers.  Must be called before any event_base is
+    created.  If this is never called, there is exactly one worker. */
+void workers_setup(unsigned int n);
+
+/** Report the number of workers in this process. */
+unsigned int worker_count();
+
+/** Report the index of the worker running on the calling thread. */
+unsigned int worker_self();
+
+/** Report the worker responsible for circuit CIRCUIT_ID. */
+inline unsigned int
+worker_for_circuit(uint32_t circuit_id)
+{
+  return circuit_id % worker_count();
+}
+
+/** Register the calling (main) thread as worker 0, running BASE with
+    CONFIGS.  The caller remains responsible for the listeners, the
+    event loop, and freeing BASE and CONFIGS. */
+void worker_adopt_main(struct event_base *base,
+                       std::vector<config_t *> const& configs);
+
+/** Start worker ID on a new thread, running BASE with CONFIGS.  The
+    worker takes ownership of both, opens its own listeners, and
+    frees everything when its event loop finishes. */
+void worker_spawn(unsigned int id, struct event_base *base,
+                  std::vector<config_t *> const& configs);
+
+/** Ask every worker to stop accepting connections and shut down as
+    conn_start_shutdown(BARBARIC) would.  The calling worker is
+    expected to shut itself down directly. */
+void workers_start_shutdown(int barbaric);
+
+/** Wait for all spawned workers to finish, then release worker 0's
+    bookkeeping.  Called by the main thread after its own event loop
+    has exited. */
+void workers_join();
+
+/** Move the downstream socket FD, accepted by the calling worker for
+    the listener INDEX of configuration CFG, to worker TARGET.  DATA
+    holds the bytes that have already been read from FD; they are
+    moved out of it, and the target worker creates a new connection
+    for FD and processes them as if they had just arrived.  PEERNAME
+    is copied.  Ownership of FD passes to this function in all
+    cases. */
+void worker_handoff(unsigned int target, config_t *cfg, size_t index,
+                    evutil_socket_t fd, const char *peername,
+                    struct evbuffer *data);
+
+#endif